@@ -0,0 +1,203 @@
+// Simulated cars shared by the benchmarks. Each car is a loopback TCP
+// connection to a simulator thread that sends battery level updates to every
+// car every 100ms and drains whatever comes back. Cars use 127.0.x.y addresses
+// so every vehicle has its own socket entry.
+#ifndef _PHEV_BENCH_H_
+#define _PHEV_BENCH_H_
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "phev.h"
+
+#define BENCH_UPDATE_INTERVAL_US 100000
+#define BENCH_FRAME_SIZE 6
+#define BENCH_MAX_BURST 256
+
+typedef struct bench_vehicle_t
+{
+    phevCtx_t *ctx;
+    char host[16];
+    int server;
+    atomic_size_t updates;
+} bench_vehicle_t;
+
+typedef struct bench_simulator_t
+{
+    bench_vehicle_t *vehicles;
+    size_t count;
+    // Frames sent per tick to vehicles[0], to mimic a car in full refresh
+    size_t hotBurst;
+    atomic_bool stop;
+    size_t sent;
+} bench_simulator_t;
+
+static int bench_eventHandler(phevEvent_t *event)
+{
+    if(event->type == PHEV_REGISTER_UPDATE)
+    {
+        bench_vehicle_t *vehicle = (bench_vehicle_t *) phev_getUserCtx(event->ctx);
+
+        atomic_fetch_add_explicit(&vehicle->updates, 1, memory_order_relaxed);
+    }
+    return 0;
+}
+static size_t bench_rssBytes(void)
+{
+    long pages = 0;
+    long resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if(statm == NULL)
+    {
+        return 0;
+    }
+    if(fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+    {
+        resident = 0;
+    }
+    fclose(statm);
+
+    return (size_t) resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+static uint64_t bench_nanos(const clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+static void bench_raiseFileLimit(void)
+{
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+static int bench_listen(uint16_t *port)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = 0;
+
+    if(fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0
+        || getsockname(fd, (struct sockaddr *) &addr, &len) != 0)
+    {
+        perror("listen");
+        exit(1);
+    }
+    *port = ntohs(addr.sin_port);
+
+    return fd;
+}
+static phevCtx_t *bench_createVehicle(bench_vehicle_t *vehicle, const size_t index, const uint16_t port, const bool uring)
+{
+    const unsigned int address = (unsigned int) (index + 1);
+
+    snprintf(vehicle->host, sizeof(vehicle->host), "127.0.%u.%u", (address / 254) % 256, address % 254 + 1);
+    atomic_init(&vehicle->updates, 0);
+    vehicle->server = -1;
+
+    phevSettings_t settings = {
+        .host = vehicle->host,
+        .port = port,
+        .registerDevice = false,
+        .handler = bench_eventHandler,
+        .ctx = vehicle,
+        .reactor = true,
+        .uring = uring,
+    };
+
+    vehicle->ctx = phev_init(settings);
+
+    return vehicle->ctx;
+}
+// Call once the vehicle has connected
+static bool bench_acceptVehicle(bench_vehicle_t *vehicle, const int listener)
+{
+    vehicle->server = accept(listener, NULL, NULL);
+
+    if(vehicle->server < 0)
+    {
+        perror("accept");
+        return false;
+    }
+    fcntl(vehicle->server, F_SETFL, fcntl(vehicle->server, F_GETFL) | O_NONBLOCK);
+
+    return true;
+}
+static void bench_fillFrame(uint8_t *frame, const uint8_t level)
+{
+    frame[0] = 0x6f;
+    frame[1] = 0x04;
+    frame[2] = 0x00;
+    frame[3] = 0x1d;
+    frame[4] = level % 100;
+    frame[5] = frame[0] + frame[1] + frame[2] + frame[3] + frame[4];
+}
+static void *bench_simulate(void *arg)
+{
+    bench_simulator_t *simulator = (bench_simulator_t *) arg;
+    uint8_t frames[BENCH_MAX_BURST * BENCH_FRAME_SIZE];
+    uint8_t drain[4096];
+    uint8_t level = 0;
+    const size_t burst = (simulator->hotBurst < BENCH_MAX_BURST ? simulator->hotBurst : BENCH_MAX_BURST);
+
+    while(!atomic_load(&simulator->stop))
+    {
+        for(size_t i = 0; i < BENCH_MAX_BURST; i++)
+        {
+            bench_fillFrame(&frames[i * BENCH_FRAME_SIZE], level + i);
+        }
+        level++;
+
+        for(size_t i = 0; i < simulator->count; i++)
+        {
+            const int fd = simulator->vehicles[i].server;
+            const size_t frameCount = (i == 0 && burst > 0 ? burst : 1);
+            const ssize_t written = write(fd, frames, frameCount * BENCH_FRAME_SIZE);
+
+            if(written > 0)
+            {
+                simulator->sent += (size_t) written / BENCH_FRAME_SIZE;
+            }
+            while(read(fd, drain, sizeof(drain)) > 0)
+            {
+            }
+        }
+        usleep(BENCH_UPDATE_INTERVAL_US);
+    }
+    return NULL;
+}
+static size_t bench_takeUpdates(bench_vehicle_t *vehicles, const size_t count)
+{
+    size_t updates = 0;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        updates += atomic_exchange(&vehicles[i].updates, 0);
+    }
+    return updates;
+}
+
+#endif
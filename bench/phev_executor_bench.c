@@ -0,0 +1,100 @@
+// Spreads simulated cars over executor shards and reports per shard
+// utilisation once a second. The first car gets a burst of updates every tick,
+// like a car in full refresh mode, so runs with and without stealing show how
+// well the other cars on its shard are moved away from it.
+//
+//   phev_executor_bench [shards] [vehicles] [seconds] [steal 0|1] [hot burst]
+#include "phev_bench.h"
+#include "phev_executor.h"
+
+#define BENCH_DEFAULT_SHARDS 4
+#define BENCH_DEFAULT_VEHICLES 256
+#define BENCH_DEFAULT_SECONDS 5
+#define BENCH_DEFAULT_BURST 200
+
+int main(int argc, char *argv[])
+{
+    const size_t shards = (argc > 1 ? (size_t) atol(argv[1]) : BENCH_DEFAULT_SHARDS);
+    const size_t count = (argc > 2 ? (size_t) atol(argv[2]) : BENCH_DEFAULT_VEHICLES);
+    const int seconds = (argc > 3 ? atoi(argv[3]) : BENCH_DEFAULT_SECONDS);
+    const bool stealing = (argc > 4 ? atoi(argv[4]) != 0 : true);
+    const size_t burst = (argc > 5 ? (size_t) atol(argv[5]) : BENCH_DEFAULT_BURST);
+    bench_vehicle_t *vehicles = calloc(count, sizeof(bench_vehicle_t));
+    uint16_t port;
+
+    bench_raiseFileLimit();
+
+    const int listener = bench_listen(&port);
+    phev_executor_settings_t settings = {
+        .shards = shards,
+        .stealing = stealing,
+    };
+    phev_executor_t *executor = phev_executor_create(settings);
+
+    if(executor == NULL || vehicles == NULL)
+    {
+        fprintf(stderr, "Cannot create executor\n");
+        return 1;
+    }
+
+    // Everything starts on shard 0 so stealing has something to do
+    for(size_t i = 0; i < count; i++)
+    {
+        phevCtx_t *vehicle = bench_createVehicle(&vehicles[i], i, port, false);
+        const bool added = (stealing ? phev_executor_addToShard(executor, 0, vehicle) : phev_executor_add(executor, vehicle));
+
+        if(!added || !bench_acceptVehicle(&vehicles[i], listener))
+        {
+            fprintf(stderr, "Could not add vehicle %zu\n", i);
+            return 1;
+        }
+    }
+
+    bench_simulator_t simulator = {
+        .vehicles = vehicles,
+        .count = count,
+        .hotBurst = burst,
+        .sent = 0,
+    };
+    pthread_t thread;
+
+    atomic_init(&simulator.stop, false);
+    bench_takeUpdates(vehicles, count);
+    pthread_create(&thread, NULL, bench_simulate, &simulator);
+
+    printf("%4s %6s %10s %12s %8s %8s %10s\n", "sec", "shard", "vehicles", "utilisation", "stolen", "given", "updates/s");
+
+    for(int second = 1; second <= seconds; second++)
+    {
+        sleep(1);
+
+        const size_t updates = bench_takeUpdates(vehicles, count);
+
+        for(size_t shard = 0; shard < executor->count; shard++)
+        {
+            phev_executor_stats_t stats;
+
+            phev_executor_stats(executor, shard, &stats);
+            printf("%4d %6zu %10zu %11.1f%% %8zu %8zu", second, shard, stats.vehicles, stats.utilisation / 10.0, stats.stolen, stats.given);
+            if(shard == 0)
+            {
+                printf(" %10zu", updates);
+            }
+            printf("\n");
+        }
+    }
+
+    atomic_store(&simulator.stop, true);
+    pthread_join(thread, NULL);
+    phev_executor_destroy(executor);
+
+    for(size_t i = 0; i < count; i++)
+    {
+        phev_exit(vehicles[i].ctx);
+        close(vehicles[i].server);
+    }
+    close(listener);
+    free(vehicles);
+
+    return 0;
+}
@@ -0,0 +1,116 @@
+// Runs N simulated cars through one gateway and reports memory and CPU per
+// vehicle as N grows.
+//
+//   phev_gateway_bench [max vehicles] [seconds per step] [uring]
+//
+// With uring the cars connect through io_uring and the ring enters per frame
+// received are reported as well.
+#include "phev_bench.h"
+#include "phev_gateway.h"
+#include "phev_tcpip_uring.h"
+
+#define BENCH_DEFAULT_VEHICLES 64
+#define BENCH_DEFAULT_SECONDS 2
+
+static bool bench_addVehicle(phev_gateway_t *gateway, bench_vehicle_t *vehicle, const size_t index, const int listener, const uint16_t port, const bool uring)
+{
+    if(!phev_gateway_add(gateway, bench_createVehicle(vehicle, index, port, uring)))
+    {
+        return false;
+    }
+    return bench_acceptVehicle(vehicle, listener);
+}
+int main(int argc, char *argv[])
+{
+    const size_t maxVehicles = (argc > 1 ? (size_t) atol(argv[1]) : BENCH_DEFAULT_VEHICLES);
+    const int seconds = (argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_SECONDS);
+    const bool uring = (argc > 3 && strcmp(argv[3], "uring") == 0);
+    bench_vehicle_t *vehicles = calloc(maxVehicles, sizeof(bench_vehicle_t));
+    uint16_t port;
+    size_t count = 0;
+
+    bench_raiseFileLimit();
+
+    const int listener = bench_listen(&port);
+    phev_gateway_t *gateway = phev_gateway_create();
+
+    if(gateway == NULL || vehicles == NULL)
+    {
+        fprintf(stderr, "Gateway not available on this platform\n");
+        return 1;
+    }
+
+    const size_t baseline = bench_rssBytes();
+
+    if(uring && !phev_uringSupported())
+    {
+        fprintf(stderr, "io_uring not available, using plain sockets\n");
+    }
+
+    printf("%10s %14s %18s %14s %14s\n", "vehicles", "rss/vehicle", "cpu us/vehicle/s", "updates/s", "enters/frame");
+
+    for(size_t step = 1; step <= maxVehicles; step *= 2)
+    {
+        while(count < step)
+        {
+            if(!bench_addVehicle(gateway, &vehicles[count], count, listener, port, uring))
+            {
+                fprintf(stderr, "Could not add vehicle %zu\n", count);
+                return 1;
+            }
+            count++;
+        }
+
+        const size_t rss = bench_rssBytes();
+        bench_simulator_t simulator = {
+            .vehicles = vehicles,
+            .count = count,
+            .hotBurst = 0,
+            .sent = 0,
+        };
+        pthread_t thread;
+
+        atomic_init(&simulator.stop, false);
+        bench_takeUpdates(vehicles, count);
+
+        phev_uring_stats_t before;
+        phev_uring_stats_t after;
+
+        phev_uringStats(&before);
+        pthread_create(&thread, NULL, bench_simulate, &simulator);
+
+        const uint64_t cpuStart = bench_nanos(CLOCK_THREAD_CPUTIME_ID);
+        const uint64_t end = bench_nanos(CLOCK_MONOTONIC) + (uint64_t) seconds * 1000000000ULL;
+
+        while(bench_nanos(CLOCK_MONOTONIC) < end)
+        {
+            phev_gateway_runOnce(gateway, 10);
+        }
+
+        const uint64_t cpu = bench_nanos(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+
+        atomic_store(&simulator.stop, true);
+        pthread_join(thread, NULL);
+        phev_uringStats(&after);
+
+        const size_t updates = bench_takeUpdates(vehicles, count);
+
+        printf("%10zu %12zuKB %18.1f %14.0f %14.3f\n", count,
+            (rss - baseline) / count / 1024,
+            (double) cpu / 1000.0 / (double) count / (double) seconds,
+            (double) updates / (double) seconds,
+            (simulator.sent ? (double) (after.enters - before.enters) / (double) simulator.sent : 0.0));
+    }
+
+    phev_gateway_exit(gateway);
+    for(size_t i = 0; i < count; i++)
+    {
+        phev_exit(vehicles[i].ctx);
+        close(vehicles[i].server);
+    }
+    phev_gateway_destroy(gateway);
+    close(listener);
+    free(vehicles);
+
+    return 0;
+}
@@ -9,6 +9,7 @@
 #include "msg_core.h"
 #include "phev_service.h"
 #include "phev_pipe.h"
+#include "phev_tcpip.h"
 
 #define KO_WF_CONNECT_INFO_GS_SP 1
 #define KO_WF_REG_DISP_SP 16
@@ -41,8 +42,11 @@ typedef enum {
     PHEV_DATE_SYNC,
     PHEV_PING_RESPONSE,
     PHEV_FILTERED_MESSAGE,
+    // data is a phev_pipe_connectionEvent_t
+    PHEV_CONNECTION_STATE,
 } phevEventTypes_t;
 
+// data is only valid for the duration of the event handler call
 typedef struct phevEvent_t {
     phevEventTypes_t type;
     uint8_t reg;
@@ -56,12 +60,20 @@ typedef int (* phevEventHandler_t)(phevEvent_t *);
 typedef struct phevCtx_t {
     phevServiceCtx_t * serviceCtx;
     phevEventHandler_t eventHandler;
+    // Connection state of the default outgoing client, NULL when passed one
+    phev_tcpip_conn_t * transport;
     void * ctx;
 } phevCtx_t;
 
 typedef struct phev_pipe_ctx_t phev_pipe_ctx_t;
 typedef struct phevPipeEvent_t phevPipeEvent_t;
+// The second argument is NULL once the car has acknowledged the write, or a
+// phevCommandFailure_t when the write was given up on or replaced. It is only
+// valid for the duration of the callback.
 typedef void (*phevCallBack_t)(phevCtx_t * ctx, void *);
+typedef struct phevCommandFailure_t {
+    uint8_t reg;
+} phevCommandFailure_t;
 typedef struct phevCallBackCtx_t {
     phevCallBack_t callback;
     phevCtx_t * ctx;
@@ -82,6 +94,11 @@ typedef struct phevSettings_t {
     bool my18;
     messagingClient_t * in;
     messagingClient_t * out;
+    bool reactor;
+    // Drives the car connection through io_uring where the kernel has it
+    bool uring;
+    // Restores the last known status from this file at startup, NULL to disable
+    const char * snapshotPath;
 } phevSettings_t;
 
 typedef enum phevAirConMode_t {
@@ -110,6 +127,8 @@ void phev_updateAll(phevCtx_t * ctx, phevCallBack_t callback);
 int phev_isLocked(phevCtx_t * ctx);
 void phev_airConMY19(phevCtx_t * ctx, phevAirConMode_t mode, phevAirConTime_t time,phevCallBack_t callback);
 void phev_airConMode(phevCtx_t * ctx, phevAirConMode_t mode, phevAirConTime_t time,phevCallBack_t callback);
+// Releases sockets and fds once the vehicle has exited, status can still be read
+void phev_close(phevCtx_t * ctx);
 bool phev_running(phevCtx_t * ctx);
 int phev_batteryLevel(phevCtx_t * ctx);
 int phev_batteryWarning(phevCtx_t * ctx);
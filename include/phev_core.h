@@ -33,6 +33,16 @@
 #define START_SEND_MY18 0xf2
 #define START_RESP_MY18 0x2f
 
+#define PHEV_CORE_MAX_FRAME_SIZE 257
+
+#define PHEV_CORE_XOR_HINT_PLAIN 0
+#define PHEV_CORE_XOR_HINT_KEY 1
+#define PHEV_CORE_XOR_HINT_KEY_FLIP 2
+
+#define PHEV_CORE_SCAN_OK 0
+#define PHEV_CORE_SCAN_INCOMPLETE 1
+#define PHEV_CORE_SCAN_INVALID 2
+
 #define VIN_LEN 17
 #define MAC_ADDR_SIZE 6
 
@@ -81,9 +91,93 @@ typedef struct phevMessage_t
     uint8_t XOR;
 } phevMessage_t;
 
-static bool phev_core_my18 = false;
+typedef struct phevFrame_t
+{
+    uint8_t command;
+    uint8_t type;
+    uint8_t reg;
+    uint8_t XOR;
+    uint8_t checksum;
+    const uint8_t *data;
+    size_t length;
+    size_t frameLength;
+} phevFrame_t;
+
+typedef struct phevMessageCtx_t
+{
+    uint8_t XOR;
+    bool encoded;
+    bool decoded;
+    phevFrame_t frame;
+    uint8_t payload[];
+} phevMessageCtx_t;
+
+#define PHEV_CORE_CMD_ALLOWED 0x01
+#define PHEV_CORE_CMD_INCOMING 0x02
+#define PHEV_CORE_CMD_OUTGOING 0x04
+#define PHEV_CORE_CMD_CLEAR_INCOMING 0x08
+#define PHEV_CORE_CMD_CLEAR_OUTGOING 0x10
+#define PHEV_CORE_CMD_FROM_CAR 0x20
+#define PHEV_CORE_CMD_UNSIZED 0x40
+#define PHEV_CORE_CMD_MY18 0x80
+
+enum
+{
+    PHEV_CORE_XOR_KEEP,
+    PHEV_CORE_XOR_FRAME,
+    PHEV_CORE_XOR_FRAME_FLIP,
+    PHEV_CORE_XOR_NONE,
+};
+enum
+{
+    PHEV_CORE_ACK_REQUEST,
+    PHEV_CORE_ACK_NEVER,
+    PHEV_CORE_ACK_PLAIN,
+};
+enum
+{
+    PHEV_CORE_CLASS_NONE,
+    PHEV_CORE_CLASS_PING,
+    PHEV_CORE_CLASS_START,
+    PHEV_CORE_CLASS_COMMAND,
+    PHEV_CORE_CLASS_KEY,
+};
+
+typedef struct phevCommandDescriptor_t
+{
+    uint8_t flags;
+    uint8_t xorRule;
+    uint8_t ackPolicy;
+    uint8_t commandClass;
+    uint8_t variant;
+} phevCommandDescriptor_t;
+
+const phevCommandDescriptor_t * phev_core_commandDescriptor(const uint8_t command);
+
+#define PHEV_CORE_TEMPLATE_SIZE 6
+#define PHEV_CORE_TEMPLATE_NONE (-1)
+
+enum
+{
+    PHEV_CORE_TEMPLATE_PING,
+    PHEV_CORE_TEMPLATE_ACK,
+    PHEV_CORE_TEMPLATE_ACK_MY18,
+    PHEV_CORE_TEMPLATE_HEADLIGHTS_ON,
+    PHEV_CORE_TEMPLATE_HEADLIGHTS_OFF,
+    PHEV_CORE_TEMPLATE_PARKING_LIGHTS_ON,
+    PHEV_CORE_TEMPLATE_PARKING_LIGHTS_OFF,
+    PHEV_CORE_TEMPLATE_UPDATE_ALL,
+    PHEV_CORE_TEMPLATE_COUNT,
+};
+
+const uint8_t * phev_core_frameTemplate(const int id);
+
+int phev_core_ackTemplate(const uint8_t command);
 
-const static uint8_t allowedCommands[] = {START_SEND, START_RESP, SEND_CMD, RESP_CMD, PING_SEND_CMD, PING_RESP_CMD, START_RESP_MY18, START_SEND_MY18, PING_SEND_CMD_MY18, PING_RESP_CMD_MY18,0x5e,0xcd,0xba,0x6e,0xcc,0xbb,0x3e,0x4f,0x4e,0xe4};
+int phev_core_registerTemplate(const uint8_t reg, const uint8_t value);
+
+// Copies a pre-encoded frame, patching the register and checksum, XORed with the given key
+size_t phev_core_renderTemplate(uint8_t *out, const size_t outLen, const int id, const uint8_t reg, const uint8_t xor);
 
 phevMessage_t * phev_core_createMessage(const uint8_t command, const uint8_t type, const uint8_t reg, const uint8_t * data, const size_t length);
 
@@ -95,8 +189,30 @@ bool phev_core_validateMessage(const uint8_t * data, const size_t len);
 
 int phev_core_decodeMessage(const uint8_t *data, const size_t len, phevMessage_t *message);
 
+int phev_core_decodeFrame(const uint8_t *data, const size_t len, uint8_t *scratch, const size_t scratchLen, phevFrame_t *frame);
+
+int phev_core_decodeFrameWithHint(const uint8_t *data, const size_t len, uint8_t *scratch, const size_t scratchLen, uint8_t *hint, phevFrame_t *frame);
+
+size_t phev_core_decodeFrames(const uint8_t *data, const size_t len, uint8_t *scratch, const size_t scratchLen, phevFrame_t *frames, const size_t maxFrames, size_t *consumed);
+
+void phev_core_xorBuffer(uint8_t *out, const uint8_t *in, const size_t length, const uint8_t xor);
+
+uint8_t phev_core_xorSum(const uint8_t *in, const size_t length, const uint8_t xor);
+
+size_t phev_core_scanFrameXOR(const uint8_t *data, const size_t len, const uint8_t xor);
+
+size_t phev_core_findIncomingXOR(const uint8_t *data, const size_t len, uint8_t *hint, uint8_t *xor);
+
+size_t phev_core_findOutgoingXOR(const uint8_t *data, const size_t len, uint8_t *hint, uint8_t *xor);
+
+// Classifies the bytes at the head of a stream as a whole frame, a frame still arriving or garbage.
+// A head that only looks partial is garbage once a complete frame is visible further on.
+int phev_core_scanIncomingFrame(const uint8_t *data, const size_t len, uint8_t *hint, uint8_t *xor, size_t *frameLength);
+
 int phev_core_encodeMessage(phevMessage_t *message,uint8_t **data);
 
+size_t phev_core_encodeFrame(uint8_t *out, const size_t outLen, const uint8_t command, const uint8_t type, const uint8_t reg, const uint8_t *data, const size_t length, const uint8_t xor);
+
 message_t * phev_core_extractMessage(const uint8_t *data, const size_t len, const uint8_t xor);
 
 phevMessage_t *phev_core_requestMessage(const uint8_t command, const uint8_t reg, const uint8_t *data, const size_t length);
@@ -145,12 +261,24 @@ uint8_t * phev_core_getData(const uint8_t * data);
 
 uint8_t phev_core_getType(const uint8_t *data);
 
+uint8_t phev_core_validateCommand(const uint8_t command);
+
+int phev_core_validate_buffer(const uint8_t *msg, const size_t len);
+
+bool phev_core_checkIncomingCommand(const uint8_t command);
+
+bool phev_core_checkOutgoingCommand(const uint8_t command);
+
 bool phev_core_validateChecksum(const uint8_t *data);
 
 message_t * phev_core_extractIncomingMessageAndXOR(const uint8_t * data);
 
 message_t * phev_core_extractOutgoingMessageAndXOR(const uint8_t * data);
 
+message_t * phev_core_extractIncomingMessageAndXORHint(const uint8_t * data, const size_t len, uint8_t * hint);
+
+message_t * phev_core_extractOutgoingMessageAndXORHint(const uint8_t * data, const size_t len, uint8_t * hint);
+
 message_t * phev_core_extractAndDecodeIncomingMessageAndXOR(const uint8_t *data);
 
 message_t * phev_core_extractAndDecodeOutgoingMessageAndXOR(const uint8_t *data);
@@ -159,6 +287,15 @@ message_t * phev_core_createMsgXOR(const uint8_t * data, const size_t length, co
 
 uint8_t phev_core_getMessageXOR(const message_t * message);
 
+message_t * phev_core_createMsgFrame(const uint8_t * data, const size_t length, const uint8_t xor, const bool encoded);
+
+bool phev_core_messageEncoded(const message_t * message);
+
+// Decodes the frame on first use and keeps it on the message for every later chain stage
+const phevFrame_t * phev_core_messageFrame(message_t * message);
+
+void phev_core_frameMessage(const phevFrame_t * frame, phevMessage_t * message);
+
 #define phev_core_strdup(...) strdup(...)
 
 #endif
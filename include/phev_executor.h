@@ -0,0 +1,88 @@
+#ifndef _PHEV_EXECUTOR_H_
+#define _PHEV_EXECUTOR_H_
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "phev.h"
+#include "phev_gateway.h"
+
+// Longest a shard sleeps before it looks at its inbox and steal requests
+#define PHEV_EXECUTOR_TICK_MS 100
+
+#ifndef PHEV_EXECUTOR_WINDOW_MS
+#define PHEV_EXECUTOR_WINDOW_MS 1000
+#endif
+
+// Utilisation is kept in parts per thousand of one core
+#ifndef PHEV_EXECUTOR_OVERLOADED
+#define PHEV_EXECUTOR_OVERLOADED 800
+#endif
+
+#ifndef PHEV_EXECUTOR_IDLE
+#define PHEV_EXECUTOR_IDLE 300
+#endif
+
+#define PHEV_EXECUTOR_NO_STEAL (-1)
+
+typedef struct phev_executor_t phev_executor_t;
+
+// A worker thread with its own gateway. Vehicles belong to exactly one shard
+// and are only touched by its thread, so the pipe and model need no locks.
+// Other threads only reach a shard through the inbox and the steal request.
+typedef struct phev_executor_shard_t
+{
+    phev_executor_t *executor;
+    size_t index;
+    pthread_t thread;
+    phev_gateway_t *gateway;
+    pthread_mutex_t inboxLock;
+    phevCtx_t **inbox;
+    size_t inboxCount;
+    size_t inboxCapacity;
+    atomic_int stealRequest;
+    atomic_bool stop;
+    atomic_uint utilisation;
+    atomic_size_t vehicles;
+    atomic_size_t dispatches;
+    atomic_size_t stolen;
+    atomic_size_t given;
+    uint64_t windowStart;
+    uint64_t windowCpu;
+} phev_executor_shard_t;
+
+typedef struct phev_executor_settings_t
+{
+    // Defaults to one shard per online CPU
+    size_t shards;
+    // Lets idle shards take vehicles from overloaded ones
+    bool stealing;
+} phev_executor_settings_t;
+
+typedef struct phev_executor_t
+{
+    phev_executor_shard_t *shards;
+    size_t count;
+    bool stealing;
+} phev_executor_t;
+
+typedef struct phev_executor_stats_t
+{
+    size_t vehicles;
+    unsigned int utilisation;
+    size_t dispatches;
+    size_t stolen;
+    size_t given;
+} phev_executor_stats_t;
+
+phev_executor_t *phev_executor_create(phev_executor_settings_t settings);
+bool phev_executor_add(phev_executor_t *executor, phevCtx_t *vehicle);
+bool phev_executor_addToShard(phev_executor_t *executor, const size_t shard, phevCtx_t *vehicle);
+bool phev_executor_steal(phev_executor_t *executor, const size_t thief, const size_t victim);
+void phev_executor_stats(phev_executor_t *executor, const size_t shard, phev_executor_stats_t *stats);
+void phev_executor_destroy(phev_executor_t *executor);
+
+#endif
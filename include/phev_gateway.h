@@ -0,0 +1,42 @@
+#ifndef _PHEV_GATEWAY_H_
+#define _PHEV_GATEWAY_H_
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include <stdint.h>
+#include <stdbool.h>
+#include "phev.h"
+
+#ifndef PHEV_GATEWAY_INITIAL_VEHICLES
+#define PHEV_GATEWAY_INITIAL_VEHICLES 8
+#endif
+
+#define PHEV_GATEWAY_MAX_EVENTS 64
+
+// Runs many vehicles from one thread. Each vehicle keeps its own pipe, model,
+// XOR state and registration; the gateway only waits on all their reactors at
+// once, so vehicles must be created with the reactor setting.
+typedef struct phev_gateway_t
+{
+    phevCtx_t **vehicles;
+    size_t count;
+    size_t capacity;
+    int epollFd;
+    int wakeFd;
+    bool exit;
+    size_t dispatches;
+} phev_gateway_t;
+
+phev_gateway_t *phev_gateway_create(void);
+bool phev_gateway_add(phev_gateway_t *gateway, phevCtx_t *vehicle);
+// Takes over a vehicle that has already been started, e.g. one moved from
+// another gateway
+bool phev_gateway_attach(phev_gateway_t *gateway, phevCtx_t *vehicle);
+void phev_gateway_remove(phev_gateway_t *gateway, phevCtx_t *vehicle);
+int phev_gateway_runOnce(phev_gateway_t *gateway, const int timeoutMs);
+void phev_gateway_run(phev_gateway_t *gateway);
+void phev_gateway_wakeup(phev_gateway_t *gateway);
+void phev_gateway_exit(phev_gateway_t *gateway);
+void phev_gateway_destroy(phev_gateway_t *gateway);
+
+#endif
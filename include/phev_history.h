@@ -0,0 +1,72 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#ifndef _PHEV_HISTORY_H_
+#define _PHEV_HISTORY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Memory used when phev_history_create is given 0
+#ifndef PHEV_HISTORY_DEFAULT_MAX_BYTES
+#define PHEV_HISTORY_DEFAULT_MAX_BYTES (64 * 1024)
+#endif
+
+// Longer registers only keep their first bytes
+#ifndef PHEV_HISTORY_VALUE_SIZE
+#define PHEV_HISTORY_VALUE_SIZE (8)
+#endif
+
+// One run of identical values. Times are stored as deltas, the ring keeps the
+// absolute time of its newest entry.
+typedef struct phevHistoryEntry_t
+{
+    // Milliseconds since the previous entry started
+    uint32_t delta;
+    // Milliseconds between the first and last sample of the run
+    uint32_t span;
+    uint16_t repeats;
+    uint8_t length;
+    uint8_t value[PHEV_HISTORY_VALUE_SIZE];
+} phevHistoryEntry_t;
+
+typedef struct phevHistoryRing_t
+{
+    uint64_t newest;
+    uint16_t capacity;
+    uint16_t head;
+    uint16_t count;
+    phevHistoryEntry_t entries[];
+} phevHistoryRing_t;
+
+typedef struct phevHistory_t
+{
+    phevHistoryRing_t * rings[256];
+    size_t maxBytes;
+    size_t usedBytes;
+} phevHistory_t;
+
+// A run as returned by the queries, times are monotonic milliseconds
+typedef struct phevHistorySample_t
+{
+    uint64_t first;
+    uint64_t last;
+    uint16_t repeats;
+    uint8_t length;
+    uint8_t value[PHEV_HISTORY_VALUE_SIZE];
+} phevHistorySample_t;
+
+phevHistory_t * phev_history_create(size_t maxBytes);
+void phev_history_destroy(phevHistory_t * history);
+// Keeps the last entries runs of reg, false when that would go over the cap
+bool phev_history_track(phevHistory_t * history, uint8_t reg, uint16_t entries);
+bool phev_history_tracked(const phevHistory_t * history, uint8_t reg);
+uint64_t phev_history_nowMs(void);
+void phev_history_append(phevHistory_t * history, uint8_t reg, const uint8_t * data, size_t length, uint64_t now);
+// Newest runs of reg, oldest first
+size_t phev_history_last(const phevHistory_t * history, uint8_t reg, size_t count, phevHistorySample_t * samples);
+// Runs of reg that overlap from to to, oldest first. Keeps the newest max.
+size_t phev_history_window(const phevHistory_t * history, uint8_t reg, uint64_t from, uint64_t to, phevHistorySample_t * samples, size_t max);
+
+#endif
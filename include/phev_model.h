@@ -5,7 +5,9 @@
 #define _PHEV_MODEL_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
+#include "phev_history.h"
 
 typedef struct phevRegister_t
 {
@@ -13,15 +15,73 @@ typedef struct phevRegister_t
     uint8_t data[]; 
 } phevRegister_t;
 
+// Borrowed view of a register, only valid until the model is next written
+typedef struct phevRegisterView_t
+{
+    const uint8_t * data;
+    size_t length;
+    uint32_t version;
+} phevRegisterView_t;
+
+// Register data lives in one slab, most sessions fit in the inline part so
+// the whole model is a single allocation
+#ifndef PHEV_MODEL_SLAB_SIZE
+#define PHEV_MODEL_SLAB_SIZE (2048)
+#endif
+
+// Slots are rounded up so small length changes still update in place
+#define PHEV_MODEL_SLOT_ALIGN (8)
+
+typedef struct phevModelSlot_t
+{
+    uint32_t offset;
+    uint16_t length;
+    uint16_t capacity;
+} phevModelSlot_t;
+
 typedef struct phevModel_t
 {
-    phevRegister_t * registers[256];
+    phevModelSlot_t slots[256];
+    // Model version of the last write that changed each register
+    uint32_t versions[256];
+    uint32_t version;
+    uint64_t dirty[4];
+    // Registers in write order, newest first, so changes since a version are
+    // found without scanning all 256
+    int16_t newest;
+    int16_t newer[256];
+    int16_t older[256];
+    // Optional, NULL unless a history was attached
+    phevHistory_t * history;
+    uint8_t * data;
+    size_t size;
+    size_t used;
+    // Space left behind by registers that outgrew their slot
+    size_t wasted;
+    uint8_t slab[PHEV_MODEL_SLAB_SIZE];
 
 } phevModel_t;
 
 
 phevModel_t * phev_model_create(void);
+void phev_model_destroy(phevModel_t *);
+// Records writes of the tracked registers, the model owns the history after this
+void phev_model_attachHistory(phevModel_t *, phevHistory_t *);
 int phev_model_setRegister(phevModel_t *, uint8_t, const uint8_t *, size_t);
+// Sets a register saved earlier under version, restore in version order
+int phev_model_restoreRegister(phevModel_t *, uint8_t, const uint8_t *, size_t, uint32_t);
+// Copy of the register, the caller frees it
 phevRegister_t * phev_model_getRegister(phevModel_t *, uint8_t);
+// Fills view without copying, false when the register is not set or empty
+bool phev_model_viewRegister(const phevModel_t *, uint8_t, phevRegisterView_t *);
 int phev_model_compareRegister(phevModel_t *, uint8_t, const uint8_t *);
+// Like memcmp but also differs when the lengths differ, -1 when not set
+int phev_model_compareRegisterData(const phevModel_t *, uint8_t, const uint8_t *, size_t);
+// Bumped by every write that changes a register, writes of the same data are not changes
+uint32_t phev_model_version(const phevModel_t *);
+// Fills regs with the registers changed after version, oldest change first
+size_t phev_model_changedSince(const phevModel_t *, uint32_t, uint8_t regs[256]);
+bool phev_model_isDirty(const phevModel_t *, uint8_t);
+// Fills regs with the dirty registers in register order and clears the set
+size_t phev_model_takeDirty(phevModel_t *, uint8_t regs[256]);
 #endif
\ No newline at end of file
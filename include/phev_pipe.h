@@ -6,20 +6,114 @@
 #include <time.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include "msg_core.h"
 #include "msg_pipe.h"
 #include "phev_core.h"
 
-#define PHEV_PIPE_MAX_EVENT_HANDLERS 10
-#define PHEV_PIPE_MAX_UPDATE_CALLBACKS 10
-#ifndef PHEV_CONNECT_WAIT_TIME
-#define PHEV_CONNECT_WAIT_TIME (1000)
-#endif
-
+#define PHEV_PIPE_INITIAL_EVENT_HANDLERS 4
 #ifndef PHEV_CONNECT_MAX_RETRIES
 #define PHEV_CONNECT_MAX_RETRIES (5)
 #endif
 
+// Backstop for transports without a timeout of their own. It is a little
+// longer than the tcp one so the transport reports the failure first.
+#ifndef PHEV_CONNECT_TIMEOUT_MS
+#define PHEV_CONNECT_TIMEOUT_MS (6000)
+#endif
+
+#ifndef PHEV_CONNECT_BACKOFF_MIN_MS
+#define PHEV_CONNECT_BACKOFF_MIN_MS (500)
+#endif
+
+#ifndef PHEV_CONNECT_BACKOFF_MAX_MS
+#define PHEV_CONNECT_BACKOFF_MAX_MS (30000)
+#endif
+
+// How often phev_pipe_waitForConnection checks on a pending connect
+#ifndef PHEV_CONNECT_POLL_MS
+#define PHEV_CONNECT_POLL_MS (50)
+#endif
+
+#ifndef PHEV_PIPE_PING_INTERVAL_MS
+#define PHEV_PIPE_PING_INTERVAL_MS (1000)
+#endif
+
+// Pings are skipped while the car keeps sending frames, but never for longer
+// than this so the car still sees us
+#ifndef PHEV_PIPE_PING_MAX_SILENCE_MS
+#define PHEV_PIPE_PING_MAX_SILENCE_MS (5000)
+#endif
+
+#ifndef PHEV_PIPE_TIME_SYNC_INTERVAL_MS
+#define PHEV_PIPE_TIME_SYNC_INTERVAL_MS (30000)
+#endif
+
+// Pings the car may leave unanswered before the link is dropped, 0 never drops
+#ifndef PHEV_PIPE_MAX_UNANSWERED_PINGS
+#define PHEV_PIPE_MAX_UNANSWERED_PINGS (3)
+#endif
+
+#ifndef PHEV_PIPE_OUTBOUND_BUFFER_SIZE
+#define PHEV_PIPE_OUTBOUND_BUFFER_SIZE (1024)
+#endif
+
+#ifndef PHEV_PIPE_COMMAND_TIMEOUT_MS
+#define PHEV_PIPE_COMMAND_TIMEOUT_MS (1000)
+#endif
+
+#ifndef PHEV_PIPE_COMMAND_MAX_TIMEOUT_MS
+#define PHEV_PIPE_COMMAND_MAX_TIMEOUT_MS (8000)
+#endif
+
+#ifndef PHEV_PIPE_COMMAND_MAX_ATTEMPTS
+#define PHEV_PIPE_COMMAND_MAX_ATTEMPTS (5)
+#endif
+
+// Minimum gap between sends of the same command when the car asks for a resend
+#ifndef PHEV_PIPE_COMMAND_RESEND_HOLDOFF_MS
+#define PHEV_PIPE_COMMAND_RESEND_HOLDOFF_MS (250)
+#endif
+
+// 0 means the number of commands in flight is only limited by memory
+#ifndef PHEV_PIPE_MAX_INFLIGHT_COMMANDS
+#define PHEV_PIPE_MAX_INFLIGHT_COMMANDS (0)
+#endif
+
+// Slots the in-flight tracker starts with, it doubles when full
+#ifndef PHEV_PIPE_INITIAL_COMMANDS
+#define PHEV_PIPE_INITIAL_COMMANDS (4)
+#endif
+
+#ifndef PHEV_PIPE_LANE_BUFFER_SIZE
+#define PHEV_PIPE_LANE_BUFFER_SIZE (512)
+#endif
+
+#ifndef PHEV_PIPE_ACK_LANE_DEPTH
+#define PHEV_PIPE_ACK_LANE_DEPTH (32)
+#endif
+
+#ifndef PHEV_PIPE_COMMAND_LANE_DEPTH
+#define PHEV_PIPE_COMMAND_LANE_DEPTH (16)
+#endif
+
+#ifndef PHEV_PIPE_PING_LANE_DEPTH
+#define PHEV_PIPE_PING_LANE_DEPTH (1)
+#endif
+
+#ifndef PHEV_PIPE_TIMESYNC_LANE_DEPTH
+#define PHEV_PIPE_TIMESYNC_LANE_DEPTH (1)
+#endif
+
+// Queued ack and command bytes above which pings and time sync are deferred
+#ifndef PHEV_PIPE_OUTBOUND_CONGESTED
+#define PHEV_PIPE_OUTBOUND_CONGESTED (PHEV_PIPE_LANE_BUFFER_SIZE / 2)
+#endif
+
+#ifndef PHEV_PIPE_INBOUND_BUFFER_SIZE
+#define PHEV_PIPE_INBOUND_BUFFER_SIZE (2 * PHEV_CORE_MAX_FRAME_SIZE)
+#endif
+
 #define PHEV_PIPE_ECU_VERSION_SIZE 11
 #define PHEV_PIPE_DATE_INFO_SIZE 6
 
@@ -34,13 +128,13 @@
 #endif
 #define _POSIX_C_SOURCE 200809L // or greater
 #include <time.h>
-#define SLEEP(msecs)                      \
-    do                                    \
-    {                                     \
-        struct timespec ts;               \
-        ts.tv_sec = msecs / 1000;         \
-        ts.tv_nsec = msecs % 1000 * 1000; \
-        nanosleep(&ts, NULL);             \
+#define SLEEP(msecs)                          \
+    do                                        \
+    {                                         \
+        struct timespec ts;                   \
+        ts.tv_sec = msecs / 1000;             \
+        ts.tv_nsec = msecs % 1000 * 1000000L; \
+        nanosleep(&ts, NULL);                 \
     } while (0)
 #elif __XTENSA__
 #include "freertos/FreeRTOS.h"
@@ -67,13 +161,21 @@ enum
     PHEV_PIPE_BB,
     PHEV_PIPE_PING_RESP,
     PHEV_PIPE_FILTERED_MESSAGE,
+    PHEV_PIPE_CONNECTION_STATE,
+    PHEV_PIPE_EVENT_COUNT,
 };
+
+#define PHEV_PIPE_EVENT_MASK(event) (1u << (event))
+#define PHEV_PIPE_ALL_EVENTS (PHEV_PIPE_EVENT_MASK(PHEV_PIPE_EVENT_COUNT) - 1)
+// Events are dispatched from the stack and their data points into the decoded frame, so it is
+// only valid for the duration of the handler call. Use phev_pipe_copyEvent to keep one.
 typedef struct phevPipeEvent_t
 {
     int event;
     size_t length;
     void *data;
     void * ctx;
+    void * userCtx;
 } phevPipeEvent_t;
 
 typedef struct phevVinEvent_t
@@ -95,34 +197,185 @@ typedef void (* phevErrorHandler_t)(phevError_t *error);
 typedef void (* phev_pipe_updateRegisterCallback_t)(phev_pipe_ctx_t *ctx, uint8_t reg, void *customCtx);
 typedef void (* phevRegistrationComplete_t)(phev_pipe_ctx_t *ctx);
 
-typedef struct phev_pipe_updateRegisterCtx_t
+// A register write waiting for the car to acknowledge it. Only one write per
+// register is ever in flight, a newer write replaces the pending one.
+typedef struct phev_pipe_command_t
+{
+    uint8_t reg;
+    uint8_t * data;
+    size_t length;
+    phev_pipe_updateRegisterCallback_t callback;
+    phev_pipe_updateRegisterCallback_t failed;
+    void * customCtx;
+    uint64_t lastSent;
+    uint64_t deadline;
+    uint32_t timeout;
+    int attempts;
+} phev_pipe_command_t;
+
+typedef struct phev_pipe_commandTracker_t
+{
+    phev_pipe_command_t *commands;
+    size_t count;
+    size_t capacity;
+    size_t maxCommands;
+    int16_t slot[256];
+} phev_pipe_commandTracker_t;
+
+// Register write handed over from another thread, see phev_pipe_submitCommand
+typedef struct phev_pipe_submission_t
+{
+    struct phev_pipe_submission_t * _Atomic next;
+    uint8_t reg;
+    uint8_t * data;
+    size_t length;
+    phev_pipe_updateRegisterCallback_t callback;
+    phev_pipe_updateRegisterCallback_t failed;
+    void * customCtx;
+} phev_pipe_submission_t;
+
+// Intrusive multi producer, single consumer queue. Producers only touch head,
+// the loop thread owns tail and the stub node.
+typedef struct phev_pipe_submitQueue_t
+{
+    phev_pipe_submission_t * _Atomic head;
+    phev_pipe_submission_t * tail;
+    phev_pipe_submission_t stub;
+    int wakeFd;
+    atomic_size_t submitted;
+    size_t drained;
+} phev_pipe_submitQueue_t;
+
+typedef enum
 {
-    phev_pipe_updateRegisterCallback_t callbacks[PHEV_PIPE_MAX_UPDATE_CALLBACKS];
-    bool used[PHEV_PIPE_MAX_UPDATE_CALLBACKS];
-    uint8_t registers[PHEV_PIPE_MAX_UPDATE_CALLBACKS];
-    uint8_t * values[PHEV_PIPE_MAX_UPDATE_CALLBACKS];
-    size_t lengths[PHEV_PIPE_MAX_UPDATE_CALLBACKS];
-    void * ctx[PHEV_PIPE_MAX_UPDATE_CALLBACKS];
-    size_t numberOfCallbacks;
-} phev_pipe_updateRegisterCtx_t;
+    PHEV_PIPE_STATE_DISCONNECTED,
+    PHEV_PIPE_STATE_CONNECTING,
+    PHEV_PIPE_STATE_CONNECTED,
+    PHEV_PIPE_STATE_BACKOFF,
+} phev_pipe_connectionState_t;
+
+// Tells whether the out client still has a connect in flight, so a failed
+// attempt is not mistaken for a slow one
+typedef bool (* phev_pipe_connectPending_t)(void *ctx);
+
+typedef struct phev_pipe_connection_t
+{
+    phev_pipe_connectionState_t state;
+    uint32_t attempts;
+    // Connect timeout while connecting, next attempt while backing off
+    uint64_t deadline;
+    uint32_t seed;
+    // Bumped on every state change, a reconnect can hand back the same fd number
+    uint32_t generation;
+    bool startPending;
+    uint8_t mac[MAC_ADDR_SIZE];
+    phev_pipe_connectPending_t pending;
+    void *pendingCtx;
+} phev_pipe_connection_t;
+
+// Data of PHEV_PIPE_CONNECTION_STATE
+typedef struct phev_pipe_connectionEvent_t
+{
+    phev_pipe_connectionState_t state;
+    uint32_t attempts;
+    uint32_t retryInMs;
+} phev_pipe_connectionEvent_t;
+
+typedef struct phev_pipe_keepalive_t
+{
+    uint32_t intervalMs;
+    uint32_t maxSilenceMs;
+    uint32_t timeSyncMs;
+    uint8_t maxUnanswered;
+    uint64_t nextPing;
+    uint64_t nextTimeSync;
+    uint64_t lastPing;
+    // Last frame from the car other than a ping response
+    uint64_t lastInbound;
+    bool pingSent;
+    uint8_t lastSentPing;
+    size_t sent;
+    size_t suppressed;
+    size_t failures;
+} phev_pipe_keepalive_t;
+
+typedef struct phev_pipe_eventSubscriber_t
+{
+    phevPipeEventHandler_t handler;
+    uint32_t mask;
+    void *userCtx;
+} phev_pipe_eventSubscriber_t;
+
+typedef struct phev_pipe_eventRegistry_t
+{
+    phev_pipe_eventSubscriber_t *subscribers;
+    size_t count;
+    size_t capacity;
+    size_t *index;
+    size_t start[PHEV_PIPE_EVENT_COUNT + 1];
+    int dispatching;
+    bool dirty;
+} phev_pipe_eventRegistry_t;
+
+enum {
+    PHEV_PIPE_LANE_ACK,
+    PHEV_PIPE_LANE_COMMAND,
+    PHEV_PIPE_LANE_PING,
+    PHEV_PIPE_LANE_TIMESYNC,
+    PHEV_PIPE_LANE_COUNT,
+};
+
+typedef struct phev_pipe_lane_t
+{
+    uint8_t buffer[PHEV_PIPE_LANE_BUFFER_SIZE];
+    size_t length;
+    size_t depth;
+    size_t maxDepth;
+    bool droppable;
+    size_t dropped;
+    size_t sent;
+} phev_pipe_lane_t;
+
+typedef struct phev_pipe_outbound_t
+{
+    uint8_t buffer[PHEV_PIPE_OUTBOUND_BUFFER_SIZE];
+    phev_pipe_lane_t lanes[PHEV_PIPE_LANE_COUNT];
+    int batching;
+    bool immediateAcks;
+    size_t writes;
+} phev_pipe_outbound_t;
+
+typedef struct phev_pipe_inbound_t
+{
+    uint8_t buffer[PHEV_PIPE_INBOUND_BUFFER_SIZE];
+    size_t length;
+    size_t discarded;
+} phev_pipe_inbound_t;
 
 typedef struct phev_pipe_ctx_t
 {
     msg_pipe_ctx_t *pipe;
-    phevPipeEventHandler_t eventHandler[PHEV_PIPE_MAX_EVENT_HANDLERS];
-    int eventHandlers;
+    phev_pipe_eventRegistry_t events;
     phevErrorHandler_t errorHandler;
-    time_t lastPingTime;
+    phev_pipe_keepalive_t keepalive;
     uint8_t currentPing;
     uint8_t pingResponse;
     bool connected;
-    phev_pipe_updateRegisterCtx_t *updateRegisterCallbacks;
+    phev_pipe_commandTracker_t commands;
+    // Shared with the pipes this one replaced, so a thread still holding one
+    // of them submits to the live queue and wakes the live loop
+    phev_pipe_submitQueue_t * submissions;
     uint8_t currentXOR;
     uint8_t pingXOR;
     uint8_t commandXOR;
+    uint8_t inboundXORHint;
     bool encrypt;
     bool registerDevice;
     phevRegistrationComplete_t registrationCompleteCallback;
+    phev_pipe_outbound_t outbound;
+    phev_pipe_inbound_t inbound;
+    msg_pipe_chain_t inboundStages;
+    phev_pipe_connection_t connection;
     void *ctx;
 } phev_pipe_ctx_t;
 
@@ -146,19 +399,35 @@ typedef struct phev_pipe_settings_t
     phevErrorHandler_t errorHandler;
     bool registerDevice;
     phevRegistrationComplete_t registrationCompleteCallback;
+    bool fusedInbound;
+    bool immediateAcks;
+    // 0 uses PHEV_PIPE_PING_INTERVAL_MS and PHEV_PIPE_MAX_UNANSWERED_PINGS
+    uint32_t pingIntervalMs;
+    uint8_t maxUnansweredPings;
     void *ctx;
 } phev_pipe_settings_t;
 
 void phev_pipe_loop(phev_pipe_ctx_t *);
 phev_pipe_ctx_t *phev_pipe_createPipe(phev_pipe_settings_t);
 void phev_pipe_waitForConnection(phev_pipe_ctx_t *ctx);
+// Moves the connection on without blocking, returns true once connected
+bool phev_pipe_connectStep(phev_pipe_ctx_t *ctx, const uint64_t now);
+// When the state machine next needs to run, UINT64_MAX while connected
+uint64_t phev_pipe_nextConnectDeadline(phev_pipe_ctx_t *ctx);
+// Pings, time syncs and drops a link whose pings go unanswered
+void phev_pipe_keepalive(phev_pipe_ctx_t *ctx, const uint64_t now);
+uint64_t phev_pipe_nextKeepaliveDeadline(phev_pipe_ctx_t *ctx);
+uint8_t phev_pipe_unansweredPings(phev_pipe_ctx_t *ctx);
 message_t *phev_pipe_outputChainInputTransformer(void *, message_t *);
 message_t *phev_pipe_outputEventTransformer(void *, message_t *);
+message_t *phev_pipe_fusedInboundTransformer(void *ctx, message_t *message);
 void phev_pipe_registerEventHandler(phev_pipe_ctx_t *, phevPipeEventHandler_t);
+void phev_pipe_subscribeEvents(phev_pipe_ctx_t *ctx, phevPipeEventHandler_t handler, const uint32_t mask, void *userCtx);
 void phev_pipe_deregisterEventHandler(phev_pipe_ctx_t *, phevPipeEventHandler_t);
 message_t *phev_pipe_commandResponder(void *, message_t *);
 messageBundle_t *phev_pipe_outputSplitter(void *, message_t *);
 void phev_pipe_ping(phev_pipe_ctx_t *);
+void phev_pipe_sendTimeSync(phev_pipe_ctx_t *ctx);
 void phev_pipe_resetPing(phev_pipe_ctx_t *);
 void phev_pipe_start(phev_pipe_ctx_t *ctx, uint8_t *mac);
 void phev_pipe_sendMac(phev_pipe_ctx_t *ctx, uint8_t *mac);
@@ -166,11 +435,34 @@ void phev_pipe_updateRegister(phev_pipe_ctx_t *, const uint8_t, const uint8_t);
 void phev_pipe_updateComplexRegister(phev_pipe_ctx_t *, const uint8_t, const uint8_t *, size_t);
 void phev_pipe_updateComplexRegisterWithCallback(phev_pipe_ctx_t *ctx, const uint8_t reg, const uint8_t * data, size_t length, phev_pipe_updateRegisterCallback_t callback, void * customCtx);
 void phev_pipe_updateRegisterWithCallback(phev_pipe_ctx_t *ctx, const uint8_t reg, const uint8_t value, phev_pipe_updateRegisterCallback_t callback, void * customCtx);
-phevPipeEvent_t *phev_pipe_createRegisterEvent(phev_pipe_ctx_t *phevCtx, phevMessage_t *phevMessage);
+void phev_pipe_updateRegisterTracked(phev_pipe_ctx_t *ctx, const uint8_t reg, const uint8_t * data, size_t length, phev_pipe_updateRegisterCallback_t callback, phev_pipe_updateRegisterCallback_t failed, void * customCtx);
+void phev_pipe_serviceCommands(phev_pipe_ctx_t *ctx, const uint64_t now);
+void phev_pipe_setMaxInflightCommands(phev_pipe_ctx_t *ctx, const size_t maxCommands);
+phev_pipe_command_t *phev_pipe_pendingCommand(phev_pipe_ctx_t *ctx, const uint8_t reg);
+uint64_t phev_pipe_nowMs(void);
+void phev_pipe_submitCommand(phev_pipe_ctx_t *ctx, const uint8_t reg, const uint8_t * data, size_t length, phev_pipe_updateRegisterCallback_t callback, phev_pipe_updateRegisterCallback_t failed, void * customCtx);
+size_t phev_pipe_drainCommands(phev_pipe_ctx_t *ctx);
+void phev_pipe_wakeup(phev_pipe_ctx_t *ctx);
+int phev_pipe_wakeFd(phev_pipe_ctx_t *ctx);
+// Shares the submission queue and wakeup fd of from with ctx, and moves the
+// commands still in flight on from over to ctx
+void phev_pipe_adoptSubmissions(phev_pipe_ctx_t *ctx, phev_pipe_ctx_t *from);
+// Fails anything still queued and closes the wakeup fd
+void phev_pipe_closeSubmissions(phev_pipe_ctx_t *ctx);
+uint64_t phev_pipe_nextCommandDeadline(phev_pipe_ctx_t *ctx);
+bool phev_pipe_createRegisterEvent(phev_pipe_ctx_t *phevCtx, phevMessage_t *phevMessage, phevPipeEvent_t *event);
+bool phev_pipe_messageToEvent(phev_pipe_ctx_t *ctx, phevMessage_t *phevMessage, phevPipeEvent_t *event, phevVinEvent_t *vinEvent);
 void phev_pipe_outboundPublish(phev_pipe_ctx_t * ctx, message_t * message);
 void phev_pipe_pingOutboundPublish(phev_pipe_ctx_t * ctx, message_t * message);
 void phev_pipe_commandOutboundPublish(phev_pipe_ctx_t * ctx, message_t * message);
+bool phev_pipe_sendFrame(phev_pipe_ctx_t * ctx, const uint8_t command, const uint8_t type, const uint8_t reg, const uint8_t * data, const size_t length, const uint8_t xor);
+bool phev_pipe_sendTemplate(phev_pipe_ctx_t * ctx, const int id, const uint8_t reg, const uint8_t xor);
+void phev_pipe_outboundFlush(phev_pipe_ctx_t * ctx);
+void phev_pipe_outboundBegin(phev_pipe_ctx_t * ctx);
+const phev_pipe_lane_t * phev_pipe_outboundLane(phev_pipe_ctx_t * ctx, const int lane);
+void phev_pipe_outboundEnd(phev_pipe_ctx_t * ctx);
 void phev_pipe_sendRegister(phev_pipe_ctx_t * ctx);
+phevPipeEvent_t *phev_pipe_copyEvent(const phevPipeEvent_t *event);
 void phev_pipe_destroyEvent(phevPipeEvent_t * event);
 void phev_pipe_disconnectInput(phev_pipe_ctx_t *ctx);
 void phev_pipe_disconnectOutput(phev_pipe_ctx_t *ctx);
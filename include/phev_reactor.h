@@ -0,0 +1,55 @@
+#ifndef _PHEV_REACTOR_H_
+#define _PHEV_REACTOR_H_
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include <stdint.h>
+#include <stdbool.h>
+#include "phev_pipe.h"
+
+// Used when the out client does not expose a socket and has to be polled
+#ifndef PHEV_REACTOR_POLL_INTERVAL_MS
+#define PHEV_REACTOR_POLL_INTERVAL_MS (100)
+#endif
+
+#define PHEV_REACTOR_MAX_EVENTS 4
+
+typedef int (* phev_reactor_socketProvider_t)(void *ctx);
+
+typedef struct phev_reactor_settings_t
+{
+    phev_pipe_ctx_t *pipe;
+    phev_reactor_socketProvider_t socketProvider;
+    // Overrides the ping interval of the pipe when set
+    uint32_t pingIntervalMs;
+    void *ctx;
+} phev_reactor_settings_t;
+
+typedef struct phev_reactor_t
+{
+    phev_pipe_ctx_t *pipe;
+    phev_reactor_socketProvider_t socketProvider;
+    void *ctx;
+    int epollFd;
+    int timerFd;
+    int wakeFd;
+    int socketFd;
+    int pipeWakeFd;
+    // Pipe and connection the fds were registered for, a new connection
+    // re-registers the socket even when it reuses the same fd number
+    const phev_pipe_ctx_t *watchedPipe;
+    uint32_t watchedGeneration;
+    size_t wakeups;
+    size_t reads;
+    size_t timers;
+    // Time spent handling events, the executor decays it to find hot vehicles
+    uint64_t busyNs;
+} phev_reactor_t;
+
+bool phev_reactor_supported(void);
+phev_reactor_t *phev_reactor_create(phev_reactor_settings_t settings);
+int phev_reactor_runOnce(phev_reactor_t *reactor, const int timeoutMs);
+void phev_reactor_wakeup(phev_reactor_t *reactor);
+void phev_reactor_destroy(phev_reactor_t *reactor);
+
+#endif
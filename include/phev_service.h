@@ -8,6 +8,12 @@
 #include "phev_pipe.h"
 #include "phev_model.h"
 #include "phev_register.h"
+#include "phev_reactor.h"
+#include "phev_snapshot.h"
+
+#ifndef PHEV_SERVICE_FUSED_INBOUND
+#define PHEV_SERVICE_FUSED_INBOUND false
+#endif
 
 
 
@@ -44,6 +50,8 @@
 #define PHEV_SERVICE_HVAC_MODE_JSON "mode"
 #define PHEV_SERVICE_HVAC_TIME_JSON "time"
 
+#define PHEV_SERVICE_STALE_JSON "stale"
+
 #define PHEV_SERVICE_START_MESSAGE_JSON "startMessage"
 #define PHEV_SERVICE_START_MESSAGE_DATA_JSON "data"
 
@@ -61,19 +69,33 @@ typedef struct phevServiceSettings_t {
     bool registerDevice;
     phevServiceYieldHandler_t yieldHandler;
     bool my18;
+    bool reactor;
+    phev_reactor_socketProvider_t socketProvider;
+    phev_pipe_connectPending_t connectPending;
+    // 0 keeps the pipe defaults
+    uint32_t pingIntervalMs;
+    uint8_t maxUnansweredPings;
+    // Keeps the model in this file and serves it at startup until the car reports in
+    const char * snapshotPath;
     void * ctx;
 
 } phevServiceSettings_t;
 
 typedef struct phevServiceCtx_t {
     phevModel_t * model;
-    phev_pipe_ctx_t * pipe;
+    // Replaced after registration while other threads submit commands to it
+    phev_pipe_ctx_t * _Atomic pipe;
     phevRegistrationComplete_t registrationCompleteCallback;
     phevServiceYieldHandler_t yieldHandler;
     uint8_t mac[6];
     bool exit;
     phevRegisterCtx_t * registrationCtx;
     bool registerDevice;
+    bool my18;
+    phev_reactor_t * reactor;
+    phevSnapshot_t * snapshot;
+    // Registers restored from the snapshot that the car has not reported since
+    uint64_t stale[4];
     void * ctx;
 } phevServiceCtx_t;
 
@@ -84,6 +106,8 @@ typedef struct phevServiceHVAC_t {
 
 phevServiceCtx_t * phev_service_create(phevServiceSettings_t settings);
 void phev_service_start(phevServiceCtx_t * ctx);
+// Releases the fds the service holds, the model can still be read afterwards
+void phev_service_close(phevServiceCtx_t * ctx);
 phevServiceCtx_t * phev_service_init(messagingClient_t *in, messagingClient_t *out,bool registerDevice);
 phevServiceCtx_t * phev_service_initForRegistration(messagingClient_t *in, messagingClient_t *out);
 void phev_service_register(const char * mac, phevServiceCtx_t * ctx, phevRegistrationComplete_t complete);
@@ -101,10 +125,12 @@ char * phev_service_statusAsJson(phevServiceCtx_t * ctx);
 bool phev_service_outputFilter(void *ctx, message_t * message);
 messageBundle_t * phev_service_inputSplitter(void * ctx, message_t * message);
 void phev_service_loop(phevServiceCtx_t * ctx);
+void phev_service_wakeup(phevServiceCtx_t * ctx);
 message_t * phev_service_jsonResponseAggregator(void * ctx, messageBundle_t * bundle);
 phevRegister_t * phev_service_getRegister(const phevServiceCtx_t * ctx, const uint8_t reg);
 void phev_service_setRegister(const phevServiceCtx_t * ctx, const uint8_t reg, const uint8_t * data, const size_t length);
 char * phev_service_getRegisterJson(const phevServiceCtx_t * ctx, const uint8_t reg);
+bool phev_service_isStale(const phevServiceCtx_t * ctx, const uint8_t reg);
 char * phev_service_getDateSync(const phevServiceCtx_t * ctx);
 bool phev_service_getChargingStatus(const phevServiceCtx_t * ctx);
 int phev_service_getRemainingChargeTime(const phevServiceCtx_t * ctx);
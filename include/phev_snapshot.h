@@ -0,0 +1,74 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#ifndef _PHEV_SNAPSHOT_H_
+#define _PHEV_SNAPSHOT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "phev_model.h"
+
+#define PHEV_SNAPSHOT_MAGIC (0x50535650)
+#define PHEV_SNAPSHOT_FORMAT (2)
+
+// Frame lengths are a single byte, so no register is longer than this
+#define PHEV_SNAPSHOT_MAX_REGISTER (255)
+
+// One fixed slot per register so a change only rewrites its own record. Each
+// record has its own checksum, a torn write loses that register and nothing else.
+typedef struct phevSnapshotRecord_t
+{
+    uint32_t version;
+    uint32_t checksum;
+    // Wall clock milliseconds of the write, the monotonic clock does not
+    // survive a restart
+    uint64_t time;
+    uint16_t length;
+    uint8_t data[PHEV_SNAPSHOT_MAX_REGISTER + 1];
+} phevSnapshotRecord_t;
+
+// Written once when the file is created, a bad header means the layout cannot be trusted
+typedef struct phevSnapshotHeader_t
+{
+    uint32_t magic;
+    uint16_t format;
+    uint16_t recordSize;
+    uint32_t checksum;
+} phevSnapshotHeader_t;
+
+// Rewritten on every sync with its own checksum, losing it costs nothing the records hold
+typedef struct phevSnapshotState_t
+{
+    uint32_t modelVersion;
+    uint32_t checksum;
+    uint64_t saved;
+} phevSnapshotState_t;
+
+typedef struct phevSnapshotFile_t
+{
+    phevSnapshotHeader_t header;
+    phevSnapshotState_t state;
+    phevSnapshotRecord_t records[256];
+} phevSnapshotFile_t;
+
+typedef struct phevSnapshot_t
+{
+    int fd;
+    phevSnapshotFile_t * file;
+    // Model version already written out
+    uint32_t synced;
+    size_t writes;
+} phevSnapshot_t;
+
+// Maps the file at path, creating or resetting it when it is not a valid snapshot
+phevSnapshot_t * phev_snapshot_open(const char * path);
+void phev_snapshot_close(phevSnapshot_t * snapshot);
+// Loads every valid record into model, returns how many were restored
+size_t phev_snapshot_restore(phevSnapshot_t * snapshot, phevModel_t * model);
+// Writes the registers changed since the last sync, returns how many
+size_t phev_snapshot_sync(phevSnapshot_t * snapshot, const phevModel_t * model);
+// Wall clock milliseconds the register was last saved, 0 when it never was
+uint64_t phev_snapshot_registerTime(const phevSnapshot_t * snapshot, uint8_t reg);
+
+#endif
@@ -4,9 +4,17 @@
 #ifndef _PHEV_TCPIP_H_
 #define _PHEV_TCPIP_H_
 #include <stdint.h>
+#include <stdbool.h>
 
 #define TCP_READ_TIMEOUT 1000
 
+// Largest frame length byte is 0xff, plus command and length bytes
+#define PHEV_TCPIP_DECODE_BUFFER_SIZE 257
+
+#ifndef PHEV_TCPIP_CONNECT_TIMEOUT_MS
+#define PHEV_TCPIP_CONNECT_TIMEOUT_MS 5000
+#endif
+
 int phev_tcpClientConnectSocket(const char *host, uint16_t port);
 
 int phev_tcpClientDisconnectSocket(int soc);
@@ -15,4 +23,52 @@ int phev_tcpClientRead(int soc, uint8_t *buf, size_t len);
 
 int phev_tcpClientWrite(int soc, uint8_t *buf, size_t len);
 
+// Per vehicle transport state. msg_tcpip hands host back to the connect hook
+// unchanged, which is how the hook finds the connection it belongs to.
+typedef struct phev_tcpip_conn_t
+{
+    char *host;
+    uint16_t port;
+    bool owned;
+    int soc;
+    int pollFd;
+    int wakeFd;
+    // Connect that has been started but is not up yet, so the next connect
+    // call can pick it up without blocking
+    int connecting;
+    uint64_t connectDeadline;
+    // State another transport keeps for the socket, such as its io_uring
+    void *transport;
+    struct phev_tcpip_conn_t *next;
+} phev_tcpip_conn_t;
+
+// Give conn->host to msg_tcpip as the host of the client
+phev_tcpip_conn_t *phev_tcpClientCreate(const char *host, uint16_t port);
+void phev_tcpClientDestroy(phev_tcpip_conn_t *conn);
+
+// Connection for a host passed to a connect hook, made on the fly for hosts
+// that did not come from phev_tcpClientCreate and released once idle
+phev_tcpip_conn_t *phev_tcpClientAttach(const char *host, uint16_t port);
+void phev_tcpClientRelease(phev_tcpip_conn_t *conn);
+
+// Fd that becomes readable when the connection has data, the socket itself
+// unless another transport tracked something else, or -1
+int phev_tcpClientSocket(phev_tcpip_conn_t *conn);
+
+// Lets other transports share the state used for wakeups and polling
+void phev_tcpClientTrackSocket(phev_tcpip_conn_t *conn, int soc, int pollFd);
+
+int phev_tcpClientWakeFd(int soc);
+
+void phev_tcpClientSetTransport(phev_tcpip_conn_t *conn, void *transport);
+// Transport state of the connection whose socket, connected or not, is soc
+void *phev_tcpClientTransport(int soc);
+
+void phev_tcpClientSetConnecting(phev_tcpip_conn_t *conn, int soc);
+int phev_tcpClientConnectingSocket(phev_tcpip_conn_t *conn);
+bool phev_tcpClientConnecting(phev_tcpip_conn_t *conn);
+
+// Extra fd that cuts a blocking read short when it becomes readable
+void phev_tcpClientSetWakeup(phev_tcpip_conn_t *conn, int fd);
+
 #endif
\ No newline at end of file
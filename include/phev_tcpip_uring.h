@@ -0,0 +1,53 @@
+#ifndef _PHEV_TCPIP_URING_H_
+#define _PHEV_TCPIP_URING_H_
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef PHEV_URING_ENTRIES
+#define PHEV_URING_ENTRIES 64
+#endif
+
+// Provided receive buffers, must be a power of two
+#ifndef PHEV_URING_BUFFERS
+#define PHEV_URING_BUFFERS 16
+#endif
+
+#ifndef PHEV_URING_BUFFER_SIZE
+#define PHEV_URING_BUFFER_SIZE 1024
+#endif
+
+#ifndef PHEV_URING_SEND_BUFFER_SIZE
+#define PHEV_URING_SEND_BUFFER_SIZE 4096
+#endif
+
+#ifndef PHEV_URING_CONNECT_TIMEOUT_MS
+#define PHEV_URING_CONNECT_TIMEOUT_MS 5000
+#endif
+
+// Totals across all io_uring connections, enters is the number of syscalls
+// made on the rings
+typedef struct phev_uring_stats_t
+{
+    size_t enters;
+    size_t receives;
+    size_t bytesIn;
+    size_t sends;
+    size_t bytesOut;
+} phev_uring_stats_t;
+
+// The same hooks as phev_tcpClient*, for tcpIpSettings_t. Receives use a
+// multishot recv into a provided buffer ring and sends go out of a registered
+// buffer. Where io_uring is missing the calls fall back to the plain socket
+// transport, which the reactor drives with epoll.
+bool phev_uringSupported(void);
+int phev_uringClientConnectSocket(const char *host, uint16_t port);
+int phev_uringClientDisconnectSocket(int soc);
+int phev_uringClientRead(int soc, uint8_t *buf, size_t len);
+int phev_uringClientWrite(int soc, uint8_t *buf, size_t len);
+void phev_uringStats(phev_uring_stats_t *stats);
+
+#endif
@@ -3,6 +3,7 @@
 #include "phev.h"
 #include "phev_pipe.h"
 #include "phev_tcpip.h"
+#include "phev_tcpip_uring.h"
 #include "phev_service.h"
 #include "phev_register.h"
 
@@ -58,7 +59,7 @@ int phev_pipeEventHandler(phev_pipe_ctx_t *ctx, phevPipeEvent_t *event)
         case PHEV_PIPE_GOT_VIN:
         {
             phevVinEvent_t * vinEv = (phevVinEvent_t *) event->data;
-            char * vin = malloc(19);
+            char vin[19] = {0};
 
             strncpy(vin,vinEv->vin,18);
 
@@ -73,7 +74,7 @@ int phev_pipeEventHandler(phev_pipe_ctx_t *ctx, phevPipeEvent_t *event)
         }
         case PHEV_PIPE_ECU_VERSION2:
         {
-            char * version = malloc(11);
+            char version[11] = {0};
 
             strncpy(version,event->data,10);
             phevEvent_t ev = {
@@ -119,6 +120,16 @@ int phev_pipeEventHandler(phev_pipe_ctx_t *ctx, phevPipeEvent_t *event)
             };
             return phevCtx->eventHandler(&ev);
         }
+        case PHEV_PIPE_CONNECTION_STATE:
+        {
+            phevEvent_t ev = {
+                .type = PHEV_CONNECTION_STATE,
+                .data = event->data,
+                .length = event->length,
+                .ctx = phevCtx,
+            };
+            return phevCtx->eventHandler(&ev);
+        }
     }
 
 
@@ -155,7 +166,7 @@ messagingClient_t * phev_createIncomingMessageClient(void)
     return in;
 }
 
-messagingClient_t * phev_createOutgoingMessageClient(const char * host, const uint16_t port)
+messagingClient_t * phev_createOutgoingMessageClient(phev_tcpip_conn_t * transport, const bool uring)
 {
     LOG_V(TAG,"START - createOutgoingMessageClient");
 
@@ -164,9 +175,21 @@ messagingClient_t * phev_createOutgoingMessageClient(const char * host, const ui
         .disconnect = phev_tcpClientDisconnectSocket,
         .read = phev_tcpClientRead,
         .write = phev_tcpClientWrite,
-        .host = strdup(host),
-        .port = port,
+        .host = (transport ? transport->host : NULL),
+        .port = (transport ? transport->port : 0),
     };
+
+    if(uring && phev_uringSupported())
+    {
+        LOG_D(TAG,"Using io_uring transport");
+
+        outSettings.connect = phev_uringClientConnectSocket;
+        outSettings.disconnect = phev_uringClientDisconnectSocket;
+        outSettings.read = phev_uringClientRead;
+        outSettings.write = phev_uringClientWrite;
+    } else if(uring) {
+        LOG_W(TAG,"io_uring not available, using plain sockets");
+    }
     messagingClient_t *out = msg_tcpip_createTcpIpClient(outSettings);
 
     LOG_V(TAG,"END - createOutgoingMessageClient");
@@ -174,6 +197,18 @@ messagingClient_t * phev_createOutgoingMessageClient(const char * host, const ui
     return out;
 }
 
+static int phev_socketProvider(void * ctx)
+{
+    phevCtx_t * phevCtx = (phevCtx_t *) ctx;
+
+    return phev_tcpClientSocket(phevCtx->transport);
+}
+static bool phev_connectPending(void * ctx)
+{
+    phevCtx_t * phevCtx = (phevCtx_t *) ctx;
+
+    return phev_tcpClientConnecting(phevCtx->transport);
+}
 phevCtx_t * phev_init(phevSettings_t settings)
 {
     LOG_V(TAG,"START - init");
@@ -184,6 +219,8 @@ phevCtx_t * phev_init(phevSettings_t settings)
     messagingClient_t * in = NULL;
     messagingClient_t * out = NULL;
 
+    ctx->transport = NULL;
+
     if(settings.in)
     {
         LOG_D(TAG,"Using passed in incoming messaging client");
@@ -203,7 +240,8 @@ phevCtx_t * phev_init(phevSettings_t settings)
     } else {
         LOG_D(TAG,"Using default outgoing messaging client");
 
-        out = phev_createOutgoingMessageClient(settings.host,settings.port);
+        ctx->transport = phev_tcpClientCreate(settings.host,settings.port);
+        out = phev_createOutgoingMessageClient(ctx->transport,settings.uring);
     }
 
     LOG_D(TAG,"Settings event handler %p", phev_pipeEventHandler);
@@ -219,23 +257,27 @@ phevCtx_t * phev_init(phevSettings_t settings)
         .errorHandler = NULL,
         .yieldHandler = NULL,
         .my18 = settings.my18,
+        .reactor = settings.reactor,
+        .socketProvider = phev_socketProvider,
+        .connectPending = (ctx->transport ? phev_connectPending : NULL),
+        .snapshotPath = settings.snapshotPath,
         .ctx = ctx,
     };
     ctx->serviceCtx = phev_service_create(s);
+    phev_tcpClientSetWakeup(ctx->transport, phev_pipe_wakeFd(ctx->serviceCtx->pipe));
 
     LOG_V(TAG,"END - init");
 
     return ctx;
 }
 
-static phevCtx_t * glob_phev_ctx = NULL;
-
 void phev_registrationComplete(phev_pipe_ctx_t * ctx)
 {
-    phevCtx_t * phevCtx = glob_phev_ctx;
+    phevCtx_t * phevCtx = (phevCtx_t *) ((phevServiceCtx_t *) ctx->ctx)->ctx;
 
     phevEvent_t ev = {
         .type = PHEV_REGISTRATION_COMPLETE,
+        .ctx = phevCtx,
     };
     phevCtx->eventHandler(&ev);
 
@@ -246,8 +288,6 @@ phevCtx_t * phev_registerDevice(phevSettings_t settings)
 
     phevCtx_t * ctx = phev_init(settings);
 
-    glob_phev_ctx = ctx;
-
     phev_service_register((const char *) settings.mac, ctx->serviceCtx, phev_registrationComplete);
 
     LOG_V(TAG,"END - registerDevice");
@@ -265,11 +305,24 @@ void phev_exit(phevCtx_t * ctx)
     LOG_V(TAG,"START - exit");
 
     ctx->serviceCtx->exit = true;
+    phev_service_wakeup(ctx->serviceCtx);
 
     LOG_V(TAG,"START - exit");
 
 }
 
+void phev_close(phevCtx_t * ctx)
+{
+    LOG_V(TAG,"START - close");
+
+    phev_tcpClientSetWakeup(ctx->transport, -1);
+    phev_service_close(ctx->serviceCtx);
+    phev_tcpClientDestroy(ctx->transport);
+    ctx->transport = NULL;
+
+    LOG_V(TAG,"END - close");
+}
+
 bool phev_running(phevCtx_t * ctx)
 {
     return !ctx->serviceCtx->exit;
@@ -283,6 +336,18 @@ static void phev_registerUpdateCallback(phev_pipe_ctx_t *ctx, uint8_t reg, void
     free(cbCtx);
 }
 
+static void phev_registerUpdateFailed(phev_pipe_ctx_t *ctx, uint8_t reg, void * customCtx)
+{
+    phevCallBackCtx_t * cbCtx = (phevCallBackCtx_t *) customCtx;
+    phevCommandFailure_t failure = {
+        .reg = reg,
+    };
+
+    LOG_W(TAG,"Update of register %02X was not acknowledged",reg);
+    cbCtx->callback(cbCtx->ctx, &failure);
+    free(cbCtx);
+}
+
 void phev_headLights(phevCtx_t * ctx, bool on, phevCallBack_t callback)
 {
     LOG_V(TAG,"START - headLights");
@@ -292,10 +357,12 @@ void phev_headLights(phevCtx_t * ctx, bool on, phevCallBack_t callback)
     cbCtx->ctx = ctx;
 
     LOG_D(TAG,"Switching %s head lights", on ? "ON" : "OFF");
+    const uint8_t value = (on ? 1 : 2);
+
     if (callback) {
-        phev_pipe_updateRegisterWithCallback(ctx->serviceCtx->pipe, KO_WF_H_LAMP_CONT_SP, (on ? 1 : 2), phev_registerUpdateCallback, cbCtx);
+        phev_pipe_submitCommand(ctx->serviceCtx->pipe, KO_WF_H_LAMP_CONT_SP, &value, 1, phev_registerUpdateCallback, phev_registerUpdateFailed, cbCtx);
     } else {
-        phev_pipe_updateRegister(ctx->serviceCtx->pipe, KO_WF_H_LAMP_CONT_SP, (on ? 1 : 2));
+        phev_pipe_submitCommand(ctx->serviceCtx->pipe, KO_WF_H_LAMP_CONT_SP, &value, 1, NULL, NULL, NULL);
     }
 
     LOG_V(TAG,"END - headLights");
@@ -310,10 +377,12 @@ void phev_parkingLights(phevCtx_t * ctx, bool on, phevCallBack_t callback)
     cbCtx->ctx = ctx;
 
     LOG_D(TAG,"Switching %s parking lights", on ? "ON" : "OFF");
+    const uint8_t value = (on ? 1 : 2);
+
     if (callback) {
-        phev_pipe_updateRegisterWithCallback(ctx->serviceCtx->pipe, KO_WF_P_LAMP_CONT_SP, (on ? 1 : 2), phev_registerUpdateCallback, cbCtx);
+        phev_pipe_submitCommand(ctx->serviceCtx->pipe, KO_WF_P_LAMP_CONT_SP, &value, 1, phev_registerUpdateCallback, phev_registerUpdateFailed, cbCtx);
     } else {
-        phev_pipe_updateRegister(ctx->serviceCtx->pipe, KO_WF_P_LAMP_CONT_SP, (on ? 1 : 2));
+        phev_pipe_submitCommand(ctx->serviceCtx->pipe, KO_WF_P_LAMP_CONT_SP, &value, 1, NULL, NULL, NULL);
     }
 
     LOG_V(TAG,"END - parkingLights");
@@ -329,10 +398,13 @@ void phev_airCon(phevCtx_t * ctx, bool on, phevCallBack_t callback)
 
     LOG_D(TAG,"Switching %s air conditioning", on ? "ON" : "OFF");
 
+    // The callback path has always sent the opposite value to the plain one
+    const uint8_t value = (callback ? (on ? 2 : 1) : (on ? 1 : 2));
+
     if (callback) {
-        phev_pipe_updateRegisterWithCallback(ctx->serviceCtx->pipe,KO_WF_MANUAL_AC_ON_RQ_SP, (on ? 2 : 1), phev_registerUpdateCallback, cbCtx);
+        phev_pipe_submitCommand(ctx->serviceCtx->pipe, KO_WF_MANUAL_AC_ON_RQ_SP, &value, 1, phev_registerUpdateCallback, phev_registerUpdateFailed, cbCtx);
     } else {
-        phev_pipe_updateRegister(ctx->serviceCtx->pipe,KO_WF_MANUAL_AC_ON_RQ_SP, (on ? 1 : 2));
+        phev_pipe_submitCommand(ctx->serviceCtx->pipe, KO_WF_MANUAL_AC_ON_RQ_SP, &value, 1, NULL, NULL, NULL);
     }
     LOG_V(TAG,"END - airCon");
 
@@ -348,10 +420,12 @@ void phev_updateAll(phevCtx_t * ctx, phevCallBack_t callback)
 
     LOG_D(TAG,"Start Update All");
 
+    const uint8_t value = 3;
+
     if (callback) {
-        phev_pipe_updateRegisterWithCallback(ctx->serviceCtx->pipe,KO_WF_EV_UPDATE_SP, 3, phev_registerUpdateCallback, cbCtx);
+        phev_pipe_submitCommand(ctx->serviceCtx->pipe, KO_WF_EV_UPDATE_SP, &value, 1, phev_registerUpdateCallback, phev_registerUpdateFailed, cbCtx);
     } else {
-        phev_pipe_updateRegister(ctx->serviceCtx->pipe,KO_WF_EV_UPDATE_SP, 3);
+        phev_pipe_submitCommand(ctx->serviceCtx->pipe, KO_WF_EV_UPDATE_SP, &value, 1, NULL, NULL, NULL);
     }
     LOG_V(TAG,"END - updateAll");
 
@@ -388,9 +462,9 @@ void phev_airConMY19(phevCtx_t * ctx, phevAirConMode_t mode, phevAirConTime_t ti
     LOG_D(TAG,"Switching air conditioning mode %d", val);
 
     if (callback) {
-        phev_pipe_updateComplexRegisterWithCallback(ctx->serviceCtx->pipe,KO_WF_AC_SCH_SP_MY19, data, sizeof(data), phev_registerUpdateCallback, cbCtx);
+        phev_pipe_submitCommand(ctx->serviceCtx->pipe,KO_WF_AC_SCH_SP_MY19, data, sizeof(data), phev_registerUpdateCallback, phev_registerUpdateFailed, cbCtx);
     } else {
-        phev_pipe_updateComplexRegister(ctx->serviceCtx->pipe,KO_WF_AC_SCH_SP_MY19, data, sizeof(data));
+        phev_pipe_submitCommand(ctx->serviceCtx->pipe,KO_WF_AC_SCH_SP_MY19, data, sizeof(data), NULL, NULL, NULL);
     }
 
     LOG_V(TAG,"END - airConMY19");
@@ -419,9 +493,9 @@ void phev_airConMode(phevCtx_t * ctx, phevAirConMode_t mode, phevAirConTime_t ti
     LOG_D(TAG,"Switching air conditioning mode %d", val);
 
     if (callback) {
-        phev_pipe_updateComplexRegisterWithCallback(ctx->serviceCtx->pipe,KO_WF_AC_SCH_SP, data, sizeof(data), phev_registerUpdateCallback, cbCtx);
+        phev_pipe_submitCommand(ctx->serviceCtx->pipe,KO_WF_AC_SCH_SP, data, sizeof(data), phev_registerUpdateCallback, phev_registerUpdateFailed, cbCtx);
     } else {
-        phev_pipe_updateComplexRegister(ctx->serviceCtx->pipe,KO_WF_AC_SCH_SP, data, sizeof(data));
+        phev_pipe_submitCommand(ctx->serviceCtx->pipe,KO_WF_AC_SCH_SP, data, sizeof(data), NULL, NULL, NULL);
     }
 
     LOG_V(TAG,"END - airConMode");
@@ -6,8 +6,141 @@
 #include "msg_utils.h"
 #include "logger.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PHEV_CORE_X86_KERNELS
+#endif
+
 const static char *APP_TAG = "PHEV_CORE";
 
+static bool phev_core_fillFrame(const uint8_t *data, const size_t frameLength, const uint8_t xor, uint8_t *scratch, phevFrame_t *frame);
+
+static void phev_core_xorBufferScalar(uint8_t *out, const uint8_t *in, const size_t length, const uint8_t xor)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        out[i] = in[i] ^ xor;
+    }
+}
+static uint8_t phev_core_xorSumScalar(const uint8_t *in, const size_t length, const uint8_t xor)
+{
+    uint8_t sum = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        sum += in[i] ^ xor;
+    }
+    return sum;
+}
+#ifdef PHEV_CORE_X86_KERNELS
+__attribute__((target("sse2"))) static void phev_core_xorBufferSSE2(uint8_t *out, const uint8_t *in, const size_t length, const uint8_t xor)
+{
+    const __m128i key = _mm_set1_epi8((char) xor);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_xor_si128(v, key));
+    }
+    phev_core_xorBufferScalar(out + i, in + i, length - i, xor);
+}
+__attribute__((target("sse2"))) static uint8_t phev_core_xorSumSSE2(const uint8_t *in, const size_t length, const uint8_t xor)
+{
+    const __m128i key = _mm_set1_epi8((char) xor);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (in + i)), key);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    uint8_t sum = (uint8_t) (_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc)));
+
+    return sum + phev_core_xorSumScalar(in + i, length - i, xor);
+}
+__attribute__((target("avx2"))) static void phev_core_xorBufferAVX2(uint8_t *out, const uint8_t *in, const size_t length, const uint8_t xor)
+{
+    const __m256i key = _mm256_set1_epi8((char) xor);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+        _mm256_storeu_si256((__m256i *) (out + i), _mm256_xor_si256(v, key));
+    }
+    phev_core_xorBufferSSE2(out + i, in + i, length - i, xor);
+}
+__attribute__((target("avx2"))) static uint8_t phev_core_xorSumAVX2(const uint8_t *in, const size_t length, const uint8_t xor)
+{
+    const __m256i key = _mm256_set1_epi8((char) xor);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (in + i)), key);
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    uint8_t sum = (uint8_t) (_mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half)));
+
+    return sum + phev_core_xorSumSSE2(in + i, length - i, xor);
+}
+#endif
+
+static void (*phev_core_xorBufferKernel)(uint8_t *, const uint8_t *, const size_t, const uint8_t) = NULL;
+static uint8_t (*phev_core_xorSumKernel)(const uint8_t *, const size_t, const uint8_t) = NULL;
+
+static void phev_core_selectKernels(void)
+{
+    phev_core_xorBufferKernel = phev_core_xorBufferScalar;
+    phev_core_xorSumKernel = phev_core_xorSumScalar;
+#ifdef PHEV_CORE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        LOG_D(APP_TAG, "Using AVX2 kernels");
+        phev_core_xorBufferKernel = phev_core_xorBufferAVX2;
+        phev_core_xorSumKernel = phev_core_xorSumAVX2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        LOG_D(APP_TAG, "Using SSE2 kernels");
+        phev_core_xorBufferKernel = phev_core_xorBufferSSE2;
+        phev_core_xorSumKernel = phev_core_xorSumSSE2;
+    }
+#endif
+}
+void phev_core_xorBuffer(uint8_t *out, const uint8_t *in, const size_t length, const uint8_t xor)
+{
+    if (length < 16)
+    {
+        phev_core_xorBufferScalar(out, in, length, xor);
+        return;
+    }
+    if (phev_core_xorBufferKernel == NULL)
+    {
+        phev_core_selectKernels();
+    }
+    phev_core_xorBufferKernel(out, in, length, xor);
+}
+uint8_t phev_core_xorSum(const uint8_t *in, const size_t length, const uint8_t xor)
+{
+    if (length < 16)
+    {
+        return phev_core_xorSumScalar(in, length, xor);
+    }
+    if (phev_core_xorSumKernel == NULL)
+    {
+        phev_core_selectKernels();
+    }
+    return phev_core_xorSumKernel(in, length, xor);
+}
+
 uint8_t *phev_core_xorDataWithValue(const uint8_t *data, const uint8_t xor)
 {
     LOG_V(APP_TAG, "START - xorDataWithValue");
@@ -18,61 +151,47 @@ uint8_t *phev_core_xorDataWithValue(const uint8_t *data, const uint8_t xor)
 
     LOG_D(APP_TAG, "Decoding data with length %d with XOR %02X", length, xor);
 
-    for (int i = 0; i < length; i++)
-    {
-        decoded[i] = data[i] ^ xor;
-    }
+    phev_core_xorBuffer(decoded, data, length, xor);
 
     LOG_BUFFER_HEXDUMP(APP_TAG, decoded, length, LOG_DEBUG);
     LOG_V(APP_TAG, "END - xorDataWithValue");
 
     return decoded;
 }
+static const phevCommandDescriptor_t phev_core_commands[256] = {
+    [0x2e] = { .flags = PHEV_CORE_CMD_INCOMING | PHEV_CORE_CMD_CLEAR_INCOMING | PHEV_CORE_CMD_FROM_CAR },
+    [0x2f] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_INCOMING | PHEV_CORE_CMD_FROM_CAR, .xorRule = PHEV_CORE_XOR_FRAME, .commandClass = PHEV_CORE_CLASS_START },
+    [0x3e] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_FROM_CAR, .xorRule = PHEV_CORE_XOR_FRAME_FLIP },
+    [0x3f] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_INCOMING | PHEV_CORE_CMD_CLEAR_INCOMING | PHEV_CORE_CMD_FROM_CAR | PHEV_CORE_CMD_MY18, .xorRule = PHEV_CORE_XOR_FRAME, .ackPolicy = PHEV_CORE_ACK_NEVER, .commandClass = PHEV_CORE_CLASS_PING, .variant = PING_RESP_CMD },
+    [0x4e] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_INCOMING | PHEV_CORE_CMD_CLEAR_INCOMING | PHEV_CORE_CMD_FROM_CAR | PHEV_CORE_CMD_MY18, .xorRule = PHEV_CORE_XOR_NONE, .ackPolicy = PHEV_CORE_ACK_PLAIN, .commandClass = PHEV_CORE_CLASS_START },
+    [0x4f] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_FROM_CAR },
+    [0x5e] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_INCOMING | PHEV_CORE_CMD_CLEAR_INCOMING | PHEV_CORE_CMD_FROM_CAR | PHEV_CORE_CMD_MY18, .ackPolicy = PHEV_CORE_ACK_PLAIN, .commandClass = PHEV_CORE_CLASS_COMMAND, .variant = RESP_CMD },
+    [0x6e] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_FROM_CAR, .xorRule = PHEV_CORE_XOR_FRAME_FLIP },
+    [0x6f] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_INCOMING | PHEV_CORE_CMD_CLEAR_INCOMING | PHEV_CORE_CMD_FROM_CAR, .xorRule = PHEV_CORE_XOR_FRAME, .commandClass = PHEV_CORE_CLASS_COMMAND, .variant = RESP_CMD_MY18 },
+    [0x9f] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_FROM_CAR, .ackPolicy = PHEV_CORE_ACK_NEVER, .commandClass = PHEV_CORE_CLASS_PING, .variant = PING_RESP_CMD_MY18 },
+    [0xba] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_FROM_CAR, .xorRule = PHEV_CORE_XOR_FRAME_FLIP },
+    [0xbb] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_INCOMING | PHEV_CORE_CMD_OUTGOING | PHEV_CORE_CMD_CLEAR_INCOMING | PHEV_CORE_CMD_FROM_CAR, .xorRule = PHEV_CORE_XOR_FRAME, .ackPolicy = PHEV_CORE_ACK_NEVER, .commandClass = PHEV_CORE_CLASS_KEY },
+    [0xcc] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_INCOMING | PHEV_CORE_CMD_OUTGOING | PHEV_CORE_CMD_CLEAR_INCOMING | PHEV_CORE_CMD_FROM_CAR, .ackPolicy = PHEV_CORE_ACK_NEVER, .commandClass = PHEV_CORE_CLASS_KEY },
+    [0xcd] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_UNSIZED | PHEV_CORE_CMD_FROM_CAR, .xorRule = PHEV_CORE_XOR_FRAME_FLIP, .ackPolicy = PHEV_CORE_ACK_NEVER },
+    [0xe4] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_OUTGOING | PHEV_CORE_CMD_CLEAR_OUTGOING | PHEV_CORE_CMD_MY18, .commandClass = PHEV_CORE_CLASS_START },
+    [0xe5] = { .flags = PHEV_CORE_CMD_OUTGOING | PHEV_CORE_CMD_CLEAR_OUTGOING | PHEV_CORE_CMD_MY18, .commandClass = PHEV_CORE_CLASS_COMMAND, .variant = SEND_CMD },
+    [0xf2] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_OUTGOING, .commandClass = PHEV_CORE_CLASS_START },
+    [0xf3] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_OUTGOING | PHEV_CORE_CMD_CLEAR_OUTGOING | PHEV_CORE_CMD_MY18, .commandClass = PHEV_CORE_CLASS_PING, .variant = PING_SEND_CMD },
+    [0xf6] = { .flags = PHEV_CORE_CMD_ALLOWED | PHEV_CORE_CMD_OUTGOING | PHEV_CORE_CMD_CLEAR_OUTGOING, .commandClass = PHEV_CORE_CLASS_COMMAND, .variant = SEND_CMD_MY18 },
+    [0xf9] = { .flags = PHEV_CORE_CMD_ALLOWED, .commandClass = PHEV_CORE_CLASS_PING, .variant = PING_SEND_CMD_MY18 },
+};
+
+const phevCommandDescriptor_t * phev_core_commandDescriptor(const uint8_t command)
+{
+    return &phev_core_commands[command];
+}
 bool phev_core_checkIncomingCommand(const uint8_t command)
 {
-    switch (command)
-    {
-    case 0x3f:
-        return true;
-    case 0x6f:
-        return true;
-    case 0x4e:
-        return true;
-    case 0x5e:
-        return true;
-    case 0xBB:
-        return true;
-    case 0xCC:
-        return true;
-    case 0x2f:
-        return true;
-    case 0x2e:
-        return true;
-    default:
-        return false;
-    }
+    return (phev_core_commands[command].flags & PHEV_CORE_CMD_INCOMING) != 0;
 }
 bool phev_core_checkOutgoingCommand(const uint8_t command)
 {
-    switch (command)
-    {
-    case 0xf3:
-        return true;
-    case 0xf6:
-        return true;
-    case 0xe4:
-        return true;
-    case 0xe5:
-        return true;
-    case 0xBB:
-        return true;
-    case 0xCC:
-        return true;
-    case 0xf2:
-        return true;
-    default:
-        return false;
-    }
+    return (phev_core_commands[command].flags & PHEV_CORE_CMD_OUTGOING) != 0;
 }
 
 bool phev_core_validateChecksum(const uint8_t *data)
@@ -93,62 +212,183 @@ bool phev_core_validateChecksum(const uint8_t *data)
         return false;
     }
 }
+size_t phev_core_scanFrameXOR(const uint8_t *data, const size_t len, const uint8_t xor)
+{
+    const size_t length = (size_t) (data[1] ^ xor) + 2;
+
+    if (length > len || length < 5)
+    {
+        return 0;
+    }
+
+    const uint8_t checksum = phev_core_xorSum(data, length - 1, xor);
+
+    return (checksum == (uint8_t) (data[length - 1] ^ xor) ? length : 0);
+}
 bool phev_core_validateChecksumXOR(const uint8_t *data, const uint8_t xor)
 {
-    uint8_t *decodedData = phev_core_xorDataWithValue(data, xor);
+    const size_t length = (size_t) (data[1] ^ xor) + 2;
 
-    bool valid = phev_core_validateChecksum(decodedData);
+    return phev_core_scanFrameXOR(data, length, xor) == length;
+}
+static bool phev_core_unencodedIncomingCommand(const uint8_t command)
+{
+    return (phev_core_commands[command].flags & PHEV_CORE_CMD_CLEAR_INCOMING) != 0;
+}
+static bool phev_core_unencodedOutgoingCommand(const uint8_t command)
+{
+    return (phev_core_commands[command].flags & PHEV_CORE_CMD_CLEAR_OUTGOING) != 0;
+}
+static size_t phev_core_matchFrameXOR(const uint8_t *data, const size_t len, const uint8_t xor, const bool outgoing)
+{
+    const uint8_t command = data[0] ^ xor;
 
-    free(decodedData);
+    if (!(outgoing ? phev_core_checkOutgoingCommand(command) : phev_core_checkIncomingCommand(command)))
+    {
+        return 0;
+    }
 
-    return valid;
+    return phev_core_scanFrameXOR(data, len, xor);
 }
-message_t *phev_core_unencodedIncomingMessage(const uint8_t *data)
+static size_t phev_core_findXOR(const uint8_t *data, const size_t len, const bool outgoing, uint8_t *hint, uint8_t *xor)
 {
-    uint8_t command = data[0];
-    uint8_t length = data[1] + 2;
+    size_t length = 0;
 
-    if(phev_core_validateChecksum(data))
+    if (len < 3)
     {
-        switch (data[0])
-        {
-        case 0x4e:
-        {
-            LOG_D(APP_TAG, "Start (4E) unencoded");
-            return msg_utils_createMsg(data, length);
-        }
-        case 0x5e:
-        {
-            LOG_D(APP_TAG, "Start (5E) unencoded");
-            return msg_utils_createMsg(data, length);
-        }
-        case 0x3f:
-        {
-            LOG_D(APP_TAG, "Ping response unencoded");
-            return msg_utils_createMsg(data, length);
-        }
-        case 0x6f:
+        return 0;
+    }
+
+    if (*hint != PHEV_CORE_XOR_HINT_PLAIN)
+    {
+        const uint8_t predicted = data[2] ^ (*hint == PHEV_CORE_XOR_HINT_KEY_FLIP ? 1 : 0);
+
+        length = phev_core_matchFrameXOR(data, len, predicted, outgoing);
+
+        if (length > 0)
         {
-            LOG_D(APP_TAG, "Command unencoded");
-            return msg_utils_createMsg(data, length);
+            *xor = predicted;
+            return length;
         }
-        case 0xbb:
+    }
+
+    if (outgoing ? phev_core_checkOutgoingCommand(data[0]) : phev_core_checkIncomingCommand(data[0]))
+    {
+        length = phev_core_scanFrameXOR(data, len, 0);
+
+        if (length > 0 || outgoing)
         {
-            LOG_D(APP_TAG, "BB Command unencoded");
-            return msg_utils_createMsg(data, length);
+            if (!(outgoing ? phev_core_unencodedOutgoingCommand(data[0]) : phev_core_unencodedIncomingCommand(data[0])))
+            {
+                LOG_E(APP_TAG, "Unknown unencoded command %02X", data[0]);
+                return 0;
+            }
+            if (length > 0)
+            {
+                *hint = PHEV_CORE_XOR_HINT_PLAIN;
+                *xor = 0;
+            }
+            return length;
         }
-        case 0xcc:
+    }
+
+    for (uint8_t flip = 0; flip < 2; flip++)
+    {
+        length = phev_core_matchFrameXOR(data, len, data[2] ^ flip, outgoing);
+
+        if (length > 0)
         {
-            LOG_D(APP_TAG, "CC Command unencoded");
-            return msg_utils_createMsg(data, length);
+            *hint = (flip ? PHEV_CORE_XOR_HINT_KEY_FLIP : PHEV_CORE_XOR_HINT_KEY);
+            *xor = data[2] ^ flip;
+            return length;
         }
-        case 0x2e:
+    }
+
+    LOG_E(APP_TAG, "Unknown encoded command %02X or %02X", data[0] ^ data[2], data[0] ^ data[2] ^ 1);
+
+    return 0;
+}
+size_t phev_core_findIncomingXOR(const uint8_t *data, const size_t len, uint8_t *hint, uint8_t *xor)
+{
+    uint8_t localHint = PHEV_CORE_XOR_HINT_PLAIN;
+
+    return phev_core_findXOR(data, len, false, (hint ? hint : &localHint), xor);
+}
+size_t phev_core_findOutgoingXOR(const uint8_t *data, const size_t len, uint8_t *hint, uint8_t *xor)
+{
+    uint8_t localHint = PHEV_CORE_XOR_HINT_PLAIN;
+
+    return phev_core_findXOR(data, len, true, (hint ? hint : &localHint), xor);
+}
+static bool phev_core_partialFrameXOR(const uint8_t *data, const size_t len, const uint8_t xor)
+{
+    const uint8_t command = data[0] ^ xor;
+
+    if (!phev_core_checkIncomingCommand(command) || (xor == 0 && !phev_core_unencodedIncomingCommand(command)))
+    {
+        return false;
+    }
+
+    return (size_t) (data[1] ^ xor) + 2 > len;
+}
+static bool phev_core_frameAhead(const uint8_t *data, const size_t len)
+{
+    const size_t window = (len < PHEV_CORE_MAX_FRAME_SIZE ? len : PHEV_CORE_MAX_FRAME_SIZE);
+
+    for (size_t offset = 1; offset + 5 <= window; offset++)
+    {
+        const uint8_t *frame = data + offset;
+        const size_t remaining = window - offset;
+
+        if ((phev_core_unencodedIncomingCommand(frame[0]) && phev_core_matchFrameXOR(frame, remaining, 0, false) > 0)
+            || phev_core_matchFrameXOR(frame, remaining, frame[2], false) > 0
+            || phev_core_matchFrameXOR(frame, remaining, frame[2] ^ 1, false) > 0)
         {
-            LOG_D(APP_TAG, "2E Command unencoded");
-            return msg_utils_createMsg(data, length);
-        }
+            return true;
         }
     }
+
+    return false;
+}
+int phev_core_scanIncomingFrame(const uint8_t *data, const size_t len, uint8_t *hint, uint8_t *xor, size_t *frameLength)
+{
+    if (len < 3)
+    {
+        return PHEV_CORE_SCAN_INCOMPLETE;
+    }
+
+    const bool partial = phev_core_partialFrameXOR(data, len, 0)
+        || phev_core_partialFrameXOR(data, len, data[2])
+        || phev_core_partialFrameXOR(data, len, data[2] ^ 1);
+
+    if (partial && phev_core_scanFrameXOR(data, len, 0) == 0
+        && phev_core_scanFrameXOR(data, len, data[2]) == 0
+        && phev_core_scanFrameXOR(data, len, data[2] ^ 1) == 0)
+    {
+        return (phev_core_frameAhead(data, len) ? PHEV_CORE_SCAN_INVALID : PHEV_CORE_SCAN_INCOMPLETE);
+    }
+
+    uint8_t localHint = PHEV_CORE_XOR_HINT_PLAIN;
+    const size_t length = phev_core_findXOR(data, len, false, (hint ? hint : &localHint), xor);
+
+    if (length > 0)
+    {
+        *frameLength = length;
+        return PHEV_CORE_SCAN_OK;
+    }
+
+    return (partial && !phev_core_frameAhead(data, len) ? PHEV_CORE_SCAN_INCOMPLETE : PHEV_CORE_SCAN_INVALID);
+}
+message_t *phev_core_unencodedIncomingMessage(const uint8_t *data)
+{
+    uint8_t command = data[0];
+    uint8_t length = data[1] + 2;
+
+    if(phev_core_validateChecksum(data) && phev_core_unencodedIncomingCommand(command))
+    {
+        LOG_D(APP_TAG, "%02X Command unencoded", command);
+        return msg_utils_createMsg(data, length);
+    }
     LOG_E(APP_TAG,"Unknown unencoded command %02X", command);
     return NULL;
 }
@@ -157,31 +397,10 @@ message_t *phev_core_unencodedOutgoingMessage(const uint8_t *data)
     uint8_t command = data[0];
     uint8_t length = data[1] + 2;
 
-    if(phev_core_validateChecksum(data))
+    if(phev_core_validateChecksum(data) && phev_core_unencodedOutgoingCommand(command))
     {
-        switch (data[0])
-        {
-        case 0xe4:
-        {
-            LOG_D(APP_TAG, "Start (E4) unencoded");
-            return msg_utils_createMsg(data, length);
-        }
-        case 0xe5:
-        {
-            LOG_D(APP_TAG, "Start (E5) unencoded");
-            return msg_utils_createMsg(data, length);
-        }
-        case 0xf3:
-        {
-            LOG_D(APP_TAG, "Ping response unencoded");
-            return msg_utils_createMsg(data, length);
-        }
-        case 0xf6:
-        {
-            LOG_D(APP_TAG, "Command unencoded");
-            return msg_utils_createMsg(data, length);
-        }
-        }
+        LOG_D(APP_TAG, "%02X Command unencoded", command);
+        return msg_utils_createMsg(data, length);
     }
     LOG_E(APP_TAG,"Unknown unencoded command %02X", command);
     return NULL;
@@ -190,90 +409,98 @@ message_t *phev_core_unencodedOutgoingMessage(const uint8_t *data)
 message_t *phev_core_encodedIncomingMessage(const uint8_t *data)
 {
     uint8_t xor = data[2];
-    uint8_t command = data[0] ^ xor;
-    uint8_t length = (data[1] ^ xor) + 2;
+    size_t length = phev_core_matchFrameXOR(data, (size_t) (data[1] ^ xor) + 2, xor, false);
 
-    if (phev_core_checkIncomingCommand(command) && phev_core_validateChecksumXOR(data, xor))
+    if (length == 0)
     {
-        message_t * message = phev_core_createMsgXOR(data,length,xor);
-        return message;
+        xor ^= 1;
+        length = phev_core_matchFrameXOR(data, (size_t) (data[1] ^ xor) + 2, xor, false);
     }
 
-    xor ^= 1;
-    command = data[0] ^ xor;
-    length = (data[1] ^ xor) + 2;
-
-    if (phev_core_checkIncomingCommand(command) && phev_core_validateChecksumXOR(data, xor))
+    if (length > 0)
     {
         return phev_core_createMsgXOR(data, length, xor);
     }
 
-    LOG_E(APP_TAG,"Unknown encoded command %02X or %02X", command, command ^ 1);
+    LOG_E(APP_TAG,"Unknown encoded command %02X or %02X", data[0] ^ xor, data[0] ^ xor ^ 1);
 
     return NULL;
 }
 message_t *phev_core_encodedOutgoingMessage(const uint8_t *data)
 {
     uint8_t xor = data[2];
-    uint8_t command = data[0] ^ xor;
-    uint8_t length = (data[1] ^ xor) + 2;
+    size_t length = phev_core_matchFrameXOR(data, (size_t) (data[1] ^ xor) + 2, xor, true);
 
-    if (phev_core_checkOutgoingCommand(command) && phev_core_validateChecksumXOR(data, xor))
+    if (length == 0)
     {
-        message_t * message = phev_core_createMsgXOR(data,length,xor);
-        return message;
+        xor ^= 1;
+        length = phev_core_matchFrameXOR(data, (size_t) (data[1] ^ xor) + 2, xor, true);
     }
 
-    xor ^= 1;
-    command = data[0] ^ xor;
-    length = (data[1] ^ xor) + 2;
-
-    if (phev_core_checkOutgoingCommand(command) && phev_core_validateChecksumXOR(data, xor))
+    if (length > 0)
     {
         return phev_core_createMsgXOR(data, length, xor);
     }
 
-    LOG_E(APP_TAG,"Unknown encoded command %02X or %02X", command, command ^ 1);
+    LOG_E(APP_TAG,"Unknown encoded command %02X or %02X", data[0] ^ xor, data[0] ^ xor ^ 1);
 
     return NULL;
 }
 message_t * phev_core_extractIncomingMessageAndXOR(const uint8_t *data)
+{
+    return phev_core_extractIncomingMessageAndXORHint(data, SIZE_MAX, NULL);
+}
+message_t * phev_core_extractIncomingMessageAndXORHint(const uint8_t *data, const size_t len, uint8_t *hint)
 {
     LOG_V(APP_TAG, "START - extractIncomingMessageAndXOR");
 
-    message_t *message = NULL;
+    uint8_t localHint = PHEV_CORE_XOR_HINT_PLAIN;
+    uint8_t *xorHint = (hint ? hint : &localHint);
+    uint8_t xor = 0;
 
-    if (phev_core_checkIncomingCommand(data[0]) && phev_core_validateChecksumXOR(data, 0))
-    {
-        message = phev_core_unencodedIncomingMessage(data);
-    }
-    else
+    size_t length = phev_core_findXOR(data, len, false, xorHint, &xor);
+
+    if (length == 0)
     {
-        message = phev_core_encodedIncomingMessage(data);
+        return NULL;
     }
 
     LOG_V(APP_TAG, "END - extractIncomingMessageAndXOR");
 
-    return message;
+    if (*xorHint == PHEV_CORE_XOR_HINT_PLAIN)
+    {
+        return msg_utils_createMsg(data, length);
+    }
+
+    return phev_core_createMsgXOR(data, length, xor);
 }
 message_t * phev_core_extractOutgoingMessageAndXOR(const uint8_t *data)
+{
+    return phev_core_extractOutgoingMessageAndXORHint(data, SIZE_MAX, NULL);
+}
+message_t * phev_core_extractOutgoingMessageAndXORHint(const uint8_t *data, const size_t len, uint8_t *hint)
 {
     LOG_V(APP_TAG, "START - extractOutgoingMessageAndXOR");
 
-    message_t *message = NULL;
+    uint8_t localHint = PHEV_CORE_XOR_HINT_PLAIN;
+    uint8_t *xorHint = (hint ? hint : &localHint);
+    uint8_t xor = 0;
 
-    if (phev_core_checkOutgoingCommand(data[0]))
-    {
-        message = phev_core_unencodedOutgoingMessage(data);
-    }
-    else
+    size_t length = phev_core_findXOR(data, len, true, xorHint, &xor);
+
+    if (length == 0)
     {
-        message = phev_core_encodedOutgoingMessage(data);
+        return NULL;
     }
 
     LOG_V(APP_TAG, "END - extractOutgoingMessageAndXOR");
 
-    return message;
+    if (*xorHint == PHEV_CORE_XOR_HINT_PLAIN)
+    {
+        return msg_utils_createMsg(data, length);
+    }
+
+    return phev_core_createMsgXOR(data, length, xor);
 }
 uint8_t phev_core_getMessageXOR(const message_t * message)
 {
@@ -285,15 +512,78 @@ uint8_t phev_core_getMessageXOR(const message_t * message)
 
     return 0;
 }
+static phevMessageCtx_t * phev_core_createMessageCtx(const size_t length, const uint8_t xor, const bool encoded)
+{
+    phevMessageCtx_t * ctx = malloc(sizeof(phevMessageCtx_t) + length);
+
+    ctx->XOR = xor;
+    ctx->encoded = encoded;
+    ctx->decoded = false;
+
+    return ctx;
+}
 message_t * phev_core_createMsgXOR(const uint8_t * data, const size_t length, const uint8_t xor)
 {
-    uint8_t * ctx = malloc(1);
+    return msg_utils_createMsgCtx(data, length, phev_core_createMessageCtx(length, xor, true));
+}
+message_t * phev_core_createMsgFrame(const uint8_t * data, const size_t length, const uint8_t xor, const bool encoded)
+{
+    phevMessageCtx_t * ctx = phev_core_createMessageCtx(length, xor, encoded);
 
-    ctx[0] = xor;
+    ctx->decoded = phev_core_fillFrame(data, length, xor, ctx->payload, &ctx->frame);
 
-    message_t * message = msg_utils_createMsgCtx(data, length, ctx);
+    return msg_utils_createMsgCtx(data, length, ctx);
+}
+bool phev_core_messageEncoded(const message_t * message)
+{
+    return message != NULL && message->ctx != NULL && ((phevMessageCtx_t *) message->ctx)->encoded;
+}
+const phevFrame_t * phev_core_messageFrame(message_t * message)
+{
+    if(message == NULL || message->data == NULL)
+    {
+        return NULL;
+    }
 
-    return message;
+    phevMessageCtx_t * ctx = (phevMessageCtx_t *) message->ctx;
+
+    if(ctx != NULL && ctx->decoded)
+    {
+        return &ctx->frame;
+    }
+
+    phevMessageCtx_t * created = NULL;
+
+    if(ctx == NULL)
+    {
+        created = phev_core_createMessageCtx(message->length, 0, false);
+        ctx = created;
+    }
+
+    if(!phev_core_decodeFrame(message->data, message->length, ctx->payload, message->length, &ctx->frame))
+    {
+        free(created);
+        return NULL;
+    }
+
+    ctx->decoded = true;
+
+    if(created != NULL)
+    {
+        message->ctx = created;
+    }
+
+    return &ctx->frame;
+}
+void phev_core_frameMessage(const phevFrame_t * frame, phevMessage_t * message)
+{
+    message->command = frame->command;
+    message->length = (uint8_t) frame->length;
+    message->type = frame->type;
+    message->reg = frame->reg;
+    message->data = (uint8_t *) frame->data;
+    message->checksum = frame->checksum;
+    message->XOR = frame->XOR;
 }
 message_t * phev_core_extractAndDecodeIncomingMessageAndXOR(const uint8_t *data)
 {
@@ -357,41 +647,17 @@ uint8_t phev_core_getXOR(const uint8_t *data, const uint8_t xor)
 
     LOG_D(APP_TAG, "Command is %02x with decoded XOR and %02X with passed XOR", command, data[0] ^ xor);
 
-    if (command == 0xBB)
+    switch (phev_core_commands[command].xorRule)
     {
+    case PHEV_CORE_XOR_FRAME:
         newXOR = data[2];
-    }
-    if (command == 0XBA)
-    {
-        newXOR = data[2] ^ 1;
-    }
-    if (command == 0x6f)
-    {
-        newXOR = data[2];
-    }
-    if (command == 0x6e)
-    {
-        newXOR = data[2] ^ 1;
-    }
-    if (command == 0x3f)
-    {
-        newXOR = data[2];
-    }
-    if (command == 0x3e)
-    {
+        break;
+    case PHEV_CORE_XOR_FRAME_FLIP:
         newXOR = data[2] ^ 1;
-    }
-    if (command == 0xcd)
-    {
-        newXOR = data[2] ^ 1;
-    }
-    if (command == 0x2f)
-    {
-        newXOR = data[2];
-    }
-    if (command == 0x4e)
-    {
+        break;
+    case PHEV_CORE_XOR_NONE:
         newXOR = 0;
+        break;
     }
 
     LOG_D(APP_TAG, "Returning new XOR of %02x", newXOR);
@@ -406,12 +672,9 @@ uint8_t phev_core_getType(const uint8_t *data)
 }
 uint8_t phev_core_validateCommand(const uint8_t command)
 {
-    for (int i = 0; i < sizeof(allowedCommands); i++)
+    if (phev_core_commands[command].flags & PHEV_CORE_CMD_ALLOWED)
     {
-        if (command == allowedCommands[i])
-        {
-            return command;
-        }
+        return command;
     }
 
     return 0;
@@ -433,16 +696,9 @@ uint8_t * phev_core_getData(const uint8_t *data)
 }
 uint8_t phev_core_checksum(const uint8_t *data)
 {
-    uint8_t b = 0;
-    int len = data[1] + 2;
-    for (int i = 0;; i++)
-    {
-        if (i >= len - 1)
-        {
-            return b;
-        }
-        b = (uint8_t)(data[i] + b);
-    }
+    const size_t len = (size_t) data[1] + 2;
+
+    return phev_core_xorSum(data, len - 1, 0);
 }
 uint8_t phev_core_getChecksum(const uint8_t *data)
 {
@@ -490,30 +746,23 @@ int phev_core_validate_buffer(const uint8_t *msg, const size_t len)
     LOG_V(APP_TAG, "START - validateBuffer");
 
     uint8_t length = msg[1];
-    uint8_t cmd = msg[0];
+    const phevCommandDescriptor_t *desc = &phev_core_commands[msg[0]];
 
-    for (int i = 0; i < sizeof(allowedCommands); i++)
+    if (!(desc->flags & PHEV_CORE_CMD_ALLOWED))
     {
-        if (cmd == allowedCommands[i])
-        {
-            //HACK to handle CD / CC
-            if (cmd == 0xcd)
-            {
-                return 1;
-            }
-            if (length + 2 > len)
-            {
-                LOG_E(APP_TAG, "Valid command but length incorrect : command %02x length %dx expected %d", msg[0], length, len);
-                return 0; // length goes past end of message
-            }
-            return 1; //valid message
-        }
+        LOG_E(APP_TAG, "Invalid command %02x length %02x", msg[0], msg[1]);
+        LOG_V(APP_TAG, "END - validateBuffer");
+        return 0; // invalid command
+    }
+    if (!(desc->flags & PHEV_CORE_CMD_UNSIZED) && length + 2 > len)
+    {
+        LOG_E(APP_TAG, "Valid command but length incorrect : command %02x length %dx expected %d", msg[0], length, len);
+        return 0; // length goes past end of message
     }
-    LOG_E(APP_TAG, "Invalid command %02x length %02x", msg[0], msg[1]);
 
     LOG_V(APP_TAG, "END - validateBuffer");
 
-    return 0; // invalid command
+    return 1; //valid message
 }
 uint8_t *phev_core_unscramble(const uint8_t *data, const size_t len)
 {
@@ -538,6 +787,99 @@ uint8_t *phev_core_unscramble(const uint8_t *data, const size_t len)
 
     return decodedData;
 }
+static bool phev_core_fillFrame(const uint8_t *data, const size_t frameLength, const uint8_t xor, uint8_t *scratch, phevFrame_t *frame)
+{
+    if (frameLength < 5)
+    {
+        LOG_E(APP_TAG, "Frame too short %d", frameLength);
+        return false;
+    }
+
+    const size_t length = frameLength - 5;
+
+    phev_core_xorBuffer(scratch, data + 4, length, xor);
+
+    frame->command = data[0] ^ xor;
+    frame->type = data[2] ^ xor;
+    frame->reg = data[3] ^ xor;
+    frame->XOR = xor;
+    frame->checksum = data[frameLength - 1] ^ xor;
+    frame->data = (length > 0 ? scratch : NULL);
+    frame->length = length;
+    frame->frameLength = frameLength;
+
+    return true;
+}
+int phev_core_decodeFrame(const uint8_t *data, const size_t len, uint8_t *scratch, const size_t scratchLen, phevFrame_t *frame)
+{
+    return phev_core_decodeFrameWithHint(data, len, scratch, scratchLen, NULL, frame);
+}
+int phev_core_decodeFrameWithHint(const uint8_t *data, const size_t len, uint8_t *scratch, const size_t scratchLen, uint8_t *hint, phevFrame_t *frame)
+{
+    LOG_V(APP_TAG, "START - decodeFrame");
+
+    if (!data || !frame || len < 2)
+    {
+        LOG_E(APP_TAG, "Invalid frame buffer");
+        return 0;
+    }
+
+    uint8_t xor = 0;
+
+    if (phev_core_findIncomingXOR(data, len, hint, &xor) == 0)
+    {
+        return 0;
+    }
+
+    const size_t frameLength = (size_t) (data[1] ^ xor) + 2;
+
+    if (frameLength >= 5 && frameLength - 5 > scratchLen)
+    {
+        LOG_E(APP_TAG, "Payload of %d bytes does not fit scratch buffer of %d", frameLength - 5, scratchLen);
+        return 0;
+    }
+
+    if (!phev_core_fillFrame(data, frameLength, xor, scratch, frame))
+    {
+        return 0;
+    }
+
+    LOG_V(APP_TAG, "END - decodeFrame");
+
+    return 1;
+}
+size_t phev_core_decodeFrames(const uint8_t *data, const size_t len, uint8_t *scratch, const size_t scratchLen, phevFrame_t *frames, const size_t maxFrames, size_t *consumed)
+{
+    LOG_V(APP_TAG, "START - decodeFrames");
+
+    uint8_t hint = PHEV_CORE_XOR_HINT_PLAIN;
+    size_t offset = 0;
+    size_t used = 0;
+    size_t numFrames = 0;
+
+    while (numFrames < maxFrames && offset < len)
+    {
+        phevFrame_t *frame = &frames[numFrames];
+
+        if (!phev_core_decodeFrameWithHint(data + offset, len - offset, scratch + used, scratchLen - used, &hint, frame))
+        {
+            break;
+        }
+        offset += frame->frameLength;
+        used += frame->length;
+        numFrames++;
+    }
+
+    if (consumed)
+    {
+        *consumed = offset;
+    }
+
+    LOG_D(APP_TAG, "Decoded %d frames from %d bytes", numFrames, offset);
+    LOG_V(APP_TAG, "END - decodeFrames");
+
+    return numFrames;
+}
 int phev_core_decodeMessage(const uint8_t *data, const size_t len, phevMessage_t *msg)
 {
     LOG_V(APP_TAG, "START - decodeMessage");
@@ -554,27 +896,26 @@ int phev_core_decodeMessage(const uint8_t *data, const size_t len, phevMessage_t
         return 0;
     }
 
-    message_t * message = phev_core_extractAndDecodeIncomingMessageAndXOR(data);
+    uint8_t scratch[PHEV_CORE_MAX_FRAME_SIZE];
+    phevFrame_t frame;
 
-    if (message)
+    if (phev_core_decodeFrame(data, len, scratch, sizeof(scratch), &frame))
     {
-
-        msg->command = message->data[0];
-        msg->length = message->data[1] - 3;
-        msg->type = message->data[2];
-        msg->reg = message->data[3];
-        msg->checksum = phev_core_getChecksum(message->data);
-        if(msg->length > 0 && message->data)
+        msg->command = frame.command;
+        msg->length = frame.length;
+        msg->type = frame.type;
+        msg->reg = frame.reg;
+        msg->checksum = frame.checksum;
+        if (frame.length > 0)
         {
-            msg->data = phev_core_getData(message->data);
+            msg->data = malloc(frame.length);
+            memcpy(msg->data, frame.data, frame.length);
         }
         else
         {
             msg->data = NULL;
         }
-        msg->XOR = phev_core_getMessageXOR(message);
-
-        msg_utils_destroyMsg(message);
+        msg->XOR = frame.XOR;
 
         return 1;
     }
@@ -597,6 +938,94 @@ message_t *phev_core_extractMessage(const uint8_t *data, const size_t len, uint8
     return decoded;
 }
 
+static const uint8_t phev_core_templates[PHEV_CORE_TEMPLATE_COUNT][PHEV_CORE_TEMPLATE_SIZE] = {
+    [PHEV_CORE_TEMPLATE_PING] = { PING_SEND_CMD_MY18, 0x04, REQUEST_TYPE, 0x00, 0x00, 0xf7 },
+    [PHEV_CORE_TEMPLATE_ACK] = { SEND_CMD, 0x04, RESPONSE_TYPE, 0x00, 0x00, 0xfb },
+    [PHEV_CORE_TEMPLATE_ACK_MY18] = { SEND_CMD_MY18, 0x04, RESPONSE_TYPE, 0x00, 0x00, 0xea },
+    [PHEV_CORE_TEMPLATE_HEADLIGHTS_ON] = { SEND_CMD, 0x04, REQUEST_TYPE, KO_WF_H_LAMP_CONT_SP, 0x01, 0x05 },
+    [PHEV_CORE_TEMPLATE_HEADLIGHTS_OFF] = { SEND_CMD, 0x04, REQUEST_TYPE, KO_WF_H_LAMP_CONT_SP, 0x02, 0x06 },
+    [PHEV_CORE_TEMPLATE_PARKING_LIGHTS_ON] = { SEND_CMD, 0x04, REQUEST_TYPE, KO_WF_P_LAMP_CONT_SP, 0x01, 0x06 },
+    [PHEV_CORE_TEMPLATE_PARKING_LIGHTS_OFF] = { SEND_CMD, 0x04, REQUEST_TYPE, KO_WF_P_LAMP_CONT_SP, 0x02, 0x07 },
+    [PHEV_CORE_TEMPLATE_UPDATE_ALL] = { SEND_CMD, 0x04, REQUEST_TYPE, KO_WF_EV_UPDATE_SP, 0x03, 0x03 },
+};
+
+const uint8_t * phev_core_frameTemplate(const int id)
+{
+    if (id < 0 || id >= PHEV_CORE_TEMPLATE_COUNT)
+    {
+        return NULL;
+    }
+    return phev_core_templates[id];
+}
+int phev_core_ackTemplate(const uint8_t command)
+{
+    switch (command)
+    {
+    case RESP_CMD:
+        return PHEV_CORE_TEMPLATE_ACK;
+    case RESP_CMD_MY18:
+        return PHEV_CORE_TEMPLATE_ACK_MY18;
+    default:
+        return PHEV_CORE_TEMPLATE_NONE;
+    }
+}
+int phev_core_registerTemplate(const uint8_t reg, const uint8_t value)
+{
+    for (int i = PHEV_CORE_TEMPLATE_HEADLIGHTS_ON; i < PHEV_CORE_TEMPLATE_COUNT; i++)
+    {
+        if (phev_core_templates[i][3] == reg && phev_core_templates[i][4] == value)
+        {
+            return i;
+        }
+    }
+    return PHEV_CORE_TEMPLATE_NONE;
+}
+size_t phev_core_renderTemplate(uint8_t *out, const size_t outLen, const int id, const uint8_t reg, const uint8_t xor)
+{
+    const uint8_t *frame = phev_core_frameTemplate(id);
+
+    if (frame == NULL || outLen < PHEV_CORE_TEMPLATE_SIZE)
+    {
+        LOG_E(APP_TAG, "Cannot render template %d", id);
+        return 0;
+    }
+
+    const uint8_t checksum = frame[PHEV_CORE_TEMPLATE_SIZE - 1] - frame[3] + reg;
+
+    phev_core_xorBuffer(out, frame, PHEV_CORE_TEMPLATE_SIZE, xor);
+
+    out[3] = reg ^ xor;
+    out[PHEV_CORE_TEMPLATE_SIZE - 1] = checksum ^ xor;
+
+    return PHEV_CORE_TEMPLATE_SIZE;
+}
+size_t phev_core_encodeFrame(uint8_t *out, const size_t outLen, const uint8_t command, const uint8_t type, const uint8_t reg, const uint8_t *data, const size_t length, const uint8_t xor)
+{
+    const size_t frameLength = length + 5;
+
+    if (frameLength > outLen || length + 3 > 0xff)
+    {
+        LOG_E(APP_TAG, "Cannot encode frame with %d bytes of data into %d bytes", length, outLen);
+        return 0;
+    }
+
+    uint8_t checksum = command + (uint8_t) (length + 3) + type + reg;
+
+    out[0] = command ^ xor;
+    out[1] = (uint8_t) (length + 3) ^ xor;
+    out[2] = type ^ xor;
+    out[3] = reg ^ xor;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        checksum += data[i];
+        out[i + 4] = data[i] ^ xor;
+    }
+
+    out[frameLength - 1] = checksum ^ xor;
+
+    return frameLength;
+}
 int phev_core_encodeMessage(phevMessage_t *message, uint8_t **data)
 {
     LOG_V(APP_TAG, "START - encodeMessage");
@@ -730,10 +1159,8 @@ uint8_t *phev_core_xorDataOutbound(const uint8_t *data, uint8_t xor)
 
     uint8_t *decoded = malloc(length);
 
-    for (int i = 0; i < length; i++)
-    {
-        decoded[i] = data[i] ^ xor;
-    }
+    phev_core_xorBuffer(decoded, data, length, xor);
+
     return decoded;
 }
 message_t *phev_core_XOROutboundMessage(const message_t *message, const uint8_t xor)
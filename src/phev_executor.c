@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "phev_executor.h"
+#include "phev_reactor.h"
+#include "phev_service.h"
+#include "phev_pipe.h"
+#include "logger.h"
+
+const static char *APP_TAG = "PHEV_EXECUTOR";
+
+static uint64_t phev_executor_cpuNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+static bool phev_executor_enqueue(phev_executor_shard_t *shard, phevCtx_t *vehicle)
+{
+    bool queued = true;
+
+    pthread_mutex_lock(&shard->inboxLock);
+
+    if(shard->inboxCount == shard->inboxCapacity)
+    {
+        const size_t capacity = (shard->inboxCapacity ? shard->inboxCapacity * 2 : PHEV_GATEWAY_INITIAL_VEHICLES);
+        phevCtx_t **inbox = realloc(shard->inbox, capacity * sizeof(phevCtx_t *));
+
+        if(inbox == NULL)
+        {
+            queued = false;
+        }
+        else
+        {
+            shard->inbox = inbox;
+            shard->inboxCapacity = capacity;
+        }
+    }
+    if(queued)
+    {
+        shard->inbox[shard->inboxCount++] = vehicle;
+    }
+
+    pthread_mutex_unlock(&shard->inboxLock);
+
+    if(queued)
+    {
+        phev_gateway_wakeup(shard->gateway);
+    }
+    return queued;
+}
+static void phev_executor_takeInbox(phev_executor_shard_t *shard)
+{
+    pthread_mutex_lock(&shard->inboxLock);
+
+    phevCtx_t **inbox = shard->inbox;
+    const size_t count = shard->inboxCount;
+
+    shard->inbox = NULL;
+    shard->inboxCount = 0;
+    shard->inboxCapacity = 0;
+
+    pthread_mutex_unlock(&shard->inboxLock);
+
+    for(size_t i = 0; i < count; i++)
+    {
+        if(!phev_gateway_attach(shard->gateway, inbox[i]))
+        {
+            LOG_E(APP_TAG, "Shard %zu cannot take vehicle", shard->index);
+        }
+    }
+    free(inbox);
+}
+// Runs on the victim's thread. The busiest vehicle stays where it is, usually a
+// car in full refresh mode, and half of the rest move to the thief so they
+// are no longer queued behind it.
+static void phev_executor_handOver(phev_executor_shard_t *shard)
+{
+    const int thiefIndex = atomic_exchange(&shard->stealRequest, PHEV_EXECUTOR_NO_STEAL);
+    phev_gateway_t *gateway = shard->gateway;
+
+    if(thiefIndex == PHEV_EXECUTOR_NO_STEAL || gateway->count < 2)
+    {
+        return;
+    }
+
+    phev_executor_shard_t *thief = &shard->executor->shards[thiefIndex];
+    phevCtx_t *hottest = gateway->vehicles[0];
+
+    for(size_t i = 1; i < gateway->count; i++)
+    {
+        if(gateway->vehicles[i]->serviceCtx->reactor->busyNs > hottest->serviceCtx->reactor->busyNs)
+        {
+            hottest = gateway->vehicles[i];
+        }
+    }
+
+    const size_t wanted = gateway->count / 2;
+    size_t moved = 0;
+    size_t i = 0;
+
+    while(moved < wanted && i < gateway->count)
+    {
+        phevCtx_t *vehicle = gateway->vehicles[i];
+
+        if(vehicle == hottest)
+        {
+            i++;
+            continue;
+        }
+        // Removing swaps the last vehicle into this slot, so i stays put
+        phev_gateway_remove(gateway, vehicle);
+        if(!phev_executor_enqueue(thief, vehicle))
+        {
+            phev_gateway_attach(gateway, vehicle);
+            break;
+        }
+        moved++;
+    }
+
+    atomic_fetch_add(&shard->given, moved);
+    atomic_fetch_add(&thief->stolen, moved);
+
+    LOG_I(APP_TAG, "Shard %zu gave %zu vehicles to shard %zu", shard->index, moved, thief->index);
+}
+static void phev_executor_measure(phev_executor_shard_t *shard)
+{
+    phev_executor_t *executor = shard->executor;
+    const uint64_t now = phev_pipe_nowMs();
+    const uint64_t elapsed = now - shard->windowStart;
+
+    if(elapsed < PHEV_EXECUTOR_WINDOW_MS)
+    {
+        return;
+    }
+
+    const uint64_t cpu = phev_executor_cpuNs();
+    const unsigned int utilisation = (unsigned int) ((cpu - shard->windowCpu) / (elapsed * 1000));
+
+    atomic_store(&shard->utilisation, utilisation);
+    shard->windowStart = now;
+    shard->windowCpu = cpu;
+
+    for(size_t i = 0; i < shard->gateway->count; i++)
+    {
+        shard->gateway->vehicles[i]->serviceCtx->reactor->busyNs /= 2;
+    }
+
+    if(!executor->stealing || utilisation >= PHEV_EXECUTOR_IDLE)
+    {
+        return;
+    }
+
+    size_t victim = shard->index;
+    unsigned int highest = PHEV_EXECUTOR_OVERLOADED;
+
+    for(size_t i = 0; i < executor->count; i++)
+    {
+        const unsigned int load = atomic_load(&executor->shards[i].utilisation);
+
+        if(i != shard->index && load >= highest && atomic_load(&executor->shards[i].vehicles) > 1)
+        {
+            victim = i;
+            highest = load;
+        }
+    }
+    if(victim != shard->index)
+    {
+        phev_executor_steal(executor, shard->index, victim);
+    }
+}
+static void *phev_executor_run(void *arg)
+{
+    phev_executor_shard_t *shard = (phev_executor_shard_t *) arg;
+
+    shard->windowStart = phev_pipe_nowMs();
+    shard->windowCpu = phev_executor_cpuNs();
+
+    while(!atomic_load(&shard->stop))
+    {
+        phev_executor_takeInbox(shard);
+        atomic_store(&shard->vehicles, shard->gateway->count);
+
+        phev_gateway_runOnce(shard->gateway, PHEV_EXECUTOR_TICK_MS);
+
+        phev_executor_handOver(shard);
+        atomic_store(&shard->vehicles, shard->gateway->count);
+        atomic_store(&shard->dispatches, shard->gateway->dispatches);
+        phev_executor_measure(shard);
+    }
+    return NULL;
+}
+phev_executor_t *phev_executor_create(phev_executor_settings_t settings)
+{
+    LOG_V(APP_TAG, "START - create");
+
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const size_t count = (settings.shards ? settings.shards : (cpus > 0 ? (size_t) cpus : 1));
+    phev_executor_t *executor = malloc(sizeof(phev_executor_t));
+
+    executor->shards = calloc(count, sizeof(phev_executor_shard_t));
+    executor->count = 0;
+    executor->stealing = settings.stealing;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        phev_executor_shard_t *shard = &executor->shards[i];
+
+        shard->executor = executor;
+        shard->index = i;
+        shard->gateway = phev_gateway_create();
+        shard->inbox = NULL;
+        shard->inboxCount = 0;
+        shard->inboxCapacity = 0;
+        atomic_init(&shard->stealRequest, PHEV_EXECUTOR_NO_STEAL);
+        atomic_init(&shard->stop, false);
+        atomic_init(&shard->utilisation, 0);
+        atomic_init(&shard->vehicles, 0);
+        atomic_init(&shard->dispatches, 0);
+        atomic_init(&shard->stolen, 0);
+        atomic_init(&shard->given, 0);
+        pthread_mutex_init(&shard->inboxLock, NULL);
+
+        if(shard->gateway == NULL || pthread_create(&shard->thread, NULL, phev_executor_run, shard) != 0)
+        {
+            LOG_E(APP_TAG, "Cannot start shard %zu", i);
+            phev_gateway_destroy(shard->gateway);
+            pthread_mutex_destroy(&shard->inboxLock);
+            phev_executor_destroy(executor);
+            return NULL;
+        }
+        executor->count++;
+    }
+
+    LOG_D(APP_TAG, "Running %zu shards", executor->count);
+    LOG_V(APP_TAG, "END - create");
+
+    return executor;
+}
+bool phev_executor_addToShard(phev_executor_t *executor, const size_t shard, phevCtx_t *vehicle)
+{
+    LOG_V(APP_TAG, "START - addToShard");
+
+    if(shard >= executor->count)
+    {
+        LOG_E(APP_TAG, "No shard %zu", shard);
+        return false;
+    }
+    if(vehicle->serviceCtx->reactor == NULL)
+    {
+        LOG_E(APP_TAG, "Vehicle has no reactor, create it with the reactor setting");
+        return false;
+    }
+
+    // Started on the calling thread, the shard only ever sees running vehicles
+    phev_pipe_start(vehicle->serviceCtx->pipe, vehicle->serviceCtx->mac);
+
+    if(!phev_executor_enqueue(&executor->shards[shard], vehicle))
+    {
+        return false;
+    }
+    atomic_fetch_add(&executor->shards[shard].vehicles, 1);
+
+    LOG_V(APP_TAG, "END - addToShard");
+
+    return true;
+}
+bool phev_executor_add(phev_executor_t *executor, phevCtx_t *vehicle)
+{
+    size_t shard = 0;
+    size_t fewest = atomic_load(&executor->shards[0].vehicles);
+
+    for(size_t i = 1; i < executor->count; i++)
+    {
+        const size_t vehicles = atomic_load(&executor->shards[i].vehicles);
+
+        if(vehicles < fewest)
+        {
+            shard = i;
+            fewest = vehicles;
+        }
+    }
+    return phev_executor_addToShard(executor, shard, vehicle);
+}
+bool phev_executor_steal(phev_executor_t *executor, const size_t thief, const size_t victim)
+{
+    int expected = PHEV_EXECUTOR_NO_STEAL;
+
+    if(thief >= executor->count || victim >= executor->count || thief == victim)
+    {
+        return false;
+    }
+    if(!atomic_compare_exchange_strong(&executor->shards[victim].stealRequest, &expected, (int) thief))
+    {
+        return false;
+    }
+    phev_gateway_wakeup(executor->shards[victim].gateway);
+
+    return true;
+}
+void phev_executor_stats(phev_executor_t *executor, const size_t shard, phev_executor_stats_t *stats)
+{
+    phev_executor_shard_t *s = &executor->shards[shard];
+
+    stats->vehicles = atomic_load(&s->vehicles);
+    stats->utilisation = atomic_load(&s->utilisation);
+    stats->dispatches = atomic_load(&s->dispatches);
+    stats->stolen = atomic_load(&s->stolen);
+    stats->given = atomic_load(&s->given);
+}
+// Vehicles are left to the caller, they are simply no longer driven
+void phev_executor_destroy(phev_executor_t *executor)
+{
+    LOG_V(APP_TAG, "START - destroy");
+
+    if(executor == NULL)
+    {
+        return;
+    }
+    for(size_t i = 0; i < executor->count; i++)
+    {
+        atomic_store(&executor->shards[i].stop, true);
+        phev_gateway_wakeup(executor->shards[i].gateway);
+    }
+    for(size_t i = 0; i < executor->count; i++)
+    {
+        phev_executor_shard_t *shard = &executor->shards[i];
+
+        pthread_join(shard->thread, NULL);
+        phev_gateway_destroy(shard->gateway);
+        pthread_mutex_destroy(&shard->inboxLock);
+        free(shard->inbox);
+    }
+    free(executor->shards);
+    free(executor);
+
+    LOG_V(APP_TAG, "END - destroy");
+}
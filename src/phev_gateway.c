@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <string.h>
+#include "phev_gateway.h"
+#include "phev_reactor.h"
+#include "phev_service.h"
+#include "phev_pipe.h"
+#include "logger.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+const static char *APP_TAG = "PHEV_GATEWAY";
+
+static bool phev_gateway_append(phev_gateway_t *gateway, phevCtx_t *vehicle)
+{
+    if(gateway->count == gateway->capacity)
+    {
+        const size_t capacity = (gateway->capacity ? gateway->capacity * 2 : PHEV_GATEWAY_INITIAL_VEHICLES);
+        phevCtx_t **vehicles = realloc(gateway->vehicles, capacity * sizeof(phevCtx_t *));
+
+        if(vehicles == NULL)
+        {
+            LOG_E(APP_TAG, "Cannot grow gateway to %zu vehicles", capacity);
+            return false;
+        }
+        gateway->vehicles = vehicles;
+        gateway->capacity = capacity;
+    }
+    gateway->vehicles[gateway->count++] = vehicle;
+
+    return true;
+}
+static bool phev_gateway_detach(phev_gateway_t *gateway, phevCtx_t *vehicle)
+{
+    for(size_t i = 0; i < gateway->count; i++)
+    {
+        if(gateway->vehicles[i] == vehicle)
+        {
+            gateway->vehicles[i] = gateway->vehicles[--gateway->count];
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef __linux__
+
+phev_gateway_t *phev_gateway_create(void)
+{
+    LOG_V(APP_TAG, "START - create");
+
+    phev_gateway_t *gateway = malloc(sizeof(phev_gateway_t));
+
+    gateway->vehicles = NULL;
+    gateway->count = 0;
+    gateway->capacity = 0;
+    gateway->exit = false;
+    gateway->dispatches = 0;
+    gateway->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    gateway->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = gateway,
+    };
+
+    if(gateway->epollFd < 0 || gateway->wakeFd < 0
+        || epoll_ctl(gateway->epollFd, EPOLL_CTL_ADD, gateway->wakeFd, &event) != 0)
+    {
+        LOG_E(APP_TAG, "Cannot set up gateway %d", errno);
+        phev_gateway_destroy(gateway);
+        return NULL;
+    }
+
+    LOG_V(APP_TAG, "END - create");
+
+    return gateway;
+}
+bool phev_gateway_add(phev_gateway_t *gateway, phevCtx_t *vehicle)
+{
+    LOG_V(APP_TAG, "START - add");
+
+    if(vehicle->serviceCtx->reactor == NULL)
+    {
+        LOG_E(APP_TAG, "Vehicle has no reactor, create it with the reactor setting");
+        return false;
+    }
+
+    phev_pipe_start(vehicle->serviceCtx->pipe, vehicle->serviceCtx->mac);
+
+    LOG_V(APP_TAG, "END - add");
+
+    return phev_gateway_attach(gateway, vehicle);
+}
+bool phev_gateway_attach(phev_gateway_t *gateway, phevCtx_t *vehicle)
+{
+    LOG_V(APP_TAG, "START - attach");
+
+    phev_reactor_t *reactor = vehicle->serviceCtx->reactor;
+
+    if(reactor == NULL)
+    {
+        LOG_E(APP_TAG, "Vehicle has no reactor, create it with the reactor setting");
+        return false;
+    }
+    if(!phev_gateway_append(gateway, vehicle))
+    {
+        return false;
+    }
+
+    // One pass without waiting picks up the socket and arms the timer, after
+    // that the reactor's own epoll fd becomes readable whenever it has work
+    phev_reactor_runOnce(reactor, 0);
+
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = vehicle,
+    };
+
+    if(epoll_ctl(gateway->epollFd, EPOLL_CTL_ADD, reactor->epollFd, &event) != 0)
+    {
+        LOG_E(APP_TAG, "Cannot watch vehicle %d", errno);
+        phev_gateway_detach(gateway, vehicle);
+        return false;
+    }
+
+    LOG_D(APP_TAG, "Gateway running %zu vehicles", gateway->count);
+    LOG_V(APP_TAG, "END - attach");
+
+    return true;
+}
+void phev_gateway_remove(phev_gateway_t *gateway, phevCtx_t *vehicle)
+{
+    LOG_V(APP_TAG, "START - remove");
+
+    if(phev_gateway_detach(gateway, vehicle))
+    {
+        epoll_ctl(gateway->epollFd, EPOLL_CTL_DEL, vehicle->serviceCtx->reactor->epollFd, NULL);
+    }
+
+    LOG_V(APP_TAG, "END - remove");
+}
+int phev_gateway_runOnce(phev_gateway_t *gateway, const int timeoutMs)
+{
+    struct epoll_event events[PHEV_GATEWAY_MAX_EVENTS];
+
+    const int num = epoll_wait(gateway->epollFd, events, PHEV_GATEWAY_MAX_EVENTS, timeoutMs);
+
+    if(num < 0)
+    {
+        if(errno == EINTR)
+        {
+            return 0;
+        }
+        LOG_E(APP_TAG, "Wait failed %d", errno);
+        return -1;
+    }
+
+    for(int i = 0; i < num; i++)
+    {
+        if(events[i].data.ptr == gateway)
+        {
+            uint64_t value;
+
+            while(read(gateway->wakeFd, &value, sizeof(value)) == sizeof(value))
+            {
+            }
+            continue;
+        }
+
+        phevCtx_t *vehicle = (phevCtx_t *) events[i].data.ptr;
+
+        if(!phev_running(vehicle))
+        {
+            LOG_I(APP_TAG, "Vehicle exited, removing from gateway");
+            phev_gateway_remove(gateway, vehicle);
+            phev_close(vehicle);
+            continue;
+        }
+        phev_reactor_runOnce(vehicle->serviceCtx->reactor, 0);
+        gateway->dispatches++;
+    }
+
+    return num;
+}
+void phev_gateway_wakeup(phev_gateway_t *gateway)
+{
+    const uint64_t one = 1;
+
+    if(write(gateway->wakeFd, &one, sizeof(one)) != sizeof(one))
+    {
+        LOG_W(APP_TAG, "Wakeup failed %d", errno);
+    }
+}
+void phev_gateway_exit(phev_gateway_t *gateway)
+{
+    gateway->exit = true;
+    phev_gateway_wakeup(gateway);
+}
+void phev_gateway_destroy(phev_gateway_t *gateway)
+{
+    if(gateway == NULL)
+    {
+        return;
+    }
+    if(gateway->epollFd >= 0)
+    {
+        close(gateway->epollFd);
+    }
+    if(gateway->wakeFd >= 0)
+    {
+        close(gateway->wakeFd);
+    }
+    free(gateway->vehicles);
+    free(gateway);
+}
+
+#else
+
+// Without epoll every vehicle is polled in turn, which is only sensible for a
+// handful of cars
+phev_gateway_t *phev_gateway_create(void)
+{
+    phev_gateway_t *gateway = malloc(sizeof(phev_gateway_t));
+
+    gateway->vehicles = NULL;
+    gateway->count = 0;
+    gateway->capacity = 0;
+    gateway->epollFd = -1;
+    gateway->wakeFd = -1;
+    gateway->exit = false;
+    gateway->dispatches = 0;
+
+    return gateway;
+}
+bool phev_gateway_add(phev_gateway_t *gateway, phevCtx_t *vehicle)
+{
+    phev_pipe_start(vehicle->serviceCtx->pipe, vehicle->serviceCtx->mac);
+
+    return phev_gateway_attach(gateway, vehicle);
+}
+bool phev_gateway_attach(phev_gateway_t *gateway, phevCtx_t *vehicle)
+{
+    return phev_gateway_append(gateway, vehicle);
+}
+void phev_gateway_remove(phev_gateway_t *gateway, phevCtx_t *vehicle)
+{
+    phev_gateway_detach(gateway, vehicle);
+}
+int phev_gateway_runOnce(phev_gateway_t *gateway, const int timeoutMs)
+{
+    size_t i = 0;
+
+    while(i < gateway->count)
+    {
+        phevCtx_t *vehicle = gateway->vehicles[i];
+
+        if(!phev_running(vehicle))
+        {
+            phev_gateway_detach(gateway, vehicle);
+            phev_close(vehicle);
+            continue;
+        }
+        phev_service_loop(vehicle->serviceCtx);
+        gateway->dispatches++;
+        i++;
+    }
+
+    return (int) gateway->count;
+}
+void phev_gateway_wakeup(phev_gateway_t *gateway)
+{
+}
+void phev_gateway_exit(phev_gateway_t *gateway)
+{
+    gateway->exit = true;
+}
+void phev_gateway_destroy(phev_gateway_t *gateway)
+{
+    if(gateway == NULL)
+    {
+        return;
+    }
+    free(gateway->vehicles);
+    free(gateway);
+}
+
+#endif
+
+void phev_gateway_run(phev_gateway_t *gateway)
+{
+    LOG_V(APP_TAG, "START - run");
+
+    while(!gateway->exit)
+    {
+        phev_gateway_runOnce(gateway, -1);
+    }
+
+    LOG_V(APP_TAG, "END - run");
+}
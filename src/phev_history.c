@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "phev_history.h"
+#include "logger.h"
+
+const static char * TAG = "PHEV_HISTORY";
+
+static uint32_t phev_history_clamp(const uint64_t ms)
+{
+    return (ms > UINT32_MAX ? UINT32_MAX : (uint32_t) ms);
+}
+static size_t phev_history_ringSize(const uint16_t entries)
+{
+    return sizeof(phevHistoryRing_t) + entries * sizeof(phevHistoryEntry_t);
+}
+phevHistory_t * phev_history_create(size_t maxBytes)
+{
+    LOG_V(TAG, "START - create");
+
+    phevHistory_t * history = malloc(sizeof(phevHistory_t));
+
+    if(history == NULL)
+    {
+        LOG_E(TAG, "Cannot allocate memory for history");
+        return NULL;
+    }
+    memset(history->rings, 0, sizeof(history->rings));
+    history->maxBytes = (maxBytes ? maxBytes : PHEV_HISTORY_DEFAULT_MAX_BYTES);
+    history->usedBytes = sizeof(phevHistory_t);
+
+    LOG_V(TAG, "END - create");
+
+    return history;
+}
+void phev_history_destroy(phevHistory_t * history)
+{
+    if(history == NULL)
+    {
+        return;
+    }
+    for(int i = 0; i < 256; i++)
+    {
+        free(history->rings[i]);
+    }
+    free(history);
+}
+bool phev_history_track(phevHistory_t * history, uint8_t reg, uint16_t entries)
+{
+    LOG_V(TAG, "START - track");
+
+    phevHistoryRing_t * ring = history->rings[reg];
+    const size_t size = phev_history_ringSize(entries);
+
+    if(entries == 0)
+    {
+        LOG_E(TAG, "Register %02X needs at least one entry", reg);
+        return false;
+    }
+    if(ring)
+    {
+        history->usedBytes -= phev_history_ringSize(ring->capacity);
+        free(ring);
+        history->rings[reg] = NULL;
+    }
+    if(history->usedBytes + size > history->maxBytes)
+    {
+        LOG_W(TAG, "Tracking register %02X would use %d of %d bytes", reg, (int) (history->usedBytes + size), (int) history->maxBytes);
+        return false;
+    }
+
+    ring = malloc(size);
+
+    if(ring == NULL)
+    {
+        LOG_E(TAG, "Cannot allocate memory for register %02X history", reg);
+        return false;
+    }
+    ring->newest = 0;
+    ring->capacity = entries;
+    ring->head = 0;
+    ring->count = 0;
+    history->rings[reg] = ring;
+    history->usedBytes += size;
+
+    LOG_V(TAG, "END - track");
+
+    return true;
+}
+bool phev_history_tracked(const phevHistory_t * history, uint8_t reg)
+{
+    return history != NULL && history->rings[reg] != NULL;
+}
+uint64_t phev_history_nowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+void phev_history_append(phevHistory_t * history, uint8_t reg, const uint8_t * data, size_t length, uint64_t now)
+{
+    phevHistoryRing_t * ring = history->rings[reg];
+
+    if(ring == NULL)
+    {
+        return;
+    }
+
+    const uint8_t stored = (length > PHEV_HISTORY_VALUE_SIZE ? PHEV_HISTORY_VALUE_SIZE : length);
+    const uint64_t elapsed = (ring->count > 0 && now > ring->newest ? now - ring->newest : 0);
+
+    if(ring->count > 0)
+    {
+        phevHistoryEntry_t * newest = &ring->entries[(ring->head + ring->capacity - 1) % ring->capacity];
+
+        // Same value again only stretches the current run
+        if(newest->length == stored && memcmp(newest->value, data, stored) == 0 && newest->repeats < UINT16_MAX)
+        {
+            newest->span = phev_history_clamp(elapsed);
+            newest->repeats++;
+            return;
+        }
+    }
+
+    phevHistoryEntry_t * entry = &ring->entries[ring->head];
+
+    entry->delta = phev_history_clamp(elapsed);
+    entry->span = 0;
+    entry->repeats = 1;
+    entry->length = stored;
+    memcpy(entry->value, data, stored);
+
+    ring->newest = (ring->count > 0 ? ring->newest + elapsed : now);
+    ring->head = (ring->head + 1) % ring->capacity;
+    if(ring->count < ring->capacity)
+    {
+        ring->count++;
+    }
+}
+static void phev_history_sample(const phevHistoryEntry_t * entry, const uint64_t first, phevHistorySample_t * sample)
+{
+    sample->first = first;
+    sample->last = first + entry->span;
+    sample->repeats = entry->repeats;
+    sample->length = entry->length;
+    memcpy(sample->value, entry->value, entry->length);
+}
+static void phev_history_reverse(phevHistorySample_t * samples, const size_t count)
+{
+    for(size_t i = 0; i < count / 2; i++)
+    {
+        const phevHistorySample_t newer = samples[i];
+
+        samples[i] = samples[count - 1 - i];
+        samples[count - 1 - i] = newer;
+    }
+}
+size_t phev_history_last(const phevHistory_t * history, uint8_t reg, size_t count, phevHistorySample_t * samples)
+{
+    const phevHistoryRing_t * ring = (history ? history->rings[reg] : NULL);
+
+    if(ring == NULL)
+    {
+        return 0;
+    }
+
+    size_t found = 0;
+    uint64_t first = ring->newest;
+
+    for(size_t i = 0; i < ring->count && found < count; i++)
+    {
+        const phevHistoryEntry_t * entry = &ring->entries[(ring->head + ring->capacity - 1 - i) % ring->capacity];
+
+        phev_history_sample(entry, first, &samples[found++]);
+        first -= entry->delta;
+    }
+    phev_history_reverse(samples, found);
+
+    return found;
+}
+size_t phev_history_window(const phevHistory_t * history, uint8_t reg, uint64_t from, uint64_t to, phevHistorySample_t * samples, size_t max)
+{
+    const phevHistoryRing_t * ring = (history ? history->rings[reg] : NULL);
+
+    if(ring == NULL)
+    {
+        return 0;
+    }
+
+    size_t found = 0;
+    uint64_t first = ring->newest;
+
+    for(size_t i = 0; i < ring->count && found < max; i++)
+    {
+        const phevHistoryEntry_t * entry = &ring->entries[(ring->head + ring->capacity - 1 - i) % ring->capacity];
+
+        if(first + entry->span < from)
+        {
+            break;
+        }
+        if(first <= to)
+        {
+            phev_history_sample(entry, first, &samples[found++]);
+        }
+        first -= entry->delta;
+    }
+    phev_history_reverse(samples, found);
+
+    return found;
+}
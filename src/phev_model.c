@@ -9,55 +9,215 @@ phevModel_t * phev_model_create(void)
     LOG_V(TAG, "START - create");
     phevModel_t * model = malloc(sizeof(phevModel_t));
 
-    for(int i=0;i<256;i++)
+    if(model == NULL)
     {
-        model->registers[i] = NULL;
+        LOG_E(TAG,"Cannot allocate memory for model");
+        return NULL;
     }
+    memset(model->slots, 0, sizeof(model->slots));
+    memset(model->versions, 0, sizeof(model->versions));
+    memset(model->dirty, 0, sizeof(model->dirty));
+    model->version = 0;
+    model->newest = -1;
+    model->history = NULL;
+    model->data = model->slab;
+    model->size = sizeof(model->slab);
+    model->used = 0;
+    model->wasted = 0;
+
     LOG_I(TAG,"Model created and initialised");
     LOG_V(TAG, "END - createModel");
     return model;
 }
+void phev_model_destroy(phevModel_t * model)
+{
+    if(model)
+    {
+        if(model->data != model->slab)
+        {
+            free(model->data);
+        }
+        phev_history_destroy(model->history);
+        free(model);
+    }
+}
+void phev_model_attachHistory(phevModel_t * model, phevHistory_t * history)
+{
+    if(model->history != history)
+    {
+        phev_history_destroy(model->history);
+    }
+    model->history = history;
+}
+// Packs the live registers together, moving to a bigger heap slab when
+// compacting alone does not leave room for extra bytes
+static bool phev_model_reserve(phevModel_t * model, const size_t extra)
+{
+    const size_t needed = model->used - model->wasted + extra;
+    size_t size = model->size;
+
+    while(size < needed)
+    {
+        size *= 2;
+    }
+    LOG_D(TAG,"Packing model into %d bytes, %d wasted",size,model->wasted);
+
+    uint8_t * packed = malloc(size);
+
+    if(packed == NULL)
+    {
+        LOG_E(TAG,"Cannot allocate memory for model - size %d",size);
+        return false;
+    }
+
+    size_t used = 0;
+
+    for(int i=0;i<256;i++)
+    {
+        phevModelSlot_t * slot = &model->slots[i];
+
+        if(slot->capacity > 0)
+        {
+            memcpy(packed + used, model->data + slot->offset, slot->length);
+            slot->offset = used;
+            used += slot->capacity;
+        }
+    }
+
+    if(size <= sizeof(model->slab))
+    {
+        memcpy(model->slab, packed, used);
+        free(packed);
+        packed = model->slab;
+    }
+    if(model->data != model->slab)
+    {
+        free(model->data);
+    }
+    model->data = packed;
+    model->size = size;
+    model->used = used;
+    model->wasted = 0;
+
+    return true;
+}
+static void phev_model_touch(phevModel_t * model, uint8_t reg)
+{
+    if(model->versions[reg] != 0)
+    {
+        if(model->newer[reg] >= 0)
+        {
+            model->older[model->newer[reg]] = model->older[reg];
+        }
+        else
+        {
+            model->newest = model->older[reg];
+        }
+        if(model->older[reg] >= 0)
+        {
+            model->newer[model->older[reg]] = model->newer[reg];
+        }
+    }
+    model->older[reg] = model->newest;
+    model->newer[reg] = -1;
+    if(model->newest >= 0)
+    {
+        model->newer[model->newest] = reg;
+    }
+    model->newest = reg;
+
+    model->versions[reg] = ++model->version;
+    model->dirty[reg >> 6] |= 1ULL << (reg & 63);
+}
+static int phev_model_store(phevModel_t * model, uint8_t reg, const uint8_t * data, size_t length)
+{
+    phevModelSlot_t * slot = &model->slots[reg];
+
+    if(slot->capacity > 0 && slot->length == length && memcmp(model->data + slot->offset,data,length) == 0)
+    {
+        LOG_D(TAG,"Register %02X not changed",reg);
+        return 1;
+    }
+    if(length > slot->capacity || slot->capacity == 0)
+    {
+        const size_t capacity = (length > 0 ? (length + PHEV_MODEL_SLOT_ALIGN - 1) & ~(size_t) (PHEV_MODEL_SLOT_ALIGN - 1) : PHEV_MODEL_SLOT_ALIGN);
 
+        // The old value stays live until the new space is secured, a failed
+        // reserve leaves the register as it was
+        if(model->used + capacity > model->size && !phev_model_reserve(model, capacity))
+        {
+            return 0;
+        }
+        model->wasted += slot->capacity;
+        slot->offset = model->used;
+        slot->capacity = capacity;
+        model->used += capacity;
+    }
+    memcpy(model->data + slot->offset,data,length);
+    slot->length = length;
+    phev_model_touch(model, reg);
+    return 1;
+}
 int phev_model_setRegister(phevModel_t * model, uint8_t reg, const uint8_t * data, size_t length)
 {
     LOG_V(TAG, "START - setRegister");
-    phevRegister_t * out = malloc(sizeof(phevRegister_t) + length);
-    out->length = length;
-    memcpy(out->data,data,length);
-    model->registers[reg] = out;
+
+    if(length > UINT16_MAX - PHEV_MODEL_SLOT_ALIGN)
+    {
+        LOG_E(TAG,"Register %d too long - length %d",reg,length);
+        return 0;
+    }
+    // Repeats count for history even though they do not change the model
+    if(model->history)
+    {
+        phev_history_append(model->history, reg, data, length, phev_history_nowMs());
+    }
+
+    const int ret = phev_model_store(model, reg, data, length);
+
     LOG_V(TAG, "END - setRegister");
+    return ret;
+}
+// Restored values were not seen now, so they stay out of the history and
+// leave the dirty bits as they were
+int phev_model_restoreRegister(phevModel_t * model, uint8_t reg, const uint8_t * data, size_t length, uint32_t version)
+{
+    const uint64_t bit = 1ULL << (reg & 63);
+    const uint64_t dirty = model->dirty[reg >> 6] & bit;
+
+    if(length > UINT16_MAX - PHEV_MODEL_SLOT_ALIGN || phev_model_store(model, reg, data, length) != 1)
+    {
+        return 0;
+    }
+    model->dirty[reg >> 6] = (model->dirty[reg >> 6] & ~bit) | dirty;
+    model->versions[reg] = version;
+    if(version > model->version)
+    {
+        model->version = version;
+    }
     return 1;
 }
 phevRegister_t * phev_model_getRegister(phevModel_t * model, uint8_t reg)
 {
     phevRegister_t * ret = NULL;
+    phevRegisterView_t view;
 
     LOG_V(TAG, "START - getRegister");
     if(model)
     {
-        phevRegister_t * out = model->registers[reg];
-        if(out == NULL)
-        {   
-            LOG_D(TAG,"Register %d is not set",reg);
+        if(!phev_model_viewRegister(model,reg,&view))
+        {
             goto phev_model_getRegister_end;
-        } else {
-            if(out->length == 0)
-            {
-                LOG_D(TAG,"Register data length is zero");
-                goto phev_model_getRegister_end;
-            } else {
-                ret = malloc(sizeof(phevRegister_t) + out->length);
-                if(ret)
-                {
-                    memcpy(ret, out, sizeof(phevRegister_t) + out->length);
-                } 
-                else
-                {
-                    LOG_E(TAG,"Cannot allocate memory for register - length %d",out->length);
-                }
-                
-               goto phev_model_getRegister_end;
-            }
+        }
+        ret = malloc(sizeof(phevRegister_t) + view.length);
+        if(ret)
+        {
+            ret->length = view.length;
+            memcpy(ret->data, view.data, view.length);
+        }
+        else
+        {
+            LOG_E(TAG,"Cannot allocate memory for register - length %d",view.length);
         }
     } else {
         LOG_E(TAG,"Model is not initialised");
@@ -68,24 +228,45 @@ phev_model_getRegister_end:
     
     return ret;
 }
+bool phev_model_viewRegister(const phevModel_t * model, uint8_t reg, phevRegisterView_t * view)
+{
+    if(model == NULL)
+    {
+        LOG_E(TAG,"Model is not initialised");
+        return false;
+    }
+
+    const phevModelSlot_t * slot = &model->slots[reg];
+
+    if(slot->capacity == 0 || slot->length == 0)
+    {
+        LOG_D(TAG,"Register %d is not set",reg);
+        return false;
+    }
+    view->data = model->data + slot->offset;
+    view->length = slot->length;
+    view->version = model->versions[reg];
+
+    return true;
+}
 int phev_model_compareRegister(phevModel_t * model, uint8_t reg , const uint8_t * data)
 {
     LOG_V(TAG, "START - compareRegister");
     if(model)
     {
-        phevRegister_t * out = phev_model_getRegister(model,reg);
+        phevRegisterView_t out;
         
-        if(out && data)
+        if(data && phev_model_viewRegister(model,reg,&out))
         {
-            int ret = memcmp(data,out->data,out->length);
+            int ret = memcmp(data,out.data,out.length);
 
             LOG_D(TAG,"Comparing register data result %d",ret);
             if(ret == 0)
             {
                 LOG_D(TAG,"Register %02X not changed",reg);
             } else {
-                LOG_BUFFER_HEXDUMP(TAG,data,out->length,LOG_DEBUG);
-                LOG_BUFFER_HEXDUMP(TAG,out->data,out->length,LOG_DEBUG);
+                LOG_BUFFER_HEXDUMP(TAG,data,out.length,LOG_DEBUG);
+                LOG_BUFFER_HEXDUMP(TAG,out.data,out.length,LOG_DEBUG);
             }
             
             
@@ -98,4 +279,64 @@ int phev_model_compareRegister(phevModel_t * model, uint8_t reg , const uint8_t
     }
     LOG_V(TAG, "END - compareRegister");
     
+}
+int phev_model_compareRegisterData(const phevModel_t * model, uint8_t reg, const uint8_t * data, size_t length)
+{
+    phevRegisterView_t view;
+
+    if(data == NULL || !phev_model_viewRegister(model, reg, &view))
+    {
+        return -1;
+    }
+    if(view.length != length)
+    {
+        LOG_D(TAG,"Register %02X length changed from %d to %d",reg,view.length,length);
+        return (view.length < length ? 1 : -1);
+    }
+
+    return memcmp(data,view.data,length);
+}
+uint32_t phev_model_version(const phevModel_t * model)
+{
+    return model->version;
+}
+size_t phev_model_changedSince(const phevModel_t * model, uint32_t version, uint8_t regs[256])
+{
+    size_t count = 0;
+
+    for(int reg = model->newest; reg >= 0 && model->versions[reg] > version; reg = model->older[reg])
+    {
+        regs[count++] = reg;
+    }
+    for(size_t i = 0; i < count / 2; i++)
+    {
+        const uint8_t newer = regs[i];
+
+        regs[i] = regs[count - 1 - i];
+        regs[count - 1 - i] = newer;
+    }
+
+    return count;
+}
+bool phev_model_isDirty(const phevModel_t * model, uint8_t reg)
+{
+    return (model->dirty[reg >> 6] >> (reg & 63)) & 1;
+}
+size_t phev_model_takeDirty(phevModel_t * model, uint8_t regs[256])
+{
+    size_t count = 0;
+
+    for(int word = 0; word < 4; word++)
+    {
+        uint64_t bits = model->dirty[word];
+
+        while(bits)
+        {
+            regs[count++] = (word << 6) + __builtin_ctzll(bits);
+            bits &= bits - 1;
+        }
+        model->dirty[word] = 0;
+    }
+
+    return count;
 }
\ No newline at end of file
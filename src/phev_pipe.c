@@ -1,3 +1,7 @@
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
 #include "phev_pipe.h"
 #include "phev_core.h"
 #include "msg_utils.h"
@@ -9,15 +13,29 @@
 
 const static char *APP_TAG = "PHEV_PIPE";
 
+static bool phev_pipe_queueFrame(phev_pipe_ctx_t * ctx, const int lane, const uint8_t command, const uint8_t type, const uint8_t reg, const uint8_t * data, const size_t length, const uint8_t xor);
+static bool phev_pipe_queueTemplate(phev_pipe_ctx_t * ctx, const int lane, const int id, const uint8_t reg, const uint8_t xor);
+static void phev_pipe_rebuildEventIndex(phev_pipe_eventRegistry_t * events);
+static void phev_pipe_outboundCommit(phev_pipe_ctx_t * ctx);
+static void phev_pipe_queueBytes(phev_pipe_ctx_t * ctx, const int lane, const uint8_t * data, const size_t length);
+static void phev_pipe_resetLanes(phev_pipe_ctx_t * ctx);
+static void phev_pipe_initSubmissions(phev_pipe_ctx_t * ctx);
+static void phev_pipe_initEvent(phevPipeEvent_t *event, phev_pipe_ctx_t *ctx, const int id, void *data, const size_t length);
+
 
 void phev_pipe_resetPing(phev_pipe_ctx_t *ctx)
 {
     LOG_V(APP_TAG, "START - resetPing");
-    time_t now;
+    phev_pipe_keepalive_t *keepalive = &ctx->keepalive;
+    const uint64_t now = phev_pipe_nowMs();
 
-    time(&now);
     ctx->currentPing = 1;
-    ctx->lastPingTime = now;
+    ctx->pingResponse = 0;
+    keepalive->nextPing = now + keepalive->intervalMs;
+    keepalive->nextTimeSync = now + keepalive->timeSyncMs;
+    keepalive->lastPing = now;
+    keepalive->lastInbound = 0;
+    keepalive->pingSent = false;
     LOG_V(APP_TAG, "END - resetPing");
 }
 
@@ -25,12 +43,15 @@ void phev_pipe_destroyEvent(phevPipeEvent_t * event)
 {
     if(event != NULL)
     {
-        if(event->data != NULL)
+        if(event->event == PHEV_PIPE_REG_UPDATE || event->event == PHEV_PIPE_REG_UPDATE_ACK)
+        {
+            phev_core_destroyMessage((phevMessage_t *) event->data);
+        }
+        else if(event->data != NULL)
         {
             free(event->data);
         }
         free(event);
-        event = NULL;
     }
 
 }
@@ -55,84 +76,244 @@ void phev_pipe_disconnectOutput(phev_pipe_ctx_t *ctx)
     ctx->currentXOR = 0;
     ctx->pingXOR = 0;
     ctx->commandXOR = 0;
+    ctx->inboundXORHint = PHEV_CORE_XOR_HINT_PLAIN;
+    ctx->inbound.length = 0;
+    phev_pipe_resetLanes(ctx);
     ctx->encrypt = false;
-    ctx->pingResponse = 0;
 
     LOG_V(APP_TAG,"END - disconnectOutput");
 }
-void phev_pipe_waitForConnection(phev_pipe_ctx_t *ctx)
+static void phev_pipe_setConnectionState(phev_pipe_ctx_t *ctx, const phev_pipe_connectionState_t state, const uint32_t retryInMs)
 {
-    LOG_V(APP_TAG, "START - waitForConnection");
-    ctx->connected = false;
-    int retries = 0;
+    phevPipeEvent_t event;
+    phev_pipe_connectionEvent_t data = {
+        .state = state,
+        .attempts = ctx->connection.attempts,
+        .retryInMs = retryInMs,
+    };
+
+    ctx->connection.state = state;
+    ctx->connection.generation++;
+
+    phev_pipe_initEvent(&event, ctx, PHEV_PIPE_CONNECTION_STATE, &data, sizeof(data));
+    phev_pipe_sendEventToHandlers(ctx, &event);
+}
+// Exponential with equal jitter: never less than half the step, so a car that
+// refuses straight away cannot make us spin, and a gateway full of cars that
+// lost the same access point does not reconnect in lock step
+static uint32_t phev_pipe_backoffMs(phev_pipe_ctx_t *ctx)
+{
+    uint32_t delay = PHEV_CONNECT_BACKOFF_MIN_MS;
+    uint32_t seed = ctx->connection.seed;
+
+    for (uint32_t i = 1; i < ctx->connection.attempts && delay < PHEV_CONNECT_BACKOFF_MAX_MS; i++)
+    {
+        delay *= 2;
+    }
+    if (delay > PHEV_CONNECT_BACKOFF_MAX_MS)
+    {
+        delay = PHEV_CONNECT_BACKOFF_MAX_MS;
+    }
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    ctx->connection.seed = seed;
+
+    return delay / 2 + seed % (delay / 2 + 1);
+}
+static void phev_pipe_sendStart(phev_pipe_ctx_t *ctx)
+{
+    if (ctx->connection.startPending)
+    {
+        ctx->connection.startPending = false;
+        phev_pipe_sendMac(ctx, ctx->connection.mac);
+        phev_pipe_updateRegister(ctx, KO_WF_EV_UPDATE_SP, 3);
+    }
+}
+bool phev_pipe_connectStep(phev_pipe_ctx_t *ctx, const uint64_t now)
+{
+    phev_pipe_connection_t *connection = &ctx->connection;
+    msg_pipe_ctx_t *pipe = ctx->pipe;
+
+    if (connection->state == PHEV_PIPE_STATE_CONNECTED)
+    {
+        if (pipe->in->connected && pipe->out->connected)
+        {
+            return true;
+        }
+        LOG_W(APP_TAG, "Connection lost");
+        ctx->connected = false;
+        connection->attempts = 0;
+        connection->deadline = now;
+        phev_pipe_setConnectionState(ctx, PHEV_PIPE_STATE_DISCONNECTED, 0);
+    }
+    if (connection->state != PHEV_PIPE_STATE_CONNECTING)
+    {
+        if (now < connection->deadline)
+        {
+            return false;
+        }
+        connection->attempts++;
+        connection->deadline = now + PHEV_CONNECT_TIMEOUT_MS;
+        phev_pipe_setConnectionState(ctx, PHEV_PIPE_STATE_CONNECTING, 0);
+    }
 
-    if (!ctx->pipe->in->connected)
+    // Transports return straight away, a connect that is still going is
+    // picked up again on the next step
+    if (!pipe->in->connected)
     {
         LOG_V(APP_TAG, "Calling in connect");
-        msg_pipe_in_connect(ctx->pipe);
+        msg_pipe_in_connect(pipe);
     }
-    if (!ctx->pipe->out->connected)
+    if (!pipe->out->connected)
     {
         LOG_V(APP_TAG, "Calling out connect");
-        msg_pipe_out_connect(ctx->pipe);
+        msg_pipe_out_connect(pipe);
+    }
+
+    if (pipe->in->connected && pipe->out->connected)
+    {
+        LOG_I(APP_TAG, "Connected after %u attempts", connection->attempts);
+        ctx->connected = true;
+        phev_pipe_resetPing(ctx);
+        phev_pipe_setConnectionState(ctx, PHEV_PIPE_STATE_CONNECTED, 0);
+        connection->attempts = 0;
+        phev_pipe_sendStart(ctx);
+        return true;
+    }
+    if (connection->pending && connection->pending(connection->pendingCtx) && now < connection->deadline)
+    {
+        return false;
+    }
+
+    const uint32_t delay = phev_pipe_backoffMs(ctx);
+
+    LOG_W(APP_TAG, "Connect attempt %u failed, retrying in %u ms", connection->attempts, delay);
+    connection->deadline = now + delay;
+    phev_pipe_setConnectionState(ctx, PHEV_PIPE_STATE_BACKOFF, delay);
+
+    return false;
+}
+uint64_t phev_pipe_nextConnectDeadline(phev_pipe_ctx_t *ctx)
+{
+    return (ctx->connection.state == PHEV_PIPE_STATE_CONNECTED ? UINT64_MAX : ctx->connection.deadline);
+}
+uint8_t phev_pipe_unansweredPings(phev_pipe_ctx_t *ctx)
+{
+    if (!ctx->keepalive.pingSent)
+    {
+        return 0;
+    }
+    // Ping numbers wrap at 0x30 and the car echoes the one it answers
+    return (uint8_t) ((ctx->keepalive.lastSentPing + 0x30 - ctx->pingResponse) % 0x30);
+}
+void phev_pipe_keepalive(phev_pipe_ctx_t *ctx, const uint64_t now)
+{
+    phev_pipe_keepalive_t *keepalive = &ctx->keepalive;
+
+    if (!ctx->pipe->out->connected)
+    {
+        return;
     }
-    while (!(ctx->pipe->in->connected && ctx->pipe->out->connected))
+    if (now >= keepalive->nextTimeSync)
     {
-        LOG_I(APP_TAG, "Not connected waiting...");
-        SLEEP(PHEV_CONNECT_WAIT_TIME);
-        if (retries > PHEV_CONNECT_MAX_RETRIES)
+        keepalive->nextTimeSync = now + keepalive->timeSyncMs;
+
+        if (ctx->registerDevice)
         {
-            LOG_E(APP_TAG, "Max retries reached");
-            return;
+            LOG_D(APP_TAG, "Not sending time sync in register device mode");
         }
-
-        if (!ctx->pipe->in->connected)
+        else if (ctx->encrypt && ctx->pingXOR == 0)
+        {
+            // Try again with the next ping once the car has sent its XOR
+            keepalive->nextTimeSync = now + keepalive->intervalMs;
+        }
+        else
         {
-            LOG_V(APP_TAG, "Calling in connect");
-            msg_pipe_in_connect(ctx->pipe);
+            phev_pipe_sendTimeSync(ctx);
         }
-        if (!ctx->pipe->out->connected)
+    }
+    if (now < keepalive->nextPing)
+    {
+        return;
+    }
+    keepalive->nextPing = now + keepalive->intervalMs;
+
+    const uint8_t unanswered = phev_pipe_unansweredPings(ctx);
+
+    if (keepalive->maxUnanswered > 0 && unanswered >= keepalive->maxUnanswered)
+    {
+        LOG_W(APP_TAG, "%d pings unanswered, dropping the connection", unanswered);
+        keepalive->failures++;
+        phev_pipe_disconnectOutput(ctx);
+        return;
+    }
+    if (keepalive->lastInbound > 0 && now - keepalive->lastInbound < keepalive->intervalMs
+        && now - keepalive->lastPing < keepalive->maxSilenceMs)
+    {
+        LOG_D(APP_TAG, "Car is talking, skipping ping");
+        keepalive->suppressed++;
+        return;
+    }
+    keepalive->lastPing = now;
+    phev_pipe_ping(ctx);
+}
+uint64_t phev_pipe_nextKeepaliveDeadline(phev_pipe_ctx_t *ctx)
+{
+    const phev_pipe_keepalive_t *keepalive = &ctx->keepalive;
+
+    return (keepalive->nextPing < keepalive->nextTimeSync ? keepalive->nextPing : keepalive->nextTimeSync);
+}
+// Blocking wrapper for callers that own their thread, the loops step the
+// state machine instead
+void phev_pipe_waitForConnection(phev_pipe_ctx_t *ctx)
+{
+    LOG_V(APP_TAG, "START - waitForConnection");
+
+    while (!phev_pipe_connectStep(ctx, phev_pipe_nowMs()))
+    {
+        if (ctx->connection.attempts > PHEV_CONNECT_MAX_RETRIES)
         {
-            LOG_V(APP_TAG, "Calling out connect");
-            msg_pipe_out_connect(ctx->pipe);
+            LOG_E(APP_TAG, "Max retries reached");
+            return;
         }
-        retries++;
+        SLEEP(PHEV_CONNECT_POLL_MS);
     }
 
-    ctx->connected = true;
     LOG_V(APP_TAG, "END - waitForConnection");
 }
 void phev_pipe_loop(phev_pipe_ctx_t *ctx)
 {
-    time_t now;
+    phev_pipe_outboundBegin(ctx);
 
-    if (ctx->pipe->in->connected && ctx->pipe->out->connected)
+    if (phev_pipe_connectStep(ctx, phev_pipe_nowMs()))
     {
-        ctx->connected = true;
         msg_pipe_loop(ctx->pipe);
     }
-    else
-    {
-        phev_pipe_waitForConnection(ctx);
-    }
 
     if (ctx->pipe->out->connected)
     {
-        LOG_V(APP_TAG, "Sending ping");
-        time(&now);
-        if (now > ctx->lastPingTime)
-        {
-            phev_pipe_ping(ctx);
-            time(&ctx->lastPingTime);
-        }
+        phev_pipe_drainCommands(ctx);
+        phev_pipe_keepalive(ctx, phev_pipe_nowMs());
+        phev_pipe_serviceCommands(ctx, phev_pipe_nowMs());
     }
+
+    phev_pipe_outboundEnd(ctx);
 }
 void phev_pipe_sendMac(phev_pipe_ctx_t *ctx, uint8_t *mac)
 {
     LOG_V(APP_TAG, "START - sendMac");
 
-    message_t *message = phev_core_startMessageEncoded(mac);
-    phev_pipe_outboundPublish(ctx, message);
+    uint8_t start[MAC_ADDR_SIZE + 1];
+    const uint8_t startaa = 0;
+
+    memcpy(start, mac, MAC_ADDR_SIZE);
+    start[MAC_ADDR_SIZE] = 0;
+
+    phev_pipe_queueFrame(ctx, PHEV_PIPE_LANE_COMMAND, START_SEND_MY18, REQUEST_TYPE, 0x01, start, sizeof(start), ctx->currentXOR);
+    phev_pipe_queueFrame(ctx, PHEV_PIPE_LANE_COMMAND, SEND_CMD, REQUEST_TYPE, KO_WF_START_AA_EVR, &startaa, 1, ctx->currentXOR);
+    phev_pipe_outboundCommit(ctx);
 
     LOG_V(APP_TAG, "END - sendMac");
 }
@@ -140,10 +321,14 @@ void phev_pipe_start(phev_pipe_ctx_t *ctx, uint8_t *mac)
 {
     LOG_V(APP_TAG, "START - start");
 
-    phev_pipe_waitForConnection(ctx);
+    // Sent once connected, the car may well be out of range right now
+    memcpy(ctx->connection.mac, mac, MAC_ADDR_SIZE);
+    ctx->connection.startPending = true;
 
-    phev_pipe_sendMac(ctx, mac);
-    phev_pipe_updateRegister(ctx, KO_WF_EV_UPDATE_SP, 3);
+    if (phev_pipe_connectStep(ctx, phev_pipe_nowMs()))
+    {
+        phev_pipe_sendStart(ctx);
+    }
     LOG_V(APP_TAG, "END - start");
 }
 phev_pipe_ctx_t *phev_pipe_createPipe(phev_pipe_settings_t settings)
@@ -171,6 +356,17 @@ phev_pipe_ctx_t *phev_pipe_createPipe(phev_pipe_settings_t settings)
     outputChain->responder = settings.outputResponder;
     outputChain->respondOnce = false;
 
+    ctx->inboundStages = *outputChain;
+
+    if (settings.fusedInbound)
+    {
+        LOG_D(APP_TAG, "Using fused inbound chain");
+        outputChain->inputTransformer = phev_pipe_fusedInboundTransformer;
+        outputChain->filter = NULL;
+        outputChain->responder = NULL;
+        outputChain->outputTransformer = NULL;
+    }
+
     msg_pipe_settings_t pipe_settings = {
         .in = settings.in,
         .out = settings.out,
@@ -185,29 +381,38 @@ phev_pipe_ctx_t *phev_pipe_createPipe(phev_pipe_settings_t settings)
     ctx->pipe = msg_pipe(pipe_settings);
 
     ctx->errorHandler = settings.errorHandler;
-    ctx->eventHandlers = 0;
-
-    for (int i = 0; i < PHEV_PIPE_MAX_EVENT_HANDLERS; i++)
-    {
-        ctx->eventHandler[i] = NULL;
-    }
-
-    ctx->updateRegisterCallbacks = malloc(sizeof(phev_pipe_updateRegisterCtx_t));
-    ctx->updateRegisterCallbacks->numberOfCallbacks = 0;
-
-    for (int i = 0; i < PHEV_PIPE_MAX_UPDATE_CALLBACKS; i++)
-    {
-        ctx->updateRegisterCallbacks->callbacks[i] = NULL;
-        ctx->updateRegisterCallbacks->used[i] = false;
-    }
+    memset(&ctx->events, 0, sizeof(ctx->events));
+
+    ctx->commands.commands = NULL;
+    ctx->commands.count = 0;
+    ctx->commands.capacity = 0;
+    ctx->commands.maxCommands = PHEV_PIPE_MAX_INFLIGHT_COMMANDS;
+    memset(ctx->commands.slot, 0xff, sizeof(ctx->commands.slot));
+    phev_pipe_initSubmissions(ctx);
     ctx->connected = false;
     ctx->ctx = settings.ctx;
     ctx->currentXOR = 0;
     ctx->pingXOR = 0;
     ctx->commandXOR = 0;
+    ctx->inboundXORHint = PHEV_CORE_XOR_HINT_PLAIN;
     ctx->encrypt = false;
     ctx->pingResponse = 0;
     ctx->registerDevice = settings.registerDevice;
+    memset(ctx->outbound.lanes, 0, sizeof(ctx->outbound.lanes));
+    phev_pipe_resetLanes(ctx);
+    ctx->outbound.batching = 0;
+    ctx->outbound.writes = 0;
+    ctx->outbound.immediateAcks = settings.immediateAcks;
+    ctx->inbound.length = 0;
+    ctx->inbound.discarded = 0;
+    memset(&ctx->connection, 0, sizeof(ctx->connection));
+    ctx->connection.state = PHEV_PIPE_STATE_DISCONNECTED;
+    ctx->connection.seed = (uint32_t) ((uintptr_t) ctx ^ phev_pipe_nowMs()) | 1;
+    memset(&ctx->keepalive, 0, sizeof(ctx->keepalive));
+    ctx->keepalive.intervalMs = (settings.pingIntervalMs ? settings.pingIntervalMs : PHEV_PIPE_PING_INTERVAL_MS);
+    ctx->keepalive.maxSilenceMs = PHEV_PIPE_PING_MAX_SILENCE_MS;
+    ctx->keepalive.timeSyncMs = PHEV_PIPE_TIME_SYNC_INTERVAL_MS;
+    ctx->keepalive.maxUnanswered = (settings.maxUnansweredPings ? settings.maxUnansweredPings : PHEV_PIPE_MAX_UNANSWERED_PINGS);
 
     phev_pipe_resetPing(ctx);
 
@@ -215,33 +420,22 @@ phev_pipe_ctx_t *phev_pipe_createPipe(phev_pipe_settings_t settings)
 
     return ctx;
 }
-static bool waiting = false;
-static bool bb_waiting = false;
-
-void refreshCallback2(phev_pipe_ctx_t *ctx, uint8_t reg, void *customCtx)
-{
-    waiting = false;
-    LOG_I(APP_TAG,"                        REFRESH ACK");
-}
 message_t *phev_pipe_outputChainInputTransformer(void *ctx, message_t *message)
 {
     LOG_V(APP_TAG, "START - outputChainInputTransformer");
     LOG_D(APP_TAG,"Incoming message");
     LOG_BUFFER_HEXDUMP(APP_TAG, message->data, message->length, LOG_DEBUG);
 
-    phevMessage_t *phevMessage = malloc(sizeof(phevMessage_t));
     phev_pipe_ctx_t *pipeCtx = (phev_pipe_ctx_t *)ctx;
 
-    int ret = phev_core_decodeMessage(message->data, message->length, phevMessage);
+    const phevFrame_t *frame = phev_core_messageFrame(message);
 
-    if (ret == 0)
+    if (frame == NULL)
     {
         LOG_E(APP_TAG, "Invalid message received");
-
-        msg_utils_destroyMsg(message);
         return NULL;
     }
-    if(message->ctx != NULL)
+    if(phev_core_messageEncoded(message))
     {
         uint8_t xor = phev_core_getMessageXOR(message);
         //LOG_I(APP_TAG,"Command received XOR changed to %02X",xor);
@@ -250,248 +444,139 @@ message_t *phev_pipe_outputChainInputTransformer(void *ctx, message_t *message)
         pipeCtx->pingXOR = xor;
 
     }
-    if(phevMessage->command == 0xbb)
+    if(frame->command == 0xbb)
     {
-        pipeCtx->commandXOR = phevMessage->data[0];
-        pipeCtx->pingXOR = phevMessage->data[0];
+        pipeCtx->commandXOR = frame->data[0];
+        pipeCtx->pingXOR = frame->data[0];
 
-        //LOG_I(APP_TAG,"%02X command recieved XOR changed to %02X",phevMessage->command, pipeCtx->commandXOR);
+        //LOG_I(APP_TAG,"%02X command recieved XOR changed to %02X",frame->command, pipeCtx->commandXOR);
 
     }
-    if(phevMessage->command == 0xcc)
+    if(frame->command == 0xcc)
     {
         // NOT WORKING HERE
 
-        pipeCtx->pingXOR = phevMessage->data[0];
-        //pipeCtx->commandXOR = phevMessage->data[0];
-        //LOG_I(APP_TAG,"%02X command recieved XOR changed to %02X",phevMessage->command, pipeCtx->pingXOR);
+        pipeCtx->pingXOR = frame->data[0];
+        //pipeCtx->commandXOR = frame->data[0];
+        //LOG_I(APP_TAG,"%02X command recieved XOR changed to %02X",frame->command, pipeCtx->pingXOR);
         // NOT WORKING HERE
     }
-    if(phevMessage->command == 0x3f)
+    if(frame->command == 0x3f)
     {
-        pipeCtx->pingResponse = phevMessage->reg;
-        LOG_D(APP_TAG,"Server Ping %d\n",phevMessage->reg);
+        pipeCtx->pingResponse = frame->reg;
+        LOG_D(APP_TAG,"Server Ping %d\n",frame->reg);
 
     }
+    else
+    {
+        pipeCtx->keepalive.lastInbound = phev_pipe_nowMs();
+    }
 
-    LOG_D(APP_TAG, "Command %02x Register %d Length %d Type %d XOR %02X", phevMessage->command, phevMessage->reg, phevMessage->length, phevMessage->type, phevMessage->XOR);
-    LOG_BUFFER_HEXDUMP(APP_TAG, phevMessage->data, phevMessage->length, LOG_DEBUG);
-
-    phev_core_destroyMessage(phevMessage);
+    LOG_D(APP_TAG, "Command %02x Register %d Length %d Type %d XOR %02X", frame->command, frame->reg, frame->length, frame->type, frame->XOR);
+    LOG_BUFFER_HEXDUMP(APP_TAG, frame->data, frame->length, LOG_DEBUG);
 
-    //free(phevMessage);
     return message;
 
+}
+static void phev_pipe_sendAck(phev_pipe_ctx_t *ctx, const phevFrame_t *frame, const uint8_t xor)
+{
+    const uint8_t command = ((frame->command & 0xf) << 4) | ((frame->command & 0xf0) >> 4);
+    const uint8_t data = 0;
+    const int id = phev_core_ackTemplate(frame->command);
+
+    LOG_D(APP_TAG, "Responded with command %02X  type %d", command, RESPONSE_TYPE);
+#ifndef NO_CMD_RESP
+    if (id != PHEV_CORE_TEMPLATE_NONE)
+    {
+        phev_pipe_queueTemplate(ctx, PHEV_PIPE_LANE_ACK, id, frame->reg, xor);
+    }
+    else
+    {
+        phev_pipe_queueFrame(ctx, PHEV_PIPE_LANE_ACK, command, RESPONSE_TYPE, frame->reg, &data, 1, xor);
+    }
+    if (ctx->outbound.immediateAcks)
+    {
+        phev_pipe_outboundFlush(ctx);
+    }
+    else
+    {
+        phev_pipe_outboundCommit(ctx);
+    }
+#endif
 }
 message_t *phev_pipe_commandResponder(void *ctx, message_t *message)
 {
     LOG_V(APP_TAG, "START - commandResponder");
     phev_pipe_ctx_t *pipeCtx = (phev_pipe_ctx_t *)ctx;
 
-    message_t *out = NULL;
-    message_t *ret = NULL;
+    const phevFrame_t *frame = phev_core_messageFrame(message);
 
-    if (message != NULL)
+    if (frame != NULL)
     {
+        LOG_D(APP_TAG, "Decoded message XOR %02x", frame->XOR);
+        const phevCommandDescriptor_t *desc = phev_core_commandDescriptor(frame->command);
 
-        phevMessage_t phevMsg;
-
-        phev_core_decodeMessage(message->data, message->length, &phevMsg);
-
-        LOG_D(APP_TAG, "Decoded message XOR %02x", phevMsg.XOR);
-        if (phevMsg.command == PING_RESP_CMD || phevMsg.command == PING_RESP_CMD_MY18 || phevMsg.command == 0xbb || phevMsg.command == 0xcd || phevMsg.command == 0xcc)
+        if (desc->ackPolicy == PHEV_CORE_ACK_NEVER)
         {
             LOG_D(APP_TAG, "Ignoring ping");
             LOG_V(APP_TAG, "END - commandResponder");
-            free(phevMsg.data);
             return NULL;
         }
-        if(phevMsg.command == 0x4e || phevMsg.command == 0x5e)
+        if(desc->ackPolicy == PHEV_CORE_ACK_PLAIN)
         {
-            LOG_D(APP_TAG, "%02X Command does not get encrypted response",phevMsg.command);
-            LOG_BUFFER_HEXDUMP(APP_TAG,phevMsg.data,phevMsg.length,LOG_DEBUG);
-            phevMessage_t *msg = phev_core_responseHandler(&phevMsg);
-            LOG_D(APP_TAG, "Responded with command %02X  type %d", phevMsg.command,phevMsg.type);
-            out = phev_core_convertToMessage(msg);
+            LOG_D(APP_TAG, "%02X Command does not get encrypted response",frame->command);
+            LOG_BUFFER_HEXDUMP(APP_TAG,frame->data,frame->length,LOG_DEBUG);
+            phev_pipe_sendAck(pipeCtx, frame, 0);
             pipeCtx->encrypt = true;
-            free(phevMsg.data);
-            return out;
+            return NULL;
         }
         if(pipeCtx->registerDevice == true)
         {
             //This is a hack to keep registration working
             LOG_I(APP_TAG,"Not responding to command for registration");
-            free(phevMsg.data);
             return NULL;
         }
 
-        LOG_D(APP_TAG, "Responding to %02X %02X", phevMsg.command, phevMsg.type);
-        if (phevMsg.type == REQUEST_TYPE)
+        LOG_D(APP_TAG, "Responding to %02X %02X", frame->command, frame->type);
+        if (frame->type == REQUEST_TYPE)
         {
-            phevMessage_t *msg = phev_core_responseHandler(&phevMsg);
-            LOG_D(APP_TAG, "Responded with command %02X  type %d", phevMsg.command,phevMsg.type);
-
-            out = phev_core_convertToMessage(msg);
-            free(phevMsg.data);
+            phev_pipe_sendAck(pipeCtx, frame, phev_core_getMessageXOR(message));
         }
     }
-    if (out)
-    {
-        message_t * encoded = phev_core_XOROutboundMessage(out, phev_core_getMessageXOR(message));
-
-        ret = msg_utils_copyMsg(encoded);
-        msg_utils_destroyMsg(encoded);
-        msg_utils_destroyMsg(out);
 
-    }
+    LOG_V(APP_TAG, "END - commandResponder");
 
-#ifndef NO_CMD_RESP
-    return ret;
-#else
     return NULL;
-#endif
 }
 
-phevPipeEvent_t *phev_pipe_createVINEvent(uint8_t *data)
+static void phev_pipe_initEvent(phevPipeEvent_t *event, phev_pipe_ctx_t *ctx, const int id, void *data, const size_t length)
+{
+    event->event = id;
+    event->data = data;
+    event->length = length;
+    event->ctx = ctx;
+
+    LOG_D(APP_TAG, "Created Event ID %d", event->event);
+}
+void phev_pipe_createVINEvent(phev_pipe_ctx_t *ctx, const uint8_t *data, phevPipeEvent_t *event, phevVinEvent_t *vinEvent)
 {
     LOG_V(APP_TAG, "START - createVINEvent");
-    phevPipeEvent_t *event = malloc(sizeof(phevPipeEvent_t));
     LOG_BUFFER_HEXDUMP(APP_TAG,data,17,LOG_INFO);
 
     if (data[19] < 3)
     {
-        phevVinEvent_t *vinEvent = malloc(sizeof(phevVinEvent_t));
-        event->event = PHEV_PIPE_GOT_VIN,
-        event->data = (uint8_t *)vinEvent;
-        event->length = sizeof(phevVinEvent_t);
+        memset(vinEvent, 0, sizeof(phevVinEvent_t));
         memcpy(vinEvent->vin, data + 1, VIN_LEN);
-        //vinEvent->vin[VIN_LEN + 1] = 0;
         vinEvent->registrations = data[19];
+        phev_pipe_initEvent(event, ctx, PHEV_PIPE_GOT_VIN, vinEvent, sizeof(phevVinEvent_t));
     }
     else
     {
-        event->event = PHEV_PIPE_MAX_REGISTRATIONS,
-        event->data = NULL;
-        event->length = 0;
+        phev_pipe_initEvent(event, ctx, PHEV_PIPE_MAX_REGISTRATIONS, NULL, 0);
     }
 
-    LOG_D(APP_TAG, "Created Event ID %d", event->event);
     LOG_BUFFER_HEXDUMP(APP_TAG, event->data, event->length, LOG_DEBUG);
     LOG_V(APP_TAG, "END - createVINEvent");
-
-    return event;
-}
-
-phevPipeEvent_t *phev_pipe_AAResponseEvent(void)
-{
-    LOG_V(APP_TAG, "START - AAResponseEvent");
-    phevPipeEvent_t *event = malloc(sizeof(phevPipeEvent_t));
-
-    event->event = PHEV_PIPE_CONNECTED,
-    event->data = NULL;
-    event->length = 0;
-    LOG_D(APP_TAG, "Created Event ID %d", event->event);
-
-    LOG_V(APP_TAG, "END - AAResponseEvent");
-
-    return event;
-}
-phevPipeEvent_t *phev_pipe_startResponseEvent(void)
-{
-    LOG_V(APP_TAG, "START - startResponseEvent");
-    phevPipeEvent_t *event = malloc(sizeof(phevPipeEvent_t));
-
-    event->event = PHEV_PIPE_START_ACK,
-    event->data = NULL;
-    event->length = 0;
-    LOG_D(APP_TAG, "Created Event ID %d", event->event);
-
-    LOG_V(APP_TAG, "END - startResponseEvent");
-
-    return event;
-}
-
-phevPipeEvent_t *phev_pipe_registrationEvent(void)
-{
-    LOG_V(APP_TAG, "START - registrationEvent");
-    phevPipeEvent_t *event = malloc(sizeof(phevPipeEvent_t));
-
-    event->event = PHEV_PIPE_REGISTRATION,
-    event->data = NULL;
-    event->length = 0;
-    LOG_D(APP_TAG, "Created Event ID %d", event->event);
-
-    LOG_V(APP_TAG, "END - registrationEvent");
-
-    return event;
-}
-phevPipeEvent_t *phev_pipe_ecuVersion2Event(uint8_t *data)
-{
-    LOG_V(APP_TAG, "START - ecuVersion2Event");
-    phevPipeEvent_t *event = malloc(sizeof(phevPipeEvent_t));
-
-    event->event = PHEV_PIPE_ECU_VERSION2;
-    event->data = malloc(PHEV_PIPE_ECU_VERSION_SIZE);
-    memcpy(event->data, data, PHEV_PIPE_ECU_VERSION_SIZE);
-    event->length = PHEV_PIPE_ECU_VERSION_SIZE;
-    LOG_D(APP_TAG, "Created Event ID %d", event->event);
-
-    LOG_V(APP_TAG, "END - ecuVersion2Event");
-
-    return event;
-}
-phevPipeEvent_t *phev_pipe_remoteSecurityPresentInfoEvent(void)
-{
-    LOG_V(APP_TAG, "START - remoteSecurityPresentInfoEvent");
-    phevPipeEvent_t *event = malloc(sizeof(phevPipeEvent_t));
-
-    event->event = PHEV_PIPE_REMOTE_SECURTY_PRSNT_INFO,
-    event->data = NULL;
-    event->length = 0;
-    LOG_D(APP_TAG, "Created Event ID %d", event->event);
-
-    LOG_V(APP_TAG, "END - remoteSecurityPresentInfoEvent");
-
-    return event;
-}
-phevPipeEvent_t *phev_pipe_regDispEvent(void)
-{
-    LOG_V(APP_TAG, "START - regDispEvent");
-    phevPipeEvent_t *event = malloc(sizeof(phevPipeEvent_t));
-
-    event->event = PHEV_PIPE_REG_DISP,
-    event->data = NULL;
-    event->length = 0;
-    LOG_D(APP_TAG, "Created Event ID %d", event->event);
-
-    LOG_V(APP_TAG, "END - regDispEvent");
-
-    return event;
-}
-phevPipeEvent_t *phev_pipe_dateInfoEvent(uint8_t *data)
-{
-    LOG_V(APP_TAG, "START - dateInfoEvent");
-    phevPipeEvent_t *event = malloc(sizeof(phevPipeEvent_t));
-    event->data = malloc(PHEV_PIPE_DATE_INFO_SIZE);
-    memcpy(event->data, data, PHEV_PIPE_DATE_INFO_SIZE);
-    event->event = PHEV_PIPE_DATE_INFO,
-    event->length = PHEV_PIPE_DATE_INFO_SIZE;
-    LOG_D(APP_TAG, "Created Event ID %d", event->event);
-
-    LOG_V(APP_TAG, "END - dateInfoEvent");
-
-    return event;
-}
-phevPipeEvent_t *phev_pipe_registrationCompleteEvent(phev_pipe_ctx_t * ctx)
-{
-    LOG_V(APP_TAG, "START - registrationCompleteEvent");
-    phevPipeEvent_t *event = malloc(sizeof(phevPipeEvent_t));
-    event->event = PHEV_PIPE_REGISTRATION_COMPLETE;
-    event->data = NULL;
-    LOG_D(APP_TAG, "Created Event ID %d", event->event);
-
-    LOG_V(APP_TAG, "END - registrationCompleteEvent");
-    return event;
 }
 void phev_pipe_sendRegister(phev_pipe_ctx_t * ctx)
 {
@@ -504,50 +589,25 @@ void phev_pipe_sendRegister(phev_pipe_ctx_t * ctx)
     LOG_V(APP_TAG,"END - sendRegister");
 
 }
-phevPipeEvent_t *phev_pipe_createBBEvent(const uint8_t * data)
-{
-    LOG_V(APP_TAG, "START - BBEvent");
-    phevPipeEvent_t *event = malloc(sizeof(phevPipeEvent_t));
-    event->data = malloc(1);
-    memcpy(event->data, data, 1);
-    event->event = PHEV_PIPE_BB,
-    event->length = 1;
-    LOG_D(APP_TAG, "Created Event ID %d", event->event);
-
-    LOG_V(APP_TAG, "END - BBEvent");
-
-    return event;
-}
-phevPipeEvent_t *phev_pipe_createPingEvent(const uint8_t reg)
-{
-    LOG_V(APP_TAG, "START - Ping Event");
-    phevPipeEvent_t *event = malloc(sizeof(phevPipeEvent_t));
-    event->data = malloc(1);
-    memcpy(event->data, &reg, 1);
-    event->event = PHEV_PIPE_PING_RESP;
-    event->length = 1;
-    LOG_D(APP_TAG, "Created Event ID %d", event->event);
-
-    LOG_V(APP_TAG, "END - Ping Event");
-
-    return event;
-
-}
-phevPipeEvent_t *phev_pipe_messageToEvent(phev_pipe_ctx_t *ctx, phevMessage_t *phevMessage)
+bool phev_pipe_messageToEvent(phev_pipe_ctx_t *ctx, phevMessage_t *phevMessage, phevPipeEvent_t *event, phevVinEvent_t *vinEvent)
 {
     LOG_V(APP_TAG, "START - messageToEvent");
     LOG_D(APP_TAG, "Message to Event Reg %d Len %d Type %d", phevMessage->reg, phevMessage->length, phevMessage->type);
-    phevPipeEvent_t *event = NULL;
 
-    if(phevMessage->command == 0xbb || phevMessage->command == 0xcc)
+    const phevCommandDescriptor_t *desc = phev_core_commandDescriptor(phevMessage->command);
+    const bool response = (phevMessage->command == RESP_CMD || phevMessage->command == RESP_CMD_MY18);
+
+    event->event = -1;
+
+    if(desc->commandClass == PHEV_CORE_CLASS_KEY)
     {
-        event = phev_pipe_createBBEvent(phevMessage->data);
-        return event;
+        phev_pipe_initEvent(event, ctx, PHEV_PIPE_BB, phevMessage->data, 1);
+        return true;
     }
-    if (phevMessage->command == PING_RESP_CMD || phevMessage->command == PING_RESP_CMD_MY18)
+    if (desc->commandClass == PHEV_CORE_CLASS_PING && (desc->flags & PHEV_CORE_CMD_FROM_CAR))
     {
-        event = phev_pipe_createPingEvent(phevMessage->reg);
-        return event;
+        phev_pipe_initEvent(event, ctx, PHEV_PIPE_PING_RESP, &phevMessage->reg, 1);
+        return true;
     }
 
     switch (phevMessage->reg)
@@ -557,17 +617,17 @@ phevPipeEvent_t *phev_pipe_messageToEvent(phev_pipe_ctx_t *ctx, phevMessage_t *p
         LOG_D(APP_TAG, "KO_WF_VIN_INFO_EVR");
         if (phevMessage->type == REQUEST_TYPE)
         {
-            event = phev_pipe_createVINEvent(phevMessage->data);
+            phev_pipe_createVINEvent(ctx, phevMessage->data, event, vinEvent);
         }
         break;
     }
     case KO_WF_REG_DISP_SP:
     {
         LOG_D(APP_TAG, "KO_WF_REG_DISP_SP");
-        if (phevMessage->type == RESPONSE_TYPE && (phevMessage->command == RESP_CMD || phevMessage->command == RESP_CMD_MY18))
+        if (phevMessage->type == RESPONSE_TYPE && response)
         {
             LOG_I(APP_TAG,"Registration Acknowledged");
-            event = phev_pipe_registrationCompleteEvent(ctx);
+            phev_pipe_initEvent(event, ctx, PHEV_PIPE_REGISTRATION_COMPLETE, NULL, 0);
             LOG_I(APP_TAG,"REGISTERED");
         }
 
@@ -578,57 +638,57 @@ phevPipeEvent_t *phev_pipe_messageToEvent(phev_pipe_ctx_t *ctx, phevMessage_t *p
         if (phevMessage->type == RESPONSE_TYPE && (phevMessage->command == START_RESP || phevMessage->command == START_RESP_MY18))
         {
             LOG_D(APP_TAG, "KO_WF_CONNECT_INFO_GS_SP");
-            event = phev_pipe_startResponseEvent();
+            phev_pipe_initEvent(event, ctx, PHEV_PIPE_START_ACK, NULL, 0);
         }
         break;
     }
     case KO_WF_START_AA_EVR:
     {
-        if (phevMessage->type == RESPONSE_TYPE && (phevMessage->command == RESP_CMD || phevMessage->command == RESP_CMD_MY18))
+        if (phevMessage->type == RESPONSE_TYPE && response)
         {
             LOG_D(APP_TAG, "KO_WF_START_AA_EVR");
-            event = phev_pipe_AAResponseEvent();
+            phev_pipe_initEvent(event, ctx, PHEV_PIPE_CONNECTED, NULL, 0);
         }
         break;
     }
     case KO_WF_REGISTRATION_EVR:
     {
-        if (phevMessage->type == REQUEST_TYPE && (phevMessage->command == RESP_CMD || phevMessage->command == RESP_CMD_MY18))
+        if (phevMessage->type == REQUEST_TYPE && response)
         {
             LOG_D(APP_TAG,"KO_WF_REGISTRATION_EVR");
-            event = phev_pipe_registrationEvent();
+            phev_pipe_initEvent(event, ctx, PHEV_PIPE_REGISTRATION, NULL, 0);
         }
         break;
     }
     case KO_WF_ECU_VERSION2_EVR:
     {
-        if (phevMessage->type == REQUEST_TYPE && (phevMessage->command == RESP_CMD || phevMessage->command == RESP_CMD_MY18))
+        if (phevMessage->type == REQUEST_TYPE && response)
         {
             LOG_D(APP_TAG,"KO_WF_ECU_VERSION2_EVR");
-            event = phev_pipe_ecuVersion2Event(phevMessage->data);
+            phev_pipe_initEvent(event, ctx, PHEV_PIPE_ECU_VERSION2, phevMessage->data, PHEV_PIPE_ECU_VERSION_SIZE);
         }
         break;
     }
     case KO_WF_REMOTE_SECURTY_PRSNT_INFO:
     {
 
-        if (phevMessage->type == REQUEST_TYPE && (phevMessage->command == RESP_CMD || phevMessage->command == RESP_CMD_MY18))
+        if (phevMessage->type == REQUEST_TYPE && response)
         {
-            event = phev_pipe_remoteSecurityPresentInfoEvent();
+            phev_pipe_initEvent(event, ctx, PHEV_PIPE_REMOTE_SECURTY_PRSNT_INFO, NULL, 0);
         }
         break;
     }
     case KO_WF_DATE_INFO_SYNC_EVR:
     {
-        if (phevMessage->type == REQUEST_TYPE && (phevMessage->command == RESP_CMD || phevMessage->command == RESP_CMD_MY18))
+        if (phevMessage->type == REQUEST_TYPE && response)
         {
-            event = phev_pipe_dateInfoEvent(phevMessage->data);
+            phev_pipe_initEvent(event, ctx, PHEV_PIPE_DATE_INFO, phevMessage->data, PHEV_PIPE_DATE_INFO_SIZE);
         }
         break;
     }
     case KO_WF_BATT_LEVEL_INFO_REP_EVR:
     {
-        if(phevMessage->type == REQUEST_TYPE && (phevMessage->command == RESP_CMD || phevMessage->command == RESP_CMD_MY18))
+        if(phevMessage->type == REQUEST_TYPE && response)
         {
             LOG_D(APP_TAG,"Battery level %d", phevMessage->data[0]);
         }
@@ -641,30 +701,36 @@ phevPipeEvent_t *phev_pipe_messageToEvent(phev_pipe_ctx_t *ctx, phevMessage_t *p
     }
 
     LOG_V(APP_TAG, "END - messageToEvent");
-    return event;
+    return event->event != -1;
 }
 void phev_pipe_sendEventToHandlers(phev_pipe_ctx_t *ctx, phevPipeEvent_t *event)
 {
     LOG_V(APP_TAG, "START - sendEventToHandlers");
 
-    if (event != NULL)
+    if (event != NULL && event->event >= 0 && event->event < PHEV_PIPE_EVENT_COUNT)
     {
-        LOG_D(APP_TAG, "Sending event ID %d", event->event);
-        if (ctx->eventHandlers > 0)
+        phev_pipe_eventRegistry_t *events = &ctx->events;
+        const size_t end = events->start[event->event + 1];
+
+        LOG_D(APP_TAG, "Sending event ID %d to %d handlers", event->event, end - events->start[event->event]);
+
+        events->dispatching++;
+
+        for (size_t i = events->start[event->event]; i < end; i++)
         {
-            LOG_D(APP_TAG, "Event handers %d", ctx->eventHandlers);
-            for (int i = 0; i < ctx->eventHandlers; i++)
-            {
-                LOG_D(APP_TAG, "Event handler num %d", i);
+            phev_pipe_eventSubscriber_t *subscriber = &events->subscribers[events->index[i]];
 
-                if (ctx->eventHandler[i] != NULL)
-                {
-                    LOG_D(APP_TAG, "Calling event handler %d pointer %p", i, ctx->eventHandler[i]);
-                    ctx->eventHandler[i](ctx, event);
-                }
+            if (subscriber->handler != NULL)
+            {
+                event->userCtx = subscriber->userCtx;
+                subscriber->handler(ctx, event);
             }
         }
-        phev_pipe_destroyEvent(event);
+
+        if (--events->dispatching == 0 && events->dirty)
+        {
+            phev_pipe_rebuildEventIndex(events);
+        }
     }
     else
     {
@@ -672,27 +738,42 @@ void phev_pipe_sendEventToHandlers(phev_pipe_ctx_t *ctx, phevPipeEvent_t *event)
     }
     LOG_V(APP_TAG, "END - sendEventToHandlers");
 }
-phevPipeEvent_t *phev_pipe_createRegisterEvent(phev_pipe_ctx_t *phevCtx, phevMessage_t *phevMessage)
+bool phev_pipe_createRegisterEvent(phev_pipe_ctx_t *phevCtx, phevMessage_t *phevMessage, phevPipeEvent_t *event)
 {
-    phevPipeEvent_t *event = NULL;
-
     if (phevMessage->command == RESP_CMD || phevMessage->command == RESP_CMD_MY18)
     {
-        event = malloc(sizeof(phevPipeEvent_t));
-        event->data = (void *)phev_core_copyMessage(phevMessage);
-        event->length = sizeof(phevMessage_t);
-        event->ctx = phevCtx;
-        if (phevMessage->type == RESPONSE_TYPE)
-        {
-            event->event = PHEV_PIPE_REG_UPDATE_ACK;
-        }
-        else
-        {
-            event->event = PHEV_PIPE_REG_UPDATE;
-        }
+        phev_pipe_initEvent(event, phevCtx, (phevMessage->type == RESPONSE_TYPE ? PHEV_PIPE_REG_UPDATE_ACK : PHEV_PIPE_REG_UPDATE), phevMessage, sizeof(phevMessage_t));
+        return true;
+    }
+
+    return false;
+}
+phevPipeEvent_t *phev_pipe_copyEvent(const phevPipeEvent_t *event)
+{
+    if (event == NULL)
+    {
+        return NULL;
+    }
+
+    phevPipeEvent_t *copy = malloc(sizeof(phevPipeEvent_t));
+
+    *copy = *event;
+
+    if (event->data == NULL)
+    {
+        copy->length = 0;
+    }
+    else if (event->event == PHEV_PIPE_REG_UPDATE || event->event == PHEV_PIPE_REG_UPDATE_ACK)
+    {
+        copy->data = phev_core_copyMessage((phevMessage_t *) event->data);
+    }
+    else
+    {
+        copy->data = malloc(event->length);
+        memcpy(copy->data, event->data, event->length);
     }
 
-    return event;
+    return copy;
 }
 void phev_pipe_sendEvent(void *ctx, phevMessage_t *phevMessage)
 {
@@ -705,20 +786,23 @@ void phev_pipe_sendEvent(void *ctx, phevMessage_t *phevMessage)
         LOG_W(APP_TAG, "Context not passed");
         return;
     }
-     LOG_D(APP_TAG, "Number of event handlers %d",phevCtx->eventHandlers);
-    if (phevCtx->eventHandlers > 0)
+     LOG_D(APP_TAG, "Number of event handlers %d",phevCtx->events.count);
+    if (phevCtx->events.count > 0)
     {
+        phevPipeEvent_t event;
+        phevVinEvent_t vinEvent;
 
-        phevPipeEvent_t *registerEvent = phev_pipe_createRegisterEvent(phevCtx, phevMessage);
-
-        LOG_D(APP_TAG, "Sending register event to handler");
-        phev_pipe_sendEventToHandlers(phevCtx, registerEvent);
-
-        phevPipeEvent_t *evt = phev_pipe_messageToEvent(phevCtx, phevMessage);
-        LOG_D(APP_TAG, "Sending message event to handler");
-
-        phev_pipe_sendEventToHandlers(phevCtx, evt);
+        if (phev_pipe_createRegisterEvent(phevCtx, phevMessage, &event))
+        {
+            LOG_D(APP_TAG, "Sending register event to handler");
+            phev_pipe_sendEventToHandlers(phevCtx, &event);
+        }
 
+        if (phev_pipe_messageToEvent(phevCtx, phevMessage, &event, &vinEvent))
+        {
+            LOG_D(APP_TAG, "Sending message event to handler");
+            phev_pipe_sendEventToHandlers(phevCtx, &event);
+        }
     }
 
     LOG_V(APP_TAG, "END - sendEvent");
@@ -727,11 +811,9 @@ message_t *phev_pipe_outputEventTransformer(void *ctx, message_t *message)
 {
     LOG_V(APP_TAG, "START - outputEventTransformer");
 
-    phevMessage_t *phevMessage = malloc(sizeof(phevMessage_t));
+    const phevFrame_t *frame = phev_core_messageFrame(message);
 
-    int length = phev_core_decodeMessage(message->data, message->length, phevMessage);
-
-    if (length == 0)
+    if (frame == NULL)
     {
         LOG_E(APP_TAG, "Invalid message received - something serious happened here as we should only have a valid message at this point");
         LOG_BUFFER_HEXDUMP(APP_TAG, message->data, message->length, LOG_DEBUG);
@@ -739,60 +821,177 @@ message_t *phev_pipe_outputEventTransformer(void *ctx, message_t *message)
         return NULL;
     }
 
-    phev_pipe_sendEvent(ctx, phevMessage);
+    phevMessage_t phevMessage;
 
-//    message_t *ret = phev_core_convertToMessage(phevMessage);
+    phev_core_frameMessage(frame, &phevMessage);
 
-    phev_core_destroyMessage(phevMessage);
+    phev_pipe_sendEvent(ctx, &phevMessage);
 
 //    LOG_V(APP_TAG, "END - outputEventTransformer");
 
-    return NULL; //ret;
+    return NULL;
 }
 
-void phev_pipe_registerEventHandler(phev_pipe_ctx_t *ctx, phevPipeEventHandler_t eventHandler)
+message_t *phev_pipe_fusedInboundTransformer(void *ctx, message_t *message)
+{
+    LOG_V(APP_TAG, "START - fusedInboundTransformer");
+
+    phev_pipe_ctx_t *pipeCtx = (phev_pipe_ctx_t *)ctx;
+    msg_pipe_chain_t *stages = &pipeCtx->inboundStages;
+
+    message_t *current = (stages->inputTransformer ? stages->inputTransformer(ctx, message) : message);
+
+    if (current == NULL)
+    {
+        LOG_V(APP_TAG, "END - fusedInboundTransformer");
+        return NULL;
+    }
+    if (stages->filter && !stages->filter(ctx, current))
+    {
+        LOG_V(APP_TAG, "END - fusedInboundTransformer");
+        return NULL;
+    }
+    if (stages->responder)
+    {
+        message_t *response = stages->responder(ctx, current);
+
+        if (response != NULL)
+        {
+            phev_pipe_queueBytes(pipeCtx, PHEV_PIPE_LANE_ACK, response->data, response->length);
+            phev_pipe_outboundCommit(pipeCtx);
+            msg_utils_destroyMsg(response);
+        }
+    }
+
+    LOG_V(APP_TAG, "END - fusedInboundTransformer");
+
+    return (stages->outputTransformer ? stages->outputTransformer(ctx, current) : current);
+}
+
+static void phev_pipe_rebuildEventIndex(phev_pipe_eventRegistry_t *events)
+{
+    size_t live = 0;
+
+    for (size_t i = 0; i < events->count; i++)
+    {
+        if (events->subscribers[i].handler != NULL)
+        {
+            events->subscribers[live++] = events->subscribers[i];
+        }
+    }
+    events->count = live;
+
+    free(events->index);
+    events->index = (live > 0 ? malloc(sizeof(size_t) * live * PHEV_PIPE_EVENT_COUNT) : NULL);
+
+    size_t next = 0;
+
+    for (int event = 0; event < PHEV_PIPE_EVENT_COUNT; event++)
+    {
+        events->start[event] = next;
+
+        for (size_t i = 0; i < live; i++)
+        {
+            if (events->subscribers[i].mask & PHEV_PIPE_EVENT_MASK(event))
+            {
+                events->index[next++] = i;
+            }
+        }
+    }
+    events->start[PHEV_PIPE_EVENT_COUNT] = next;
+    events->dirty = false;
+}
+static void phev_pipe_eventsChanged(phev_pipe_eventRegistry_t *events)
 {
-    LOG_V(APP_TAG, "START - registerEventHandler");
+    events->dirty = true;
 
-    if (ctx->eventHandlers < PHEV_PIPE_MAX_EVENT_HANDLERS)
+    if (events->dispatching == 0)
     {
-        for (int i = 0; i < PHEV_PIPE_MAX_EVENT_HANDLERS; i++)
+        phev_pipe_rebuildEventIndex(events);
+    }
+}
+void phev_pipe_subscribeEvents(phev_pipe_ctx_t *ctx, phevPipeEventHandler_t handler, const uint32_t mask, void *userCtx)
+{
+    LOG_V(APP_TAG, "START - subscribeEvents");
+
+    phev_pipe_eventRegistry_t *events = &ctx->events;
+
+    if (handler == NULL)
+    {
+        LOG_E(APP_TAG, "Cannot register NULL handler");
+        return;
+    }
+
+    for (size_t i = 0; i < events->count; i++)
+    {
+        if (events->subscribers[i].handler == handler && events->subscribers[i].userCtx == userCtx)
         {
-            if (ctx->eventHandler[i] == NULL)
+            if ((events->subscribers[i].mask | mask) != events->subscribers[i].mask)
             {
-                LOG_D(APP_TAG, "Registered handler %p", eventHandler);
-                ctx->eventHandler[ctx->eventHandlers++] = eventHandler;
-                return;
+                events->subscribers[i].mask |= mask;
+                phev_pipe_eventsChanged(events);
             }
+            LOG_V(APP_TAG, "END - subscribeEvents");
+            return;
         }
-        LOG_E(APP_TAG, "Cannot register handler no free slots found");
     }
-    else
+
+    if (events->count == events->capacity)
     {
-        LOG_E(APP_TAG, "Cannot register handler max handlers %d reached", PHEV_PIPE_MAX_EVENT_HANDLERS);
+        size_t capacity = (events->capacity ? events->capacity * 2 : PHEV_PIPE_INITIAL_EVENT_HANDLERS);
+        phev_pipe_eventSubscriber_t *subscribers = realloc(events->subscribers, sizeof(phev_pipe_eventSubscriber_t) * capacity);
+
+        if (subscribers == NULL)
+        {
+            LOG_E(APP_TAG, "Cannot grow event handlers to %d", capacity);
+            return;
+        }
+        events->subscribers = subscribers;
+        events->capacity = capacity;
     }
-    LOG_V(APP_TAG, "END - registerEventHandler");
+
+    LOG_D(APP_TAG, "Registered handler %p mask %08X", handler, mask);
+
+    events->subscribers[events->count].handler = handler;
+    events->subscribers[events->count].mask = mask;
+    events->subscribers[events->count].userCtx = userCtx;
+    events->count++;
+
+    phev_pipe_eventsChanged(events);
+
+    LOG_V(APP_TAG, "END - subscribeEvents");
+}
+void phev_pipe_registerEventHandler(phev_pipe_ctx_t *ctx, phevPipeEventHandler_t eventHandler)
+{
+    phev_pipe_subscribeEvents(ctx, eventHandler, PHEV_PIPE_ALL_EVENTS, NULL);
 }
 void phev_pipe_deregisterEventHandler(phev_pipe_ctx_t *ctx, phevPipeEventHandler_t eventHandler)
 {
     LOG_V(APP_TAG, "START - deregisterEventHandler");
 
-    for (int i = 0; i < PHEV_PIPE_MAX_EVENT_HANDLERS; i++)
+    bool found = false;
+
+    for (size_t i = 0; i < ctx->events.count; i++)
     {
-        if (ctx->eventHandler[i] == eventHandler)
+        if (ctx->events.subscribers[i].handler == eventHandler)
         {
             LOG_D(APP_TAG, "Deregistered handler");
-            ctx->eventHandler[i--] = NULL;
-            return;
+            ctx->events.subscribers[i].handler = NULL;
+            found = true;
         }
     }
 
+    if (found)
+    {
+        phev_pipe_eventsChanged(&ctx->events);
+    }
+
     LOG_V(APP_TAG, "END - deregisterEventHandler");
 }
 
 void phev_pipe_checkXORChanged(phev_pipe_ctx_t * ctx, message_t * message)
 {
-    if(message->ctx != NULL)
+    if(phev_core_messageEncoded(message))
     {
         uint8_t xor =phev_core_getMessageXOR(message);
 
@@ -803,6 +1002,136 @@ void phev_pipe_checkXORChanged(phev_pipe_ctx_t * ctx, message_t * message)
         }
     }
 }
+static void phev_pipe_dispatchBundle(phev_pipe_ctx_t *ctx, messageBundle_t *messages)
+{
+    LOG_V(APP_TAG, "START - dispatchBundle");
+
+    msg_pipe_chain_t *chain = ctx->pipe->out_chain;
+    messageBundle_t *outputs = malloc(sizeof(messageBundle_t));
+
+    outputs->numMessages = 0;
+
+    for (int i = 0; i < messages->numMessages; i++)
+    {
+        message_t *message = messages->messages[i];
+        message_t *transformed = (chain->inputTransformer ? chain->inputTransformer(ctx, message) : message);
+
+        if (transformed != NULL && (chain->filter == NULL || chain->filter(ctx, transformed)))
+        {
+            if (chain->responder)
+            {
+                message_t *response = chain->responder(ctx, transformed);
+                if (response != NULL)
+                {
+                    phev_pipe_queueBytes(ctx, PHEV_PIPE_LANE_ACK, response->data, response->length);
+                    phev_pipe_outboundCommit(ctx);
+                    msg_utils_destroyMsg(response);
+                }
+            }
+
+            message_t *output = (chain->outputTransformer ? chain->outputTransformer(ctx, transformed) : msg_utils_copyMsg(transformed));
+
+            if (output != NULL)
+            {
+                outputs->messages[outputs->numMessages++] = output;
+            }
+        }
+
+        if (transformed != NULL && transformed != message)
+        {
+            msg_utils_destroyMsg(transformed);
+        }
+        msg_utils_destroyMsg(message);
+    }
+
+    if (chain->aggregator && outputs->numMessages > 0)
+    {
+        message_t *aggregated = chain->aggregator(ctx, outputs);
+
+        if (aggregated != NULL)
+        {
+            msg_pipe_inboundPublish(ctx->pipe, aggregated);
+            msg_utils_destroyMsg(aggregated);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < outputs->numMessages; i++)
+        {
+            msg_pipe_inboundPublish(ctx->pipe, outputs->messages[i]);
+        }
+    }
+
+    for (int i = 0; i < outputs->numMessages; i++)
+    {
+        msg_utils_destroyMsg(outputs->messages[i]);
+    }
+    free(outputs);
+
+    messages->numMessages = 0;
+
+    LOG_V(APP_TAG, "END - dispatchBundle");
+}
+static void phev_pipe_bundleMessage(phev_pipe_ctx_t *ctx, messageBundle_t **messages, message_t *message)
+{
+    const int capacity = (int) (sizeof((*messages)->messages) / sizeof((*messages)->messages[0]));
+
+    if (*messages == NULL)
+    {
+        *messages = malloc(sizeof(messageBundle_t));
+        (*messages)->numMessages = 0;
+    }
+
+    if ((*messages)->numMessages == capacity)
+    {
+        LOG_D(APP_TAG, "Bundle full, dispatching %d messages inline", capacity);
+        phev_pipe_dispatchBundle(ctx, *messages);
+    }
+
+    (*messages)->messages[(*messages)->numMessages++] = message;
+}
+static size_t phev_pipe_extractFrames(phev_pipe_ctx_t *ctx, const uint8_t *data, const size_t len, messageBundle_t **messages)
+{
+    size_t offset = 0;
+    size_t skipped = 0;
+
+    while (offset < len)
+    {
+        uint8_t xor = 0;
+        size_t length = 0;
+
+        const int status = phev_core_scanIncomingFrame(data + offset, len - offset, &ctx->inboundXORHint, &xor, &length);
+
+        if (status == PHEV_CORE_SCAN_INCOMPLETE)
+        {
+            break;
+        }
+        if (status == PHEV_CORE_SCAN_INVALID)
+        {
+            skipped++;
+            offset++;
+            continue;
+        }
+
+        message_t *out = phev_core_createMsgFrame(data + offset, length, xor, ctx->inboundXORHint != PHEV_CORE_XOR_HINT_PLAIN);
+
+        LOG_D(APP_TAG, "Extract message output");
+        LOG_BUFFER_HEXDUMP(APP_TAG, out->data, out->length, LOG_DEBUG);
+
+        phev_pipe_checkXORChanged(ctx, out);
+        phev_pipe_bundleMessage(ctx, messages, out);
+
+        offset += length;
+    }
+
+    if (skipped > 0)
+    {
+        LOG_W(APP_TAG, "Resynchronised after discarding %d bytes", (int) skipped);
+        ctx->inbound.discarded += skipped;
+    }
+
+    return offset;
+}
 messageBundle_t *phev_pipe_outputSplitter(void *ctx, message_t *message)
 {
     LOG_V(APP_TAG, "START - outputSplitter");
@@ -822,40 +1151,46 @@ messageBundle_t *phev_pipe_outputSplitter(void *ctx, message_t *message)
     }
     LOG_BUFFER_HEXDUMP(APP_TAG, message->data, message->length, LOG_DEBUG);
 
-    message_t * out = phev_core_extractIncomingMessageAndXOR(message->data);
+    phev_pipe_inbound_t *inbound = &pipeCtx->inbound;
+    messageBundle_t *messages = NULL;
+    size_t offset = 0;
 
-    if (out == NULL)
+    while (inbound->length > 0 && offset < message->length)
     {
-        LOG_E(APP_TAG,"Could not extract message");
-        return NULL;
-    }
-    LOG_D(APP_TAG,"Extract message output");
-    LOG_BUFFER_HEXDUMP(APP_TAG, out->data, out->length, LOG_DEBUG);
+        size_t take = message->length - offset;
 
-    phev_pipe_checkXORChanged(pipeCtx, out);
+        if (take > sizeof(inbound->buffer) - inbound->length)
+        {
+            take = sizeof(inbound->buffer) - inbound->length;
+        }
+        memcpy(inbound->buffer + inbound->length, message->data + offset, take);
+        inbound->length += take;
+        offset += take;
 
-    messageBundle_t *messages = malloc(sizeof(messageBundle_t));
+        const size_t consumed = phev_pipe_extractFrames(pipeCtx, inbound->buffer, inbound->length, &messages);
 
-    messages->numMessages = 0;
-    messages->messages[messages->numMessages++] = msg_utils_copyMsg(out);
+        memmove(inbound->buffer, inbound->buffer + consumed, inbound->length - consumed);
+        inbound->length -= consumed;
+    }
 
-    int total = out->length;
+    if (offset < message->length)
+    {
+        offset += phev_pipe_extractFrames(pipeCtx, message->data + offset, message->length - offset, &messages);
 
-    msg_utils_destroyMsg(out);
+        memcpy(inbound->buffer, message->data + offset, message->length - offset);
+        inbound->length = message->length - offset;
+    }
 
-    while (message->length > total)
+    if (inbound->length > 0)
     {
-        out = phev_core_extractIncomingMessageAndXOR(message->data + total);
-        if (out == NULL) {
-            break;
-        }
+        LOG_D(APP_TAG, "Holding %d bytes of partial frame", (int) inbound->length);
+    }
 
-        LOG_D(APP_TAG,"Extract message output");
-        LOG_BUFFER_HEXDUMP(APP_TAG, out->data, out->length, LOG_DEBUG);
-        phev_pipe_checkXORChanged(pipeCtx,out);
-        total += out->length;
-        messages->messages[messages->numMessages++] = msg_utils_copyMsg(out);
-        msg_utils_destroyMsg(out);
+    if (messages == NULL || messages->numMessages == 0)
+    {
+        free(messages);
+        LOG_V(APP_TAG, "END - outputSplitter");
+        return NULL;
     }
 
     //msg_utils_destroyMsg(message); // Cannot destroy until tests are fixed
@@ -884,11 +1219,9 @@ void phev_pipe_sendTimeSync(phev_pipe_ctx_t *ctx)
         1};
     LOG_D(APP_TAG, "Year %d Month %d Date %d Hour %d Min %d Sec %d\n", pingTime[0], pingTime[1], pingTime[2], pingTime[3], pingTime[4], pingTime[5]);
 
-    phevMessage_t *dateCmd = phev_core_commandMessage(KO_WF_DATE_INFO_SYNC_SP, pingTime, sizeof(pingTime));
-    message_t *message = phev_core_convertToMessage(dateCmd);
-
 #ifndef NO_TIME_SYNC
-    phev_pipe_commandOutboundPublish(ctx, message);
+    phev_pipe_queueFrame(ctx, PHEV_PIPE_LANE_TIMESYNC, SEND_CMD, REQUEST_TYPE, KO_WF_DATE_INFO_SYNC_SP, pingTime, sizeof(pingTime), ctx->commandXOR);
+    phev_pipe_outboundCommit(ctx);
 #endif
 
     LOG_V(APP_TAG, "END - sendTimeSync");
@@ -902,26 +1235,18 @@ void phev_pipe_ping(phev_pipe_ctx_t *ctx)
         LOG_I(APP_TAG,"Not sending ping after start message recieved if not got XOR");
         return;
     }
-    if (((ctx->currentPing) % 30) == 0)
-    {
-        if(!ctx->registerDevice)
-        {
-            phev_pipe_sendTimeSync(ctx);
-        }
-        else
-        {
-            LOG_D(APP_TAG,"Not sending time sync in register device mode");
-        }
-    }
-    phevMessage_t *ping = phev_core_pingMessage(ctx->currentPing++);
+    const uint8_t ping = ctx->currentPing++;
     ctx->currentPing %= 0x30;
     LOG_D(APP_TAG,"Client Ping %d\n",ctx->currentPing);
-    message_t *message = phev_core_convertToMessage(ping);
 
 #ifndef NO_PING
     if(!ctx->registerDevice)
     {
-        phev_pipe_pingOutboundPublish(ctx, message);
+        phev_pipe_queueTemplate(ctx, PHEV_PIPE_LANE_PING, PHEV_CORE_TEMPLATE_PING, ping, ctx->pingXOR);
+        phev_pipe_outboundCommit(ctx);
+        ctx->keepalive.lastSentPing = ping;
+        ctx->keepalive.pingSent = true;
+        ctx->keepalive.sent++;
     }
     else
     {
@@ -929,8 +1254,6 @@ void phev_pipe_ping(phev_pipe_ctx_t *ctx)
     }
 
 #endif
-    //msg_utils_destroyMsg(message);
-    //phev_core_destroyMessage(ping);
     LOG_V(APP_TAG, "END - ping");
 }
 void phev_pipe_updateComplexRegister(phev_pipe_ctx_t *ctx, const uint8_t reg, const uint8_t * data, const size_t length)
@@ -946,80 +1269,170 @@ void phev_pipe_updateRegisterNoRetry(phev_pipe_ctx_t *ctx, const uint8_t reg, co
 {
     LOG_V(APP_TAG, "START - updateRegister");
 
-    phevMessage_t *update = NULL;
-
     if(data == NULL)
     {
         LOG_W(APP_TAG,"Cannot send data with no data");
         return;
     }
 
-    if(length == 1)
+    const int id = (length == 1 ? phev_core_registerTemplate(reg, data[0]) : PHEV_CORE_TEMPLATE_NONE);
+
+    if (id != PHEV_CORE_TEMPLATE_NONE)
     {
-        update = phev_core_simpleRequestCommandMessage(reg, data[0]);
+        phev_pipe_sendTemplate(ctx, id, reg, ctx->commandXOR);
     }
     else
     {
-        update = phev_core_commandMessage(reg,data,length);
+        phev_pipe_sendFrame(ctx, SEND_CMD, REQUEST_TYPE, reg, data, length, ctx->commandXOR);
     }
 
-    message_t *message = phev_core_convertToMessage(update);
+    LOG_V(APP_TAG, "END - updateRegister");
+}
 
-    phev_pipe_commandOutboundPublish(ctx, message);
+uint64_t phev_pipe_nowMs(void)
+{
+    struct timespec ts;
 
-    LOG_V(APP_TAG, "END - updateRegister");
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+phev_pipe_command_t *phev_pipe_pendingCommand(phev_pipe_ctx_t *ctx, const uint8_t reg)
+{
+    const int16_t slot = ctx->commands.slot[reg];
+
+    return (slot < 0 ? NULL : &ctx->commands.commands[slot]);
 }
+uint64_t phev_pipe_nextCommandDeadline(phev_pipe_ctx_t *ctx)
+{
+    uint64_t next = UINT64_MAX;
 
+    for(size_t i = 0; i < ctx->commands.count; i++)
+    {
+        if(ctx->commands.commands[i].deadline < next)
+        {
+            next = ctx->commands.commands[i].deadline;
+        }
+    }
+
+    return next;
+}
+void phev_pipe_setMaxInflightCommands(phev_pipe_ctx_t *ctx, const size_t maxCommands)
+{
+    ctx->commands.maxCommands = maxCommands;
+}
+static void phev_pipe_transmitCommand(phev_pipe_ctx_t *ctx, phev_pipe_command_t *command, const uint64_t now)
+{
+    command->attempts++;
+    command->lastSent = now;
+    command->deadline = now + command->timeout;
+
+    phev_pipe_updateRegisterNoRetry(ctx, command->reg, command->data, command->length);
+}
+// Removes the command from the tracker and hands back the callback the caller
+// asked for, so it can be invoked after the tracker is consistent again.
+static void phev_pipe_detachCommand(phev_pipe_ctx_t *ctx, const uint8_t reg, const bool completed, phev_pipe_updateRegisterCallback_t *callback, void **customCtx)
+{
+    phev_pipe_commandTracker_t *tracker = &ctx->commands;
+    const int16_t slot = tracker->slot[reg];
+
+    *callback = NULL;
+    *customCtx = NULL;
+
+    if(slot < 0)
+    {
+        return;
+    }
+
+    phev_pipe_command_t *command = &tracker->commands[slot];
+
+    *callback = (completed ? command->callback : command->failed);
+    *customCtx = command->customCtx;
+
+    free(command->data);
+
+    tracker->count--;
+    if((size_t) slot != tracker->count)
+    {
+        tracker->commands[slot] = tracker->commands[tracker->count];
+        tracker->slot[tracker->commands[slot].reg] = slot;
+    }
+    tracker->slot[reg] = -1;
+}
+static void phev_pipe_retireCommand(phev_pipe_ctx_t *ctx, const uint8_t reg, const bool completed)
+{
+    phev_pipe_updateRegisterCallback_t callback;
+    void *customCtx;
+
+    phev_pipe_detachCommand(ctx, reg, completed, &callback, &customCtx);
+
+    if(callback != NULL)
+    {
+        callback(ctx, reg, customCtx);
+    }
+}
+void phev_pipe_serviceCommands(phev_pipe_ctx_t *ctx, const uint64_t now)
+{
+    phev_pipe_commandTracker_t *tracker = &ctx->commands;
+    size_t i = 0;
+
+    while(i < tracker->count)
+    {
+        phev_pipe_command_t *command = &tracker->commands[i];
+
+        if(now < command->deadline)
+        {
+            i++;
+            continue;
+        }
+        if(command->attempts >= PHEV_PIPE_COMMAND_MAX_ATTEMPTS)
+        {
+            LOG_W(APP_TAG,"Register %02X not acknowledged after %d attempts",command->reg,command->attempts);
+            phev_pipe_retireCommand(ctx, command->reg, false);
+            continue;
+        }
+
+        command->timeout = (command->timeout * 2 > PHEV_PIPE_COMMAND_MAX_TIMEOUT_MS ? PHEV_PIPE_COMMAND_MAX_TIMEOUT_MS : command->timeout * 2);
+        LOG_D(APP_TAG,"Resending register %02X attempt %d",command->reg,command->attempts + 1);
+        phev_pipe_transmitCommand(ctx, command, now);
+        i++;
+    }
+}
 int phev_pipe_updateRegisterEventHandler(phev_pipe_ctx_t *ctx, phevPipeEvent_t *event)
 {
     LOG_V(APP_TAG, "START - updateRegisterEventHandler");
 
-
     if(!event)
     {
         return 0;
     }
 
-    LOG_D(APP_TAG, "Register callbacks %d",ctx->updateRegisterCallbacks->numberOfCallbacks);
+    LOG_D(APP_TAG, "Commands in flight %d",ctx->commands.count);
 
-    if(ctx->updateRegisterCallbacks->numberOfCallbacks == 0)
+    if(ctx->commands.count == 0)
     {
         LOG_D(APP_TAG,"No register events");
         return 0;
     }
-    if (event->event == PHEV_PIPE_BB && ctx->updateRegisterCallbacks->numberOfCallbacks > 0)
+    if (event->event == PHEV_PIPE_BB)
     {
-        LOG_D(APP_TAG,"Resending commands");
-        for(int i=0; i< PHEV_PIPE_MAX_UPDATE_CALLBACKS; i++)
+        const uint64_t now = phev_pipe_nowMs();
+
+        LOG_D(APP_TAG,"Resend requested");
+        for(size_t i = 0; i < ctx->commands.count; i++)
         {
-            if(ctx->updateRegisterCallbacks->used[i])
+            phev_pipe_command_t *command = &ctx->commands.commands[i];
+
+            if(now >= command->lastSent + PHEV_PIPE_COMMAND_RESEND_HOLDOFF_MS && command->deadline > now)
             {
-                phev_pipe_updateRegisterNoRetry(ctx, ctx->updateRegisterCallbacks->registers[i], ctx->updateRegisterCallbacks->values[i],ctx->updateRegisterCallbacks->lengths[i]);
+                command->deadline = now;
             }
         }
-
+        phev_pipe_serviceCommands(ctx, now);
     }
     if (event->event == PHEV_PIPE_REG_UPDATE_ACK)
     {
-        for (int i = 0; i < PHEV_PIPE_MAX_UPDATE_CALLBACKS; i++)
-        {
-            if (ctx->updateRegisterCallbacks->used[i] && ctx->updateRegisterCallbacks->registers[i] == ((phevMessage_t *)event->data)->reg)
-            {
-                if(ctx->updateRegisterCallbacks->callbacks[i]!= NULL)
-                {
-                    ctx->updateRegisterCallbacks->callbacks[i](ctx, ctx->updateRegisterCallbacks->registers[i], ctx->updateRegisterCallbacks->ctx[i]);
-                }
-                ctx->updateRegisterCallbacks->callbacks[i] = NULL;
-                ctx->updateRegisterCallbacks->registers[i] = 0;
-                free(ctx->updateRegisterCallbacks->values[i]);
-                ctx->updateRegisterCallbacks->values[i] = NULL;
-                ctx->updateRegisterCallbacks->lengths[i] = 0;
-
-                ctx->updateRegisterCallbacks->used[i] = false;
-
-                ctx->updateRegisterCallbacks->numberOfCallbacks--;
-            }
-        }
+        phev_pipe_retireCommand(ctx, ((phevMessage_t *)event->data)->reg, true);
     }
     LOG_V(APP_TAG, "END - updateRegisterEventHandler");
 
@@ -1029,52 +1442,489 @@ void phev_pipe_updateRegisterWithCallback(phev_pipe_ctx_t *ctx, const uint8_t re
 {
     LOG_V(APP_TAG, "START - updateRegisterWithCallback");
 
-    uint8_t * data = malloc(1);
-    data[0] = value;
+    const uint8_t data = value;
 
-    phev_pipe_updateComplexRegisterWithCallback(ctx, reg, data, 1, callback, customCtx);
+    phev_pipe_updateRegisterTracked(ctx, reg, &data, 1, callback, NULL, customCtx);
 
     LOG_V(APP_TAG, "END - updateRegisterWithCallback");
 
 }
 void phev_pipe_updateComplexRegisterWithCallback(phev_pipe_ctx_t *ctx, const uint8_t reg, const uint8_t * data, const size_t length, phev_pipe_updateRegisterCallback_t callback, void *customCtx)
 {
-    LOG_V(APP_TAG, "START - updateRegisterWithCallback");
+    phev_pipe_updateRegisterTracked(ctx, reg, data, length, callback, NULL, customCtx);
+}
+void phev_pipe_updateRegisterTracked(phev_pipe_ctx_t *ctx, const uint8_t reg, const uint8_t * data, const size_t length, phev_pipe_updateRegisterCallback_t callback, phev_pipe_updateRegisterCallback_t failed, void *customCtx)
+{
+    LOG_V(APP_TAG, "START - updateRegisterTracked");
+
+    phev_pipe_commandTracker_t *tracker = &ctx->commands;
+    phev_pipe_updateRegisterCallback_t superseded = NULL;
+    void *supersededCtx = NULL;
 
-    for (int i = 0; i < PHEV_PIPE_MAX_UPDATE_CALLBACKS; i++)
+    // The old write is only reported once the new one is in place, so a
+    // callback that writes the register again replaces this one cleanly
+    if(tracker->slot[reg] >= 0)
     {
-        if (ctx->updateRegisterCallbacks->used[i] == false)
+        LOG_D(APP_TAG,"Replacing pending write to register %02X",reg);
+        phev_pipe_detachCommand(ctx, reg, false, &superseded, &supersededCtx);
+    }
+    else if(tracker->maxCommands > 0 && tracker->count >= tracker->maxCommands)
+    {
+        LOG_W(APP_TAG, "Cannot track register %02X, %d commands already in flight",reg,tracker->count);
+        if(failed != NULL)
         {
-            uint8_t * dataCopy = malloc(length);
-            memcpy(dataCopy, data, length);
-            ctx->updateRegisterCallbacks->used[i] = true;
-            ctx->updateRegisterCallbacks->callbacks[i] = callback;
-            ctx->updateRegisterCallbacks->registers[i] = reg;
-            ctx->updateRegisterCallbacks->values[i] = dataCopy;
-            ctx->updateRegisterCallbacks->lengths[i] = length;
-            ctx->updateRegisterCallbacks->ctx[i] = customCtx;
+            failed(ctx, reg, customCtx);
+        }
+        return;
+    }
 
-            ctx->updateRegisterCallbacks->numberOfCallbacks++;
+    if(tracker->count == tracker->capacity)
+    {
+        const size_t capacity = (tracker->capacity == 0 ? PHEV_PIPE_INITIAL_COMMANDS : tracker->capacity * 2);
+        phev_pipe_command_t *commands = realloc(tracker->commands, capacity * sizeof(phev_pipe_command_t));
 
-            phev_pipe_registerEventHandler(ctx, (phevPipeEventHandler_t)phev_pipe_updateRegisterEventHandler);
+        if(commands == NULL)
+        {
+            LOG_E(APP_TAG,"Cannot grow command tracker");
+            if(failed != NULL)
+            {
+                failed(ctx, reg, customCtx);
+            }
+            return;
+        }
+        tracker->commands = commands;
+        tracker->capacity = capacity;
+    }
 
-            phev_pipe_updateRegisterNoRetry(ctx, reg, data, length);
+    phev_pipe_command_t *command = &tracker->commands[tracker->count];
 
-            LOG_V(APP_TAG, "END - updateRegisterWithCallback");
-            return;
+    command->reg = reg;
+    command->data = malloc(length);
+    memcpy(command->data, data, length);
+    command->length = length;
+    command->callback = callback;
+    command->failed = failed;
+    command->customCtx = customCtx;
+    command->timeout = PHEV_PIPE_COMMAND_TIMEOUT_MS;
+    command->attempts = 0;
+    tracker->slot[reg] = (int16_t) tracker->count;
+    tracker->count++;
+
+    phev_pipe_subscribeEvents(ctx, (phevPipeEventHandler_t)phev_pipe_updateRegisterEventHandler, PHEV_PIPE_EVENT_MASK(PHEV_PIPE_BB) | PHEV_PIPE_EVENT_MASK(PHEV_PIPE_REG_UPDATE_ACK), NULL);
+
+    phev_pipe_transmitCommand(ctx, command, phev_pipe_nowMs());
+
+    if(superseded != NULL)
+    {
+        superseded(ctx, reg, supersededCtx);
+    }
+
+    LOG_V(APP_TAG, "END - updateRegisterTracked");
+}
+
+static void phev_pipe_resetLanes(phev_pipe_ctx_t * ctx)
+{
+    static const size_t depths[PHEV_PIPE_LANE_COUNT] = {
+        PHEV_PIPE_ACK_LANE_DEPTH,
+        PHEV_PIPE_COMMAND_LANE_DEPTH,
+        PHEV_PIPE_PING_LANE_DEPTH,
+        PHEV_PIPE_TIMESYNC_LANE_DEPTH,
+    };
+
+    for(int i = 0; i < PHEV_PIPE_LANE_COUNT; i++)
+    {
+        phev_pipe_lane_t * lane = &ctx->outbound.lanes[i];
+
+        lane->length = 0;
+        lane->depth = 0;
+        lane->maxDepth = depths[i];
+        lane->droppable = (i == PHEV_PIPE_LANE_PING || i == PHEV_PIPE_LANE_TIMESYNC);
+    }
+}
+const phev_pipe_lane_t * phev_pipe_outboundLane(phev_pipe_ctx_t * ctx, const int lane)
+{
+    return (lane >= 0 && lane < PHEV_PIPE_LANE_COUNT ? &ctx->outbound.lanes[lane] : NULL);
+}
+static void phev_pipe_initSubmissions(phev_pipe_ctx_t * ctx)
+{
+    phev_pipe_submitQueue_t * queue = malloc(sizeof(phev_pipe_submitQueue_t));
+
+    ctx->submissions = queue;
+
+    atomic_init(&queue->stub.next, NULL);
+    atomic_init(&queue->head, &queue->stub);
+    atomic_init(&queue->submitted, 0);
+    queue->tail = &queue->stub;
+    queue->drained = 0;
+#ifdef __linux__
+    queue->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+    queue->wakeFd = -1;
+#endif
+}
+static void phev_pipe_pushSubmission(phev_pipe_submitQueue_t * queue, phev_pipe_submission_t * submission)
+{
+    atomic_store_explicit(&submission->next, NULL, memory_order_relaxed);
+
+    phev_pipe_submission_t * prev = atomic_exchange_explicit(&queue->head, submission, memory_order_acq_rel);
+
+    atomic_store_explicit(&prev->next, submission, memory_order_release);
+}
+// Returns NULL when empty, or when a producer is still half way through a
+// push; its wakeup makes the loop come back for it.
+static phev_pipe_submission_t * phev_pipe_popSubmission(phev_pipe_submitQueue_t * queue)
+{
+    phev_pipe_submission_t * tail = queue->tail;
+    phev_pipe_submission_t * next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if(tail == &queue->stub)
+    {
+        if(next == NULL)
+        {
+            return NULL;
         }
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if(next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+    if(tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+    {
+        return NULL;
+    }
+
+    phev_pipe_pushSubmission(queue, &queue->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if(next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+void phev_pipe_submitCommand(phev_pipe_ctx_t *ctx, const uint8_t reg, const uint8_t * data, const size_t length, phev_pipe_updateRegisterCallback_t callback, phev_pipe_updateRegisterCallback_t failed, void * customCtx)
+{
+    phev_pipe_submission_t * submission = malloc(sizeof(phev_pipe_submission_t) + length);
+
+    if(submission == NULL)
+    {
+        LOG_E(APP_TAG,"Cannot submit write to register %02X",reg);
+        if(failed != NULL)
+        {
+            failed(ctx, reg, customCtx);
+        }
+        return;
+    }
+
+    submission->reg = reg;
+    submission->data = (uint8_t *) (submission + 1);
+    memcpy(submission->data, data, length);
+    submission->length = length;
+    submission->callback = callback;
+    submission->failed = failed;
+    submission->customCtx = customCtx;
+
+    phev_pipe_pushSubmission(ctx->submissions, submission);
+    atomic_fetch_add_explicit(&ctx->submissions->submitted, 1, memory_order_relaxed);
+
+    phev_pipe_wakeup(ctx);
+}
+size_t phev_pipe_drainCommands(phev_pipe_ctx_t *ctx)
+{
+    phev_pipe_submitQueue_t * queue = ctx->submissions;
+    phev_pipe_submission_t * submission;
+    size_t drained = 0;
+
+#ifdef __linux__
+    uint64_t value;
+
+    if(queue->wakeFd >= 0 && read(queue->wakeFd, &value, sizeof(value)) != sizeof(value))
+    {
+        LOG_V(APP_TAG,"No wakeup pending");
+    }
+#endif
+    while((submission = phev_pipe_popSubmission(queue)) != NULL)
+    {
+        phev_pipe_updateRegisterTracked(ctx, submission->reg, submission->data, submission->length, submission->callback, submission->failed, submission->customCtx);
+        free(submission);
+        drained++;
     }
+    queue->drained += drained;
+
+    return drained;
+}
+void phev_pipe_wakeup(phev_pipe_ctx_t *ctx)
+{
+#ifdef __linux__
+    const uint64_t one = 1;
 
-    LOG_W(APP_TAG, "Cannot add update register handler too many allocated %d",ctx->updateRegisterCallbacks->numberOfCallbacks);
+    if(ctx->submissions->wakeFd >= 0 && write(ctx->submissions->wakeFd, &one, sizeof(one)) != sizeof(one))
+    {
+        LOG_W(APP_TAG,"Wakeup failed");
+    }
+#endif
 }
+int phev_pipe_wakeFd(phev_pipe_ctx_t *ctx)
+{
+    return ctx->submissions->wakeFd;
+}
+// The queue and its fd are shared rather than moved because transports and
+// other threads may still hold the old pipe. Commands already sent are
+// tracked again on ctx, which sends them once more.
+void phev_pipe_adoptSubmissions(phev_pipe_ctx_t *ctx, phev_pipe_ctx_t *from)
+{
+    phev_pipe_submitQueue_t * queue = ctx->submissions;
+    phev_pipe_commandTracker_t * tracker = &from->commands;
+    phev_pipe_submission_t * submission;
+
+    if(queue != from->submissions)
+    {
+        while((submission = phev_pipe_popSubmission(queue)) != NULL)
+        {
+            phev_pipe_pushSubmission(from->submissions, submission);
+            atomic_fetch_add_explicit(&from->submissions->submitted, 1, memory_order_relaxed);
+        }
+#ifdef __linux__
+        if(queue->wakeFd >= 0)
+        {
+            close(queue->wakeFd);
+        }
+#endif
+        free(queue);
+        ctx->submissions = from->submissions;
+    }
+
+    for(size_t i = 0; i < tracker->count; i++)
+    {
+        phev_pipe_command_t *command = &tracker->commands[i];
 
+        tracker->slot[command->reg] = -1;
+        phev_pipe_updateRegisterTracked(ctx, command->reg, command->data, command->length, command->callback, command->failed, command->customCtx);
+        free(command->data);
+    }
+    tracker->count = 0;
+
+    phev_pipe_wakeup(ctx);
+}
+void phev_pipe_closeSubmissions(phev_pipe_ctx_t *ctx)
+{
+    phev_pipe_submission_t * submission;
+
+    while((submission = phev_pipe_popSubmission(ctx->submissions)) != NULL)
+    {
+        if(submission->failed != NULL)
+        {
+            submission->failed(ctx, submission->reg, submission->customCtx);
+        }
+        free(submission);
+    }
+#ifdef __linux__
+    if(ctx->submissions->wakeFd >= 0)
+    {
+        close(ctx->submissions->wakeFd);
+    }
+#endif
+    ctx->submissions->wakeFd = -1;
+}
+// A full lane either flushes everything queued so far or, for pings and time
+// sync, drops the new frame since a later one supersedes it anyway.
+static uint8_t * phev_pipe_outboundReserve(phev_pipe_ctx_t * ctx, const int lane, const size_t length)
+{
+    phev_pipe_lane_t * queue = &ctx->outbound.lanes[lane];
+
+    if(length > PHEV_PIPE_LANE_BUFFER_SIZE)
+    {
+        LOG_E(APP_TAG,"Frame of %d bytes larger than outbound lane",length);
+        return NULL;
+    }
+    if(queue->depth >= queue->maxDepth || queue->length + length > PHEV_PIPE_LANE_BUFFER_SIZE)
+    {
+        if(queue->droppable)
+        {
+            LOG_D(APP_TAG,"Outbound lane %d full, dropping frame",lane);
+            queue->dropped++;
+            return NULL;
+        }
+        phev_pipe_outboundFlush(ctx);
+    }
+
+    return queue->buffer + queue->length;
+}
+static void phev_pipe_outboundAppend(phev_pipe_ctx_t * ctx, const int lane, const size_t length)
+{
+    if(length > 0)
+    {
+        ctx->outbound.lanes[lane].length += length;
+        ctx->outbound.lanes[lane].depth++;
+    }
+}
+static bool phev_pipe_queueFrame(phev_pipe_ctx_t * ctx, const int lane, const uint8_t command, const uint8_t type, const uint8_t reg, const uint8_t * data, const size_t length, const uint8_t xor)
+{
+    uint8_t * out = phev_pipe_outboundReserve(ctx, lane, length + 5);
+
+    if(out == NULL)
+    {
+        return false;
+    }
+
+    size_t frameLength = phev_core_encodeFrame(out, length + 5, command, type, reg, data, length, xor);
+
+    phev_pipe_outboundAppend(ctx, lane, frameLength);
+
+    return frameLength > 0;
+}
+static bool phev_pipe_queueTemplate(phev_pipe_ctx_t * ctx, const int lane, const int id, const uint8_t reg, const uint8_t xor)
+{
+    uint8_t * out = phev_pipe_outboundReserve(ctx, lane, PHEV_CORE_TEMPLATE_SIZE);
+
+    if(out == NULL)
+    {
+        return false;
+    }
+
+    size_t frameLength = phev_core_renderTemplate(out, PHEV_CORE_TEMPLATE_SIZE, id, reg, xor);
+
+    phev_pipe_outboundAppend(ctx, lane, frameLength);
+
+    return frameLength > 0;
+}
+static void phev_pipe_queueBytes(phev_pipe_ctx_t * ctx, const int lane, const uint8_t * data, const size_t length)
+{
+    uint8_t * out = phev_pipe_outboundReserve(ctx, lane, length);
+
+    if(out != NULL)
+    {
+        memcpy(out, data, length);
+        phev_pipe_outboundAppend(ctx, lane, length);
+    }
+}
+static void phev_pipe_queueMessage(phev_pipe_ctx_t * ctx, const int lane, const message_t * message, const uint8_t xor)
+{
+    const size_t length = message->data[1] + 2;
+    uint8_t * out = phev_pipe_outboundReserve(ctx, lane, length);
+
+    if(out != NULL)
+    {
+        phev_core_xorBuffer(out, message->data, length, xor);
+        phev_pipe_outboundAppend(ctx, lane, length);
+    }
+}
+static void phev_pipe_outboundWrite(phev_pipe_ctx_t * ctx, const size_t length)
+{
+    message_t message = {
+        .data = ctx->outbound.buffer,
+        .length = length,
+        .ctx = NULL,
+    };
+
+    msg_pipe_outboundPublish(ctx->pipe, &message);
+
+    ctx->outbound.writes++;
+}
+// Lanes are written highest priority first. While acks and commands back up
+// past PHEV_PIPE_OUTBOUND_CONGESTED the droppable lanes are held back.
+void phev_pipe_outboundFlush(phev_pipe_ctx_t * ctx)
+{
+    LOG_V(APP_TAG,"START - outboundFlush");
+
+    phev_pipe_lane_t * lanes = ctx->outbound.lanes;
+    const bool congested = (lanes[PHEV_PIPE_LANE_ACK].length + lanes[PHEV_PIPE_LANE_COMMAND].length) >= PHEV_PIPE_OUTBOUND_CONGESTED;
+    size_t length = 0;
+
+    for(int i = 0; i < PHEV_PIPE_LANE_COUNT; i++)
+    {
+        phev_pipe_lane_t * lane = &lanes[i];
+        size_t offset = 0;
+
+        if(lane->length == 0 || (lane->droppable && congested))
+        {
+            continue;
+        }
+        while(offset < lane->length)
+        {
+            size_t chunk = lane->length - offset;
+
+            if(chunk > PHEV_PIPE_OUTBOUND_BUFFER_SIZE - length)
+            {
+                chunk = PHEV_PIPE_OUTBOUND_BUFFER_SIZE - length;
+            }
+            memcpy(ctx->outbound.buffer + length, lane->buffer + offset, chunk);
+            length += chunk;
+            offset += chunk;
+
+            if(length == PHEV_PIPE_OUTBOUND_BUFFER_SIZE)
+            {
+                phev_pipe_outboundWrite(ctx, length);
+                length = 0;
+            }
+        }
+        lane->sent += lane->depth;
+        lane->length = 0;
+        lane->depth = 0;
+    }
+    if(length > 0)
+    {
+        phev_pipe_outboundWrite(ctx, length);
+    }
+
+    LOG_V(APP_TAG,"END - outboundFlush");
+}
+// While a batch is open frames only accumulate in the outbound buffer, the
+// outermost phev_pipe_outboundEnd sends them all with a single write.
+void phev_pipe_outboundBegin(phev_pipe_ctx_t * ctx)
+{
+    ctx->outbound.batching++;
+}
+void phev_pipe_outboundEnd(phev_pipe_ctx_t * ctx)
+{
+    if(ctx->outbound.batching > 0)
+    {
+        ctx->outbound.batching--;
+    }
+    phev_pipe_outboundCommit(ctx);
+}
+static void phev_pipe_outboundCommit(phev_pipe_ctx_t * ctx)
+{
+    if(ctx->outbound.batching == 0)
+    {
+        phev_pipe_outboundFlush(ctx);
+    }
+}
+bool phev_pipe_sendFrame(phev_pipe_ctx_t * ctx, const uint8_t command, const uint8_t type, const uint8_t reg, const uint8_t * data, const size_t length, const uint8_t xor)
+{
+    LOG_V(APP_TAG,"START - sendFrame");
+
+    bool ret = phev_pipe_queueFrame(ctx, PHEV_PIPE_LANE_COMMAND, command, type, reg, data, length, xor);
+
+    phev_pipe_outboundCommit(ctx);
+
+    LOG_V(APP_TAG,"END - sendFrame");
+
+    return ret;
+}
+bool phev_pipe_sendTemplate(phev_pipe_ctx_t * ctx, const int id, const uint8_t reg, const uint8_t xor)
+{
+    LOG_V(APP_TAG,"START - sendTemplate");
+
+    bool ret = phev_pipe_queueTemplate(ctx, PHEV_PIPE_LANE_COMMAND, id, reg, xor);
+
+    phev_pipe_outboundCommit(ctx);
+
+    LOG_V(APP_TAG,"END - sendTemplate");
+
+    return ret;
+}
 void phev_pipe_pingOutboundPublish(phev_pipe_ctx_t * ctx, message_t * message)
 {
     LOG_V(APP_TAG,"START - pingOutboundPublish");
 
-    message_t * encoded = phev_core_XOROutboundMessage(message, ctx->pingXOR);
-
-    msg_pipe_outboundPublish(ctx->pipe, encoded);
+    phev_pipe_queueMessage(ctx, PHEV_PIPE_LANE_PING, message, ctx->pingXOR);
+    phev_pipe_outboundCommit(ctx);
 
     msg_utils_destroyMsg(message);
 
@@ -1086,9 +1936,8 @@ void phev_pipe_commandOutboundPublish(phev_pipe_ctx_t * ctx, message_t * message
 {
     LOG_V(APP_TAG,"START - commandOutboundPublish");
 
-    message_t * encoded = phev_core_XOROutboundMessage(message, ctx->commandXOR);
-
-    msg_pipe_outboundPublish(ctx->pipe, encoded);
+    phev_pipe_queueMessage(ctx, PHEV_PIPE_LANE_COMMAND, message, ctx->commandXOR);
+    phev_pipe_outboundCommit(ctx);
 
     msg_utils_destroyMsg(message);
 
@@ -1100,9 +1949,8 @@ void phev_pipe_outboundPublish(phev_pipe_ctx_t * ctx, message_t * message)
 {
     LOG_V(APP_TAG,"START - outboundPublish");
 
-    message_t * encoded = phev_core_XOROutboundMessage(message, ctx->currentXOR);
-
-    msg_pipe_outboundPublish(ctx->pipe, encoded);
+    phev_pipe_queueMessage(ctx, PHEV_PIPE_LANE_COMMAND, message, ctx->currentXOR);
+    phev_pipe_outboundCommit(ctx);
 
     msg_utils_destroyMsg(message);
 
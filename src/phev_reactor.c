@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <string.h>
+#include "phev_reactor.h"
+#include "msg_pipe.h"
+#include "logger.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#endif
+
+const static char *APP_TAG = "PHEV_REACTOR";
+
+#ifdef __linux__
+
+bool phev_reactor_supported(void)
+{
+    return true;
+}
+static uint64_t phev_reactor_nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+static void phev_reactor_drain(const int fd)
+{
+    uint64_t value;
+
+    while(read(fd, &value, sizeof(value)) == sizeof(value))
+    {
+    }
+}
+static bool phev_reactor_watch(phev_reactor_t *reactor, const int fd)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.fd = fd,
+    };
+
+    return epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+static void phev_reactor_follow(phev_reactor_t *reactor, int *watched, const int fd, const bool renew)
+{
+    if(fd == *watched && !renew)
+    {
+        return;
+    }
+    if(*watched >= 0)
+    {
+        epoll_ctl(reactor->epollFd, EPOLL_CTL_DEL, *watched, NULL);
+    }
+    if(fd >= 0 && !phev_reactor_watch(reactor, fd))
+    {
+        LOG_E(APP_TAG, "Cannot watch fd %d", fd);
+        *watched = -1;
+        return;
+    }
+    LOG_D(APP_TAG, "Watching fd %d", fd);
+    *watched = fd;
+}
+// The out client reconnects and the pipe can be replaced behind our back, so
+// both fds are looked up again before every wait.
+static void phev_reactor_watchSources(phev_reactor_t *reactor)
+{
+    const bool newPipe = reactor->watchedPipe != reactor->pipe;
+    const bool newConnection = newPipe || reactor->watchedGeneration != reactor->pipe->connection.generation;
+
+    phev_reactor_follow(reactor, &reactor->socketFd, (reactor->socketProvider ? reactor->socketProvider(reactor->ctx) : -1), newConnection);
+    phev_reactor_follow(reactor, &reactor->pipeWakeFd, phev_pipe_wakeFd(reactor->pipe), newPipe);
+    reactor->watchedPipe = reactor->pipe;
+    reactor->watchedGeneration = reactor->pipe->connection.generation;
+}
+static void phev_reactor_armTimer(phev_reactor_t *reactor, const uint64_t now)
+{
+    uint64_t next = UINT64_MAX;
+    const uint64_t keepalive = (reactor->pipe->pipe->out->connected ? phev_pipe_nextKeepaliveDeadline(reactor->pipe) : UINT64_MAX);
+    const uint64_t command = phev_pipe_nextCommandDeadline(reactor->pipe);
+    const uint64_t connect = phev_pipe_nextConnectDeadline(reactor->pipe);
+    struct itimerspec spec;
+
+    if(keepalive < next)
+    {
+        next = keepalive;
+    }
+    if(command < next)
+    {
+        next = command;
+    }
+    if(connect < next)
+    {
+        next = connect;
+    }
+    // Nothing to poll while backing off, the connect deadline wakes us
+    if(reactor->socketFd < 0 && reactor->pipe->connection.state != PHEV_PIPE_STATE_BACKOFF
+        && now + PHEV_REACTOR_POLL_INTERVAL_MS < next)
+    {
+        next = now + PHEV_REACTOR_POLL_INTERVAL_MS;
+    }
+
+    const uint64_t delay = (next > now ? next - now : 0);
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = delay / 1000;
+    spec.it_value.tv_nsec = (delay % 1000) * 1000000;
+    if(delay == 0)
+    {
+        // A zero value disarms the timer, fire straight away instead
+        spec.it_value.tv_nsec = 1;
+    }
+
+    timerfd_settime(reactor->timerFd, 0, &spec, NULL);
+}
+phev_reactor_t *phev_reactor_create(phev_reactor_settings_t settings)
+{
+    LOG_V(APP_TAG, "START - create");
+
+    phev_reactor_t *reactor = malloc(sizeof(phev_reactor_t));
+
+    reactor->pipe = settings.pipe;
+    reactor->socketProvider = settings.socketProvider;
+    reactor->ctx = settings.ctx;
+    if(settings.pingIntervalMs)
+    {
+        reactor->pipe->keepalive.intervalMs = settings.pingIntervalMs;
+        reactor->pipe->keepalive.nextPing = phev_pipe_nowMs() + settings.pingIntervalMs;
+    }
+    reactor->socketFd = -1;
+    reactor->pipeWakeFd = -1;
+    reactor->watchedPipe = NULL;
+    reactor->watchedGeneration = 0;
+    reactor->wakeups = 0;
+    reactor->reads = 0;
+    reactor->timers = 0;
+    reactor->busyNs = 0;
+    reactor->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    reactor->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(reactor->epollFd < 0 || reactor->timerFd < 0 || reactor->wakeFd < 0
+        || !phev_reactor_watch(reactor, reactor->timerFd) || !phev_reactor_watch(reactor, reactor->wakeFd))
+    {
+        LOG_E(APP_TAG, "Cannot set up reactor %d", errno);
+        phev_reactor_destroy(reactor);
+        return NULL;
+    }
+
+    LOG_V(APP_TAG, "END - create");
+
+    return reactor;
+}
+int phev_reactor_runOnce(phev_reactor_t *reactor, const int timeoutMs)
+{
+    struct epoll_event events[PHEV_REACTOR_MAX_EVENTS];
+    phev_pipe_ctx_t *pipe = reactor->pipe;
+    bool readable = false;
+
+    phev_pipe_connectStep(pipe, phev_pipe_nowMs());
+
+    phev_reactor_watchSources(reactor);
+    phev_reactor_armTimer(reactor, phev_pipe_nowMs());
+
+    const int num = epoll_wait(reactor->epollFd, events, PHEV_REACTOR_MAX_EVENTS, timeoutMs);
+
+    if(num < 0)
+    {
+        if(errno == EINTR)
+        {
+            return 0;
+        }
+        LOG_E(APP_TAG, "Wait failed %d", errno);
+        return -1;
+    }
+
+    const uint64_t started = phev_reactor_nowNs();
+
+    for(int i = 0; i < num; i++)
+    {
+        const int fd = events[i].data.fd;
+
+        if(fd == reactor->wakeFd)
+        {
+            phev_reactor_drain(fd);
+            reactor->wakeups++;
+        }
+        else if(fd == reactor->pipeWakeFd)
+        {
+            // Commands stay queued until the pipe connects, the fd is level
+            // triggered so it has to be cleared here either way
+            phev_reactor_drain(fd);
+            reactor->wakeups++;
+        }
+        else if(fd == reactor->timerFd)
+        {
+            phev_reactor_drain(fd);
+            reactor->timers++;
+            readable = readable || reactor->socketFd < 0;
+        }
+        else if(fd == reactor->socketFd)
+        {
+            readable = true;
+        }
+    }
+
+    const uint64_t now = phev_pipe_nowMs();
+
+    phev_pipe_outboundBegin(pipe);
+
+    // Only read when the socket is ready, otherwise the client read would
+    // block for its own timeout
+    if(readable && pipe->pipe->out->connected)
+    {
+        reactor->reads++;
+        msg_pipe_loop(pipe->pipe);
+    }
+    if(pipe->pipe->out->connected)
+    {
+        phev_pipe_drainCommands(pipe);
+    }
+    phev_pipe_keepalive(pipe, now);
+    phev_pipe_serviceCommands(pipe, now);
+
+    phev_pipe_outboundEnd(pipe);
+
+    reactor->busyNs += phev_reactor_nowNs() - started;
+
+    return num;
+}
+void phev_reactor_wakeup(phev_reactor_t *reactor)
+{
+    const uint64_t one = 1;
+
+    if(reactor != NULL && write(reactor->wakeFd, &one, sizeof(one)) != sizeof(one))
+    {
+        LOG_W(APP_TAG, "Wakeup failed %d", errno);
+    }
+}
+void phev_reactor_destroy(phev_reactor_t *reactor)
+{
+    if(reactor == NULL)
+    {
+        return;
+    }
+    if(reactor->epollFd >= 0)
+    {
+        close(reactor->epollFd);
+    }
+    if(reactor->timerFd >= 0)
+    {
+        close(reactor->timerFd);
+    }
+    if(reactor->wakeFd >= 0)
+    {
+        close(reactor->wakeFd);
+    }
+    free(reactor);
+}
+
+#else
+
+bool phev_reactor_supported(void)
+{
+    return false;
+}
+phev_reactor_t *phev_reactor_create(phev_reactor_settings_t settings)
+{
+    LOG_W(APP_TAG, "Reactor is only available on Linux");
+
+    return NULL;
+}
+int phev_reactor_runOnce(phev_reactor_t *reactor, const int timeoutMs)
+{
+    return -1;
+}
+void phev_reactor_wakeup(phev_reactor_t *reactor)
+{
+}
+void phev_reactor_destroy(phev_reactor_t *reactor)
+{
+}
+
+#endif
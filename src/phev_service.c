@@ -15,6 +15,15 @@ const static char *TAG = "PHEV_SERVICE";
 
 const static uint8_t *DEFAULT_MAC[6] = {0, 0, 0, 0, 0, 0};
 
+// Registers statusAsJson is built from
+const static uint8_t STATUS_REGISTERS[] = {
+    KO_WF_BATT_LEVEL_INFO_REP_EVR,
+    KO_WF_DATE_INFO_SYNC_EVR,
+    KO_WF_OBCHG_OK_ON_INFO_REP_EVR,
+    KO_AC_MANUAL_SW_EVR,
+    KO_WF_TM_AC_STAT_INFO_REP_EVR,
+};
+
 int phev_service_eventHandler(phev_pipe_ctx_t *ctx, phevPipeEvent_t *event)
 {
     LOG_V(TAG, "START - eventHandler");
@@ -56,17 +65,23 @@ phevServiceCtx_t *phev_service_create(phevServiceSettings_t settings)
     LOG_V(TAG, "START - create");
     phevServiceCtx_t *ctx = NULL;
 
-    if(settings.my18)
-    {
-        phev_core_my18 = true;
-    }
-
     ctx = phev_service_init(settings.in, settings.out,settings.registerDevice);
 
+    ctx->my18 = settings.my18;
     ctx->yieldHandler = settings.yieldHandler;
     ctx->exit = false;
     ctx->ctx = settings.ctx;
     ctx->registrationCompleteCallback = NULL;
+    ctx->pipe->connection.pending = settings.connectPending;
+    ctx->pipe->connection.pendingCtx = settings.ctx;
+    if (settings.pingIntervalMs)
+    {
+        ctx->pipe->keepalive.intervalMs = settings.pingIntervalMs;
+    }
+    if (settings.maxUnansweredPings)
+    {
+        ctx->pipe->keepalive.maxUnanswered = settings.maxUnansweredPings;
+    }
     if (settings.mac)
     {
         memcpy(ctx->mac, settings.mac, 6);
@@ -85,7 +100,39 @@ phevServiceCtx_t *phev_service_create(phevServiceSettings_t settings)
     if(settings.registerDevice)
     {
         LOG_D(TAG,"Settings registration event handler %p",phev_service_eventHandler);
-        phev_pipe_registerEventHandler(ctx->pipe, phev_service_eventHandler);
+        phev_pipe_subscribeEvents(ctx->pipe, phev_service_eventHandler, PHEV_PIPE_EVENT_MASK(PHEV_PIPE_REGISTRATION_COMPLETE) | PHEV_PIPE_EVENT_MASK(PHEV_PIPE_GOT_VIN) | PHEV_PIPE_EVENT_MASK(PHEV_PIPE_REG_UPDATE_ACK), NULL);
+    }
+
+    if(settings.snapshotPath)
+    {
+        ctx->snapshot = phev_snapshot_open(settings.snapshotPath);
+
+        if(ctx->snapshot && phev_snapshot_restore(ctx->snapshot, ctx->model) > 0)
+        {
+            uint8_t regs[256];
+            const size_t count = phev_model_changedSince(ctx->model, 0, regs);
+
+            for(size_t i = 0; i < count; i++)
+            {
+                ctx->stale[regs[i] >> 6] |= 1ULL << (regs[i] & 63);
+            }
+        }
+    }
+
+    if(settings.reactor)
+    {
+        phev_reactor_settings_t reactorSettings = {
+            .pipe = ctx->pipe,
+            .socketProvider = settings.socketProvider,
+            .ctx = settings.ctx,
+        };
+
+        ctx->reactor = phev_reactor_create(reactorSettings);
+
+        if(ctx->reactor == NULL)
+        {
+            LOG_W(TAG,"Reactor not available, polling instead");
+        }
     }
 
     LOG_V(TAG, "END - create");
@@ -101,7 +148,19 @@ void phev_service_start(phevServiceCtx_t *ctx)
 
     while (!ctx->exit)
     {
-        phev_service_loop(ctx);
+        if (ctx->reactor)
+        {
+            phev_reactor_runOnce(ctx->reactor, -1);
+        }
+        else
+        {
+            phev_service_loop(ctx);
+            if (!ctx->pipe->connected)
+            {
+                // Connecting no longer blocks, so pace the polling loop
+                SLEEP(PHEV_CONNECT_POLL_MS);
+            }
+        }
         if (ctx->yieldHandler)
         {
             ctx->yieldHandler(ctx);
@@ -109,6 +168,18 @@ void phev_service_start(phevServiceCtx_t *ctx)
     }
     LOG_V(TAG, "END - start");
 }
+void phev_service_close(phevServiceCtx_t *ctx)
+{
+    LOG_V(TAG, "START - close");
+
+    phev_reactor_destroy(ctx->reactor);
+    ctx->reactor = NULL;
+    phev_pipe_closeSubmissions(ctx->pipe);
+    phev_snapshot_close(ctx->snapshot);
+    ctx->snapshot = NULL;
+
+    LOG_V(TAG, "END - close");
+}
 phevServiceCtx_t *phev_service_init(messagingClient_t *in, messagingClient_t *out, bool registerDevice)
 {
     LOG_V(TAG, "START - init");
@@ -118,6 +189,10 @@ phevServiceCtx_t *phev_service_init(messagingClient_t *in, messagingClient_t *ou
     LOG_D(TAG, "Creating model and pipe");
     ctx->model = phev_model_create();
     ctx->registerDevice = registerDevice;
+    ctx->my18 = false;
+    ctx->reactor = NULL;
+    ctx->snapshot = NULL;
+    memset(ctx->stale, 0, sizeof(ctx->stale));
     ctx->pipe = phev_service_createPipe(ctx, in, out);
     ctx->pipe->ctx = ctx;
 
@@ -189,6 +264,13 @@ void phev_service_bufferDump(const uint8_t * buffer, const size_t length)
     }
     printf("\n");
 }
+static void phev_service_saveSnapshot(phevServiceCtx_t *ctx)
+{
+    if (ctx->snapshot)
+    {
+        phev_snapshot_sync(ctx->snapshot, ctx->model);
+    }
+}
 bool phev_service_outputFilter(void *ctx, message_t *message)
 {
     LOG_V(TAG, "START - outputFilter");
@@ -198,57 +280,69 @@ bool phev_service_outputFilter(void *ctx, message_t *message)
 
     phevServiceCtx_t *serviceCtx = ((phev_pipe_ctx_t *)ctx)->ctx;
 
-    phevMessage_t phevMessage;
+    const phevFrame_t *frame = phev_core_messageFrame(message);
 
-    phev_core_decodeMessage(message->data, message->length, &phevMessage);
+    if (frame == NULL)
+    {
+        LOG_E(TAG, "Cannot decode message");
+        return false;
+    }
 
-    if ((phevMessage.command == PING_RESP_CMD )|| (phevMessage.command == START_RESP))
+    if ((frame->command == PING_RESP_CMD )|| (frame->command == START_RESP))
     {
         LOG_D(TAG, "Not sending ping or start response");
-        free(phevMessage.data);
         return true;
     }
-    LOG_D(TAG, "Reg %d", phevMessage.reg);
+    LOG_D(TAG, "Reg %d", frame->reg);
 
-    if (phevMessage.command == RESP_CMD && phevMessage.type == REQUEST_TYPE)
+    if (frame->command == RESP_CMD && frame->type == REQUEST_TYPE)
     {
-        phevRegister_t *reg = phev_model_getRegister(serviceCtx->model, phevMessage.reg);
+        phevRegisterView_t reg;
+        const bool stale = phev_service_isStale(serviceCtx, frame->reg);
+
+        serviceCtx->stale[frame->reg >> 6] &= ~(1ULL << (frame->reg & 63));
 
-        if (reg)
+        if (phev_model_viewRegister(serviceCtx->model, frame->reg, &reg))
         {
-            LOG_D(TAG, "Register has previously been set Reg %02X",phevMessage.reg);
-            LOG_D(TAG,"Register Data len is %d and data",reg->length);
-            LOG_BUFFER_HEXDUMP(TAG,reg->data,reg->length,LOG_DEBUG);
+            LOG_D(TAG, "Register has previously been set Reg %02X",frame->reg);
+            LOG_D(TAG,"Register Data len is %d and data",reg.length);
+            LOG_BUFFER_HEXDUMP(TAG,reg.data,reg.length,LOG_DEBUG);
 
-            int same = phev_model_compareRegister(serviceCtx->model, phevMessage.reg, phevMessage.data);
+            int same = phev_model_compareRegisterData(serviceCtx->model, frame->reg, frame->data, frame->length);
             if (same != 0)
             {
-                LOG_D(TAG, "Setting Reg %d", phevMessage.reg);
+                LOG_D(TAG, "Setting Reg %d", frame->reg);
 
-                phev_model_setRegister(serviceCtx->model, phevMessage.reg, phevMessage.data, phevMessage.length);
-
-                free(phevMessage.data);
+                phev_model_setRegister(serviceCtx->model, frame->reg, frame->data, frame->length);
+                phev_service_saveSnapshot(serviceCtx);
 
                 return true;
             }
+            // A restored value the car has just confirmed is news to listeners
+            if (stale)
+            {
+                LOG_D(TAG, "Reg %d confirmed", frame->reg);
+                return true;
+            }
             LOG_D(TAG, "Is same %d", same);
-            free(phevMessage.data);
-            phevPipeEvent_t *event = malloc(sizeof(phevPipeEvent_t));
-            event->data = NULL;
-            event->event = PHEV_PIPE_FILTERED_MESSAGE;
-            event->length = 0;
-            phev_pipe_sendEventToHandlers((phev_pipe_ctx_t *) ctx, event);
+            phevPipeEvent_t event = {
+                .event = PHEV_PIPE_FILTERED_MESSAGE,
+                .data = NULL,
+                .length = 0,
+                .ctx = ctx,
+            };
+            phev_pipe_sendEventToHandlers((phev_pipe_ctx_t *) ctx, &event);
 
             return false;
         }
         else
         {
-            LOG_D(TAG, "Setting Reg %d", phevMessage.reg);
+            LOG_D(TAG, "Setting Reg %d", frame->reg);
 
-            phev_model_setRegister(serviceCtx->model, phevMessage.reg, phevMessage.data, phevMessage.length);
+            phev_model_setRegister(serviceCtx->model, frame->reg, frame->data, frame->length);
+            phev_service_saveSnapshot(serviceCtx);
         }
     }
-    free(phevMessage.data);
 
     LOG_V(TAG, "END - outputFilter");
 
@@ -275,6 +369,7 @@ phev_pipe_ctx_t *phev_service_createPipe(phevServiceCtx_t *ctx, messagingClient_
         .outputInputTransformer = phev_pipe_outputChainInputTransformer,
         .outputOutputTransformer = phev_service_jsonOutputTransformer,
         .registerDevice = ctx->registerDevice,
+        .fusedInbound = PHEV_SERVICE_FUSED_INBOUND,
     };
 
     phev_pipe_ctx_t *pipe = phev_pipe_createPipe(settings);
@@ -725,9 +820,18 @@ message_t *phev_service_jsonOutputTransformer(void *ctx, message_t *message)
         message_t * ret = phev_pipe_outputEventTransformer(ctx, message);
         msg_utils_destroyMsg(ret);
     }
-    phevMessage_t *phevMessage = malloc(sizeof(phevMessage_t));
+    const phevFrame_t *frame = phev_core_messageFrame(message);
 
-    phev_core_decodeMessage(message->data, message->length, phevMessage);
+    if (frame == NULL)
+    {
+        LOG_E(TAG, "Cannot decode message");
+        return NULL;
+    }
+
+    phevMessage_t view;
+    phevMessage_t *phevMessage = &view;
+
+    phev_core_frameMessage(frame, phevMessage);
     char *output;
     cJSON *out = NULL;
 
@@ -736,7 +840,6 @@ message_t *phev_service_jsonOutputTransformer(void *ctx, message_t *message)
 
     if (response == NULL)
     {
-        phev_core_destroyMessage(phevMessage);
         return NULL;
     }
 
@@ -763,7 +866,6 @@ message_t *phev_service_jsonOutputTransformer(void *ctx, message_t *message)
     default:
     {
         cJSON_Delete(response);
-        phev_core_destroyMessage(phevMessage);
         return NULL;
     }
     }
@@ -771,7 +873,6 @@ message_t *phev_service_jsonOutputTransformer(void *ctx, message_t *message)
     if (!out)
     {
         cJSON_Delete(response);
-        phev_core_destroyMessage(phevMessage);
         return NULL;
     }
 
@@ -791,7 +892,6 @@ message_t *phev_service_jsonOutputTransformer(void *ctx, message_t *message)
     message_t *outputMessage = msg_utils_createMsg((uint8_t *)output, strlen(output) );
     LOG_BUFFER_HEXDUMP(TAG, outputMessage->data, outputMessage->length, LOG_DEBUG);
     cJSON_Delete(response);
-    phev_core_destroyMessage(phevMessage);
     free(output);
     LOG_V(TAG, "END - jsonOutputTransformer");
 
@@ -801,30 +901,33 @@ int phev_service_getBatteryLevel(phevServiceCtx_t *ctx)
 {
     LOG_V(TAG, "START - getBatteryLevel");
 
-    phevRegister_t *reg = phev_model_getRegister(ctx->model, KO_WF_BATT_LEVEL_INFO_REP_EVR);
+    phevRegisterView_t reg;
+    const bool found = phev_model_viewRegister(ctx->model, KO_WF_BATT_LEVEL_INFO_REP_EVR, &reg);
 
     LOG_V(TAG, "END - getBatteryLevel");
-    return (reg ? (int )reg->data[0] : -1);
+    return (found ? (int )reg.data[0] : -1);
 }
 
 int phev_service_getBatteryWarning(phevServiceCtx_t *ctx)
 {
     LOG_V(TAG, "START - getBatteryWarning");
 
-    phevRegister_t *reg = phev_model_getRegister(ctx->model, KO_WF_CHG_GUN_STATUS_EVR);
+    phevRegisterView_t reg;
+    const bool found = phev_model_viewRegister(ctx->model, KO_WF_CHG_GUN_STATUS_EVR, &reg) && reg.length > 2;
 
     LOG_V(TAG, "END - getBatteryWarning");
-    return (reg ? (int )reg->data[2] : -1);
+    return (found ? (int )reg.data[2] : -1);
 }
 
 int phev_service_doorIsLocked(phevServiceCtx_t *ctx)
 {
     LOG_V(TAG, "START - doorIsLocked");
 
-    phevRegister_t *reg = phev_model_getRegister(ctx->model, KO_WF_DOOR_STATUS_INFO_REP_EVR);
+    phevRegisterView_t reg;
+    const bool found = phev_model_viewRegister(ctx->model, KO_WF_DOOR_STATUS_INFO_REP_EVR, &reg);
 
     LOG_V(TAG, "END - doorIsLocked");
-    return (reg ? (int )reg->data[0] : -1);
+    return (found ? (int )reg.data[0] : -1);
 }
 char *phev_service_statusAsJson(phevServiceCtx_t *ctx)
 {
@@ -833,7 +936,6 @@ char *phev_service_statusAsJson(phevServiceCtx_t *ctx)
     cJSON *json = cJSON_CreateObject();
     cJSON *status = cJSON_CreateObject();
     cJSON *battery = cJSON_CreateObject();
-    cJSON *date = cJSON_CreateObject();
 
     if (json && status && battery)
     {
@@ -851,12 +953,21 @@ char *phev_service_statusAsJson(phevServiceCtx_t *ctx)
         cJSON_AddItemToObject(status, PHEV_SERVICE_BATTERY_JSON, battery);
         cJSON_AddItemToObject(json, PHEV_SERVICE_STATUS_JSON, status);
 
+        for(size_t i = 0; i < sizeof(STATUS_REGISTERS); i++)
+        {
+            if(phev_service_isStale(ctx, STATUS_REGISTERS[i]))
+            {
+                cJSON_AddItemToObject(status, PHEV_SERVICE_STALE_JSON, cJSON_CreateTrue());
+                break;
+            }
+        }
+
         char * dateStr = phev_service_getDateSync(ctx);
 
         if(dateStr)
         {
-            date->valuestring = dateStr;
             cJSON_AddStringToObject(status, PHEV_SERVICE_DATE_SYNC_JSON, dateStr);
+            free(dateStr);
         }
 
         if(phev_service_getChargingStatus(ctx))
@@ -878,7 +989,7 @@ char *phev_service_statusAsJson(phevServiceCtx_t *ctx)
             cJSON_AddItemToObject(hvacStatus, PHEV_SERVICE_HVAC_MODE_JSON, mode);
             cJSON_AddItemToObject(hvacStatus, PHEV_SERVICE_HVAC_TIME_JSON, time);
             cJSON_AddItemToObject(status,PHEV_SERVICE_HVAC_STATUS_JSON,hvacStatus);
-
+            free(hvac);
         }
 
         char *out = cJSON_Print(json);
@@ -907,6 +1018,13 @@ void phev_service_loop(phevServiceCtx_t *ctx)
     //LOG_V(TAG, "END - loop");
 }
 
+void phev_service_wakeup(phevServiceCtx_t *ctx)
+{
+    if (ctx->reactor)
+    {
+        phev_reactor_wakeup(ctx->reactor);
+    }
+}
 message_t *phev_service_jsonResponseAggregator(void *ctx, messageBundle_t *bundle)
 {
     cJSON *out = cJSON_CreateObject();
@@ -953,8 +1071,18 @@ phevServiceCtx_t *phev_service_resetPipeAfterRegistration(phevServiceCtx_t *ctx)
 {
     phev_pipe_ctx_t *pipe = phev_service_createPipe(ctx, ctx->pipe->pipe->in, ctx->pipe->pipe->out);
 
+    pipe->connection.pending = ctx->pipe->connection.pending;
+    pipe->connection.pendingCtx = ctx->pipe->connection.pendingCtx;
+    pipe->keepalive.intervalMs = ctx->pipe->keepalive.intervalMs;
+    pipe->keepalive.maxUnanswered = ctx->pipe->keepalive.maxUnanswered;
+    phev_pipe_adoptSubmissions(pipe, ctx->pipe);
     ctx->pipe = pipe;
 
+    if (ctx->reactor)
+    {
+        ctx->reactor->pipe = pipe;
+    }
+
     return ctx;
 }
 void phev_service_register(const char *mac, phevServiceCtx_t *ctx, phevRegistrationComplete_t complete)
@@ -985,9 +1113,9 @@ char *phev_service_getRegisterJson(const phevServiceCtx_t *ctx, const uint8_t re
 
     if (ctx)
     {
-        phevRegister_t *out = phev_model_getRegister(ctx->model, reg);
+        phevRegisterView_t out;
 
-        if (out == NULL)
+        if (!phev_model_viewRegister(ctx->model, reg, &out))
         {
             LOG_I(TAG, "getRegister - register not found");
             return NULL;
@@ -997,15 +1125,20 @@ char *phev_service_getRegisterJson(const phevServiceCtx_t *ctx, const uint8_t re
         cJSON *regJson = cJSON_CreateNumber((double)reg);
         cJSON *data = cJSON_CreateArray();
 
-        for (int i = 0; i < out->length; i++)
+        for (int i = 0; i < out.length; i++)
         {
-            cJSON *item = cJSON_CreateNumber(out->data[i]);
+            cJSON *item = cJSON_CreateNumber(out.data[i]);
             cJSON_AddItemToArray(data, item);
         }
 
         cJSON_AddItemToObject(json, PHEV_SERVICE_REGISTER_JSON, regJson);
         cJSON_AddItemToObject(json, PHEV_SERVICE_REGISTER_DATA_JSON, data);
 
+        if (phev_service_isStale(ctx, reg))
+        {
+            cJSON_AddItemToObject(json, PHEV_SERVICE_STALE_JSON, cJSON_CreateTrue());
+        }
+
         char *ret = cJSON_PrintUnformatted(json);
         cJSON_Delete(json);
         LOG_V(TAG, "END - getRegisterJson");
@@ -1017,6 +1150,10 @@ char *phev_service_getRegisterJson(const phevServiceCtx_t *ctx, const uint8_t re
         return NULL;
     }
 }
+bool phev_service_isStale(const phevServiceCtx_t *ctx, const uint8_t reg)
+{
+    return (ctx->stale[reg >> 6] >> (reg & 63)) & 1;
+}
 void phev_service_setRegister(const phevServiceCtx_t *ctx, const uint8_t reg, const uint8_t *data, const size_t length)
 {
     LOG_V(TAG, "START - setRegister");
@@ -1024,17 +1161,18 @@ void phev_service_setRegister(const phevServiceCtx_t *ctx, const uint8_t reg, co
     {
         LOG_E(TAG, "Failed to set register %d", reg);
     }
+    phev_service_saveSnapshot((phevServiceCtx_t *) ctx);
     LOG_V(TAG, "END - setRegister");
     return;
 }
 char * phev_service_getDateSync(const phevServiceCtx_t * ctx)
 {
     LOG_V(TAG,"START - getDateSync");
-    phevRegister_t * reg = phev_model_getRegister(ctx->model,KO_WF_DATE_INFO_SYNC_EVR);
-    if(reg)
+    phevRegisterView_t reg;
+    if(phev_model_viewRegister(ctx->model,KO_WF_DATE_INFO_SYNC_EVR,&reg) && reg.length >= PHEV_PIPE_DATE_INFO_SIZE)
     {
         char * date;
-        asprintf(&date,"20%02d-%02d-%02dT%02d:%02d:%02dZ",reg->data[0],reg->data[1],reg->data[2],reg->data[3],reg->data[4],reg->data[5]);
+        asprintf(&date,"20%02d-%02d-%02dT%02d:%02d:%02dZ",reg.data[0],reg.data[1],reg.data[2],reg.data[3],reg.data[4],reg.data[5]);
         return date;
     }
     return NULL;
@@ -1042,12 +1180,12 @@ char * phev_service_getDateSync(const phevServiceCtx_t * ctx)
 bool phev_service_getChargingStatus(const phevServiceCtx_t * ctx)
 {
     LOG_V(TAG,"START - getChargingStatus");
-    phevRegister_t * reg = phev_model_getRegister(ctx->model,KO_WF_OBCHG_OK_ON_INFO_REP_EVR);
-    if(reg)
+    phevRegisterView_t reg;
+    if(phev_model_viewRegister(ctx->model,KO_WF_OBCHG_OK_ON_INFO_REP_EVR,&reg))
     {
         LOG_V(TAG,"END- getChargingStatus");
 
-        return reg->data[0] == 1;
+        return reg.data[0] == 1;
     }
     LOG_V(TAG,"END - getChargingStatus");
 
@@ -1056,11 +1194,11 @@ bool phev_service_getChargingStatus(const phevServiceCtx_t * ctx)
 int phev_service_getRemainingChargeTime(const phevServiceCtx_t * ctx)
 {
     LOG_V(TAG,"START - getRemainingChargingTime");
-    phevRegister_t * reg = phev_model_getRegister(ctx->model, KO_WF_OBCHG_OK_ON_INFO_REP_EVR);
-    if(reg && reg->data[2] != 255)
+    phevRegisterView_t reg;
+    if(phev_model_viewRegister(ctx->model, KO_WF_OBCHG_OK_ON_INFO_REP_EVR, &reg) && reg.length > 2 && reg.data[2] != 255)
     {
-        uint8_t high = reg->data[1];
-        uint8_t low = reg->data[2];
+        uint8_t high = reg.data[1];
+        uint8_t low = reg.data[2];
 
         return ((low < 0 ? low + 0x100 : low) * 0x100) + (high < 0 ? high + 0x100 : high);
     }
@@ -1070,23 +1208,25 @@ int phev_service_getRemainingChargeTime(const phevServiceCtx_t * ctx)
 
 phevServiceHVAC_t * phev_service_getHVACStatus(const phevServiceCtx_t * ctx)
 {
-    phevRegister_t * acOperatingReg = phev_model_getRegister(ctx->model, KO_AC_MANUAL_SW_EVR);
+    phevRegisterView_t acOperatingReg;
+    phevRegisterView_t acModeReg;
+
+    const bool operating = phev_model_viewRegister(ctx->model, KO_AC_MANUAL_SW_EVR, &acOperatingReg) && acOperatingReg.length > 1;
 
-    phevRegister_t * acModeReg = phev_model_getRegister(ctx->model, KO_WF_TM_AC_STAT_INFO_REP_EVR);
+    const bool mode = phev_model_viewRegister(ctx->model, KO_WF_TM_AC_STAT_INFO_REP_EVR, &acModeReg);
 
-    if(acOperatingReg || acModeReg)
+    if(operating || mode)
     {
         phevServiceHVAC_t * hvac = malloc(sizeof(phevServiceHVAC_t));
-        if(acOperatingReg)
+        if(operating)
         {
-            hvac->operating = acOperatingReg->data[1] == true;
-            hvac->operating = acOperatingReg->data[1] == true;
+            hvac->operating = acOperatingReg.data[1] == true;
         } else {
             hvac->operating = false;
         }
-        if(acModeReg)
+        if(mode)
         {
-            hvac->mode = acModeReg->data[0];
+            hvac->mode = acModeReg.data[0];
         } else {
             hvac->mode = 0;
         }
@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "phev_snapshot.h"
+#include "logger.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+const static char * TAG = "PHEV_SNAPSHOT";
+
+#ifdef __linux__
+
+static uint32_t phev_snapshot_crc(uint32_t crc, const void * data, const size_t length)
+{
+    const uint8_t * bytes = data;
+
+    crc = ~crc;
+    for(size_t i = 0; i < length; i++)
+    {
+        crc ^= bytes[i];
+        for(int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+
+    return ~crc;
+}
+static uint32_t phev_snapshot_recordChecksum(const phevSnapshotRecord_t * record)
+{
+    uint32_t crc = phev_snapshot_crc(0, &record->version, sizeof(record->version));
+
+    crc = phev_snapshot_crc(crc, &record->time, sizeof(record->time));
+    crc = phev_snapshot_crc(crc, &record->length, sizeof(record->length));
+
+    return phev_snapshot_crc(crc, record->data, record->length);
+}
+static uint32_t phev_snapshot_headerChecksum(const phevSnapshotHeader_t * header)
+{
+    phevSnapshotHeader_t copy = *header;
+
+    copy.checksum = 0;
+
+    return phev_snapshot_crc(0, &copy, sizeof(copy));
+}
+static uint32_t phev_snapshot_stateChecksum(const phevSnapshotState_t * state)
+{
+    const uint32_t crc = phev_snapshot_crc(0, &state->modelVersion, sizeof(state->modelVersion));
+
+    return phev_snapshot_crc(crc, &state->saved, sizeof(state->saved));
+}
+static bool phev_snapshot_recordValid(const phevSnapshotRecord_t * record)
+{
+    return record->version != 0 && record->length > 0 && record->length <= PHEV_SNAPSHOT_MAX_REGISTER
+        && record->checksum == phev_snapshot_recordChecksum(record);
+}
+static uint64_t phev_snapshot_wallMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+static void phev_snapshot_reset(phevSnapshotFile_t * file)
+{
+    memset(file, 0, sizeof(phevSnapshotFile_t));
+    file->header.magic = PHEV_SNAPSHOT_MAGIC;
+    file->header.format = PHEV_SNAPSHOT_FORMAT;
+    file->header.recordSize = sizeof(phevSnapshotRecord_t);
+    file->header.checksum = phev_snapshot_headerChecksum(&file->header);
+    file->state.checksum = phev_snapshot_stateChecksum(&file->state);
+}
+phevSnapshot_t * phev_snapshot_open(const char * path)
+{
+    LOG_V(TAG, "START - open");
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if(fd < 0)
+    {
+        LOG_E(TAG, "Cannot open snapshot %s %d", path, errno);
+        return NULL;
+    }
+
+    const off_t size = lseek(fd, 0, SEEK_END);
+
+    if(size != sizeof(phevSnapshotFile_t) && ftruncate(fd, sizeof(phevSnapshotFile_t)) != 0)
+    {
+        LOG_E(TAG, "Cannot size snapshot %s %d", path, errno);
+        close(fd);
+        return NULL;
+    }
+
+    phevSnapshotFile_t * file = mmap(NULL, sizeof(phevSnapshotFile_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if(file == MAP_FAILED)
+    {
+        LOG_E(TAG, "Cannot map snapshot %s %d", path, errno);
+        close(fd);
+        return NULL;
+    }
+
+    const phevSnapshotHeader_t * header = &file->header;
+
+    if(size != sizeof(phevSnapshotFile_t) || header->magic != PHEV_SNAPSHOT_MAGIC || header->format != PHEV_SNAPSHOT_FORMAT
+        || header->recordSize != sizeof(phevSnapshotRecord_t) || header->checksum != phev_snapshot_headerChecksum(header))
+    {
+        LOG_W(TAG, "Snapshot %s is missing or invalid, starting empty", path);
+        phev_snapshot_reset(file);
+    }
+    else if(file->state.checksum != phev_snapshot_stateChecksum(&file->state))
+    {
+        LOG_W(TAG, "Snapshot %s sync state is invalid, keeping the records", path);
+        memset(&file->state, 0, sizeof(phevSnapshotState_t));
+        file->state.checksum = phev_snapshot_stateChecksum(&file->state);
+    }
+
+    phevSnapshot_t * snapshot = malloc(sizeof(phevSnapshot_t));
+
+    if(snapshot == NULL)
+    {
+        LOG_E(TAG, "Cannot allocate memory for snapshot");
+        munmap(file, sizeof(phevSnapshotFile_t));
+        close(fd);
+        return NULL;
+    }
+    snapshot->fd = fd;
+    snapshot->file = file;
+    snapshot->synced = 0;
+    snapshot->writes = 0;
+
+    LOG_V(TAG, "END - open");
+
+    return snapshot;
+}
+void phev_snapshot_close(phevSnapshot_t * snapshot)
+{
+    if(snapshot == NULL)
+    {
+        return;
+    }
+    msync(snapshot->file, sizeof(phevSnapshotFile_t), MS_SYNC);
+    munmap(snapshot->file, sizeof(phevSnapshotFile_t));
+    close(snapshot->fd);
+    free(snapshot);
+}
+size_t phev_snapshot_restore(phevSnapshot_t * snapshot, phevModel_t * model)
+{
+    LOG_V(TAG, "START - restore");
+
+    const phevSnapshotRecord_t * records = snapshot->file->records;
+    uint8_t order[256];
+    size_t count = 0;
+
+    for(int reg = 0; reg < 256; reg++)
+    {
+        if(!phev_snapshot_recordValid(&records[reg]))
+        {
+            if(records[reg].version != 0)
+            {
+                LOG_W(TAG, "Dropping corrupt record for register %02X", reg);
+            }
+            continue;
+        }
+
+        // Insert by version so the model sees the writes in their original order
+        size_t at = count++;
+
+        while(at > 0 && records[order[at - 1]].version > records[reg].version)
+        {
+            order[at] = order[at - 1];
+            at--;
+        }
+        order[at] = reg;
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        const phevSnapshotRecord_t * record = &records[order[i]];
+
+        phev_model_restoreRegister(model, order[i], record->data, record->length, record->version);
+    }
+    snapshot->synced = phev_model_version(model);
+
+    LOG_I(TAG, "Restored %d registers", (int) count);
+    LOG_V(TAG, "END - restore");
+
+    return count;
+}
+size_t phev_snapshot_sync(phevSnapshot_t * snapshot, const phevModel_t * model)
+{
+    uint8_t regs[256];
+    phevRegisterView_t view;
+    phevSnapshotFile_t * file = snapshot->file;
+
+    if(phev_model_version(model) == snapshot->synced)
+    {
+        return 0;
+    }
+
+    const size_t count = phev_model_changedSince(model, snapshot->synced, regs);
+    const uint64_t now = phev_snapshot_wallMs();
+
+    for(size_t i = 0; i < count; i++)
+    {
+        phevSnapshotRecord_t * record = &file->records[regs[i]];
+
+        if(!phev_model_viewRegister(model, regs[i], &view) || view.length > PHEV_SNAPSHOT_MAX_REGISTER)
+        {
+            memset(record, 0, sizeof(phevSnapshotRecord_t));
+            continue;
+        }
+        record->version = view.version;
+        record->time = now;
+        record->length = view.length;
+        memcpy(record->data, view.data, view.length);
+        record->checksum = phev_snapshot_recordChecksum(record);
+    }
+    file->state.modelVersion = phev_model_version(model);
+    file->state.saved = now;
+    file->state.checksum = phev_snapshot_stateChecksum(&file->state);
+
+    // The kernel writes the dirty pages back, there is no need to wait here
+    msync(file, sizeof(phevSnapshotFile_t), MS_ASYNC);
+
+    snapshot->synced = phev_model_version(model);
+    snapshot->writes += count;
+
+    return count;
+}
+uint64_t phev_snapshot_registerTime(const phevSnapshot_t * snapshot, uint8_t reg)
+{
+    const phevSnapshotRecord_t * record = &snapshot->file->records[reg];
+
+    return (phev_snapshot_recordValid(record) ? record->time : 0);
+}
+
+#else
+
+phevSnapshot_t * phev_snapshot_open(const char * path)
+{
+    LOG_W(TAG, "Snapshots are only available on Linux");
+
+    return NULL;
+}
+void phev_snapshot_close(phevSnapshot_t * snapshot)
+{
+}
+size_t phev_snapshot_restore(phevSnapshot_t * snapshot, phevModel_t * model)
+{
+    return 0;
+}
+size_t phev_snapshot_sync(phevSnapshot_t * snapshot, const phevModel_t * model)
+{
+    return 0;
+}
+uint64_t phev_snapshot_registerTime(const phevSnapshot_t * snapshot, uint8_t reg)
+{
+    return 0;
+}
+
+#endif
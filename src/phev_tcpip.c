@@ -5,6 +5,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #ifdef __linux__
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -61,22 +65,282 @@ const static char *APP_TAG = "PHEV_TCPIP";
 
 const static int loglvl = LOG_DEBUG;
 
-static uint8_t decoded[1024];
+// Every car answers on the same address, so connections are told apart by
+// the host string msg_tcpip hands back to the connect hook, not by its text.
+// The list only indexes the per vehicle state for the hooks that get a host
+// or a socket. Executor shards look connections up while other threads
+// connect, hence the lock.
+static phev_tcpip_conn_t *connections = NULL;
+static pthread_mutex_t connectionsLock = PTHREAD_MUTEX_INITIALIZER;
 
-uint8_t *xorDataWithValue(const uint8_t *data, uint8_t xor)
+static phev_tcpip_conn_t *phev_tcpip_newConnection(char *host, uint16_t port, bool owned)
 {
+    phev_tcpip_conn_t *conn = malloc(sizeof(phev_tcpip_conn_t));
 
-    uint8_t length = (data[1] ^ xor) + 2;
+    if(conn == NULL)
+    {
+        LOG_E(APP_TAG, "Cannot allocate connection for %s:%d", host, port);
+        return NULL;
+    }
+    conn->host = host;
+    conn->port = port;
+    conn->owned = owned;
+    conn->soc = -1;
+    conn->pollFd = -1;
+    conn->wakeFd = -1;
+    conn->connecting = -1;
+    conn->connectDeadline = 0;
+    conn->transport = NULL;
+    conn->next = connections;
+    connections = conn;
+
+    return conn;
+}
+// Callers hold connectionsLock
+static void phev_tcpip_unlink(phev_tcpip_conn_t *conn)
+{
+    for(phev_tcpip_conn_t **link = &connections; *link != NULL; link = &(*link)->next)
+    {
+        if(*link == conn)
+        {
+            *link = conn->next;
+            break;
+        }
+    }
+}
+phev_tcpip_conn_t *phev_tcpClientCreate(const char *host, uint16_t port)
+{
+    char *copy = (host ? strdup(host) : NULL);
+
+    if(copy == NULL)
+    {
+        LOG_E(APP_TAG, "Host not set");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&connectionsLock);
+
+    phev_tcpip_conn_t *conn = phev_tcpip_newConnection(copy, port, true);
+
+    pthread_mutex_unlock(&connectionsLock);
+
+    if(conn == NULL)
+    {
+        free(copy);
+    }
+
+    return conn;
+}
+void phev_tcpClientDestroy(phev_tcpip_conn_t *conn)
+{
+    if(conn == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&connectionsLock);
+    phev_tcpip_unlink(conn);
+    pthread_mutex_unlock(&connectionsLock);
+
+    // Sockets belong to the transport that opened them, only the state goes
+    if(conn->owned)
+    {
+        free(conn->host);
+    }
+    free(conn);
+}
+// Hosts that did not come from phev_tcpClientCreate get a connection of their
+// own for as long as they have a socket or a connect in flight
+phev_tcpip_conn_t *phev_tcpClientAttach(const char *host, uint16_t port)
+{
+    phev_tcpip_conn_t *conn;
+
+    pthread_mutex_lock(&connectionsLock);
+
+    for(conn = connections; conn != NULL; conn = conn->next)
+    {
+        if(conn->host == host && conn->port == port)
+        {
+            break;
+        }
+    }
+    if(conn == NULL)
+    {
+        conn = phev_tcpip_newConnection((char *) host, port, false);
+    }
+
+    pthread_mutex_unlock(&connectionsLock);
+
+    return conn;
+}
+// Drops a connection made by phev_tcpClientAttach once it has nothing left to track
+void phev_tcpClientRelease(phev_tcpip_conn_t *conn)
+{
+    pthread_mutex_lock(&connectionsLock);
+
+    const bool idle = (conn != NULL && !conn->owned && conn->soc < 0 && conn->connecting < 0 && conn->transport == NULL);
+
+    if(idle)
+    {
+        phev_tcpip_unlink(conn);
+    }
+
+    pthread_mutex_unlock(&connectionsLock);
+
+    if(idle)
+    {
+        free(conn);
+    }
+}
+void phev_tcpClientTrackSocket(phev_tcpip_conn_t *conn, int soc, int pollFd)
+{
+    pthread_mutex_lock(&connectionsLock);
+
+    conn->soc = soc;
+    conn->pollFd = pollFd;
+
+    pthread_mutex_unlock(&connectionsLock);
+}
+static uint64_t phev_tcpip_nowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+void phev_tcpClientSetConnecting(phev_tcpip_conn_t *conn, int soc)
+{
+    pthread_mutex_lock(&connectionsLock);
+
+    conn->connecting = soc;
+    conn->connectDeadline = (soc >= 0 ? phev_tcpip_nowMs() + PHEV_TCPIP_CONNECT_TIMEOUT_MS : 0);
+
+    pthread_mutex_unlock(&connectionsLock);
+}
+static int phev_tcpip_connectingSocket(phev_tcpip_conn_t *conn, uint64_t *deadline)
+{
+    if(conn == NULL)
+    {
+        return -1;
+    }
 
-    if(length > 1023) return NULL;
+    pthread_mutex_lock(&connectionsLock);
 
-    for (int i = 0; i < length; i++)
+    const int soc = conn->connecting;
+
+    if(deadline)
     {
-        decoded[i] = data[i] ^ xor;
+        *deadline = conn->connectDeadline;
     }
-    return (uint8_t *) decoded;
+
+    pthread_mutex_unlock(&connectionsLock);
+
+    return soc;
+}
+int phev_tcpClientConnectingSocket(phev_tcpip_conn_t *conn)
+{
+    return phev_tcpip_connectingSocket(conn, NULL);
+}
+bool phev_tcpClientConnecting(phev_tcpip_conn_t *conn)
+{
+    return phev_tcpip_connectingSocket(conn, NULL) >= 0;
 }
-static uint8_t *decode(const uint8_t *message)
+int phev_tcpClientWakeFd(int soc)
+{
+    int wakeFd = -1;
+
+    pthread_mutex_lock(&connectionsLock);
+
+    for(phev_tcpip_conn_t *conn = connections; conn != NULL; conn = conn->next)
+    {
+        if(conn->soc == soc)
+        {
+            wakeFd = conn->wakeFd;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&connectionsLock);
+
+    return wakeFd;
+}
+void phev_tcpClientSetTransport(phev_tcpip_conn_t *conn, void *transport)
+{
+    pthread_mutex_lock(&connectionsLock);
+
+    conn->transport = transport;
+
+    pthread_mutex_unlock(&connectionsLock);
+}
+void *phev_tcpClientTransport(int soc)
+{
+    void *transport = NULL;
+
+    if(soc < 0)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&connectionsLock);
+
+    for(phev_tcpip_conn_t *conn = connections; conn != NULL; conn = conn->next)
+    {
+        if(conn->soc == soc || conn->connecting == soc)
+        {
+            transport = conn->transport;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&connectionsLock);
+
+    return transport;
+}
+void phev_tcpClientSetWakeup(phev_tcpip_conn_t *conn, int fd)
+{
+    if(conn == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&connectionsLock);
+
+    conn->wakeFd = fd;
+
+    pthread_mutex_unlock(&connectionsLock);
+}
+int phev_tcpClientSocket(phev_tcpip_conn_t *conn)
+{
+    int fd = -1;
+
+    if(conn == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&connectionsLock);
+
+    if(conn->soc != -1)
+    {
+        fd = conn->pollFd;
+    }
+
+    pthread_mutex_unlock(&connectionsLock);
+
+    return fd;
+}
+
+uint8_t *xorDataWithValue(const uint8_t *data, uint8_t xor, uint8_t *decoded)
+{
+    const size_t length = (uint8_t) (data[1] ^ xor) + 2;
+
+    phev_core_xorBuffer(decoded, data, length, xor);
+
+    return decoded;
+}
+// Decodes into the caller's buffer, which must hold PHEV_TCPIP_DECODE_BUFFER_SIZE bytes
+static uint8_t *decode(const uint8_t *message, uint8_t *decoded)
 {
     uint8_t *data = NULL;
     uint8_t xor = message[2];
@@ -94,12 +358,12 @@ static uint8_t *decode(const uint8_t *message)
             {
                 xor ^= mask;
             }
-            data = xorDataWithValue(message, xor);
+            data = xorDataWithValue(message, xor, decoded);
         }
         else
         {
             xor = (message[2] & 0xfe) ^ ((message[0] & 0x01) ^ 1);
-            data = xorDataWithValue(message, xor);
+            data = xorDataWithValue(message, xor, decoded);
         }
     }
     return data;
@@ -148,12 +412,24 @@ static void my_ms_to_timeval(int timeout_ms, struct timeval *tv)
 static int tcp_poll_read(int soc, int timeout_ms)
 {
     int ret;
+    int maxFd = soc;
+    const int wakeFd = phev_tcpClientWakeFd(soc);
     fd_set readset;
     FD_ZERO(&readset);
     FD_SET(soc, &readset);
+    if (wakeFd >= 0)
+    {
+        FD_SET(wakeFd, &readset);
+        maxFd = (wakeFd > soc ? wakeFd : soc);
+    }
     struct timeval timeout;
     my_ms_to_timeval(timeout_ms, &timeout);
-    ret = select(soc + 1, &readset, NULL, NULL, &timeout);
+    ret = select(maxFd + 1, &readset, NULL, NULL, &timeout);
+    if (ret > 0 && !FD_ISSET(soc, &readset))
+    {
+        // Woken up for queued commands, behave like a read timeout
+        return 0;
+    }
     return ret;
 }
 static int tcp_read(int soc, uint8_t *buffer, int len, int timeout_ms)
@@ -254,6 +530,43 @@ int phev_tcpClientConnectSocket(const char *host, uint16_t port)
     return ConnectSocket;
 }
 #else
+// 0 once connected, EINPROGRESS while still going, otherwise the error
+static int phev_tcpip_connectResult(int sock)
+{
+    fd_set writeset;
+    struct timeval timeout = {0, 0};
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    FD_ZERO(&writeset);
+    FD_SET(sock, &writeset);
+
+    if (select(sock + 1, NULL, &writeset, NULL, &timeout) <= 0)
+    {
+        return EINPROGRESS;
+    }
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length) != 0)
+    {
+        return errno;
+    }
+    return error;
+}
+static int phev_tcpip_connected(phev_tcpip_conn_t *conn, int sock)
+{
+    // Reads and writes stay blocking as before, only the connect is not
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
+
+    LOG_I(APP_TAG, "Connected to host %s port %d", conn->host, conn->port);
+
+    phev_tcpClientTrackSocket(conn, sock, sock);
+
+    LOG_V(APP_TAG, "END - connectSocket");
+
+    return sock;
+}
+// Never blocks. The first call starts the connect and returns -1 with errno
+// set to EINPROGRESS, later calls return the socket once it is up. A connect
+// that fails or times out is reported once, the call after that starts anew.
 int phev_tcpClientConnectSocket(const char *host, uint16_t port)
 {
     LOG_V(APP_TAG, "START - connectSocket");
@@ -264,6 +577,41 @@ int phev_tcpClientConnectSocket(const char *host, uint16_t port)
         LOG_E(APP_TAG, "Host not set");
         return -1;
     }
+
+    phev_tcpip_conn_t *conn = phev_tcpClientAttach(host, port);
+
+    if (conn == NULL)
+    {
+        return -1;
+    }
+
+    uint64_t deadline = 0;
+    const int pending = phev_tcpip_connectingSocket(conn, &deadline);
+
+    if (pending >= 0)
+    {
+        const int result = phev_tcpip_connectResult(pending);
+
+        if (result == EINPROGRESS && phev_tcpip_nowMs() < deadline)
+        {
+            errno = EINPROGRESS;
+            return -1;
+        }
+
+        phev_tcpClientSetConnecting(conn, -1);
+
+        if (result == 0)
+        {
+            return phev_tcpip_connected(conn, pending);
+        }
+
+        LOG_E(APP_TAG, "Failed to connect %d", result);
+        close(pending);
+        phev_tcpClientRelease(conn);
+        errno = (result == EINPROGRESS ? ETIMEDOUT : result);
+        return -1;
+    }
+
     struct sockaddr_in addr;
     /* set up address to connect to */
     memset(&addr, 0, sizeof(addr));
@@ -279,23 +627,35 @@ int phev_tcpClientConnectSocket(const char *host, uint16_t port)
     if (sock == -1)
     {
         LOG_E(APP_TAG, "Failed to open socket");
+        phev_tcpClientRelease(conn);
 
         return -1;
     }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
     int ret = TCP_CONNECT(sock, (struct sockaddr *)(&addr), sizeof(addr));
-    if (ret == -1)
+
+    if (ret == 0)
+    {
+        return phev_tcpip_connected(conn, sock);
+    }
+    if (errno != EINPROGRESS)
     {
-        LOG_E(APP_TAG, "Failed to connect");
+        const int error = errno;
 
+        LOG_E(APP_TAG, "Failed to connect %d", error);
+        close(sock);
+        phev_tcpClientRelease(conn);
+        errno = error;
         return -1;
     }
 
-    LOG_I(APP_TAG, "Connected to host %s port %d", host, port);
+    LOG_D(APP_TAG, "Connecting to host %s port %d", host, port);
+    phev_tcpClientSetConnecting(conn, sock);
+    errno = EINPROGRESS;
 
-    //global_sock = sock;
-    LOG_V(APP_TAG, "END - connectSocket");
-
-    return sock;
+    return -1;
 }
 #endif
 
@@ -313,7 +673,8 @@ int phev_tcpClientRead(int soc, uint8_t *buf, size_t len)
     {
         LOG_BUFFER_HEXDUMP("READ",buf,num,loglvl);
         //phexdump("<< ", buf, num, LOG_INFO);
-        uint8_t * decoded = decode(buf);
+        uint8_t buffer[PHEV_TCPIP_DECODE_BUFFER_SIZE];
+        uint8_t * decoded = decode(buf, buffer);
         if (decoded)
         {
             //phexdump("<< DECODED3 ", decoded, num, LOG_INFO)
@@ -339,7 +700,8 @@ int phev_tcpClientWrite(int soc, uint8_t *buf, size_t len)
     if (num > 2 && num < 256)
     {
         LOG_BUFFER_HEXDUMP("WRITE",buf,num,loglvl);
-        uint8_t * decoded = decode(buf);
+        uint8_t buffer[PHEV_TCPIP_DECODE_BUFFER_SIZE];
+        uint8_t * decoded = decode(buf, buffer);
         if (decoded)
         {
             LOG_BUFFER_HEXDUMP("WRITE DECODED",decoded,num,loglvl);
@@ -351,6 +713,23 @@ int phev_tcpClientWrite(int soc, uint8_t *buf, size_t len)
 }
 int phev_tcpClientDisconnectSocket(int soc)
 {
+    phev_tcpip_conn_t *conn;
+
+    pthread_mutex_lock(&connectionsLock);
+
+    for(conn = connections; conn != NULL; conn = conn->next)
+    {
+        if(conn->soc == soc)
+        {
+            conn->soc = -1;
+            conn->pollFd = -1;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&connectionsLock);
+
+    phev_tcpClientRelease(conn);
     close(soc);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,803 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include "phev_tcpip_uring.h"
+#include "phev_tcpip.h"
+#include "logger.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// Multishot recv arrived after the provided buffer ring, so it implies it
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ENTER_EXT_ARG)
+#define PHEV_URING 1
+#endif
+#endif
+#endif
+
+const static char *APP_TAG = "PHEV_URING";
+
+static atomic_size_t uringEnters;
+static atomic_size_t uringReceives;
+static atomic_size_t uringBytesIn;
+static atomic_size_t uringSends;
+static atomic_size_t uringBytesOut;
+
+void phev_uringStats(phev_uring_stats_t *stats)
+{
+    stats->enters = atomic_load(&uringEnters);
+    stats->receives = atomic_load(&uringReceives);
+    stats->bytesIn = atomic_load(&uringBytesIn);
+    stats->sends = atomic_load(&uringSends);
+    stats->bytesOut = atomic_load(&uringBytesOut);
+}
+
+#ifdef PHEV_URING
+
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PHEV_URING_GROUP 0
+
+// Low byte of user_data, sends keep their length above it
+#define PHEV_URING_TAG_RECV 1
+#define PHEV_URING_TAG_SEND 2
+#define PHEV_URING_TAG_CONNECT 3
+#define PHEV_URING_TAG_TIMEOUT 4
+#define PHEV_URING_TAG_WAKE 5
+#define PHEV_URING_TAG_PENDING 6
+
+#define PHEV_URING_CONNECTING 1
+
+typedef struct phev_uring_conn_t
+{
+    int soc;
+    int ringFd;
+    bool plain;
+    uint8_t *ring;
+    size_t ringSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqLocalTail;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *bufRing;
+    uint16_t bufTail;
+    uint8_t *buffers;
+    // Received buffers not yet handed to the caller, oldest first
+    uint16_t pendingBid[PHEV_URING_BUFFERS];
+    uint32_t pendingLength[PHEV_URING_BUFFERS];
+    unsigned pendingHead;
+    unsigned pendingTail;
+    size_t pendingOffset;
+    uint8_t *sendBuffer;
+    size_t sendsInFlight;
+    int wakeFd;
+    bool recvArmed;
+    bool wakeArmed;
+    bool multishot;
+    bool woken;
+    bool eof;
+    bool failed;
+    int connectResult;
+    phev_tcpip_conn_t *link;
+} phev_uring_conn_t;
+
+// The ring lives on the vehicle's transport connection. Read and write hooks
+// only get a socket, so they find it through there.
+static phev_uring_conn_t *phev_uring_lookup(const int soc)
+{
+    return phev_tcpClientTransport(soc);
+}
+static uint64_t phev_uring_nowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+static bool phev_uring_setupRing(phev_uring_conn_t *conn)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+
+    conn->ringFd = (int) syscall(__NR_io_uring_setup, PHEV_URING_ENTRIES, &params);
+
+    if(conn->ringFd < 0)
+    {
+        return false;
+    }
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+    {
+        close(conn->ringFd);
+        conn->ringFd = -1;
+        return false;
+    }
+
+    const size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    conn->ringSize = (sqSize > cqSize ? sqSize : cqSize);
+    conn->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    conn->ring = mmap(NULL, conn->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, conn->ringFd, IORING_OFF_SQ_RING);
+    conn->sqes = mmap(NULL, conn->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, conn->ringFd, IORING_OFF_SQES);
+
+    if(conn->ring == MAP_FAILED || conn->sqes == MAP_FAILED)
+    {
+        if(conn->ring != MAP_FAILED)
+        {
+            munmap(conn->ring, conn->ringSize);
+        }
+        if(conn->sqes != MAP_FAILED)
+        {
+            munmap(conn->sqes, conn->sqesSize);
+        }
+        conn->ring = NULL;
+        conn->sqes = NULL;
+        close(conn->ringFd);
+        conn->ringFd = -1;
+        return false;
+    }
+
+    conn->sqHead = (unsigned *) (conn->ring + params.sq_off.head);
+    conn->sqTail = (unsigned *) (conn->ring + params.sq_off.tail);
+    conn->sqArray = (unsigned *) (conn->ring + params.sq_off.array);
+    conn->sqMask = *(unsigned *) (conn->ring + params.sq_off.ring_mask);
+    conn->sqEntries = params.sq_entries;
+    conn->sqLocalTail = *conn->sqTail;
+    conn->cqHead = (unsigned *) (conn->ring + params.cq_off.head);
+    conn->cqTail = (unsigned *) (conn->ring + params.cq_off.tail);
+    conn->cqMask = *(unsigned *) (conn->ring + params.cq_off.ring_mask);
+    conn->cqes = (struct io_uring_cqe *) (conn->ring + params.cq_off.cqes);
+
+    return true;
+}
+static void phev_uring_releaseRing(phev_uring_conn_t *conn)
+{
+    if(conn->ringFd >= 0)
+    {
+        munmap(conn->sqes, conn->sqesSize);
+        munmap(conn->ring, conn->ringSize);
+        close(conn->ringFd);
+        conn->ringFd = -1;
+    }
+    free(conn->bufRing);
+    free(conn->buffers);
+    free(conn->sendBuffer);
+    conn->bufRing = NULL;
+    conn->buffers = NULL;
+    conn->sendBuffer = NULL;
+}
+// Submits everything queued and, when minComplete is set, waits for that many
+// completions or until the timeout. A negative timeout waits for ever.
+static int phev_uring_submit(phev_uring_conn_t *conn, const unsigned minComplete, const int timeoutMs)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t argSize = 0;
+    unsigned flags = 0;
+
+    __atomic_store_n(conn->sqTail, conn->sqLocalTail, __ATOMIC_RELEASE);
+
+    const unsigned toSubmit = conn->sqLocalTail - __atomic_load_n(conn->sqHead, __ATOMIC_ACQUIRE);
+
+    if(toSubmit == 0 && minComplete == 0)
+    {
+        return 0;
+    }
+    if(minComplete > 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+        if(timeoutMs >= 0)
+        {
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (long long) (timeoutMs % 1000) * 1000000;
+            memset(&arg, 0, sizeof(arg));
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+            argp = &arg;
+            argSize = sizeof(arg);
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+    }
+
+    atomic_fetch_add_explicit(&uringEnters, 1, memory_order_relaxed);
+
+    if(syscall(__NR_io_uring_enter, conn->ringFd, toSubmit, minComplete, flags, argp, argSize) < 0
+        && errno != ETIME && errno != EINTR)
+    {
+        LOG_E(APP_TAG, "Ring enter failed %d", errno);
+        return -1;
+    }
+    return 0;
+}
+static struct io_uring_sqe *phev_uring_sqe(phev_uring_conn_t *conn)
+{
+    if(conn->sqLocalTail - __atomic_load_n(conn->sqHead, __ATOMIC_ACQUIRE) >= conn->sqEntries)
+    {
+        phev_uring_submit(conn, 0, -1);
+    }
+
+    const unsigned index = conn->sqLocalTail & conn->sqMask;
+    struct io_uring_sqe *sqe = &conn->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    conn->sqArray[index] = index;
+    conn->sqLocalTail++;
+
+    return sqe;
+}
+static void phev_uring_provide(phev_uring_conn_t *conn, const uint16_t bid)
+{
+    struct io_uring_buf *buf = &conn->bufRing->bufs[conn->bufTail & (PHEV_URING_BUFFERS - 1)];
+
+    buf->addr = (uint64_t) (uintptr_t) (conn->buffers + (size_t) bid * PHEV_URING_BUFFER_SIZE);
+    buf->len = PHEV_URING_BUFFER_SIZE;
+    buf->bid = bid;
+    conn->bufTail++;
+    __atomic_store_n(&conn->bufRing->tail, conn->bufTail, __ATOMIC_RELEASE);
+}
+static bool phev_uring_registerBuffers(phev_uring_conn_t *conn)
+{
+    struct io_uring_buf_reg reg;
+    struct iovec iov;
+
+    if(posix_memalign((void **) &conn->bufRing, 4096, PHEV_URING_BUFFERS * sizeof(struct io_uring_buf)) != 0)
+    {
+        conn->bufRing = NULL;
+        return false;
+    }
+    memset(conn->bufRing, 0, PHEV_URING_BUFFERS * sizeof(struct io_uring_buf));
+    conn->buffers = malloc(PHEV_URING_BUFFERS * PHEV_URING_BUFFER_SIZE);
+    conn->sendBuffer = malloc(PHEV_URING_SEND_BUFFER_SIZE);
+
+    if(conn->buffers == NULL || conn->sendBuffer == NULL)
+    {
+        return false;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) conn->bufRing;
+    reg.ring_entries = PHEV_URING_BUFFERS;
+    reg.bgid = PHEV_URING_GROUP;
+
+    if(syscall(__NR_io_uring_register, conn->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        return false;
+    }
+    for(uint16_t bid = 0; bid < PHEV_URING_BUFFERS; bid++)
+    {
+        phev_uring_provide(conn, bid);
+    }
+
+    iov.iov_base = conn->sendBuffer;
+    iov.iov_len = PHEV_URING_SEND_BUFFER_SIZE;
+
+    return syscall(__NR_io_uring_register, conn->ringFd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+}
+// Queues whatever has stopped: a multishot recv ends when it runs out of
+// buffers, or straight away where the kernel only does single shots
+static void phev_uring_arm(phev_uring_conn_t *conn)
+{
+    if(!conn->recvArmed && !conn->eof && !conn->failed)
+    {
+        struct io_uring_sqe *sqe = phev_uring_sqe(conn);
+
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->soc;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = PHEV_URING_GROUP;
+        sqe->ioprio = (conn->multishot ? IORING_RECV_MULTISHOT : 0);
+        sqe->user_data = PHEV_URING_TAG_RECV;
+        conn->recvArmed = true;
+    }
+    if(!conn->wakeArmed && conn->wakeFd >= 0)
+    {
+        struct io_uring_sqe *sqe = phev_uring_sqe(conn);
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = conn->wakeFd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = PHEV_URING_TAG_WAKE;
+        conn->wakeArmed = true;
+    }
+}
+// Completions only touch the ring memory, no syscall
+static void phev_uring_reap(phev_uring_conn_t *conn)
+{
+    unsigned head = *conn->cqHead;
+    const unsigned tail = __atomic_load_n(conn->cqTail, __ATOMIC_ACQUIRE);
+
+    while(head != tail)
+    {
+        const struct io_uring_cqe *cqe = &conn->cqes[head & conn->cqMask];
+        const bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+        switch(cqe->user_data & 0xff)
+        {
+            case PHEV_URING_TAG_RECV:
+            {
+                if(!more)
+                {
+                    conn->recvArmed = false;
+                }
+                if(cqe->res > 0)
+                {
+                    const unsigned slot = conn->pendingTail++ % PHEV_URING_BUFFERS;
+
+                    conn->pendingBid[slot] = (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                    conn->pendingLength[slot] = (uint32_t) cqe->res;
+                    atomic_fetch_add_explicit(&uringReceives, 1, memory_order_relaxed);
+                    atomic_fetch_add_explicit(&uringBytesIn, (size_t) cqe->res, memory_order_relaxed);
+                }
+                else if(cqe->res == 0)
+                {
+                    conn->eof = true;
+                }
+                else if(cqe->res == -EINVAL && conn->multishot)
+                {
+                    LOG_W(APP_TAG, "Multishot receive not supported, using single shots");
+                    conn->multishot = false;
+                }
+                else if(cqe->res != -ENOBUFS)
+                {
+                    LOG_E(APP_TAG, "Receive failed %d", -cqe->res);
+                    conn->failed = true;
+                }
+                break;
+            }
+            case PHEV_URING_TAG_SEND:
+            {
+                conn->sendsInFlight--;
+                if(cqe->res != (int) (cqe->user_data >> 8))
+                {
+                    LOG_E(APP_TAG, "Send failed %d", cqe->res);
+                    conn->failed = true;
+                }
+                break;
+            }
+            case PHEV_URING_TAG_WAKE:
+            {
+                conn->woken = true;
+                if(!more)
+                {
+                    conn->wakeArmed = false;
+                }
+                break;
+            }
+            case PHEV_URING_TAG_CONNECT:
+            {
+                conn->connectResult = cqe->res;
+                break;
+            }
+            default:
+                break;
+        }
+        head++;
+    }
+    __atomic_store_n(conn->cqHead, head, __ATOMIC_RELEASE);
+}
+static size_t phev_uring_copyPending(phev_uring_conn_t *conn, uint8_t *buf, const size_t len)
+{
+    size_t copied = 0;
+
+    while(copied < len && conn->pendingHead != conn->pendingTail)
+    {
+        const unsigned slot = conn->pendingHead % PHEV_URING_BUFFERS;
+        const size_t remaining = conn->pendingLength[slot] - conn->pendingOffset;
+        const size_t chunk = (remaining < len - copied ? remaining : len - copied);
+
+        memcpy(buf + copied, conn->buffers + (size_t) conn->pendingBid[slot] * PHEV_URING_BUFFER_SIZE + conn->pendingOffset, chunk);
+        copied += chunk;
+        conn->pendingOffset += chunk;
+
+        if(conn->pendingOffset == conn->pendingLength[slot])
+        {
+            phev_uring_provide(conn, conn->pendingBid[slot]);
+            conn->pendingOffset = 0;
+            conn->pendingHead++;
+        }
+    }
+    return copied;
+}
+// Separate submissions to one socket may complete out of order, so a new
+// write waits for the previous one. Sends normally complete inside the enter
+// that submitted them, so this rarely blocks.
+static void phev_uring_waitForSends(phev_uring_conn_t *conn)
+{
+    const uint64_t deadline = phev_uring_nowMs() + TCP_READ_TIMEOUT;
+
+    phev_uring_reap(conn);
+
+    while(conn->sendsInFlight > 0 && !conn->failed)
+    {
+        const uint64_t now = phev_uring_nowMs();
+
+        if(now >= deadline)
+        {
+            LOG_E(APP_TAG, "Send timed out");
+            conn->failed = true;
+            break;
+        }
+        if(phev_uring_submit(conn, 1, (int) (deadline - now)) != 0)
+        {
+            conn->failed = true;
+            break;
+        }
+        phev_uring_reap(conn);
+    }
+}
+static void phev_uring_destroy(phev_uring_conn_t *conn)
+{
+    phev_uring_releaseRing(conn);
+    free(conn);
+}
+bool phev_uringSupported(void)
+{
+    static atomic_int supported = -1;
+    int known = atomic_load(&supported);
+
+    if(known >= 0)
+    {
+        return known == 1;
+    }
+
+    const uint8_t needed[] = {
+        IORING_OP_CONNECT, IORING_OP_RECV, IORING_OP_WRITE_FIXED,
+        IORING_OP_LINK_TIMEOUT, IORING_OP_POLL_ADD, IORING_OP_NOP,
+    };
+    phev_uring_conn_t conn;
+    const size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probeSize);
+
+    memset(&conn, 0, sizeof(conn));
+    known = 0;
+
+    if(probe != NULL && phev_uring_setupRing(&conn))
+    {
+        if(syscall(__NR_io_uring_register, conn.ringFd, IORING_REGISTER_PROBE, probe, 256) == 0)
+        {
+            known = 1;
+            for(size_t i = 0; i < sizeof(needed); i++)
+            {
+                if(needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+                {
+                    known = 0;
+                }
+            }
+        }
+        phev_uring_releaseRing(&conn);
+    }
+    free(probe);
+
+    LOG_I(APP_TAG, "io_uring %s", known ? "available" : "not available");
+    atomic_store(&supported, known);
+
+    return known == 1;
+}
+// Runs completions the kernel still owes us without waiting for any
+static void phev_uring_poll(phev_uring_conn_t *conn)
+{
+    atomic_fetch_add_explicit(&uringEnters, 1, memory_order_relaxed);
+    syscall(__NR_io_uring_enter, conn->ringFd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+    phev_uring_reap(conn);
+}
+static int phev_uring_startConnect(phev_tcpip_conn_t *link)
+{
+    const char *host = link->host;
+    const uint16_t port = link->port;
+    phev_uring_conn_t *conn = calloc(1, sizeof(phev_uring_conn_t));
+
+    if(conn == NULL)
+    {
+        LOG_E(APP_TAG, "Cannot allocate ring state");
+        phev_tcpClientRelease(link);
+        return -1;
+    }
+
+    conn->link = link;
+    conn->ringFd = -1;
+    conn->wakeFd = -1;
+    conn->multishot = true;
+
+    if(!phev_uring_setupRing(conn))
+    {
+        LOG_W(APP_TAG, "io_uring not available, using a plain socket");
+        free(conn);
+        return phev_tcpClientConnectSocket(host, port);
+    }
+
+    struct sockaddr_in addr;
+    struct __kernel_timespec timeout = {
+        .tv_sec = PHEV_URING_CONNECT_TIMEOUT_MS / 1000,
+        .tv_nsec = (PHEV_URING_CONNECT_TIMEOUT_MS % 1000) * 1000000,
+    };
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(host);
+
+    conn->soc = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(conn->soc < 0)
+    {
+        LOG_E(APP_TAG, "Failed to open socket");
+        phev_uring_destroy(conn);
+        phev_tcpClientRelease(link);
+        return -1;
+    }
+
+    // The connect and its timeout go in as one linked pair. Both are copied
+    // by the kernel when submitted, so the stack is fine.
+    struct io_uring_sqe *sqe = phev_uring_sqe(conn);
+
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = conn->soc;
+    sqe->addr = (uint64_t) (uintptr_t) &addr;
+    sqe->off = sizeof(addr);
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = PHEV_URING_TAG_CONNECT;
+
+    sqe = phev_uring_sqe(conn);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) &timeout;
+    sqe->len = 1;
+    sqe->user_data = PHEV_URING_TAG_TIMEOUT;
+
+    conn->connectResult = PHEV_URING_CONNECTING;
+
+    if(phev_uring_submit(conn, 0, -1) != 0)
+    {
+        close(conn->soc);
+        phev_uring_destroy(conn);
+        phev_tcpClientRelease(link);
+        return -1;
+    }
+
+    LOG_D(APP_TAG, "Connecting to host %s port %d", host, port);
+    phev_tcpClientSetTransport(link, conn);
+    phev_tcpClientSetConnecting(link, conn->soc);
+    errno = EINPROGRESS;
+
+    return -1;
+}
+static int phev_uring_finishConnect(phev_uring_conn_t *conn)
+{
+    phev_tcpip_conn_t *link = conn->link;
+    const int soc = conn->soc;
+
+    phev_tcpClientSetConnecting(link, -1);
+
+    if(conn->connectResult != 0)
+    {
+        LOG_E(APP_TAG, "Failed to connect %d", -conn->connectResult);
+        phev_tcpClientSetTransport(link, NULL);
+        phev_uring_destroy(conn);
+        close(soc);
+        phev_tcpClientRelease(link);
+        return -1;
+    }
+
+    if(!phev_uring_registerBuffers(conn))
+    {
+        LOG_W(APP_TAG, "Cannot register io_uring buffers, using a plain socket");
+        phev_uring_releaseRing(conn);
+        conn->plain = true;
+    }
+
+    phev_tcpClientTrackSocket(link, soc, (conn->plain ? soc : conn->ringFd));
+
+    if(!conn->plain)
+    {
+        conn->wakeFd = phev_tcpClientWakeFd(soc);
+        phev_uring_arm(conn);
+        phev_uring_submit(conn, 0, -1);
+    }
+
+    LOG_I(APP_TAG, "Connected to host %s port %d", link->host, link->port);
+
+    return soc;
+}
+// Same contract as phev_tcpClientConnectSocket: never blocks, returns -1 with
+// errno EINPROGRESS until the connect completes
+int phev_uringClientConnectSocket(const char *host, uint16_t port)
+{
+    LOG_V(APP_TAG, "START - connectSocket");
+
+    if(host == NULL)
+    {
+        LOG_E(APP_TAG, "Host not set");
+        return -1;
+    }
+
+    phev_tcpip_conn_t *link = phev_tcpClientAttach(host, port);
+
+    if(link == NULL)
+    {
+        return -1;
+    }
+
+    const int pending = phev_tcpClientConnectingSocket(link);
+
+    if(pending < 0)
+    {
+        return phev_uring_startConnect(link);
+    }
+
+    phev_uring_conn_t *conn = phev_uring_lookup(pending);
+
+    if(conn == NULL)
+    {
+        // Fell back to a plain socket when the connect started
+        return phev_tcpClientConnectSocket(host, port);
+    }
+
+    phev_uring_reap(conn);
+    if(conn->connectResult == PHEV_URING_CONNECTING)
+    {
+        phev_uring_poll(conn);
+    }
+    if(conn->connectResult == PHEV_URING_CONNECTING)
+    {
+        errno = EINPROGRESS;
+        return -1;
+    }
+
+    const int soc = phev_uring_finishConnect(conn);
+
+    LOG_V(APP_TAG, "END - connectSocket");
+
+    return soc;
+}
+int phev_uringClientRead(int soc, uint8_t *buf, size_t len)
+{
+    LOG_V(APP_TAG, "START - read");
+
+    phev_uring_conn_t *conn = phev_uring_lookup(soc);
+
+    if(conn == NULL || conn->plain)
+    {
+        return phev_tcpClientRead(soc, buf, len);
+    }
+
+    phev_uring_reap(conn);
+
+    size_t copied = phev_uring_copyPending(conn, buf, len);
+
+    if(copied == 0 && !conn->woken && !conn->eof && !conn->failed)
+    {
+        phev_uring_arm(conn);
+        phev_uring_submit(conn, 1, TCP_READ_TIMEOUT);
+        phev_uring_reap(conn);
+        copied = phev_uring_copyPending(conn, buf, len);
+    }
+
+    phev_uring_arm(conn);
+    if(conn->pendingHead != conn->pendingTail)
+    {
+        // The caller's buffer was too small. A nop completion keeps the ring
+        // readable so whoever polls it comes back for the rest.
+        struct io_uring_sqe *sqe = phev_uring_sqe(conn);
+
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = PHEV_URING_TAG_PENDING;
+    }
+    phev_uring_submit(conn, 0, -1);
+    conn->woken = false;
+
+    LOG_D(APP_TAG, "Read %zu bytes from ring", copied);
+    LOG_V(APP_TAG, "END - read");
+
+    if(copied > 0)
+    {
+        return (int) copied;
+    }
+    return (conn->eof || conn->failed ? -1 : 0);
+}
+int phev_uringClientWrite(int soc, uint8_t *buf, size_t len)
+{
+    LOG_V(APP_TAG, "START - write");
+
+    phev_uring_conn_t *conn = phev_uring_lookup(soc);
+
+    if(conn == NULL || conn->plain)
+    {
+        return phev_tcpClientWrite(soc, buf, len);
+    }
+
+    size_t written = 0;
+
+    while(written < len && !conn->failed)
+    {
+        phev_uring_waitForSends(conn);
+        if(conn->failed)
+        {
+            break;
+        }
+
+        const size_t chunk = (len - written < PHEV_URING_SEND_BUFFER_SIZE ? len - written : PHEV_URING_SEND_BUFFER_SIZE);
+        struct io_uring_sqe *sqe = phev_uring_sqe(conn);
+
+        memcpy(conn->sendBuffer, buf + written, chunk);
+
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = soc;
+        sqe->addr = (uint64_t) (uintptr_t) conn->sendBuffer;
+        sqe->len = (uint32_t) chunk;
+        sqe->buf_index = 0;
+        sqe->user_data = PHEV_URING_TAG_SEND | ((uint64_t) chunk << 8);
+
+        conn->sendsInFlight++;
+        written += chunk;
+        atomic_fetch_add_explicit(&uringSends, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&uringBytesOut, chunk, memory_order_relaxed);
+
+        if(phev_uring_submit(conn, 0, -1) != 0)
+        {
+            conn->failed = true;
+        }
+    }
+
+    LOG_D(APP_TAG, "Queued %zu bytes on ring", written);
+    LOG_V(APP_TAG, "END - write");
+
+    return (conn->failed ? -1 : (int) len);
+}
+int phev_uringClientDisconnectSocket(int soc)
+{
+    phev_uring_conn_t *conn = phev_uring_lookup(soc);
+
+    if(conn != NULL)
+    {
+        phev_tcpClientSetTransport(conn->link, NULL);
+        phev_uring_destroy(conn);
+    }
+    return phev_tcpClientDisconnectSocket(soc);
+}
+
+#else
+
+bool phev_uringSupported(void)
+{
+    return false;
+}
+int phev_uringClientConnectSocket(const char *host, uint16_t port)
+{
+    return phev_tcpClientConnectSocket(host, port);
+}
+int phev_uringClientDisconnectSocket(int soc)
+{
+    return phev_tcpClientDisconnectSocket(soc);
+}
+int phev_uringClientRead(int soc, uint8_t *buf, size_t len)
+{
+    return phev_tcpClientRead(soc, buf, len);
+}
+int phev_uringClientWrite(int soc, uint8_t *buf, size_t len)
+{
+    return phev_tcpClientWrite(soc, buf, len);
+}
+
+#endif
@@ -900,6 +900,268 @@ void test_core_phev_core_extractIncomingMessageValidFirstByteCommand(void)
     TEST_ASSERT_EQUAL_HEX8_ARRAY(expected,message->data,sizeof(expected));
     
 }
+void test_phev_core_decodeFrame_matches_decodeMessage(void)
+{
+    const uint8_t frame1[] = { 0x4f,0x26,0x20,0x23,0x21,0x31,0x43,0xcd };
+    const uint8_t frame2[] = { 0x3f,0x04,0x01,0x00,0x00,0x44 };
+    const uint8_t frame3[] = { 0xa1,0x9a,0x9f,0x96,0x9e,0xd2 };
+    const uint8_t frame4[] = { 0x5F,0x34,0x31,0x35,0x30,0x49 };
+    const uint8_t frame5[] = { 0xF1,0x9A,0x9E,0x85,0x9F,0x11 };
+    const uint8_t frame6[] = { 0x4E,0x0C,0x00,0x01,0x04,0x69,0x1D,0x04,0x61,0x94,0xF2,0x3F,0x02,0x11 };
+    const uint8_t frame7[] = { 0xB1,0x0E,0x0B,0x91,0x00,0x6F };
+    const uint8_t frame8[] = { 0xDE,0x16,0x13,0xC4,0x3B,0xC2 };
+    const uint8_t frame9[] = { 0xd6,0xae,0xb9,0xac,0xb9,0xf3,0xf4,0xf8,0xe1,0xfd,0xfe,0xfe,0x8b,0xee,0xfe,0xe3,0x89,0x89,0x8b,0x89,0x8a,0x8c,0xb8,0xb8,0x4a };
+    const uint8_t frame10[] = { 0x4F,0x0C,0x00,0x01,0x04,0x69,0x1D,0x04,0x61,0x94,0xF2,0x3F,0x02,0x11 };
+
+    const uint8_t * frames[] = { singleMessage, doubleMessage, frame1, frame2, frame3, frame4, frame5, frame6, frame7, frame8, frame9, frame10 };
+    const size_t lengths[] = { sizeof(singleMessage), sizeof(doubleMessage), sizeof(frame1), sizeof(frame2), sizeof(frame3), sizeof(frame4), sizeof(frame5), sizeof(frame6), sizeof(frame7), sizeof(frame8), sizeof(frame9), sizeof(frame10) };
+
+    for (int i = 0; i < sizeof(frames) / sizeof(frames[0]); i++)
+    {
+        uint8_t scratch[PHEV_CORE_MAX_FRAME_SIZE];
+        phevFrame_t frame;
+        phevMessage_t msg;
+
+        int frameRet = phev_core_decodeFrame(frames[i], lengths[i], scratch, sizeof(scratch), &frame);
+        int msgRet = phev_core_decodeMessage(frames[i], lengths[i], &msg);
+        message_t * decoded = phev_core_extractAndDecodeIncomingMessageAndXOR(frames[i]);
+
+        TEST_ASSERT_EQUAL(msgRet, frameRet);
+        TEST_ASSERT_EQUAL(decoded != NULL, frameRet);
+        if (frameRet == 0)
+        {
+            continue;
+        }
+        TEST_ASSERT_EQUAL(msg.command, frame.command);
+        TEST_ASSERT_EQUAL(msg.type, frame.type);
+        TEST_ASSERT_EQUAL(msg.reg, frame.reg);
+        TEST_ASSERT_EQUAL(msg.XOR, frame.XOR);
+        TEST_ASSERT_EQUAL(msg.checksum, frame.checksum);
+        TEST_ASSERT_EQUAL(msg.length, frame.length);
+        TEST_ASSERT_EQUAL(decoded->length, frame.frameLength);
+        TEST_ASSERT_EQUAL(decoded->data[0], frame.command);
+        TEST_ASSERT_EQUAL(phev_core_getMessageXOR(decoded), frame.XOR);
+        if (frame.length > 0)
+        {
+            TEST_ASSERT_EQUAL_HEX8_ARRAY(msg.data, frame.data, frame.length);
+            TEST_ASSERT_EQUAL_HEX8_ARRAY(decoded->data + 4, frame.data, frame.length);
+        }
+        free(msg.data);
+        msg_utils_destroyMsg(decoded);
+    }
+}
+void test_phev_core_scanFrameXOR(void)
+{
+    const uint8_t input[] = { 0x5F,0x34,0x31,0x35,0x30,0x49 };
+    const uint8_t bad[] = { 0x5F,0x34,0x31,0x35,0x30,0x48 };
+
+    TEST_ASSERT_EQUAL(6, phev_core_scanFrameXOR(input, sizeof(input), 0x30));
+    TEST_ASSERT_EQUAL(0, phev_core_scanFrameXOR(input, sizeof(input), 0x31));
+    TEST_ASSERT_EQUAL(0, phev_core_scanFrameXOR(bad, sizeof(bad), 0x30));
+    TEST_ASSERT_EQUAL(0, phev_core_scanFrameXOR(input, sizeof(input) - 1, 0x30));
+}
+void test_phev_core_findIncomingXOR_hint(void)
+{
+    const uint8_t odd[] = { 0x5F,0x34,0x31,0x35,0x30,0x49 };
+    const uint8_t even[] = { 0xF1,0x9A,0x9E,0x85,0x9F,0x11 };
+    const uint8_t clear[] = { 0x6F,0x04,0x01,0x07,0x00,0x7B };
+    uint8_t hint = PHEV_CORE_XOR_HINT_PLAIN;
+    uint8_t xor = 0;
+
+    TEST_ASSERT_EQUAL(sizeof(odd), phev_core_findIncomingXOR(odd, sizeof(odd), &hint, &xor));
+    TEST_ASSERT_EQUAL(0x30, xor);
+    TEST_ASSERT_EQUAL(PHEV_CORE_XOR_HINT_KEY_FLIP, hint);
+
+    TEST_ASSERT_EQUAL(sizeof(odd), phev_core_findIncomingXOR(odd, sizeof(odd), &hint, &xor));
+    TEST_ASSERT_EQUAL(0x30, xor);
+
+    TEST_ASSERT_EQUAL(sizeof(even), phev_core_findIncomingXOR(even, sizeof(even), &hint, &xor));
+    TEST_ASSERT_EQUAL(0x9e, xor);
+    TEST_ASSERT_EQUAL(PHEV_CORE_XOR_HINT_KEY, hint);
+
+    TEST_ASSERT_EQUAL(sizeof(clear), phev_core_findIncomingXOR(clear, sizeof(clear), &hint, &xor));
+    TEST_ASSERT_EQUAL(0, xor);
+    TEST_ASSERT_EQUAL(PHEV_CORE_XOR_HINT_PLAIN, hint);
+}
+void test_phev_core_scanIncomingFrame(void)
+{
+    const uint8_t clear[] = { 0x6F,0x04,0x01,0x07,0x00,0x7B };
+    const uint8_t garbage[] = { 0x00,0x00,0x00,0x00 };
+    uint8_t hint = PHEV_CORE_XOR_HINT_PLAIN;
+    uint8_t xor = 0xff;
+    size_t length = 0;
+
+    TEST_ASSERT_EQUAL(PHEV_CORE_SCAN_OK, phev_core_scanIncomingFrame(clear, sizeof(clear), &hint, &xor, &length));
+    TEST_ASSERT_EQUAL(sizeof(clear), length);
+    TEST_ASSERT_EQUAL(0, xor);
+
+    TEST_ASSERT_EQUAL(PHEV_CORE_SCAN_INCOMPLETE, phev_core_scanIncomingFrame(clear, 2, &hint, &xor, &length));
+    TEST_ASSERT_EQUAL(PHEV_CORE_SCAN_INCOMPLETE, phev_core_scanIncomingFrame(clear, 4, &hint, &xor, &length));
+    TEST_ASSERT_EQUAL(PHEV_CORE_SCAN_INVALID, phev_core_scanIncomingFrame(garbage, sizeof(garbage), &hint, &xor, &length));
+}
+void test_phev_core_scanIncomingFrame_resyncs_past_partial_looking_byte(void)
+{
+    const uint8_t data[] = { 0x6F,0x6F,0x04,0x01,0x07,0x00,0x7B };
+    uint8_t hint = PHEV_CORE_XOR_HINT_PLAIN;
+    uint8_t xor = 0xff;
+    size_t length = 0;
+
+    TEST_ASSERT_EQUAL(PHEV_CORE_SCAN_INCOMPLETE, phev_core_scanIncomingFrame(data, 4, &hint, &xor, &length));
+    TEST_ASSERT_EQUAL(PHEV_CORE_SCAN_INVALID, phev_core_scanIncomingFrame(data, sizeof(data), &hint, &xor, &length));
+    TEST_ASSERT_EQUAL(PHEV_CORE_SCAN_OK, phev_core_scanIncomingFrame(data + 1, sizeof(data) - 1, &hint, &xor, &length));
+    TEST_ASSERT_EQUAL(6, length);
+}
+void test_phev_core_renderTemplate_matches_encodeFrame(void)
+{
+    uint8_t expected[PHEV_CORE_TEMPLATE_SIZE];
+    uint8_t out[PHEV_CORE_TEMPLATE_SIZE];
+
+    for (int id = 0; id < PHEV_CORE_TEMPLATE_COUNT; id++)
+    {
+        const uint8_t * frame = phev_core_frameTemplate(id);
+        const uint8_t reg = (id <= PHEV_CORE_TEMPLATE_ACK_MY18 ? 0x12 : frame[3]);
+
+        TEST_ASSERT_EQUAL(PHEV_CORE_TEMPLATE_SIZE, phev_core_encodeFrame(expected, sizeof(expected), frame[0], frame[2], reg, &frame[4], 1, 0x5a));
+        TEST_ASSERT_EQUAL(PHEV_CORE_TEMPLATE_SIZE, phev_core_renderTemplate(out, sizeof(out), id, reg, 0x5a));
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, out, PHEV_CORE_TEMPLATE_SIZE);
+    }
+
+    TEST_ASSERT_EQUAL(PHEV_CORE_TEMPLATE_HEADLIGHTS_ON, phev_core_registerTemplate(KO_WF_H_LAMP_CONT_SP, 1));
+    TEST_ASSERT_EQUAL(PHEV_CORE_TEMPLATE_UPDATE_ALL, phev_core_registerTemplate(KO_WF_EV_UPDATE_SP, 3));
+    TEST_ASSERT_EQUAL(PHEV_CORE_TEMPLATE_NONE, phev_core_registerTemplate(KO_WF_EV_UPDATE_SP, 4));
+    TEST_ASSERT_EQUAL(PHEV_CORE_TEMPLATE_ACK, phev_core_ackTemplate(RESP_CMD));
+    TEST_ASSERT_EQUAL(PHEV_CORE_TEMPLATE_NONE, phev_core_ackTemplate(0x4e));
+    TEST_ASSERT_EQUAL(0, phev_core_renderTemplate(out, sizeof(out) - 1, PHEV_CORE_TEMPLATE_PING, 0, 0));
+}
+void test_phev_core_messageFrame_decodes_once(void)
+{
+    const uint8_t odd[] = { 0x5F,0x34,0x31,0x35,0x30,0x49 };
+    const uint8_t clear[] = { 0x6F,0x04,0x01,0x07,0x00,0x7B };
+
+    message_t * encoded = phev_core_createMsgFrame(odd, sizeof(odd), 0x30, true);
+    const phevFrame_t * frame = phev_core_messageFrame(encoded);
+
+    TEST_ASSERT_NOT_NULL(frame);
+    TEST_ASSERT_EQUAL_PTR(frame, phev_core_messageFrame(encoded));
+    TEST_ASSERT_EQUAL(0x6F, frame->command);
+    TEST_ASSERT_EQUAL(0x05, frame->reg);
+    TEST_ASSERT_EQUAL(0x30, phev_core_getMessageXOR(encoded));
+    TEST_ASSERT_TRUE(phev_core_messageEncoded(encoded));
+
+    message_t * plain = msg_utils_createMsg(clear, sizeof(clear));
+
+    frame = phev_core_messageFrame(plain);
+
+    TEST_ASSERT_NOT_NULL(frame);
+    TEST_ASSERT_EQUAL_PTR(frame, phev_core_messageFrame(plain));
+    TEST_ASSERT_EQUAL(0x07, frame->reg);
+    TEST_ASSERT_EQUAL(1, frame->length);
+    TEST_ASSERT_EQUAL(0, phev_core_getMessageXOR(plain));
+    TEST_ASSERT_FALSE(phev_core_messageEncoded(plain));
+
+    msg_utils_destroyMsg(encoded);
+    msg_utils_destroyMsg(plain);
+}
+void test_phev_core_xorBuffer_and_xorSum(void)
+{
+    uint8_t input[300];
+    uint8_t out[300];
+
+    for (int i = 0; i < sizeof(input); i++)
+    {
+        input[i] = (uint8_t) (i * 37 + 11);
+    }
+
+    for (size_t length = 0; length <= sizeof(input); length += 7)
+    {
+        uint8_t sum = 0;
+
+        phev_core_xorBuffer(out, input, length, 0xa5);
+
+        for (size_t i = 0; i < length; i++)
+        {
+            TEST_ASSERT_EQUAL_HEX8(input[i] ^ 0xa5, out[i]);
+            sum += input[i] ^ 0xa5;
+        }
+        TEST_ASSERT_EQUAL_HEX8(sum, phev_core_xorSum(input, length, 0xa5));
+    }
+}
+void test_phev_core_decodeFrames(void)
+{
+    const uint8_t input[] = {0xFD,0xC6,0xC3,0xD9,0xC2,0x9D,0xAD,0xCB,0xC2,0xE0,0xC2,0xC2,0x3D,0xBD,0x3D,0xC3,0xDA,0x6F,0x04,0x01,0x07,0x00,0x7B,0x6F};
+    uint8_t scratch[PHEV_CORE_MAX_FRAME_SIZE];
+    phevFrame_t frames[4];
+    size_t consumed = 0;
+
+    size_t numFrames = phev_core_decodeFrames(input, sizeof(input), scratch, sizeof(scratch), frames, 4, &consumed);
+
+    TEST_ASSERT_EQUAL(3, numFrames);
+    TEST_ASSERT_EQUAL(sizeof(input) - 1, consumed);
+
+    size_t offset = 0;
+    for (int i = 0; i < numFrames; i++)
+    {
+        uint8_t single[PHEV_CORE_MAX_FRAME_SIZE];
+        phevFrame_t frame;
+
+        TEST_ASSERT_EQUAL(1, phev_core_decodeFrame(input + offset, sizeof(input) - offset, single, sizeof(single), &frame));
+        TEST_ASSERT_EQUAL(frame.command, frames[i].command);
+        TEST_ASSERT_EQUAL(frame.reg, frames[i].reg);
+        TEST_ASSERT_EQUAL(frame.XOR, frames[i].XOR);
+        TEST_ASSERT_EQUAL(frame.length, frames[i].length);
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(frame.data, frames[i].data, frame.length);
+        offset += frame.frameLength;
+    }
+}
+void test_phev_core_commandDescriptor(void)
+{
+    const uint8_t incoming[] = { 0x2e,0x2f,0x3f,0x4e,0x5e,0x6f,0xbb,0xcc };
+    const uint8_t outgoing[] = { 0xbb,0xcc,0xe4,0xe5,0xf2,0xf3,0xf6 };
+    const uint8_t allowed[] = { 0x2f,0x3e,0x3f,0x4e,0x4f,0x5e,0x6e,0x6f,0x9f,0xba,0xbb,0xcc,0xcd,0xe4,0xf2,0xf3,0xf6,0xf9 };
+
+    for (int command = 0; command < 256; command++)
+    {
+        bool isIncoming = memchr(incoming, command, sizeof(incoming)) != NULL;
+        bool isOutgoing = memchr(outgoing, command, sizeof(outgoing)) != NULL;
+        bool isAllowed = memchr(allowed, command, sizeof(allowed)) != NULL;
+
+        TEST_ASSERT_EQUAL(isIncoming, phev_core_checkIncomingCommand(command));
+        TEST_ASSERT_EQUAL(isOutgoing, phev_core_checkOutgoingCommand(command));
+        TEST_ASSERT_EQUAL((isAllowed ? command : 0), phev_core_validateCommand(command));
+    }
+
+    TEST_ASSERT_EQUAL(PHEV_CORE_CLASS_PING, phev_core_commandDescriptor(PING_RESP_CMD_MY18)->commandClass);
+    TEST_ASSERT_EQUAL(PING_RESP_CMD, phev_core_commandDescriptor(PING_RESP_CMD_MY18)->variant);
+    TEST_ASSERT_EQUAL(PHEV_CORE_ACK_PLAIN, phev_core_commandDescriptor(0x4e)->ackPolicy);
+    TEST_ASSERT_EQUAL(PHEV_CORE_ACK_NEVER, phev_core_commandDescriptor(0xcd)->ackPolicy);
+    TEST_ASSERT_EQUAL(PHEV_CORE_ACK_REQUEST, phev_core_commandDescriptor(RESP_CMD)->ackPolicy);
+    TEST_ASSERT_TRUE(phev_core_commandDescriptor(SEND_CMD_MY18)->flags & PHEV_CORE_CMD_MY18);
+}
+void test_phev_core_validate_buffer_cd_unsized(void)
+{
+    const uint8_t cd[] = { 0xcd,0x10,0x00 };
+    const uint8_t shortFrame[] = { 0x6f,0x10,0x00 };
+    const uint8_t invalid[] = { 0x11,0x01,0x00 };
+
+    TEST_ASSERT_EQUAL(1, phev_core_validate_buffer(cd, sizeof(cd)));
+    TEST_ASSERT_EQUAL(0, phev_core_validate_buffer(shortFrame, sizeof(shortFrame)));
+    TEST_ASSERT_EQUAL(0, phev_core_validate_buffer(invalid, sizeof(invalid)));
+}
+void test_phev_core_encodeFrame(void)
+{
+    const uint8_t data[] = { 0x13,0x05,0x13,0x01 };
+    uint8_t out[PHEV_CORE_MAX_FRAME_SIZE];
+
+    phevMessage_t * msg = phev_core_commandMessage(0x12, data, sizeof(data));
+    message_t * message = phev_core_convertToMessage(msg);
+    message_t * expected = phev_core_XOROutboundMessage(message, 0x68);
+
+    size_t length = phev_core_encodeFrame(out, sizeof(out), SEND_CMD, REQUEST_TYPE, 0x12, data, sizeof(data), 0x68);
+
+    TEST_ASSERT_EQUAL(expected->length, length);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected->data, out, length);
+    TEST_ASSERT_EQUAL(0, phev_core_encodeFrame(out, length - 1, SEND_CMD, REQUEST_TYPE, 0x12, data, sizeof(data), 0x68));
+}
 /*
 void test_phev_core_decode_encode(void)
 {
@@ -0,0 +1,72 @@
+#include "unity.h"
+#include "phev.h"
+#include "phev_executor.h"
+
+#ifdef __linux__
+#include <unistd.h>
+
+bool test_phev_executor_waitForVehicles(phev_executor_t * executor, size_t shard, size_t vehicles)
+{
+    phev_executor_stats_t stats;
+
+    for(int i = 0; i < 200; i++)
+    {
+        phev_executor_stats(executor, shard, &stats);
+        if(stats.vehicles == vehicles)
+        {
+            return true;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+void test_phev_executor_add_spreads_vehicles(void)
+{
+    phev_executor_settings_t settings = {
+        .shards = 2,
+    };
+    phev_executor_t * executor = phev_executor_create(settings);
+
+    TEST_ASSERT_NOT_NULL(executor);
+    TEST_ASSERT_EQUAL(2,executor->count);
+
+    for(int i = 0; i < 4; i++)
+    {
+        TEST_ASSERT_TRUE(phev_executor_add(executor, test_phev_gateway_createVehicle()));
+    }
+
+    TEST_ASSERT_TRUE(test_phev_executor_waitForVehicles(executor, 0, 2));
+    TEST_ASSERT_TRUE(test_phev_executor_waitForVehicles(executor, 1, 2));
+
+    phev_executor_destroy(executor);
+}
+void test_phev_executor_steal_keeps_hottest_vehicle(void)
+{
+    phev_executor_settings_t settings = {
+        .shards = 2,
+    };
+    phev_executor_t * executor = phev_executor_create(settings);
+    phevCtx_t * hot = test_phev_gateway_createVehicle();
+    phev_executor_stats_t victim;
+    phev_executor_stats_t thief;
+
+    hot->serviceCtx->reactor->busyNs = 1000000000ULL;
+
+    TEST_ASSERT_TRUE(phev_executor_addToShard(executor, 0, test_phev_gateway_createVehicle()));
+    TEST_ASSERT_TRUE(phev_executor_addToShard(executor, 0, hot));
+    TEST_ASSERT_TRUE(phev_executor_addToShard(executor, 0, test_phev_gateway_createVehicle()));
+    TEST_ASSERT_TRUE(test_phev_executor_waitForVehicles(executor, 0, 3));
+
+    TEST_ASSERT_TRUE(phev_executor_steal(executor, 1, 0));
+    TEST_ASSERT_TRUE(test_phev_executor_waitForVehicles(executor, 1, 1));
+
+    phev_executor_stats(executor, 0, &victim);
+    phev_executor_stats(executor, 1, &thief);
+
+    TEST_ASSERT_EQUAL(2,victim.vehicles);
+    TEST_ASSERT_EQUAL(1,victim.given);
+    TEST_ASSERT_EQUAL(1,thief.stolen);
+
+    phev_executor_destroy(executor);
+}
+#endif
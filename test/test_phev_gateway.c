@@ -0,0 +1,64 @@
+#include "unity.h"
+#include "phev.h"
+#include "phev_gateway.h"
+
+#ifdef __linux__
+
+message_t * test_phev_gateway_noInput(messagingClient_t * client)
+{
+    return NULL;
+}
+void test_phev_gateway_noOutput(messagingClient_t * client, message_t * message)
+{
+}
+phevCtx_t * test_phev_gateway_createVehicle(void)
+{
+    messagingSettings_t clientSettings = {
+        .incomingHandler = test_phev_gateway_noInput,
+        .outgoingHandler = test_phev_gateway_noOutput,
+    };
+    phevSettings_t settings = {
+        .in = msg_core_createMessagingClient(clientSettings),
+        .out = msg_core_createMessagingClient(clientSettings),
+        .reactor = true,
+    };
+
+    return phev_init(settings);
+}
+void test_phev_gateway_runs_vehicles_independently(void)
+{
+    phev_gateway_t * gateway = phev_gateway_create();
+    phevCtx_t * first = test_phev_gateway_createVehicle();
+    phevCtx_t * second = test_phev_gateway_createVehicle();
+
+    TEST_ASSERT_NOT_NULL(gateway);
+    TEST_ASSERT_TRUE(phev_gateway_add(gateway, first));
+    TEST_ASSERT_TRUE(phev_gateway_add(gateway, second));
+    TEST_ASSERT_EQUAL(2,gateway->count);
+    TEST_ASSERT_TRUE(first->serviceCtx->pipe != second->serviceCtx->pipe);
+    TEST_ASSERT_TRUE(first->serviceCtx->model != second->serviceCtx->model);
+
+    phev_exit(first);
+    phev_gateway_runOnce(gateway, 1000);
+
+    TEST_ASSERT_EQUAL(1,gateway->count);
+    TEST_ASSERT_EQUAL_PTR(second,gateway->vehicles[0]);
+    TEST_ASSERT_NULL(first->serviceCtx->reactor);
+    TEST_ASSERT_EQUAL(-1,phev_pipe_wakeFd(first->serviceCtx->pipe));
+
+    phev_gateway_destroy(gateway);
+}
+void test_phev_gateway_exit_interrupts_wait(void)
+{
+    phev_gateway_t * gateway = phev_gateway_create();
+    const uint64_t start = phev_pipe_nowMs();
+
+    phev_gateway_exit(gateway);
+    phev_gateway_run(gateway);
+
+    TEST_ASSERT_TRUE(gateway->exit);
+    TEST_ASSERT_TRUE(phev_pipe_nowMs() - start < 1000);
+
+    phev_gateway_destroy(gateway);
+}
+#endif
@@ -0,0 +1,95 @@
+#include "unity.h"
+#include "phev_history.h"
+#include "phev_model.h"
+
+void test_phev_history_runs_and_last(void)
+{
+    const uint8_t soc50[] = {50};
+    const uint8_t soc51[] = {51};
+    const uint8_t soc52[] = {52};
+    phevHistorySample_t samples[4];
+    phevHistory_t * history = phev_history_create(0);
+
+    TEST_ASSERT_TRUE(phev_history_track(history, 0x1d, 2));
+
+    phev_history_append(history, 0x1d, soc50, 1, 1000);
+    phev_history_append(history, 0x1d, soc50, 1, 2000);
+    phev_history_append(history, 0x1d, soc51, 1, 3000);
+    phev_history_append(history, 0x1d, soc51, 1, 4500);
+    phev_history_append(history, 0x1d, soc52, 1, 6000);
+    phev_history_append(history, 0x1e, soc52, 1, 6000);
+
+    TEST_ASSERT_EQUAL(2, phev_history_last(history, 0x1d, 4, samples));
+    TEST_ASSERT_EQUAL(51, samples[0].value[0]);
+    TEST_ASSERT_EQUAL(3000, samples[0].first);
+    TEST_ASSERT_EQUAL(4500, samples[0].last);
+    TEST_ASSERT_EQUAL(2, samples[0].repeats);
+    TEST_ASSERT_EQUAL(52, samples[1].value[0]);
+    TEST_ASSERT_EQUAL(6000, samples[1].first);
+
+    TEST_ASSERT_EQUAL(1, phev_history_last(history, 0x1d, 1, samples));
+    TEST_ASSERT_EQUAL(52, samples[0].value[0]);
+    TEST_ASSERT_EQUAL(0, phev_history_last(history, 0x1e, 4, samples));
+
+    phev_history_destroy(history);
+}
+void test_phev_history_window(void)
+{
+    uint8_t value[1];
+    phevHistorySample_t samples[8];
+    phevHistory_t * history = phev_history_create(0);
+
+    phev_history_track(history, 0x10, 8);
+
+    for(int i = 0; i < 6; i++)
+    {
+        value[0] = i;
+        phev_history_append(history, 0x10, value, 1, 1000 * (i + 1));
+    }
+
+    TEST_ASSERT_EQUAL(3, phev_history_window(history, 0x10, 2500, 5000, samples, 8));
+    TEST_ASSERT_EQUAL(2, samples[0].value[0]);
+    TEST_ASSERT_EQUAL(4, samples[2].value[0]);
+
+    TEST_ASSERT_EQUAL(2, phev_history_window(history, 0x10, 0, 10000, samples, 2));
+    TEST_ASSERT_EQUAL(4, samples[0].value[0]);
+    TEST_ASSERT_EQUAL(5, samples[1].value[0]);
+
+    phev_history_destroy(history);
+}
+void test_phev_history_memory_cap(void)
+{
+    phevHistory_t * history = phev_history_create(sizeof(phevHistory_t) + 2 * sizeof(phevHistoryRing_t) + 10 * sizeof(phevHistoryEntry_t));
+
+    TEST_ASSERT_TRUE(phev_history_track(history, 0x01, 10));
+    TEST_ASSERT_FALSE(phev_history_track(history, 0x02, 1));
+    TEST_ASSERT_TRUE(phev_history_track(history, 0x01, 5));
+    TEST_ASSERT_TRUE(phev_history_track(history, 0x02, 5));
+    TEST_ASSERT_TRUE(history->usedBytes <= history->maxBytes);
+
+    phev_history_destroy(history);
+}
+void test_phev_history_records_model_writes(void)
+{
+    const uint8_t locked[] = {1};
+    const uint8_t unlocked[] = {0};
+    phevHistorySample_t samples[4];
+    phevModel_t * model = phev_model_create();
+    phevHistory_t * history = phev_history_create(0);
+
+    phev_history_track(history, 0x24, 4);
+    phev_model_attachHistory(model, history);
+
+    phev_model_setRegister(model, 0x24, locked, 1);
+    phev_model_setRegister(model, 0x24, locked, 1);
+    phev_model_setRegister(model, 0x24, unlocked, 1);
+    phev_model_setRegister(model, 0x25, unlocked, 1);
+
+    TEST_ASSERT_EQUAL(2, phev_history_last(model->history, 0x24, 4, samples));
+    TEST_ASSERT_EQUAL(1, samples[0].value[0]);
+    TEST_ASSERT_EQUAL(2, samples[0].repeats);
+    TEST_ASSERT_EQUAL(0, samples[1].value[0]);
+    TEST_ASSERT_TRUE(samples[0].first <= samples[1].first);
+
+    phev_model_destroy(model);
+}
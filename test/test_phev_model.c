@@ -109,4 +109,121 @@ void test_phev_model_compare_not_set(void)
 
     TEST_ASSERT_NOT_EQUAL(0,ret);
 
+}
+void test_phev_model_view_register(void)
+{
+    const uint8_t data[] = {1,2,3,4};
+
+    const uint8_t replacementData[] = {5,6,7,8};
+
+    phevRegisterView_t view;
+
+    phevModel_t * model = phev_model_create();
+
+    TEST_ASSERT_FALSE(phev_model_viewRegister(model,0x11,&view));
+
+    phev_model_setRegister(model,0x11,data,4);
+
+    TEST_ASSERT_TRUE(phev_model_viewRegister(model,0x11,&view));
+    TEST_ASSERT_EQUAL(4,view.length);
+    TEST_ASSERT_EQUAL(1,view.version);
+    TEST_ASSERT_EQUAL_MEMORY(data,view.data,4);
+
+    const uint8_t * borrowed = view.data;
+
+    phev_model_setRegister(model,0x11,replacementData,4);
+
+    TEST_ASSERT_TRUE(phev_model_viewRegister(model,0x11,&view));
+    TEST_ASSERT_EQUAL(2,view.version);
+    TEST_ASSERT_EQUAL_PTR(borrowed,view.data);
+    TEST_ASSERT_EQUAL_MEMORY(replacementData,view.data,4);
+}
+void test_phev_model_compare_register_data_length(void)
+{
+    const uint8_t data[] = {1,2,3,4};
+
+    const uint8_t longer[] = {1,2,3,4,5};
+
+    phevModel_t * model = phev_model_create();
+
+    TEST_ASSERT_NOT_EQUAL(0,phev_model_compareRegisterData(model,0x11,data,4));
+
+    phev_model_setRegister(model,0x11,data,4);
+
+    TEST_ASSERT_EQUAL(0,phev_model_compareRegisterData(model,0x11,data,4));
+    TEST_ASSERT_NOT_EQUAL(0,phev_model_compareRegisterData(model,0x11,longer,5));
+    TEST_ASSERT_NOT_EQUAL(0,phev_model_compareRegisterData(model,0x11,data,3));
+}
+void test_phev_model_slab_grows_and_packs(void)
+{
+    uint8_t data[200];
+
+    phevRegisterView_t view;
+
+    phevModel_t * model = phev_model_create();
+
+    for(int reg=0;reg<64;reg++)
+    {
+        memset(data,reg,sizeof(data));
+        TEST_ASSERT_EQUAL(1,phev_model_setRegister(model,reg,data,1 + reg));
+    }
+    for(int reg=0;reg<64;reg++)
+    {
+        memset(data,reg + 1,sizeof(data));
+        TEST_ASSERT_EQUAL(1,phev_model_setRegister(model,reg,data,sizeof(data)));
+    }
+
+    TEST_ASSERT_TRUE(model->size > PHEV_MODEL_SLAB_SIZE);
+    TEST_ASSERT_TRUE(model->used <= model->size);
+
+    for(int reg=0;reg<64;reg++)
+    {
+        memset(data,reg + 1,sizeof(data));
+        TEST_ASSERT_TRUE(phev_model_viewRegister(model,reg,&view));
+        TEST_ASSERT_EQUAL(sizeof(data),view.length);
+        TEST_ASSERT_EQUAL(65 + reg,view.version);
+        TEST_ASSERT_EQUAL_MEMORY(data,view.data,sizeof(data));
+    }
+
+    phev_model_destroy(model);
+}
+void test_phev_model_changed_since(void)
+{
+    const uint8_t on[] = {1};
+
+    const uint8_t off[] = {0};
+
+    uint8_t regs[256];
+
+    phevModel_t * model = phev_model_create();
+
+    phev_model_setRegister(model,0x10,on,1);
+    phev_model_setRegister(model,0x20,on,1);
+    phev_model_setRegister(model,0x30,on,1);
+
+    const uint32_t seen = phev_model_version(model);
+
+    TEST_ASSERT_EQUAL(3,seen);
+    TEST_ASSERT_EQUAL(3,phev_model_takeDirty(model,regs));
+    TEST_ASSERT_EQUAL(0x10,regs[0]);
+    TEST_ASSERT_EQUAL(0x30,regs[2]);
+    TEST_ASSERT_FALSE(phev_model_isDirty(model,0x10));
+
+    phev_model_setRegister(model,0x30,off,1);
+    phev_model_setRegister(model,0x20,on,1);
+    phev_model_setRegister(model,0x10,off,1);
+
+    TEST_ASSERT_EQUAL(5,phev_model_version(model));
+    TEST_ASSERT_FALSE(phev_model_isDirty(model,0x20));
+    TEST_ASSERT_TRUE(phev_model_isDirty(model,0x30));
+
+    TEST_ASSERT_EQUAL(2,phev_model_changedSince(model,seen,regs));
+    TEST_ASSERT_EQUAL(0x30,regs[0]);
+    TEST_ASSERT_EQUAL(0x10,regs[1]);
+
+    TEST_ASSERT_EQUAL(3,phev_model_changedSince(model,0,regs));
+    TEST_ASSERT_EQUAL(0x20,regs[0]);
+    TEST_ASSERT_EQUAL(0,phev_model_changedSince(model,5,regs));
+
+    phev_model_destroy(model);
 }
\ No newline at end of file
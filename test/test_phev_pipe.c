@@ -1,4 +1,7 @@
 #include <string.h>
+#ifdef __linux__
+#include <unistd.h>
+#endif
 #include "unity.h"
 
 #include "msg_core.h"
@@ -977,6 +980,222 @@ void test_phev_pipe_splitter_two_encoded_messages(void)
 
 }
 
+void test_phev_pipe_splitter_updates_inbound_xor_hint(void)
+{
+    uint8_t msg_data[] = {0xFD,0xC6,0xC3,0xD9,0xC2,0x9D,0xAD,0xCB,0xC2,0xE0,0xC2,0xC2,0x3D,0xBD,0x3D,0xC3,0xDA};
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerIn,
+        .outgoingHandler = test_phev_pipe_outHandlerIn,
+    };
+    messagingSettings_t outSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerOut,
+        .outgoingHandler = test_phev_pipe_outHandlerOut,
+    };
+
+    messagingClient_t * in = msg_core_createMessagingClient(inSettings);
+    messagingClient_t * out = msg_core_createMessagingClient(outSettings);
+
+    phev_pipe_settings_t settings = {
+        .in = in,
+        .out = out,
+        .inputSplitter = NULL,
+        .outputSplitter = NULL,
+        .inputResponder = NULL,
+        .outputResponder = (msg_pipe_responder_t) phev_pipe_commandResponder,
+        .outputOutputTransformer = (msg_pipe_transformer_t) phev_pipe_outputEventTransformer,
+        .preConnectHook = NULL,
+        .outputInputTransformer = (msg_pipe_transformer_t) phev_pipe_outputChainInputTransformer,
+    };
+
+    phev_pipe_ctx_t * ctx =  phev_pipe_createPipe(settings);
+
+    TEST_ASSERT_EQUAL(PHEV_CORE_XOR_HINT_PLAIN, ctx->inboundXORHint);
+
+    message_t * message = msg_utils_createMsg(msg_data, sizeof(msg_data));
+
+    messageBundle_t * messages = phev_pipe_outputSplitter(ctx, message);
+
+    TEST_ASSERT_NOT_NULL(messages);
+    TEST_ASSERT_EQUAL(2, messages->numMessages);
+    TEST_ASSERT_EQUAL(PHEV_CORE_XOR_HINT_KEY, ctx->inboundXORHint);
+}
+
+static int test_pipe_global_inbound_count = 0;
+
+void test_phev_pipe_outHandlerIn_count(messagingClient_t *client, message_t *message)
+{
+    test_pipe_global_inbound_count++;
+}
+phev_pipe_ctx_t * test_phev_pipe_createSplitterPipe(messagingSettings_t inSettings)
+{
+    messagingSettings_t outSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerOut,
+        .outgoingHandler = test_phev_pipe_outHandlerOut,
+    };
+
+    messagingClient_t * in = msg_core_createMessagingClient(inSettings);
+    messagingClient_t * out = msg_core_createMessagingClient(outSettings);
+
+    phev_pipe_settings_t settings = {
+        .in = in,
+        .out = out,
+        .inputSplitter = NULL,
+        .outputSplitter = NULL,
+        .inputResponder = NULL,
+        .outputResponder = NULL,
+        .outputOutputTransformer = NULL,
+        .preConnectHook = NULL,
+        .outputInputTransformer = NULL,
+    };
+
+    return phev_pipe_createPipe(settings);
+}
+void test_phev_pipe_splitter_carries_partial_frame(void)
+{
+    const uint8_t first[] = {0x6F,0x04,0x01,0x07};
+    const uint8_t second[] = {0x00,0x7B,0x6F,0x04,0x01,0x08,0x00,0x7C};
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerIn,
+        .outgoingHandler = test_phev_pipe_outHandlerIn,
+    };
+
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createSplitterPipe(inSettings);
+
+    messageBundle_t * messages = phev_pipe_outputSplitter(ctx, msg_utils_createMsg(first, sizeof(first)));
+
+    TEST_ASSERT_NULL(messages);
+    TEST_ASSERT_EQUAL(sizeof(first), ctx->inbound.length);
+
+    messages = phev_pipe_outputSplitter(ctx, msg_utils_createMsg(second, sizeof(second)));
+
+    TEST_ASSERT_NOT_NULL(messages);
+    TEST_ASSERT_EQUAL(2, messages->numMessages);
+    TEST_ASSERT_EQUAL(6, messages->messages[0]->length);
+    TEST_ASSERT_EQUAL(0x07, messages->messages[0]->data[3]);
+    TEST_ASSERT_EQUAL(0x08, messages->messages[1]->data[3]);
+    TEST_ASSERT_EQUAL(0, ctx->inbound.length);
+}
+void test_phev_pipe_splitter_resyncs_after_garbage(void)
+{
+    const uint8_t data[] = {0xFF,0xFF,0xFF,0x6F,0x04,0x01,0x07,0x00,0x7B};
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerIn,
+        .outgoingHandler = test_phev_pipe_outHandlerIn,
+    };
+
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createSplitterPipe(inSettings);
+
+    messageBundle_t * messages = phev_pipe_outputSplitter(ctx, msg_utils_createMsg(data, sizeof(data)));
+
+    TEST_ASSERT_NOT_NULL(messages);
+    TEST_ASSERT_EQUAL(1, messages->numMessages);
+    TEST_ASSERT_EQUAL(0x6F, messages->messages[0]->data[0]);
+    TEST_ASSERT_EQUAL(3, ctx->inbound.discarded);
+    TEST_ASSERT_EQUAL(0, ctx->inbound.length);
+}
+void test_phev_pipe_splitter_skips_short_checksum_valid_prefixes(void)
+{
+    const uint8_t data[] = {0x6F,0x01,0x70,0x6F,0x02,0x01,0x72,0x6F,0x04,0x01,0x07,0x00,0x7B};
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerIn,
+        .outgoingHandler = test_phev_pipe_outHandlerIn,
+    };
+
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createSplitterPipe(inSettings);
+
+    messageBundle_t * messages = phev_pipe_outputSplitter(ctx, msg_utils_createMsg(data, sizeof(data)));
+
+    TEST_ASSERT_NOT_NULL(messages);
+    TEST_ASSERT_EQUAL(1, messages->numMessages);
+    TEST_ASSERT_EQUAL(6, messages->messages[0]->length);
+    TEST_ASSERT_EQUAL(0x07, messages->messages[0]->data[3]);
+    TEST_ASSERT_EQUAL(7, ctx->inbound.discarded);
+    TEST_ASSERT_EQUAL(0, ctx->inbound.length);
+}
+void test_phev_pipe_outputChainInputTransformer_keeps_invalid_message(void)
+{
+    const uint8_t data[] = {0x6F,0x02,0x01,0x72};
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerIn,
+        .outgoingHandler = test_phev_pipe_outHandlerIn,
+    };
+
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createSplitterPipe(inSettings);
+    message_t * message = msg_utils_createMsg(data, sizeof(data));
+
+    TEST_ASSERT_NULL(phev_pipe_outputChainInputTransformer(ctx, message));
+    TEST_ASSERT_EQUAL(sizeof(data), message->length);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(data, message->data, sizeof(data));
+
+    msg_utils_destroyMsg(message);
+}
+void test_phev_pipe_splitter_dispatches_full_bundles(void)
+{
+    const uint8_t frame[] = {0x6F,0x04,0x01,0x07,0x00,0x7B};
+    const int capacity = (int) (sizeof(((messageBundle_t *) 0)->messages) / sizeof(message_t *));
+    const int frames = capacity + 5;
+    uint8_t data[sizeof(frame) * 64];
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerIn,
+        .outgoingHandler = test_phev_pipe_outHandlerIn_count,
+    };
+
+    TEST_ASSERT_TRUE(frames <= 64);
+
+    for (int i = 0; i < frames; i++)
+    {
+        memcpy(data + i * sizeof(frame), frame, sizeof(frame));
+    }
+
+    test_pipe_global_inbound_count = 0;
+
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createSplitterPipe(inSettings);
+
+    messageBundle_t * messages = phev_pipe_outputSplitter(ctx, msg_utils_createMsg(data, frames * sizeof(frame)));
+
+    TEST_ASSERT_NOT_NULL(messages);
+    TEST_ASSERT_EQUAL(5, messages->numMessages);
+    TEST_ASSERT_EQUAL(capacity, test_pipe_global_inbound_count);
+}
+void test_phev_pipe_fusedInbound_acks_request(void)
+{
+    const uint8_t request[] = {0x6F,0x04,0x00,0x12,0x01,0x86};
+    const uint8_t expected[] = {0xF6,0x04,0x01,0x12,0x00,0x0D};
+
+    test_pipe_global_message_idx = 0;
+    test_pipe_global_message[0] = NULL;
+    test_pipe_global_in_message = NULL;
+
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerIn,
+        .outgoingHandler = test_phev_pipe_outHandlerIn,
+    };
+    messagingSettings_t outSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerOut,
+        .outgoingHandler = test_phev_pipe_outHandlerOut,
+    };
+
+    phev_pipe_settings_t settings = {
+        .in = msg_core_createMessagingClient(inSettings),
+        .out = msg_core_createMessagingClient(outSettings),
+        .outputResponder = (msg_pipe_responder_t) phev_pipe_commandResponder,
+        .outputInputTransformer = (msg_pipe_transformer_t) phev_pipe_outputChainInputTransformer,
+        .fusedInbound = true,
+    };
+
+    phev_pipe_ctx_t * ctx = phev_pipe_createPipe(settings);
+
+    TEST_ASSERT_EQUAL_PTR(phev_pipe_fusedInboundTransformer, ctx->pipe->out_chain->inputTransformer);
+    TEST_ASSERT_NULL(ctx->pipe->out_chain->responder);
+
+    message_t * message = msg_utils_createMsg(request, sizeof(request));
+    message_t * out = phev_pipe_fusedInboundTransformer(ctx, message);
+
+    TEST_ASSERT_EQUAL_PTR(message, out);
+    TEST_ASSERT_EQUAL(1, test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL(sizeof(expected), test_pipe_global_message[0]->length);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, test_pipe_global_message[0]->data, sizeof(expected));
+}
 void test_phev_pipe_no_input_connection(void)
 {
     test_pipe_global_message_idx = 0;
@@ -1245,6 +1464,17 @@ void test_phev_pipe_updateRegisterWithCallback_encoded(void)
 int test_phev_pipe_event_handler(phev_pipe_ctx_t * ctx, phevPipeEvent_t * event)
 {
 
+}
+int test_phev_pipe_event_handler_other(phev_pipe_ctx_t * ctx, phevPipeEvent_t * event)
+{
+    return 0;
+}
+static int test_pipe_global_event_calls = 0;
+
+int test_phev_pipe_event_handler_counting(phev_pipe_ctx_t * ctx, phevPipeEvent_t * event)
+{
+    test_pipe_global_event_calls += *((int *) event->userCtx);
+    return 0;
 }
 void test_phev_pipe_registerEventHandler(void)
 {
@@ -1281,10 +1511,10 @@ void test_phev_pipe_registerEventHandler(void)
     };
     phev_pipe_ctx_t * ctx =  phev_pipe_createPipe(settings);
 
-    TEST_ASSERT_EQUAL(0,ctx->eventHandlers);
+    TEST_ASSERT_EQUAL(0,ctx->events.count);
     phev_pipe_registerEventHandler(ctx,test_phev_pipe_event_handler);
-    TEST_ASSERT_EQUAL(1,ctx->eventHandlers);
-    TEST_ASSERT_EQUAL(test_phev_pipe_event_handler,ctx->eventHandler[0]);
+    TEST_ASSERT_EQUAL(1,ctx->events.count);
+    TEST_ASSERT_EQUAL(test_phev_pipe_event_handler,ctx->events.subscribers[0].handler);
 }
 void test_phev_pipe_register_multiple_registerEventHandlers(void)
 {
@@ -1321,15 +1551,54 @@ void test_phev_pipe_register_multiple_registerEventHandlers(void)
     };
     phev_pipe_ctx_t * ctx =  phev_pipe_createPipe(settings);
 
-    TEST_ASSERT_EQUAL(0,ctx->eventHandlers);
-    phev_pipe_registerEventHandler(ctx,test_phev_pipe_event_handler);
+    TEST_ASSERT_EQUAL(0,ctx->events.count);
     phev_pipe_registerEventHandler(ctx,test_phev_pipe_event_handler);
-    TEST_ASSERT_EQUAL(2,ctx->eventHandlers);
-    TEST_ASSERT_EQUAL(test_phev_pipe_event_handler,ctx->eventHandler[0]);
-    TEST_ASSERT_EQUAL(test_phev_pipe_event_handler,ctx->eventHandler[1]);
+    phev_pipe_registerEventHandler(ctx,test_phev_pipe_event_handler_other);
+    TEST_ASSERT_EQUAL(2,ctx->events.count);
+    TEST_ASSERT_EQUAL(test_phev_pipe_event_handler,ctx->events.subscribers[0].handler);
+    TEST_ASSERT_EQUAL(test_phev_pipe_event_handler_other,ctx->events.subscribers[1].handler);
 
 }
 
+void test_phev_pipe_subscribeEvents_filters_and_dedupes(void)
+{
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerIn,
+        .outgoingHandler = test_phev_pipe_outHandlerIn,
+    };
+
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createSplitterPipe(inSettings);
+
+    int one = 1;
+    int ten = 10;
+
+    phev_pipe_subscribeEvents(ctx, test_phev_pipe_event_handler_counting, PHEV_PIPE_EVENT_MASK(PHEV_PIPE_BB), &one);
+    phev_pipe_subscribeEvents(ctx, test_phev_pipe_event_handler_counting, PHEV_PIPE_EVENT_MASK(PHEV_PIPE_BB), &one);
+    phev_pipe_subscribeEvents(ctx, test_phev_pipe_event_handler_counting, PHEV_PIPE_EVENT_MASK(PHEV_PIPE_PING_RESP), &ten);
+
+    for (int i = 0; i < 20; i++)
+    {
+        phev_pipe_registerEventHandler(ctx, test_phev_pipe_event_handler_other);
+    }
+
+    TEST_ASSERT_EQUAL(3, ctx->events.count);
+
+    phevPipeEvent_t bb = { .event = PHEV_PIPE_BB };
+    phevPipeEvent_t ping = { .event = PHEV_PIPE_PING_RESP };
+
+    test_pipe_global_event_calls = 0;
+    phev_pipe_sendEventToHandlers(ctx, &bb);
+    TEST_ASSERT_EQUAL(1, test_pipe_global_event_calls);
+
+    phev_pipe_sendEventToHandlers(ctx, &ping);
+    TEST_ASSERT_EQUAL(11, test_pipe_global_event_calls);
+
+    phev_pipe_deregisterEventHandler(ctx, test_phev_pipe_event_handler_counting);
+    TEST_ASSERT_EQUAL(1, ctx->events.count);
+
+    phev_pipe_sendEventToHandlers(ctx, &bb);
+    TEST_ASSERT_EQUAL(11, test_pipe_global_event_calls);
+}
 void test_phev_pipe_createRegisterEvent_ack(void)
 {
     uint8_t data[] = {0,1,2,3,4,5};
@@ -1362,9 +1631,10 @@ void test_phev_pipe_createRegisterEvent_ack(void)
     phev_pipe_ctx_t * ctx =  phev_pipe_createPipe(settings);
     phevMessage_t * message = phev_core_createMessage(0x6f,RESPONSE_TYPE,0x12,data, sizeof(data));
 
-    phevPipeEvent_t * event = phev_pipe_createRegisterEvent(ctx,message);
+    phevPipeEvent_t evt;
+    phevPipeEvent_t * event = &evt;
 
-    TEST_ASSERT_NOT_NULL(event);
+    TEST_ASSERT_TRUE(phev_pipe_createRegisterEvent(ctx,message,event));
     TEST_ASSERT_EQUAL(ctx,event->ctx);
     TEST_ASSERT_EQUAL(PHEV_PIPE_REG_UPDATE_ACK,event->event);
     TEST_ASSERT_EQUAL(0x12,((phevMessage_t *) event->data)->reg);
@@ -1403,9 +1673,10 @@ void test_phev_pipe_createRegisterEvent_update(void)
     phev_pipe_ctx_t * ctx =  phev_pipe_createPipe(settings);
     phevMessage_t * message = phev_core_createMessage(0x6f,REQUEST_TYPE,0x12,data, sizeof(data));
 
-    phevPipeEvent_t * event = phev_pipe_createRegisterEvent(ctx,message);
+    phevPipeEvent_t evt;
+    phevPipeEvent_t * event = &evt;
 
-    TEST_ASSERT_NOT_NULL(event);
+    TEST_ASSERT_TRUE(phev_pipe_createRegisterEvent(ctx,message,event));
     TEST_ASSERT_EQUAL(ctx,event->ctx);
     TEST_ASSERT_EQUAL(PHEV_PIPE_REG_UPDATE,event->event);
     TEST_ASSERT_EQUAL(0x12,((phevMessage_t *) event->data)->reg);
@@ -1413,6 +1684,575 @@ void test_phev_pipe_createRegisterEvent_update(void)
     TEST_ASSERT_EQUAL_MEMORY(message->data,((phevMessage_t *) event->data)->data,message->length);
     TEST_ASSERT_EQUAL_MEMORY(data,((phevMessage_t *) event->data)->data,sizeof(data));
 } 
+void test_phev_pipe_copyEvent_retains_register_event(void)
+{
+    uint8_t data[] = {0,1,2,3,4,5};
+
+    phevMessage_t * message = phev_core_createMessage(0x6f,REQUEST_TYPE,0x12,data, sizeof(data));
+    phevPipeEvent_t event;
+
+    TEST_ASSERT_TRUE(phev_pipe_createRegisterEvent(NULL,message,&event));
+    TEST_ASSERT_EQUAL_PTR(message,event.data);
+
+    phevPipeEvent_t * copy = phev_pipe_copyEvent(&event);
+
+    phev_core_destroyMessage(message);
+
+    TEST_ASSERT_NOT_NULL(copy);
+    TEST_ASSERT_EQUAL(PHEV_PIPE_REG_UPDATE,copy->event);
+    TEST_ASSERT_EQUAL(0x12,((phevMessage_t *) copy->data)->reg);
+    TEST_ASSERT_EQUAL_MEMORY(data,((phevMessage_t *) copy->data)->data,sizeof(data));
+
+    phev_pipe_destroyEvent(copy);
+}
+void test_phev_pipe_messageToEvent_vin_on_stack(void)
+{
+    uint8_t data[20] = {0x00,'J','M','A','X','D','G','G','2','W','G','Z','0','0','2','0','3','5',0x01,0x01};
+    phevMessage_t message = {
+        .command = 0x6f,
+        .type = REQUEST_TYPE,
+        .reg = KO_WF_VIN_INFO_EVR,
+        .data = data,
+        .length = sizeof(data),
+    };
+    phevPipeEvent_t event;
+    phevVinEvent_t vin;
+
+    TEST_ASSERT_TRUE(phev_pipe_messageToEvent(NULL,&message,&event,&vin));
+    TEST_ASSERT_EQUAL(PHEV_PIPE_GOT_VIN,event.event);
+    TEST_ASSERT_EQUAL_PTR(&vin,event.data);
+    TEST_ASSERT_EQUAL_STRING("JMAXDGG2WGZ002035",vin.vin);
+    TEST_ASSERT_EQUAL(1,vin.registrations);
+
+    message.reg = KO_WF_BATT_LEVEL_INFO_REP_EVR;
+
+    TEST_ASSERT_FALSE(phev_pipe_messageToEvent(NULL,&message,&event,&vin));
+}
+static int test_pipe_command_completed = 0;
+static int test_pipe_command_failed = 0;
+static void * test_pipe_command_failed_ctx = NULL;
+
+void test_phev_pipe_command_completed(phev_pipe_ctx_t * ctx, uint8_t reg, void * customCtx)
+{
+    test_pipe_command_completed++;
+}
+void test_phev_pipe_command_failed(phev_pipe_ctx_t * ctx, uint8_t reg, void * customCtx)
+{
+    test_pipe_command_failed++;
+    test_pipe_command_failed_ctx = customCtx;
+}
+phev_pipe_ctx_t * test_phev_pipe_createCommandPipe(void)
+{
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerIn,
+        .outgoingHandler = test_phev_pipe_outHandlerIn,
+    };
+
+    test_pipe_global_message_idx = 0;
+    test_pipe_global_message[0] = NULL;
+    test_pipe_command_completed = 0;
+    test_pipe_command_failed = 0;
+    test_pipe_command_failed_ctx = NULL;
+
+    return test_phev_pipe_createSplitterPipe(inSettings);
+}
+void test_phev_pipe_updateRegisterTracked_replaces_pending(void)
+{
+    const uint8_t on = 1;
+    const uint8_t off = 2;
+    int first = 0;
+    int second = 0;
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createCommandPipe();
+
+    phev_pipe_updateRegisterTracked(ctx, KO_WF_H_LAMP_CONT_SP, &on, 1, test_phev_pipe_command_completed, test_phev_pipe_command_failed, &first);
+    phev_pipe_updateRegisterTracked(ctx, KO_WF_H_LAMP_CONT_SP, &off, 1, test_phev_pipe_command_completed, test_phev_pipe_command_failed, &second);
+
+    TEST_ASSERT_EQUAL(2,test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL(1,ctx->commands.count);
+    TEST_ASSERT_EQUAL(1,test_pipe_command_failed);
+    TEST_ASSERT_EQUAL_PTR(&first,test_pipe_command_failed_ctx);
+
+    phev_pipe_command_t * command = phev_pipe_pendingCommand(ctx, KO_WF_H_LAMP_CONT_SP);
+
+    TEST_ASSERT_NOT_NULL(command);
+    TEST_ASSERT_EQUAL(off,command->data[0]);
+    TEST_ASSERT_EQUAL_PTR(&second,command->customCtx);
+}
+static uint8_t test_pipe_command_superseded_by = 0;
+
+void test_phev_pipe_command_superseded(phev_pipe_ctx_t * ctx, uint8_t reg, void * customCtx)
+{
+    phev_pipe_command_t * command = phev_pipe_pendingCommand(ctx, reg);
+
+    test_pipe_command_failed++;
+    test_pipe_command_superseded_by = (command ? command->data[0] : 0);
+}
+void test_phev_pipe_updateRegisterTracked_reports_superseded_after_replacing(void)
+{
+    const uint8_t on = 1;
+    const uint8_t off = 2;
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createCommandPipe();
+
+    test_pipe_command_superseded_by = 0;
+    phev_pipe_updateRegisterTracked(ctx, KO_WF_H_LAMP_CONT_SP, &on, 1, NULL, test_phev_pipe_command_superseded, NULL);
+    phev_pipe_updateRegisterTracked(ctx, KO_WF_H_LAMP_CONT_SP, &off, 1, NULL, test_phev_pipe_command_failed, NULL);
+
+    TEST_ASSERT_EQUAL(1,test_pipe_command_failed);
+    TEST_ASSERT_EQUAL(off,test_pipe_command_superseded_by);
+    TEST_ASSERT_EQUAL(1,ctx->commands.count);
+}
+void test_phev_pipe_updateRegisterTracked_completes_on_ack(void)
+{
+    const uint8_t on = 1;
+    uint8_t data[] = {0};
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createCommandPipe();
+
+    phev_pipe_updateRegisterTracked(ctx, KO_WF_H_LAMP_CONT_SP, &on, 1, test_phev_pipe_command_completed, test_phev_pipe_command_failed, NULL);
+    phev_pipe_updateRegisterTracked(ctx, KO_WF_P_LAMP_CONT_SP, &on, 1, test_phev_pipe_command_completed, test_phev_pipe_command_failed, NULL);
+
+    phevMessage_t ack = {
+        .command = 0x6f,
+        .type = RESPONSE_TYPE,
+        .reg = KO_WF_H_LAMP_CONT_SP,
+        .data = data,
+        .length = sizeof(data),
+    };
+    phevPipeEvent_t event = {
+        .event = PHEV_PIPE_REG_UPDATE_ACK,
+        .data = &ack,
+        .length = sizeof(ack),
+    };
+
+    phev_pipe_sendEventToHandlers(ctx, &event);
+
+    TEST_ASSERT_EQUAL(1,test_pipe_command_completed);
+    TEST_ASSERT_EQUAL(0,test_pipe_command_failed);
+    TEST_ASSERT_EQUAL(1,ctx->commands.count);
+    TEST_ASSERT_NULL(phev_pipe_pendingCommand(ctx, KO_WF_H_LAMP_CONT_SP));
+    TEST_ASSERT_NOT_NULL(phev_pipe_pendingCommand(ctx, KO_WF_P_LAMP_CONT_SP));
+}
+void test_phev_pipe_serviceCommands_retries_with_backoff(void)
+{
+    const uint8_t on = 1;
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createCommandPipe();
+
+    phev_pipe_updateRegisterTracked(ctx, KO_WF_H_LAMP_CONT_SP, &on, 1, test_phev_pipe_command_completed, test_phev_pipe_command_failed, NULL);
+
+    phev_pipe_command_t * command = phev_pipe_pendingCommand(ctx, KO_WF_H_LAMP_CONT_SP);
+    uint64_t deadline = command->deadline;
+
+    phev_pipe_serviceCommands(ctx, deadline - 1);
+
+    TEST_ASSERT_EQUAL(1,test_pipe_global_message_idx);
+
+    phev_pipe_serviceCommands(ctx, deadline);
+
+    TEST_ASSERT_EQUAL(2,test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL(2,command->attempts);
+    TEST_ASSERT_EQUAL(deadline + PHEV_PIPE_COMMAND_TIMEOUT_MS * 2,command->deadline);
+
+    while(phev_pipe_pendingCommand(ctx, KO_WF_H_LAMP_CONT_SP) != NULL)
+    {
+        phev_pipe_serviceCommands(ctx, command->deadline);
+    }
+
+    TEST_ASSERT_EQUAL(PHEV_PIPE_COMMAND_MAX_ATTEMPTS,test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL(1,test_pipe_command_failed);
+    TEST_ASSERT_EQUAL(0,test_pipe_command_completed);
+    TEST_ASSERT_EQUAL(0,ctx->commands.count);
+}
+void test_phev_pipe_outbound_batches_until_end(void)
+{
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createCommandPipe();
+
+    phev_pipe_outboundBegin(ctx);
+    phev_pipe_sendTemplate(ctx, PHEV_CORE_TEMPLATE_PING, 1, 0);
+    phev_pipe_sendTemplate(ctx, PHEV_CORE_TEMPLATE_PING, 2, 0);
+
+    TEST_ASSERT_EQUAL(0,test_pipe_global_message_idx);
+
+    phev_pipe_outboundEnd(ctx);
+
+    TEST_ASSERT_EQUAL(1,test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL(1,ctx->outbound.writes);
+    TEST_ASSERT_EQUAL(PHEV_CORE_TEMPLATE_SIZE * 2,test_pipe_global_message[0]->length);
+}
+void test_phev_pipe_outbound_immediate_acks(void)
+{
+    const uint8_t request[] = {0x6f,0x04,0x00,0x12,0x00,0x85};
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerIn,
+        .outgoingHandler = test_phev_pipe_outHandlerIn,
+    };
+    messagingSettings_t outSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerOut,
+        .outgoingHandler = test_phev_pipe_outHandlerOut,
+    };
+    phev_pipe_settings_t settings = {
+        .in = msg_core_createMessagingClient(inSettings),
+        .out = msg_core_createMessagingClient(outSettings),
+        .immediateAcks = true,
+    };
+
+    test_pipe_global_message_idx = 0;
+    test_pipe_global_message[0] = NULL;
+
+    phev_pipe_ctx_t * ctx = phev_pipe_createPipe(settings);
+    message_t * message = phev_core_createMsgFrame(request, sizeof(request), 0, false);
+
+    phev_pipe_outboundBegin(ctx);
+    phev_pipe_sendTemplate(ctx, PHEV_CORE_TEMPLATE_PING, 1, 0);
+    phev_pipe_commandResponder(ctx, message);
+
+    TEST_ASSERT_EQUAL(1,test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL(PHEV_CORE_TEMPLATE_SIZE * 2,test_pipe_global_message[0]->length);
+    TEST_ASSERT_EQUAL_HEX8(0xf6,test_pipe_global_message[0]->data[0]);
+
+    phev_pipe_outboundEnd(ctx);
+
+    TEST_ASSERT_EQUAL(1,test_pipe_global_message_idx);
+
+    msg_utils_destroyMsg(message);
+}
+void test_phev_pipe_outbound_lanes_send_acks_first(void)
+{
+    const uint8_t request[] = {0x6f,0x04,0x00,0x12,0x00,0x85};
+    const uint8_t on = 1;
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createCommandPipe();
+    message_t * message = phev_core_createMsgFrame(request, sizeof(request), 0, false);
+
+    phev_pipe_outboundBegin(ctx);
+    phev_pipe_ping(ctx);
+    phev_pipe_updateRegisterTracked(ctx, KO_WF_H_LAMP_CONT_SP, &on, 1, NULL, NULL, NULL);
+    phev_pipe_commandResponder(ctx, message);
+
+    TEST_ASSERT_EQUAL(1,phev_pipe_outboundLane(ctx, PHEV_PIPE_LANE_ACK)->depth);
+    TEST_ASSERT_EQUAL(1,phev_pipe_outboundLane(ctx, PHEV_PIPE_LANE_COMMAND)->depth);
+    TEST_ASSERT_EQUAL(1,phev_pipe_outboundLane(ctx, PHEV_PIPE_LANE_PING)->depth);
+
+    phev_pipe_outboundEnd(ctx);
+
+    TEST_ASSERT_EQUAL(1,test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL_HEX8(0xf6,test_pipe_global_message[0]->data[0]);
+    TEST_ASSERT_EQUAL_HEX8(SEND_CMD,test_pipe_global_message[0]->data[PHEV_CORE_TEMPLATE_SIZE]);
+    TEST_ASSERT_EQUAL_HEX8(0xf3,test_pipe_global_message[0]->data[PHEV_CORE_TEMPLATE_SIZE * 2]);
+    TEST_ASSERT_EQUAL(0,phev_pipe_outboundLane(ctx, PHEV_PIPE_LANE_ACK)->depth);
+    TEST_ASSERT_EQUAL(1,phev_pipe_outboundLane(ctx, PHEV_PIPE_LANE_PING)->sent);
+
+    msg_utils_destroyMsg(message);
+}
+void test_phev_pipe_outbound_lanes_drop_and_defer_pings(void)
+{
+    const uint8_t data[200] = {0};
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createCommandPipe();
+
+    phev_pipe_outboundBegin(ctx);
+    phev_pipe_ping(ctx);
+    phev_pipe_ping(ctx);
+
+    TEST_ASSERT_EQUAL(1,phev_pipe_outboundLane(ctx, PHEV_PIPE_LANE_PING)->depth);
+    TEST_ASSERT_EQUAL(1,phev_pipe_outboundLane(ctx, PHEV_PIPE_LANE_PING)->dropped);
+
+    phev_pipe_sendFrame(ctx, SEND_CMD, REQUEST_TYPE, 0x10, data, sizeof(data), 0);
+    phev_pipe_sendFrame(ctx, SEND_CMD, REQUEST_TYPE, 0x11, data, sizeof(data), 0);
+    phev_pipe_outboundEnd(ctx);
+
+    TEST_ASSERT_EQUAL(1,phev_pipe_outboundLane(ctx, PHEV_PIPE_LANE_PING)->depth);
+    TEST_ASSERT_EQUAL(2,phev_pipe_outboundLane(ctx, PHEV_PIPE_LANE_COMMAND)->sent);
+
+    phev_pipe_outboundFlush(ctx);
+
+    TEST_ASSERT_EQUAL(0,phev_pipe_outboundLane(ctx, PHEV_PIPE_LANE_PING)->depth);
+    TEST_ASSERT_EQUAL(1,phev_pipe_outboundLane(ctx, PHEV_PIPE_LANE_PING)->sent);
+}
+void test_phev_pipe_submitCommand_drained_on_loop_thread(void)
+{
+    const uint8_t on = 1;
+    const uint8_t schedule[] = {2,1,1,0};
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createCommandPipe();
+
+    phev_pipe_submitCommand(ctx, KO_WF_H_LAMP_CONT_SP, &on, 1, test_phev_pipe_command_completed, test_phev_pipe_command_failed, NULL);
+    phev_pipe_submitCommand(ctx, KO_WF_P_LAMP_CONT_SP, &on, 1, NULL, NULL, NULL);
+    phev_pipe_submitCommand(ctx, KO_WF_AC_SCH_SP_MY19, schedule, sizeof(schedule), NULL, NULL, NULL);
+
+    TEST_ASSERT_EQUAL(0,test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL(3,ctx->submissions->submitted);
+#ifdef __linux__
+    uint64_t signalled = 0;
+
+    TEST_ASSERT_EQUAL(sizeof(signalled),read(phev_pipe_wakeFd(ctx), &signalled, sizeof(signalled)));
+    TEST_ASSERT_EQUAL(3,signalled);
+#endif
+
+    phev_pipe_outboundBegin(ctx);
+
+    TEST_ASSERT_EQUAL(3,phev_pipe_drainCommands(ctx));
+    TEST_ASSERT_EQUAL(0,phev_pipe_drainCommands(ctx));
+
+    phev_pipe_outboundEnd(ctx);
+
+    TEST_ASSERT_EQUAL(1,test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL(PHEV_CORE_TEMPLATE_SIZE * 2 + sizeof(schedule) + 5,test_pipe_global_message[0]->length);
+    TEST_ASSERT_NOT_NULL(phev_pipe_pendingCommand(ctx, KO_WF_H_LAMP_CONT_SP));
+    TEST_ASSERT_NOT_NULL(phev_pipe_pendingCommand(ctx, KO_WF_P_LAMP_CONT_SP));
+    TEST_ASSERT_EQUAL(0,ctx->submissions->submitted - ctx->submissions->drained);
+}
+void test_phev_pipe_adoptSubmissions_shares_queue_and_fd(void)
+{
+    const uint8_t on = 1;
+    phev_pipe_ctx_t * old = test_phev_pipe_createCommandPipe();
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createCommandPipe();
+    const int wakeFd = phev_pipe_wakeFd(old);
+
+    phev_pipe_submitCommand(old, KO_WF_H_LAMP_CONT_SP, &on, 1, NULL, test_phev_pipe_command_failed, NULL);
+    phev_pipe_adoptSubmissions(ctx, old);
+
+    TEST_ASSERT_EQUAL(wakeFd,phev_pipe_wakeFd(ctx));
+    TEST_ASSERT_EQUAL(wakeFd,phev_pipe_wakeFd(old));
+
+    // A thread that still holds the old pipe reaches the new one
+    phev_pipe_submitCommand(old, KO_WF_P_LAMP_CONT_SP, &on, 1, NULL, test_phev_pipe_command_failed, NULL);
+
+    phev_pipe_outboundBegin(ctx);
+    TEST_ASSERT_EQUAL(2,phev_pipe_drainCommands(ctx));
+    phev_pipe_outboundEnd(ctx);
+
+    TEST_ASSERT_NOT_NULL(phev_pipe_pendingCommand(ctx, KO_WF_H_LAMP_CONT_SP));
+    TEST_ASSERT_NOT_NULL(phev_pipe_pendingCommand(ctx, KO_WF_P_LAMP_CONT_SP));
+}
+void test_phev_pipe_adoptSubmissions_moves_inflight_commands(void)
+{
+    const uint8_t on = 1;
+    int customCtx = 0;
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerIn,
+        .outgoingHandler = test_phev_pipe_outHandlerIn,
+    };
+    phev_pipe_ctx_t * old = test_phev_pipe_createCommandPipe();
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createSplitterPipe(inSettings);
+
+    phev_pipe_updateRegisterTracked(old, KO_WF_H_LAMP_CONT_SP, &on, 1, test_phev_pipe_command_completed, test_phev_pipe_command_failed, &customCtx);
+    phev_pipe_adoptSubmissions(ctx, old);
+
+    TEST_ASSERT_EQUAL(0,old->commands.count);
+    TEST_ASSERT_NULL(phev_pipe_pendingCommand(old, KO_WF_H_LAMP_CONT_SP));
+    TEST_ASSERT_EQUAL(0,test_pipe_command_failed);
+
+    phev_pipe_command_t * command = phev_pipe_pendingCommand(ctx, KO_WF_H_LAMP_CONT_SP);
+
+    TEST_ASSERT_NOT_NULL(command);
+    TEST_ASSERT_EQUAL(on,command->data[0]);
+    TEST_ASSERT_EQUAL_PTR(&customCtx,command->customCtx);
+    TEST_ASSERT_EQUAL(2,test_pipe_global_message_idx);
+}
+void test_phev_pipe_closeSubmissions_fails_queued_commands(void)
+{
+    const uint8_t on = 1;
+    int customCtx = 0;
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createCommandPipe();
+
+    phev_pipe_submitCommand(ctx, KO_WF_H_LAMP_CONT_SP, &on, 1, NULL, test_phev_pipe_command_failed, &customCtx);
+    phev_pipe_closeSubmissions(ctx);
+
+    TEST_ASSERT_EQUAL(1,test_pipe_command_failed);
+    TEST_ASSERT_EQUAL_PTR(&customCtx,test_pipe_command_failed_ctx);
+    TEST_ASSERT_EQUAL(-1,phev_pipe_wakeFd(ctx));
+    TEST_ASSERT_EQUAL(0,phev_pipe_drainCommands(ctx));
+}
+static int test_phev_pipe_connectAttempts = 0;
+static bool test_phev_pipe_connectSucceeds = false;
+static bool test_phev_pipe_connectInFlight = false;
+static phev_pipe_connectionState_t test_phev_pipe_lastState = PHEV_PIPE_STATE_DISCONNECTED;
+static uint32_t test_phev_pipe_lastRetry = 0;
+
+int test_phev_pipe_flakyConnect(messagingClient_t * client)
+{
+    test_phev_pipe_connectAttempts++;
+    if(test_phev_pipe_connectSucceeds)
+    {
+        client->connected = 1;
+        return 0;
+    }
+    return -1;
+}
+bool test_phev_pipe_connectPending(void * ctx)
+{
+    return test_phev_pipe_connectInFlight;
+}
+int test_phev_pipe_connectionHandler(phev_pipe_ctx_t * ctx, phevPipeEvent_t * event)
+{
+    phev_pipe_connectionEvent_t * data = (phev_pipe_connectionEvent_t *) event->data;
+
+    test_phev_pipe_lastState = data->state;
+    test_phev_pipe_lastRetry = data->retryInMs;
+
+    return 0;
+}
+phev_pipe_ctx_t * test_phev_pipe_createFlakyPipe(void)
+{
+    test_pipe_global_message_idx = 0;
+    test_phev_pipe_connectAttempts = 0;
+    test_phev_pipe_connectSucceeds = false;
+    test_phev_pipe_connectInFlight = false;
+
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerIn,
+        .outgoingHandler = test_phev_pipe_outHandlerIn,
+    };
+    messagingSettings_t outSettings = {
+        .incomingHandler = test_phev_pipe_inHandlerOut,
+        .outgoingHandler = test_phev_pipe_outHandlerOut,
+        .connect = test_phev_pipe_flakyConnect,
+    };
+    phev_pipe_settings_t settings = {
+        .in = msg_core_createMessagingClient(inSettings),
+        .out = msg_core_createMessagingClient(outSettings),
+    };
+    phev_pipe_ctx_t * ctx = phev_pipe_createPipe(settings);
+
+    phev_pipe_subscribeEvents(ctx, test_phev_pipe_connectionHandler, PHEV_PIPE_EVENT_MASK(PHEV_PIPE_CONNECTION_STATE), NULL);
+    test_phev_pipe_connectAttempts = 0;
+
+    return ctx;
+}
+void test_phev_pipe_connectStep_backs_off_with_jitter(void)
+{
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createFlakyPipe();
+
+    TEST_ASSERT_FALSE(phev_pipe_connectStep(ctx, 1000));
+    TEST_ASSERT_EQUAL(PHEV_PIPE_STATE_BACKOFF, ctx->connection.state);
+    TEST_ASSERT_EQUAL(PHEV_PIPE_STATE_BACKOFF, test_phev_pipe_lastState);
+    TEST_ASSERT_EQUAL(1, test_phev_pipe_connectAttempts);
+    TEST_ASSERT_TRUE(test_phev_pipe_lastRetry >= PHEV_CONNECT_BACKOFF_MIN_MS / 2);
+    TEST_ASSERT_TRUE(test_phev_pipe_lastRetry <= PHEV_CONNECT_BACKOFF_MIN_MS);
+    TEST_ASSERT_EQUAL(1000 + test_phev_pipe_lastRetry, phev_pipe_nextConnectDeadline(ctx));
+
+    TEST_ASSERT_FALSE(phev_pipe_connectStep(ctx, 1000 + test_phev_pipe_lastRetry - 1));
+    TEST_ASSERT_EQUAL(1, test_phev_pipe_connectAttempts);
+
+    uint64_t now = phev_pipe_nextConnectDeadline(ctx);
+
+    TEST_ASSERT_FALSE(phev_pipe_connectStep(ctx, now));
+    TEST_ASSERT_EQUAL(2, test_phev_pipe_connectAttempts);
+    TEST_ASSERT_TRUE(test_phev_pipe_lastRetry >= PHEV_CONNECT_BACKOFF_MIN_MS);
+    TEST_ASSERT_TRUE(test_phev_pipe_lastRetry <= PHEV_CONNECT_BACKOFF_MIN_MS * 2);
+
+    test_phev_pipe_connectSucceeds = true;
+    now = phev_pipe_nextConnectDeadline(ctx);
+
+    TEST_ASSERT_TRUE(phev_pipe_connectStep(ctx, now));
+    TEST_ASSERT_EQUAL(PHEV_PIPE_STATE_CONNECTED, test_phev_pipe_lastState);
+    TEST_ASSERT_TRUE(ctx->connected);
+    TEST_ASSERT_EQUAL(0, ctx->connection.attempts);
+    TEST_ASSERT_EQUAL(UINT64_MAX, phev_pipe_nextConnectDeadline(ctx));
+}
+void test_phev_pipe_connectStep_waits_for_pending_connect(void)
+{
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createFlakyPipe();
+
+    ctx->connection.pending = test_phev_pipe_connectPending;
+    test_phev_pipe_connectInFlight = true;
+
+    TEST_ASSERT_FALSE(phev_pipe_connectStep(ctx, 1000));
+    TEST_ASSERT_EQUAL(PHEV_PIPE_STATE_CONNECTING, ctx->connection.state);
+    TEST_ASSERT_FALSE(phev_pipe_connectStep(ctx, 1000 + PHEV_CONNECT_TIMEOUT_MS - 1));
+    TEST_ASSERT_EQUAL(PHEV_PIPE_STATE_CONNECTING, ctx->connection.state);
+    TEST_ASSERT_EQUAL(1, ctx->connection.attempts);
+
+    TEST_ASSERT_FALSE(phev_pipe_connectStep(ctx, 1000 + PHEV_CONNECT_TIMEOUT_MS));
+    TEST_ASSERT_EQUAL(PHEV_PIPE_STATE_BACKOFF, ctx->connection.state);
+}
+void test_phev_pipe_sleep_waits_milliseconds(void)
+{
+    const uint64_t start = phev_pipe_nowMs();
+
+    SLEEP(PHEV_CONNECT_POLL_MS);
+
+    TEST_ASSERT_TRUE(phev_pipe_nowMs() - start >= PHEV_CONNECT_POLL_MS);
+}
+void test_phev_pipe_start_sends_mac_once_connected(void)
+{
+    uint8_t mac[] = {0x24,0x0d,0xc2,0xc2,0x91,0x85};
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createFlakyPipe();
+
+    phev_pipe_start(ctx, mac);
+
+    TEST_ASSERT_EQUAL(0, test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL(PHEV_PIPE_STATE_BACKOFF, ctx->connection.state);
+
+    test_phev_pipe_connectSucceeds = true;
+
+    TEST_ASSERT_TRUE(phev_pipe_connectStep(ctx, phev_pipe_nextConnectDeadline(ctx)));
+    TEST_ASSERT_TRUE(test_pipe_global_message_idx > 0);
+    TEST_ASSERT_FALSE(ctx->connection.startPending);
+
+    const int sent = test_pipe_global_message_idx;
+
+    ctx->pipe->out->connected = 0;
+
+    TEST_ASSERT_TRUE(phev_pipe_connectStep(ctx, phev_pipe_nowMs()));
+    TEST_ASSERT_EQUAL(sent, test_pipe_global_message_idx);
+}
+void test_phev_pipe_keepalive_skips_ping_while_car_talks(void)
+{
+    const uint8_t frame[] = {0x6f,0x04,0x00,0x12,0x00,0x85};
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createCommandPipe();
+    message_t * message = phev_core_createMsgFrame(frame, sizeof(frame), 0, false);
+
+    ctx->pipe->out->connected = 1;
+    phev_pipe_outputChainInputTransformer(ctx, message);
+
+    const uint64_t now = ctx->keepalive.lastInbound;
+
+    TEST_ASSERT_TRUE(now > 0);
+    ctx->keepalive.nextPing = now;
+
+    phev_pipe_keepalive(ctx, now);
+
+    TEST_ASSERT_EQUAL(0,test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL(1,ctx->keepalive.suppressed);
+    TEST_ASSERT_EQUAL(now + ctx->keepalive.intervalMs,phev_pipe_nextKeepaliveDeadline(ctx));
+
+    phev_pipe_keepalive(ctx, phev_pipe_nextKeepaliveDeadline(ctx));
+
+    TEST_ASSERT_EQUAL(1,test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL_HEX8(0xf3,test_pipe_global_message[0]->data[0]);
+    TEST_ASSERT_EQUAL(1,ctx->keepalive.sent);
+
+    msg_utils_destroyMsg(message);
+}
+void test_phev_pipe_keepalive_drops_link_on_unanswered_pings(void)
+{
+    const uint8_t response[] = {0x3f,0x04,0x01,0x01,0x00,0x45};
+    phev_pipe_ctx_t * ctx = test_phev_pipe_createCommandPipe();
+    message_t * message = phev_core_createMsgFrame(response, sizeof(response), 0, false);
+    uint64_t now = ctx->keepalive.nextPing;
+
+    ctx->pipe->out->connected = 1;
+    phev_pipe_keepalive(ctx, now);
+    phev_pipe_outputChainInputTransformer(ctx, message);
+
+    TEST_ASSERT_EQUAL(0,phev_pipe_unansweredPings(ctx));
+    TEST_ASSERT_EQUAL(0,ctx->keepalive.lastInbound);
+
+    for(int i = 0; i < PHEV_PIPE_MAX_UNANSWERED_PINGS; i++)
+    {
+        now += ctx->keepalive.intervalMs;
+        phev_pipe_keepalive(ctx, now);
+    }
+
+    TEST_ASSERT_EQUAL(PHEV_PIPE_MAX_UNANSWERED_PINGS,phev_pipe_unansweredPings(ctx));
+    TEST_ASSERT_EQUAL(0,ctx->keepalive.failures);
+
+    now += ctx->keepalive.intervalMs;
+    phev_pipe_keepalive(ctx, now);
+
+    TEST_ASSERT_EQUAL(1,ctx->keepalive.failures);
+    TEST_ASSERT_EQUAL(PHEV_PIPE_MAX_UNANSWERED_PINGS + 1,ctx->keepalive.sent);
+    TEST_ASSERT_EQUAL(0,phev_pipe_unansweredPings(ctx));
+
+    msg_utils_destroyMsg(message);
+}
 /*
 void test_phev_pipe_default_event_handler(void)
 {
@@ -0,0 +1,219 @@
+#include "unity.h"
+#include "phev_reactor.h"
+#include "phev_pipe.h"
+#include "msg_utils.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/socket.h>
+
+static int test_reactor_socket = -1;
+static int test_reactor_reads = 0;
+
+int test_phev_reactor_noSocket(void * ctx)
+{
+    return -1;
+}
+int test_phev_reactor_socketProvider(void * ctx)
+{
+    return test_reactor_socket;
+}
+message_t * test_phev_reactor_inHandlerOut(messagingClient_t * client)
+{
+    uint8_t buffer[64];
+    const ssize_t num = read(test_reactor_socket, buffer, sizeof(buffer));
+
+    if(num <= 0)
+    {
+        return NULL;
+    }
+    test_reactor_reads++;
+
+    return msg_utils_createMsg(buffer, num);
+}
+message_t * test_phev_reactor_noInput(messagingClient_t * client)
+{
+    return NULL;
+}
+void test_phev_reactor_outHandler(messagingClient_t * client, message_t * message)
+{
+    test_pipe_global_message[test_pipe_global_message_idx++] = msg_utils_copyMsg(message);
+}
+phev_pipe_ctx_t * test_phev_reactor_createPipe(bool socketInput)
+{
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_reactor_noInput,
+        .outgoingHandler = NULL,
+    };
+    messagingSettings_t outSettings = {
+        .incomingHandler = (socketInput ? test_phev_reactor_inHandlerOut : test_phev_reactor_noInput),
+        .outgoingHandler = test_phev_reactor_outHandler,
+    };
+    phev_pipe_settings_t settings = {
+        .in = msg_core_createMessagingClient(inSettings),
+        .out = msg_core_createMessagingClient(outSettings),
+    };
+
+    test_pipe_global_message_idx = 0;
+    test_pipe_global_message[0] = NULL;
+    test_reactor_reads = 0;
+
+    return phev_pipe_createPipe(settings);
+}
+void test_phev_reactor_timer_sends_ping(void)
+{
+    phev_pipe_ctx_t * pipe = test_phev_reactor_createPipe(false);
+    phev_reactor_settings_t settings = {
+        .pipe = pipe,
+        .socketProvider = test_phev_reactor_noSocket,
+        .pingIntervalMs = 1,
+    };
+    phev_reactor_t * reactor = phev_reactor_create(settings);
+
+    TEST_ASSERT_NOT_NULL(reactor);
+
+    usleep(2000);
+    phev_reactor_runOnce(reactor, 1000);
+
+    TEST_ASSERT_EQUAL(1,reactor->timers);
+    TEST_ASSERT_EQUAL(1,test_pipe_global_message_idx);
+    TEST_ASSERT_EQUAL_HEX8(0xf3,test_pipe_global_message[0]->data[0]);
+
+    phev_reactor_destroy(reactor);
+}
+void test_phev_reactor_reads_when_socket_ready(void)
+{
+    const uint8_t frame[] = {0x3f,0x04,0x01,0x01,0x00,0x45};
+    int sockets[2];
+    phev_pipe_ctx_t * pipe = test_phev_reactor_createPipe(true);
+    phev_reactor_settings_t settings = {
+        .pipe = pipe,
+        .socketProvider = test_phev_reactor_socketProvider,
+        .pingIntervalMs = 60000,
+    };
+
+    TEST_ASSERT_EQUAL(0,socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    test_reactor_socket = sockets[0];
+
+    phev_reactor_t * reactor = phev_reactor_create(settings);
+
+    TEST_ASSERT_EQUAL(1,write(sockets[1], frame, sizeof(frame)) == sizeof(frame));
+
+    phev_reactor_runOnce(reactor, 1000);
+
+    TEST_ASSERT_EQUAL(sockets[0],reactor->socketFd);
+    TEST_ASSERT_EQUAL(1,reactor->reads);
+    TEST_ASSERT_EQUAL(1,test_reactor_reads);
+    TEST_ASSERT_EQUAL(0,reactor->timers);
+
+    phev_reactor_destroy(reactor);
+    close(sockets[0]);
+    close(sockets[1]);
+    test_reactor_socket = -1;
+}
+void test_phev_reactor_wakeup_interrupts_wait(void)
+{
+    phev_pipe_ctx_t * pipe = test_phev_reactor_createPipe(false);
+    int sockets[2];
+    phev_reactor_settings_t settings = {
+        .pipe = pipe,
+        .socketProvider = test_phev_reactor_socketProvider,
+        .pingIntervalMs = 60000,
+    };
+
+    TEST_ASSERT_EQUAL(0,socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    test_reactor_socket = sockets[0];
+
+    phev_reactor_t * reactor = phev_reactor_create(settings);
+    const uint64_t start = phev_pipe_nowMs();
+
+    phev_reactor_wakeup(reactor);
+    phev_reactor_runOnce(reactor, 5000);
+
+    TEST_ASSERT_EQUAL(1,reactor->wakeups);
+    TEST_ASSERT_EQUAL(0,reactor->reads);
+    TEST_ASSERT_TRUE(phev_pipe_nowMs() - start < 1000);
+
+    phev_reactor_destroy(reactor);
+    close(sockets[0]);
+    close(sockets[1]);
+    test_reactor_socket = -1;
+}
+void test_phev_reactor_rewatches_reused_fd_after_reconnect(void)
+{
+    const uint8_t frame[] = {0x3f,0x04,0x01,0x01,0x00,0x45};
+    int sockets[2];
+    int replacement[2];
+    phev_pipe_ctx_t * pipe = test_phev_reactor_createPipe(true);
+    phev_reactor_settings_t settings = {
+        .pipe = pipe,
+        .socketProvider = test_phev_reactor_socketProvider,
+        .pingIntervalMs = 60000,
+    };
+
+    TEST_ASSERT_EQUAL(0,socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    test_reactor_socket = sockets[0];
+
+    phev_reactor_t * reactor = phev_reactor_create(settings);
+
+    phev_reactor_runOnce(reactor, 0);
+
+    // The reconnected socket lands on the fd number the old one had
+    TEST_ASSERT_EQUAL(0,socketpair(AF_UNIX, SOCK_STREAM, 0, replacement));
+    close(sockets[1]);
+    TEST_ASSERT_EQUAL(sockets[0],dup2(replacement[0], sockets[0]));
+    close(replacement[0]);
+    pipe->connection.generation++;
+
+    TEST_ASSERT_EQUAL(1,write(replacement[1], frame, sizeof(frame)) == sizeof(frame));
+
+    phev_reactor_runOnce(reactor, 1000);
+
+    TEST_ASSERT_EQUAL(sockets[0],reactor->socketFd);
+    TEST_ASSERT_EQUAL(1,reactor->reads);
+    TEST_ASSERT_EQUAL(1,test_reactor_reads);
+
+    phev_reactor_destroy(reactor);
+    close(sockets[0]);
+    close(replacement[1]);
+    test_reactor_socket = -1;
+}
+int test_phev_reactor_failConnect(messagingClient_t * client)
+{
+    return -1;
+}
+void test_phev_reactor_queued_command_waits_for_connection(void)
+{
+    const uint8_t data[] = {0x01};
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_reactor_noInput,
+        .outgoingHandler = NULL,
+    };
+    messagingSettings_t outSettings = {
+        .incomingHandler = test_phev_reactor_noInput,
+        .outgoingHandler = test_phev_reactor_outHandler,
+        .connect = test_phev_reactor_failConnect,
+    };
+    phev_pipe_settings_t pipeSettings = {
+        .in = msg_core_createMessagingClient(inSettings),
+        .out = msg_core_createMessagingClient(outSettings),
+    };
+    phev_pipe_ctx_t * pipe = phev_pipe_createPipe(pipeSettings);
+    phev_reactor_settings_t settings = {
+        .pipe = pipe,
+        .socketProvider = test_phev_reactor_noSocket,
+        .pingIntervalMs = 60000,
+    };
+    phev_reactor_t * reactor = phev_reactor_create(settings);
+
+    phev_pipe_submitCommand(pipe, 0x0a, data, sizeof(data), NULL, NULL, NULL);
+
+    TEST_ASSERT_EQUAL(1,phev_reactor_runOnce(reactor, 1000));
+    TEST_ASSERT_EQUAL(0,phev_reactor_runOnce(reactor, 50));
+    TEST_ASSERT_EQUAL(1,reactor->wakeups);
+    TEST_ASSERT_EQUAL(0,pipe->submissions->drained);
+    TEST_ASSERT_FALSE(pipe->connected);
+
+    phev_reactor_destroy(reactor);
+}
+#endif
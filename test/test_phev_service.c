@@ -1325,9 +1325,7 @@ void test_phev_service_getRegister(void)
  
     phevServiceCtx_t * ctx = phev_service_create(settings);
 
-    ctx->model->registers[1] = malloc(sizeof(phevRegister_t) + sizeof(expectedData));
-    ctx->model->registers[1]->length = sizeof(expectedData);
-    memcpy(ctx->model->registers[1]->data,expectedData,sizeof(expectedData));
+    phev_model_setRegister(ctx->model,1,expectedData,sizeof(expectedData));
 
     TEST_ASSERT_NOT_NULL(ctx);
 
@@ -1367,9 +1365,7 @@ void test_phev_service_getAllRegisters(void)
  
     phevServiceCtx_t * ctx = phev_service_create(settings);
 
-    ctx->model->registers[1] = malloc(sizeof(phevRegister_t) + sizeof(expectedData));
-    ctx->model->registers[1]->length = sizeof(expectedData);
-    memcpy(ctx->model->registers[1]->data,expectedData,sizeof(expectedData));
+    phev_model_setRegister(ctx->model,1,expectedData,sizeof(expectedData));
 
     TEST_ASSERT_NOT_NULL(ctx);
 
@@ -1418,7 +1414,7 @@ void test_phev_service_setRegister(void)
 
     TEST_ASSERT_NOT_NULL(reg);
 
-    TEST_ASSERT_EQUAL_MEMORY(expectedData, ctx->model->registers[2]->data, sizeof(expectedData));
+    TEST_ASSERT_EQUAL_MEMORY(expectedData, reg->data, sizeof(expectedData));
     
 }
 void test_phev_service_getRegisterJson(void)
@@ -1452,9 +1448,7 @@ void test_phev_service_getRegisterJson(void)
  
     phevServiceCtx_t * ctx = phev_service_create(settings);
 
-    ctx->model->registers[1] = malloc(sizeof(phevRegister_t) + sizeof(data));
-    ctx->model->registers[1]->length = sizeof(data);
-    memcpy(ctx->model->registers[1]->data,data,sizeof(data));
+    phev_model_setRegister(ctx->model,1,data,sizeof(data));
 
     TEST_ASSERT_NOT_NULL(ctx);
 
@@ -1651,6 +1645,77 @@ void test_phev_service_status(void)
 
     TEST_ASSERT_EQUAL(time->valueint,1);
 }
+void test_phev_service_status_from_snapshot(void)
+{
+    const char * path = "/tmp/test_phev_service_snapshot";
+    const uint8_t battery[] = {0x50};
+    const uint8_t door[] = {0x01};
+    const uint8_t batteryFrame[] = {0x6f,0x04,0x00,0x1d,0x50,0xe0};
+    messagingSettings_t inSettings = {
+        .incomingHandler = test_phev_service_inHandlerIn,
+        .outgoingHandler = test_phev_service_outHandlerIn,
+    };
+    messagingSettings_t outSettings = {
+        .incomingHandler = test_phev_service_inHandlerOut,
+        .outgoingHandler = test_phev_service_outHandlerOut,
+    };
+    
+    messagingClient_t * in = msg_core_createMessagingClient(inSettings);
+    messagingClient_t * out = msg_core_createMessagingClient(outSettings);
+
+    phevModel_t * model = phev_model_create();
+    phevSnapshot_t * snapshot = phev_snapshot_open(path);
+
+    phev_model_setRegister(model,KO_WF_BATT_LEVEL_INFO_REP_EVR,battery,sizeof(battery));
+    phev_model_setRegister(model,KO_WF_DOOR_STATUS_INFO_REP_EVR,door,sizeof(door));
+    phev_snapshot_sync(snapshot,model);
+    phev_snapshot_close(snapshot);
+
+    phevServiceSettings_t settings = {
+        .in = in,
+        .out = out,
+        .registerDevice = false,
+        .snapshotPath = path,
+        .ctx = NULL, 
+    };
+ 
+    phevServiceCtx_t * ctx = phev_service_create(settings);
+
+    TEST_ASSERT_TRUE(phev_service_isStale(ctx,KO_WF_BATT_LEVEL_INFO_REP_EVR));
+    TEST_ASSERT_TRUE(phev_service_isStale(ctx,KO_WF_DOOR_STATUS_INFO_REP_EVR));
+    TEST_ASSERT_EQUAL(80,phev_service_getBatteryLevel(ctx));
+
+    cJSON * json = cJSON_Parse(phev_service_statusAsJson(ctx));
+
+    cJSON * status = cJSON_GetObjectItemCaseSensitive(json, "status");
+
+    TEST_ASSERT_TRUE(cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(status, "stale")));
+    cJSON_Delete(json);
+
+    // The car confirming one register leaves the others stale
+    message_t * message = msg_utils_createMsg(batteryFrame, sizeof(batteryFrame));
+
+    TEST_ASSERT_TRUE(phev_service_outputFilter(ctx->pipe, message));
+    TEST_ASSERT_FALSE(phev_service_isStale(ctx,KO_WF_BATT_LEVEL_INFO_REP_EVR));
+    TEST_ASSERT_FALSE(phev_service_outputFilter(ctx->pipe, message));
+    TEST_ASSERT_TRUE(phev_service_isStale(ctx,KO_WF_DOOR_STATUS_INFO_REP_EVR));
+
+    json = cJSON_Parse(phev_service_statusAsJson(ctx));
+    status = cJSON_GetObjectItemCaseSensitive(json, "status");
+
+    TEST_ASSERT_NULL(cJSON_GetObjectItemCaseSensitive(status, "stale"));
+    cJSON_Delete(json);
+
+    json = cJSON_Parse(phev_service_getRegisterJson(ctx,KO_WF_DOOR_STATUS_INFO_REP_EVR));
+
+    TEST_ASSERT_TRUE(cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "stale")));
+    cJSON_Delete(json);
+
+    phev_service_close(ctx);
+
+    TEST_ASSERT_NULL(ctx->snapshot);
+    remove(path);
+}
 
 
 /*
@@ -1663,4 +1728,4 @@ const timeRemain = remain => {
         (high < 0 ? high + 0x100 : high)
 
 }
-*/
\ No newline at end of file
+*/
@@ -0,0 +1,142 @@
+#include "unity.h"
+#include "phev_snapshot.h"
+#include "phev_model.h"
+
+#ifdef __linux__
+#include <stdio.h>
+#include <unistd.h>
+
+static char test_snapshot_path[] = "/tmp/phev_snapshot_XXXXXX";
+
+const char * test_phev_snapshot_path(void)
+{
+    strcpy(test_snapshot_path, "/tmp/phev_snapshot_XXXXXX");
+    close(mkstemp(test_snapshot_path));
+
+    return test_snapshot_path;
+}
+void test_phev_snapshot_restores_model(void)
+{
+    const uint8_t soc[] = {0x50};
+    const uint8_t date[] = {0x13,0x0c,0x0b,0x13,0x0c,0x29,0x01};
+    const uint8_t soc2[] = {0x51};
+    const char * path = test_phev_snapshot_path();
+    phevModel_t * model = phev_model_create();
+    phevSnapshot_t * snapshot = phev_snapshot_open(path);
+    phevRegisterView_t view;
+
+    TEST_ASSERT_NOT_NULL(snapshot);
+    TEST_ASSERT_EQUAL(0, phev_snapshot_restore(snapshot, model));
+
+    phev_model_setRegister(model, 0x1d, soc, sizeof(soc));
+    phev_model_setRegister(model, 0x12, date, sizeof(date));
+
+    TEST_ASSERT_EQUAL(2, phev_snapshot_sync(snapshot, model));
+    TEST_ASSERT_EQUAL(0, phev_snapshot_sync(snapshot, model));
+
+    phev_model_setRegister(model, 0x1d, soc2, sizeof(soc2));
+
+    TEST_ASSERT_EQUAL(1, phev_snapshot_sync(snapshot, model));
+    TEST_ASSERT_TRUE(phev_snapshot_registerTime(snapshot, 0x1d) > 0);
+
+    phev_snapshot_close(snapshot);
+    phev_model_destroy(model);
+
+    model = phev_model_create();
+    snapshot = phev_snapshot_open(path);
+
+    TEST_ASSERT_EQUAL(2, phev_snapshot_restore(snapshot, model));
+    TEST_ASSERT_EQUAL(3, phev_model_version(model));
+    TEST_ASSERT_FALSE(phev_model_isDirty(model, 0x1d));
+    TEST_ASSERT_FALSE(phev_model_isDirty(model, 0x12));
+    TEST_ASSERT_TRUE(phev_model_viewRegister(model, 0x1d, &view));
+    TEST_ASSERT_EQUAL(3, view.version);
+    TEST_ASSERT_EQUAL_HEX8(0x51, view.data[0]);
+    TEST_ASSERT_TRUE(phev_model_viewRegister(model, 0x12, &view));
+    TEST_ASSERT_EQUAL(sizeof(date), view.length);
+    TEST_ASSERT_EQUAL_MEMORY(date, view.data, sizeof(date));
+    TEST_ASSERT_EQUAL(0, phev_snapshot_sync(snapshot, model));
+
+    phev_snapshot_close(snapshot);
+    phev_model_destroy(model);
+    unlink(path);
+}
+void test_phev_snapshot_drops_corrupt_data(void)
+{
+    const uint8_t soc[] = {0x50};
+    const uint8_t door[] = {0x01};
+    const char * path = test_phev_snapshot_path();
+    phevModel_t * model = phev_model_create();
+    phevSnapshot_t * snapshot = phev_snapshot_open(path);
+    phevRegisterView_t view;
+
+    phev_model_setRegister(model, 0x1d, soc, sizeof(soc));
+    phev_model_setRegister(model, 0x24, door, sizeof(door));
+    phev_snapshot_sync(snapshot, model);
+
+    snapshot->file->records[0x1d].data[0] ^= 0xff;
+    phev_snapshot_close(snapshot);
+    phev_model_destroy(model);
+
+    model = phev_model_create();
+    snapshot = phev_snapshot_open(path);
+
+    TEST_ASSERT_EQUAL(1, phev_snapshot_restore(snapshot, model));
+    TEST_ASSERT_FALSE(phev_model_viewRegister(model, 0x1d, &view));
+    TEST_ASSERT_TRUE(phev_model_viewRegister(model, 0x24, &view));
+
+    // A torn sync state keeps the records, a bad header does not
+    snapshot->file->state.modelVersion++;
+    phev_snapshot_close(snapshot);
+    phev_model_destroy(model);
+
+    model = phev_model_create();
+    snapshot = phev_snapshot_open(path);
+
+    TEST_ASSERT_EQUAL(1, phev_snapshot_restore(snapshot, model));
+    TEST_ASSERT_EQUAL(0, snapshot->file->state.modelVersion);
+
+    snapshot->file->header.checksum ^= 1;
+    phev_snapshot_close(snapshot);
+    phev_model_destroy(model);
+
+    model = phev_model_create();
+    snapshot = phev_snapshot_open(path);
+
+    TEST_ASSERT_EQUAL(0, phev_snapshot_restore(snapshot, model));
+
+    phev_snapshot_close(snapshot);
+    phev_model_destroy(model);
+    unlink(path);
+}
+void test_phev_snapshot_restore_skips_history(void)
+{
+    const uint8_t soc[] = {0x50};
+    const char * path = test_phev_snapshot_path();
+    phevModel_t * model = phev_model_create();
+    phevSnapshot_t * snapshot = phev_snapshot_open(path);
+    phevHistory_t * history = phev_history_create(0);
+    phevHistorySample_t samples[2];
+
+    phev_model_setRegister(model, 0x1d, soc, sizeof(soc));
+    phev_snapshot_sync(snapshot, model);
+    phev_snapshot_close(snapshot);
+    phev_model_destroy(model);
+
+    model = phev_model_create();
+    phev_history_track(history, 0x1d, 2);
+    phev_model_attachHistory(model, history);
+    snapshot = phev_snapshot_open(path);
+
+    TEST_ASSERT_EQUAL(1, phev_snapshot_restore(snapshot, model));
+    TEST_ASSERT_EQUAL(0, phev_history_last(history, 0x1d, 2, samples));
+
+    phev_model_setRegister(model, 0x1d, soc, sizeof(soc));
+
+    TEST_ASSERT_EQUAL(1, phev_history_last(history, 0x1d, 2, samples));
+
+    phev_snapshot_close(snapshot);
+    phev_model_destroy(model);
+    unlink(path);
+}
+#endif
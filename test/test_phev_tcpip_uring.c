@@ -0,0 +1,124 @@
+#include "unity.h"
+#include "phev_tcpip_uring.h"
+#include "phev_tcpip.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+int test_phev_tcpip_uring_listen(uint16_t * port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = 0,
+    };
+    socklen_t addrLen = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    bind(listener, (struct sockaddr *) &addr, sizeof(addr));
+    listen(listener, 1);
+    getsockname(listener, (struct sockaddr *) &addr, &addrLen);
+    *port = ntohs(addr.sin_port);
+
+    return listener;
+}
+int test_phev_tcpip_uring_connect(const char * host, uint16_t port)
+{
+    for(int i = 0; i < 1000; i++)
+    {
+        const int soc = phev_uringClientConnectSocket(host, port);
+
+        if(soc >= 0 || errno != EINPROGRESS)
+        {
+            return soc;
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+void test_phev_tcpip_uring_batches_frames(void)
+{
+    const uint8_t frame[] = {0x6f, 0x04, 0x00, 0x1d, 0x01, 0x91};
+    const int frames = 8;
+    uint16_t port;
+    uint8_t buffer[256];
+    uint8_t command[] = {0xf6, 0x04, 0x00, 0x0a, 0x01, 0x05};
+    phev_uring_stats_t before;
+    phev_uring_stats_t after;
+
+    if(!phev_uringSupported())
+    {
+        TEST_IGNORE_MESSAGE("io_uring not available");
+    }
+
+    const int listener = test_phev_tcpip_uring_listen(&port);
+    const int soc = test_phev_tcpip_uring_connect("127.0.0.1", port);
+    const int server = accept(listener, NULL, NULL);
+
+    TEST_ASSERT_TRUE(soc >= 0);
+    TEST_ASSERT_TRUE(server >= 0);
+
+    for(int i = 0; i < frames; i++)
+    {
+        TEST_ASSERT_EQUAL(sizeof(frame), write(server, frame, sizeof(frame)));
+    }
+    usleep(50000);
+
+    phev_uringStats(&before);
+    const int len = phev_uringClientRead(soc, buffer, sizeof(buffer));
+    phev_uringStats(&after);
+
+    TEST_ASSERT_EQUAL(frames * sizeof(frame), len);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(frame, &buffer[(frames - 1) * sizeof(frame)], sizeof(frame));
+    TEST_ASSERT_TRUE(after.enters - before.enters < (size_t) frames);
+
+    TEST_ASSERT_EQUAL(sizeof(command), phev_uringClientWrite(soc, command, sizeof(command)));
+    TEST_ASSERT_EQUAL(sizeof(command), read(server, buffer, sizeof(buffer)));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(command, buffer, sizeof(command));
+
+    phev_uringClientDisconnectSocket(soc);
+    close(server);
+    close(listener);
+}
+void test_phev_tcpip_keeps_vehicles_on_same_address_apart(void)
+{
+    uint16_t port;
+    int soc = -1;
+
+    const int listener = test_phev_tcpip_uring_listen(&port);
+    phev_tcpip_conn_t * first = phev_tcpClientCreate("127.0.0.1", port);
+    phev_tcpip_conn_t * second = phev_tcpClientCreate("127.0.0.1", port);
+
+    phev_tcpClientSetWakeup(first, 100);
+    phev_tcpClientSetWakeup(second, 200);
+
+    for(int i = 0; i < 1000 && soc < 0; i++)
+    {
+        soc = phev_tcpClientConnectSocket(first->host, port);
+        if(soc < 0)
+        {
+            TEST_ASSERT_EQUAL(EINPROGRESS, errno);
+            TEST_ASSERT_FALSE(phev_tcpClientConnecting(second));
+            usleep(1000);
+        }
+    }
+    const int server = accept(listener, NULL, NULL);
+
+    TEST_ASSERT_TRUE(soc >= 0);
+    TEST_ASSERT_EQUAL(soc, phev_tcpClientSocket(first));
+    TEST_ASSERT_EQUAL(-1, phev_tcpClientSocket(second));
+    TEST_ASSERT_EQUAL(100, phev_tcpClientWakeFd(soc));
+
+    phev_tcpClientDisconnectSocket(soc);
+    TEST_ASSERT_EQUAL(-1, phev_tcpClientSocket(first));
+
+    phev_tcpClientDestroy(first);
+    phev_tcpClientDestroy(second);
+    close(server);
+    close(listener);
+}
+#endif
@@ -10,6 +10,12 @@
 #include "test_phev_pipe.c"
 #include "test_phev_service.c"
 #include "test_phev_model.c"
+#include "test_phev_history.c"
+#include "test_phev_snapshot.c"
+#include "test_phev_reactor.c"
+#include "test_phev_gateway.c"
+#include "test_phev_executor.c"
+#include "test_phev_tcpip_uring.c"
 #include "test_phev.c"
 
 void setUp(void) 
@@ -80,6 +86,18 @@ int main()
     RUN_TEST(test_core_phev_core_extractIncomingMessageAndXOR_2F_command);
     RUN_TEST(test_phev_core_getMessageXOR);
     RUN_TEST(test_core_phev_core_extractIncomingMessageValidFirstByteCommand);
+    RUN_TEST(test_phev_core_decodeFrame_matches_decodeMessage);
+    RUN_TEST(test_phev_core_scanFrameXOR);
+    RUN_TEST(test_phev_core_findIncomingXOR_hint);
+    RUN_TEST(test_phev_core_scanIncomingFrame);
+    RUN_TEST(test_phev_core_scanIncomingFrame_resyncs_past_partial_looking_byte);
+    RUN_TEST(test_phev_core_renderTemplate_matches_encodeFrame);
+    RUN_TEST(test_phev_core_messageFrame_decodes_once);
+    RUN_TEST(test_phev_core_xorBuffer_and_xorSum);
+    RUN_TEST(test_phev_core_decodeFrames);
+    RUN_TEST(test_phev_core_commandDescriptor);
+    RUN_TEST(test_phev_core_validate_buffer_cd_unsized);
+    RUN_TEST(test_phev_core_encodeFrame);
 
 //  PHEV PIPE
     
@@ -96,6 +114,13 @@ int main()
 
     RUN_TEST(test_phev_pipe_splitter_one_encoded_message);
     RUN_TEST(test_phev_pipe_splitter_two_encoded_messages);
+    RUN_TEST(test_phev_pipe_splitter_updates_inbound_xor_hint);
+    RUN_TEST(test_phev_pipe_splitter_carries_partial_frame);
+    RUN_TEST(test_phev_pipe_splitter_resyncs_after_garbage);
+    RUN_TEST(test_phev_pipe_splitter_skips_short_checksum_valid_prefixes);
+    RUN_TEST(test_phev_pipe_outputChainInputTransformer_keeps_invalid_message);
+    RUN_TEST(test_phev_pipe_splitter_dispatches_full_bundles);
+    RUN_TEST(test_phev_pipe_fusedInbound_acks_request);
 
     RUN_TEST(test_phev_pipe_publish);
     RUN_TEST(test_phev_pipe_commandResponder);
@@ -110,14 +135,62 @@ int main()
     RUN_TEST(test_phev_pipe_waitForConnection_should_timeout);
     RUN_TEST(test_phev_pipe_waitForConnection);
 #endif
-//    RUN_TEST(test_phev_pipe_sendMac);
+    RUN_TEST(test_phev_pipe_sendMac);
     RUN_TEST(test_phev_pipe_updateRegister);
     RUN_TEST(test_phev_pipe_updateRegisterWithCallback);
     RUN_TEST(test_phev_pipe_updateRegisterWithCallback_encoded);
+    RUN_TEST(test_phev_pipe_updateRegisterTracked_replaces_pending);
+    RUN_TEST(test_phev_pipe_updateRegisterTracked_reports_superseded_after_replacing);
+    RUN_TEST(test_phev_pipe_updateRegisterTracked_completes_on_ack);
+    RUN_TEST(test_phev_pipe_serviceCommands_retries_with_backoff);
+    RUN_TEST(test_phev_pipe_outbound_batches_until_end);
+    RUN_TEST(test_phev_pipe_outbound_immediate_acks);
+    RUN_TEST(test_phev_pipe_outbound_lanes_send_acks_first);
+    RUN_TEST(test_phev_pipe_outbound_lanes_drop_and_defer_pings);
+    RUN_TEST(test_phev_pipe_submitCommand_drained_on_loop_thread);
+    RUN_TEST(test_phev_pipe_adoptSubmissions_shares_queue_and_fd);
+    RUN_TEST(test_phev_pipe_adoptSubmissions_moves_inflight_commands);
+    RUN_TEST(test_phev_pipe_closeSubmissions_fails_queued_commands);
+    RUN_TEST(test_phev_pipe_connectStep_backs_off_with_jitter);
+    RUN_TEST(test_phev_pipe_connectStep_waits_for_pending_connect);
+    RUN_TEST(test_phev_pipe_sleep_waits_milliseconds);
+    RUN_TEST(test_phev_pipe_start_sends_mac_once_connected);
+    RUN_TEST(test_phev_pipe_keepalive_skips_ping_while_car_talks);
+    RUN_TEST(test_phev_pipe_keepalive_drops_link_on_unanswered_pings);
     RUN_TEST(test_phev_pipe_registerEventHandler);
     RUN_TEST(test_phev_pipe_register_multiple_registerEventHandlers);
+    RUN_TEST(test_phev_pipe_subscribeEvents_filters_and_dedupes);
     RUN_TEST(test_phev_pipe_createRegisterEvent_ack);
-    RUN_TEST(test_phev_pipe_createRegisterEvent_update);    
+    RUN_TEST(test_phev_pipe_createRegisterEvent_update);
+    RUN_TEST(test_phev_pipe_copyEvent_retains_register_event);
+    RUN_TEST(test_phev_pipe_messageToEvent_vin_on_stack);    
+
+//  PHEV_REACTOR
+#ifdef __linux__
+    RUN_TEST(test_phev_reactor_timer_sends_ping);
+    RUN_TEST(test_phev_reactor_reads_when_socket_ready);
+    RUN_TEST(test_phev_reactor_wakeup_interrupts_wait);
+    RUN_TEST(test_phev_reactor_rewatches_reused_fd_after_reconnect);
+    RUN_TEST(test_phev_reactor_queued_command_waits_for_connection);
+#endif
+
+//  PHEV_GATEWAY
+#ifdef __linux__
+    RUN_TEST(test_phev_gateway_runs_vehicles_independently);
+    RUN_TEST(test_phev_gateway_exit_interrupts_wait);
+#endif
+
+//  PHEV_EXECUTOR
+#ifdef __linux__
+    RUN_TEST(test_phev_executor_add_spreads_vehicles);
+    RUN_TEST(test_phev_executor_steal_keeps_hottest_vehicle);
+#endif
+
+//  PHEV_TCPIP_URING
+#ifdef __linux__
+    RUN_TEST(test_phev_tcpip_uring_batches_frames);
+    RUN_TEST(test_phev_tcpip_keeps_vehicles_on_same_address_apart);
+#endif
 
 // PHEV SERVICE
 
@@ -190,6 +263,7 @@ int main()
     RUN_TEST(test_phev_service_hvacStatus_off);
     RUN_TEST(test_phev_service_statusAsJson_hvac_operating);
     RUN_TEST(test_phev_service_status);
+    RUN_TEST(test_phev_service_status_from_snapshot);
     
 //  PHEV_MODEL
 
@@ -201,6 +275,25 @@ int main()
     RUN_TEST(test_phev_model_register_compare);
     RUN_TEST(test_phev_model_register_compare_not_same);
     RUN_TEST(test_phev_model_compare_not_set);
+    RUN_TEST(test_phev_model_view_register);
+    RUN_TEST(test_phev_model_compare_register_data_length);
+    RUN_TEST(test_phev_model_slab_grows_and_packs);
+    RUN_TEST(test_phev_model_changed_since);
+
+//  PHEV_HISTORY
+
+    RUN_TEST(test_phev_history_runs_and_last);
+    RUN_TEST(test_phev_history_window);
+    RUN_TEST(test_phev_history_memory_cap);
+    RUN_TEST(test_phev_history_records_model_writes);
+
+//  PHEV_SNAPSHOT
+
+#ifdef __linux__
+    RUN_TEST(test_phev_snapshot_restores_model);
+    RUN_TEST(test_phev_snapshot_drops_corrupt_data);
+    RUN_TEST(test_phev_snapshot_restore_skips_history);
+#endif
 
 // PHEV
 